@@ -13,6 +13,8 @@
 #include "GEMHit.h"
 #include "GEMTracker.h"
 #include "Projection.h"
+#include "HitStream.h"
+#include "Helper.h"
 
 #include "THaDetMap.h"
 #include "TClonesArray.h"
@@ -29,7 +31,12 @@
 #include <iostream>
 #include <string>
 #include <stdexcept>
+#include <cstring>
 #include <algorithm>
+#include <cstdlib>
+#ifdef TREESEARCH_HAVE_AVX2
+#include <immintrin.h>
+#endif
 
 using namespace std;
 using namespace Podd;
@@ -38,18 +45,10 @@ using namespace Podd;
 
 namespace TreeSearch {
 
-struct StripData_t {
-  Float_t adcraw;
-  Float_t adc;
-  Float_t time;
-  Bool_t  pass;
-  StripData_t() : adcraw(0), adc(0), time(0), pass(false) {}
-  StripData_t( Float_t _raw, Float_t _adc, Float_t _time, Bool_t _pass )
-    : adcraw(_raw), adc(_adc), time(_time), pass(_pass) {}
-};
-
 // Sanity limit on number of channels (strips)
 static const Int_t kMaxNChan = 20000;
+// Clear() resets all strips when more than 1/kSparseClear of them had data
+static const Int_t kSparseClear = 4;
 
 //_____________________________________________________________________________
 GEMPlane::GEMPlane( const char* name, const char* description,
@@ -58,7 +57,7 @@ GEMPlane::GEMPlane( const char* name, const char* description,
     fMapType(kOneToOne), fMaxClusterSize(0), fMinAmpl(0), fSplitFrac(0),
     fMaxSamp(1), fAmplSigma(0), fADCraw(0), fADC(0), fHitTime(0), fADCcor(0),
     fGoodHit(0), fDnoise(0), fNrawStrips(0), fNhitStrips(0), fHitOcc(0),
-    fOccupancy(0), fADCMap(0)
+    fOccupancy(0), fADCMap(0), fStripBuf(0)
 {
   // Constructor
 
@@ -94,6 +93,7 @@ GEMPlane::~GEMPlane()
     RemoveVariables();
 
   // fHits deleted in base class
+  delete fStripBuf;
   delete fGoodHit;
   delete fADCcor;
   delete fHitTime;
@@ -128,13 +128,39 @@ void GEMPlane::Clear( Option_t* opt )
 
   if( !IsDummy() ) {
     assert( fADCraw and fADC and fHitTime and fADCcor and fGoodHit );
-    memset( fADCraw, 0, fNelem*sizeof(Float_t) );
-    memset( fADC, 0, fNelem*sizeof(Float_t) );
-    memset( fHitTime, 0, fNelem*sizeof(Float_t) );
-    memset( fADCcor, 0, fNelem*sizeof(Float_t) );
-    memset( fGoodHit, 0, fNelem*sizeof(Byte_t) );
+    assert( fStripBuf );
+    // Only the strips buffered by Decode can have data, so at low occupancy,
+    // resetting just those is much cheaper than clearing the full arrays
+    GEMStripBuffer& buf = *fStripBuf;
+    if( buf.fAllDirty or
+	buf.fN > static_cast<UInt_t>(fNelem/kSparseClear) ) {
+      memset( fADCraw, 0, fNelem*sizeof(Float_t) );
+      memset( fADC, 0, fNelem*sizeof(Float_t) );
+      memset( fHitTime, 0, fNelem*sizeof(Float_t) );
+      memset( fADCcor, 0, fNelem*sizeof(Float_t) );
+      memset( fGoodHit, 0, fNelem*sizeof(Byte_t) );
+      fStripsSeen.assign( fNelem, false );
+    } else {
+      for( UInt_t k = 0; k < buf.fN; ++k ) {
+	Int_t istrip = buf.fStrip[k];
+	fADCraw[istrip] = fADC[istrip] = fHitTime[istrip] = 0;
+	fADCcor[istrip] = 0;
+	fGoodHit[istrip] = 0;
+	fStripsSeen[istrip] = false;
+      }
+      if( buf.fCorDirty )
+	memset( fADCcor, 0, fNelem*sizeof(Float_t) );
+    }
+    buf.fN = 0;
+    buf.fAllDirty = buf.fCorDirty = false;
     fSigStrips.clear();
-    fStripsSeen.assign( fNelem, false );
+    if( TestBit(kSparseStrips) ) {
+      fSigADCraw.clear();
+      fSigADC.clear();
+      fSigHitTime.clear();
+      fSigADCcor.clear();
+      fSigGoodHit.clear();
+    }
   }
 
   fNhitStrips = fNrawStrips = 0;
@@ -190,21 +216,135 @@ Int_t GEMPlane::MapChannel( Int_t idx ) const
 }
 
 //_____________________________________________________________________________
-static StripData_t ChargeDep( const vector<Float_t>& amp )
+// Work buffers for GEMDecode. The data of all strips of an event are
+// gathered here first, so that the pulse shape analysis and pedestal
+// subtraction can be done for all strips in one pass.
+// The sample and result arrays are 32-byte aligned and padded to multiples
+// of 8 entries, so that they can be processed with AVX vectors.
+class GEMStripBuffer {
+public:
+  GEMStripBuffer( UInt_t n, UInt_t nchips )
+    : fN(0), fSize((n+7) & ~7U), fMem(0), fAllDirty(true), fCorDirty(false)
+  {
+    void* ptr = 0;
+    if( posix_memalign( &ptr, 32, kNarr*fSize*sizeof(Float_t) ) != 0 )
+      throw std::bad_alloc();
+    fMem = static_cast<Float_t*>(ptr);
+    memset( fMem, 0, kNarr*fSize*sizeof(Float_t) );
+    fStrip.resize(n);
+    fMod.resize(n);
+    fChan.resize(n);
+    fNsamp.resize(n);
+    fChip.resize(n);
+    fOrder.resize(n);
+    fChipStart.resize(nchips+1);
+    fNoise.reserve(n);
+  }
+  ~GEMStripBuffer() { free(fMem); }
+
+  Float_t* Get( UInt_t k ) { assert(k < kNarr); return fMem + k*fSize; }
+
+  // Input arrays: first three samples and pedestal. Outputs: integrals of
+  // raw and deconvoluted samples, pedestal-corrected integral, pulse shape
+  // test result (1 = pass, 0 = fail)
+  enum { kS0, kS1, kS2, kPed, kADCraw, kADC, kADCcor, kPass, kNarr };
+
+  UInt_t        fN;      // Number of buffered strips
+  UInt_t        fSize;   // Capacity of each array, multiple of 8
+  Float_t*      fMem;    // The kNarr arrays
+  vector<Int_t> fStrip;  // Strip numbers
+  vector<Int_t> fMod;    // Detector map module index
+  vector<Int_t> fChan;   // Channel number in module
+  vector<Int_t> fNsamp;  // Number of samples read
+  vector<Int_t> fChip;   // Front-end chip number
+
+  // Clearing of the plane's per-strip arrays. Normally, only the fN strips
+  // above are reset
+  Bool_t        fAllDirty; // All arrays must be cleared (never initialized)
+  Bool_t        fCorDirty; // All of fADCcor was modified
+
+  // Work space for the per-chip common-mode correction
+  vector<UInt_t>  fOrder;      // Buffer indices ordered by chip ...
+  vector<UInt_t>  fChipStart;  // ... starting at these positions
+  vector<Float_t> fNoise;      // ADC values of one chip below threshold
+
+private:
+  GEMStripBuffer( const GEMStripBuffer& );
+  GEMStripBuffer& operator=( const GEMStripBuffer& );
+};
+
+#ifdef TREESEARCH_HAVE_AVX2
+//_____________________________________________________________________________
+TREESEARCH_AVX2
+static UInt_t ChargeDepAVX2( GEMStripBuffer& buf, Float_t delta_t,
+			     Float_t w1, Float_t w2, Float_t w3 )
 {
-  // Deconvolute signal given by samples in 'amp', return approximate integral.
+  // Vector part of ChargeDep, with the sample interval delta_t and weight
+  // factors w1-w3 computed there. Processes the first 8*(buf.fN/8) strips,
+  // eight at a time, and returns the number done.
+
+  const Float_t *a0 = buf.Get(GEMStripBuffer::kS0);
+  const Float_t *a1 = buf.Get(GEMStripBuffer::kS1);
+  const Float_t *a2 = buf.Get(GEMStripBuffer::kS2);
+  const Float_t *ped = buf.Get(GEMStripBuffer::kPed);
+  Float_t *adcraw = buf.Get(GEMStripBuffer::kADCraw);
+  Float_t *adc    = buf.Get(GEMStripBuffer::kADC);
+  Float_t *adccor = buf.Get(GEMStripBuffer::kADCcor);
+  Float_t *pass   = buf.Get(GEMStripBuffer::kPass);
+
+  UInt_t i = 0;
+  const __m256 vdt = _mm256_set1_ps(delta_t), vw1 = _mm256_set1_ps(w1);
+  const __m256 vw2 = _mm256_set1_ps(w2), vw3 = _mm256_set1_ps(w3);
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  for( ; i+8 <= buf.fN; i += 8 ) {
+    __m256 s0 = _mm256_load_ps(a0+i);
+    __m256 s1 = _mm256_load_ps(a1+i);
+    __m256 s2 = _mm256_load_ps(a2+i);
+    __m256 raw = _mm256_mul_ps( vdt, _mm256_add_ps(_mm256_add_ps(s0,s1),s2) );
+    // Deconvoluted signal samples, assuming measurements of zero before
+    // the leading edge
+    __m256 sig0 = _mm256_mul_ps(s0,vw1);
+    __m256 sig1 = _mm256_add_ps( _mm256_mul_ps(s1,vw1),
+				 _mm256_mul_ps(s0,vw2) );
+    __m256 sig2 = _mm256_add_ps( _mm256_add_ps(_mm256_mul_ps(s2,vw1),
+					       _mm256_mul_ps(s1,vw2)),
+				 _mm256_mul_ps(s0,vw3) );
+    __m256 sum = _mm256_mul_ps( vdt, _mm256_add_ps(_mm256_add_ps(sig0,sig1),
+						   sig2) );
+    // Sample ratios. Lanes with s2 <= 0 fail regardless of the ratio
+    __m256 r1 = _mm256_div_ps(s0,s2), r2 = _mm256_div_ps(s1,s2);
+    __m256 ok = _mm256_and_ps( _mm256_cmp_ps(s2,zero,_CMP_GT_OQ),
+			       _mm256_and_ps(_mm256_cmp_ps(r1,one,_CMP_LT_OQ),
+					     _mm256_cmp_ps(r2,one,_CMP_LT_OQ)) );
+    ok = _mm256_and_ps( ok, _mm256_cmp_ps(r1,r2,_CMP_LT_OQ) );
+    _mm256_store_ps( adcraw+i, raw );
+    _mm256_store_ps( adc+i, sum );
+    _mm256_store_ps( adccor+i, _mm256_sub_ps(sum,_mm256_load_ps(ped+i)) );
+    _mm256_store_ps( pass+i, _mm256_and_ps(ok,one) );
+  }
+  return i;
+}
+#endif
+
+//_____________________________________________________________________________
+static void ChargeDep( GEMStripBuffer& buf )
+{
+  // Deconvolute the signals given by the three samples of each buffered
+  // strip, compute approximate integrals, pedestal-correct them and
+  // check the pulse shape.
   // Currently analyzes exactly 3 samples.
   // From Kalyan Allada
   // NIM A326, 112 (1993)
+  //
+  // The vector and scalar code perform the same single-precision
+  // operations in the same order, so the results do not depend on
+  // whether AVX2 is available. (GEMPlane.o is compiled without contraction
+  // to fused multiply-adds for this reason.)
 
   //FIXME: from database, proper value for Tp
   const Float_t delta_t = 25.0; // time interval between samples (ns)
   const Float_t Tp      = 50.0; // RC filter time constant (ns)
 
-  assert( amp.size() >= 3 );
-
-  Float_t adcraw = delta_t*(amp[0]+amp[1]+amp[2]);
-
   // Weight factors calculated based on the response of the silicon microstrip
   // detector:
   // v(t) = (delta_t/Tp)*exp(-delta_t/Tp)
@@ -219,25 +359,69 @@ static StripData_t ChargeDep( const vector<Float_t>& amp )
   Float_t w2 = -2*TMath::Exp(-1)/x;
   Float_t w3 = TMath::Exp(-x-1)/x;
 
-  // Deconvoluted signal samples, assuming measurements of zero before the
-  // leading edge
-  Float_t sig[3] = { amp[0]*w1,
-		     amp[1]*w1+amp[0]*w2,
-		     amp[2]*w1+amp[1]*w2+amp[0]*w3 };
-
-  Float_t adc    = delta_t*(sig[0]+sig[1]+sig[2]);
-  Float_t time   = 0;     // TODO
-
-  Bool_t pass;
-  // Calculate ratios for 3 samples and check for bad signals
-  if( amp[2] > 0 ) {
-    Float_t r1 = amp[0]/amp[2];
-    Float_t r2 = amp[1]/amp[2];
-    pass = (r1 < 1.0 and r2 < 1.0 and r1 < r2);
-  } else
-    pass = false;
+  const Float_t *a0 = buf.Get(GEMStripBuffer::kS0);
+  const Float_t *a1 = buf.Get(GEMStripBuffer::kS1);
+  const Float_t *a2 = buf.Get(GEMStripBuffer::kS2);
+  const Float_t *ped = buf.Get(GEMStripBuffer::kPed);
+  Float_t *adcraw = buf.Get(GEMStripBuffer::kADCraw);
+  Float_t *adc    = buf.Get(GEMStripBuffer::kADC);
+  Float_t *adccor = buf.Get(GEMStripBuffer::kADCcor);
+  Float_t *pass   = buf.Get(GEMStripBuffer::kPass);
+
+  UInt_t i = 0;
+#ifdef TREESEARCH_HAVE_AVX2
+  if( HaveAVX2() )
+    i = ChargeDepAVX2( buf, delta_t, w1, w2, w3 );
+#endif
+  for( ; i < buf.fN; ++i ) {
+    adcraw[i] = delta_t*(a0[i]+a1[i]+a2[i]);
+    Float_t sig[3] = { a0[i]*w1,
+		       a1[i]*w1+a0[i]*w2,
+		       a2[i]*w1+a1[i]*w2+a0[i]*w3 };
+    adc[i]    = delta_t*(sig[0]+sig[1]+sig[2]);
+    adccor[i] = adc[i] - ped[i];
+    // Calculate ratios for 3 samples and check for bad signals
+    bool ok = false;
+    if( a2[i] > 0 ) {
+      Float_t r1 = a0[i]/a2[i];
+      Float_t r2 = a1[i]/a2[i];
+      ok = (r1 < 1.0 and r2 < 1.0 and r1 < r2);
+    }
+    pass[i] = ok ? 1.0f : 0.0f;
+  }
+}
 
-  return StripData_t(adcraw,adc,time,pass);
+#ifdef TREESEARCH_HAVE_AVX2
+//_____________________________________________________________________________
+TREESEARCH_AVX2
+static Int_t SubtractNoiseAVX2( Float_t* adccor, Int_t n, Double_t dnoise )
+{
+  // Vector part of SubtractNoise. Corrects the first 4*(n/4) values, four
+  // at a time, and returns the number done.
+
+  Int_t i = 0;
+  const __m256d vnoise = _mm256_set1_pd(dnoise);
+  for( ; i+4 <= n; i += 4 ) {
+    __m256d v = _mm256_cvtps_pd( _mm_loadu_ps(adccor+i) );
+    _mm_storeu_ps( adccor+i, _mm256_cvtpd_ps(_mm256_sub_pd(v,vnoise)) );
+  }
+  return i;
+}
+#endif
+
+//_____________________________________________________________________________
+static void SubtractNoise( Float_t* adccor, Int_t n, Double_t dnoise )
+{
+  // Subtract the common-mode noise "dnoise" from the n values in adccor.
+  // The subtraction is done in double precision, as in plain C++.
+
+  Int_t i = 0;
+#ifdef TREESEARCH_HAVE_AVX2
+  if( HaveAVX2() )
+    i = SubtractNoiseAVX2( adccor, n, dnoise );
+#endif
+  for( ; i < n; ++i )
+    adccor[i] -= dnoise;
 }
 
 //_____________________________________________________________________________
@@ -260,6 +444,131 @@ void GEMPlane::AddStrip( Int_t istrip )
 #endif
 }
 
+#ifdef TREESEARCH_HAVE_AVX2
+//_____________________________________________________________________________
+TREESEARCH_AVX2
+static Int_t FindSigStripsAVX2( const Float_t* adccor, const Byte_t* good,
+				Int_t n, Double_t minampl, UInt_t& nhit,
+				vector<Int_t>& sigstrips )
+{
+  // Vector part of GEMPlane::FindSigStrips. Tests the first 4*(n/4) strips,
+  // four at a time, and returns the number done.
+
+  Int_t i = 0;
+  const __m256d vmin = _mm256_set1_pd(minampl), zero = _mm256_setzero_pd();
+  for( ; i+4 <= n; i += 4 ) {
+    __m256d adc = _mm256_cvtps_pd( _mm_loadu_ps(adccor+i) );
+    Int_t pos = _mm256_movemask_pd( _mm256_cmp_pd(adc,zero,_CMP_GT_OQ) );
+    Int_t sig = _mm256_movemask_pd( _mm256_cmp_pd(adc,vmin,_CMP_GE_OQ) );
+    nhit += __builtin_popcount(pos);
+    for( ; sig; sig &= sig-1 ) {
+      Int_t istrip = i + __builtin_ctz(sig);
+      if( good[istrip] )
+	sigstrips.push_back(istrip);
+    }
+  }
+  return i;
+}
+#endif
+
+//_____________________________________________________________________________
+void GEMPlane::FindSigStrips()
+{
+  // Equivalent to calling AddStrip for all strips, without filling
+  // histograms. Utility function used by Decode.
+
+  Int_t i = 0;
+#ifdef TREESEARCH_HAVE_AVX2
+  if( HaveAVX2() )
+    i = FindSigStripsAVX2( fADCcor, fGoodHit, fNelem, fMinAmpl,
+			   fNhitStrips, fSigStrips );
+#endif
+  for( ; i < fNelem; ++i ) {
+    Float_t adc = fADCcor[i];
+    if( adc > 0 )
+      ++fNhitStrips;
+    if( fGoodHit[i] and adc >= fMinAmpl )
+      fSigStrips.push_back(i);
+  }
+}
+
+//_____________________________________________________________________________
+static Double_t Median( vector<Float_t>& v )
+{
+  // Return the median of the values in v, which are reordered. For an even
+  // number of values, the average of the two central ones is returned.
+  // Returns zero for an empty v.
+
+  if( v.empty() )
+    return 0;
+  vector<Float_t>::iterator mid = v.begin() + v.size()/2;
+  nth_element( v.begin(), mid, v.end() );
+  Double_t med = *mid;
+  if( v.size() % 2 == 0 )
+    med = 0.5*(med + *max_element(v.begin(),mid));
+  return med;
+}
+
+//_____________________________________________________________________________
+void GEMPlane::SubtractChipNoise()
+{
+  // Correct the ADC values of the buffered strips for the common-mode noise
+  // of their front-end (APV25) chips and record the signal strips.
+  // Utility function used by Decode.
+  //
+  // The common-mode estimate of each chip is the median of the corrected
+  // ADC values of its strips below the threshold, which is insensitive to
+  // unrecognized hits. The strips are grouped by chip and then processed in
+  // a single pass, chip by chip. Only strips with data are corrected.
+
+  GEMStripBuffer& buf = *fStripBuf;
+  vector<UInt_t>& start = buf.fChipStart;
+  UInt_t nchips = start.size()-1;
+
+  // Counting sort of the buffered strips by chip number
+  start.assign( nchips+1, 0 );
+  for( UInt_t k = 0; k < buf.fN; ++k )
+    ++start[buf.fChip[k]+1];
+  for( UInt_t ic = 0; ic < nchips; ++ic )
+    start[ic+1] += start[ic];
+  for( UInt_t k = 0; k < buf.fN; ++k )
+    buf.fOrder[start[buf.fChip[k]]++] = k;
+  // Each start[ic] is now the end of chip ic's range
+  for( UInt_t ic = nchips; ic > 0; --ic )
+    start[ic] = start[ic-1];
+  start[0] = 0;
+
+  Double_t noisesum = 0.0;
+  UInt_t   n_noise = 0;
+  for( UInt_t ic = 0; ic < nchips; ++ic ) {
+    UInt_t begin = start[ic], end = start[ic+1];
+    if( begin == end )
+      continue;
+    // Sum up ADCs that are likely not a hit
+    buf.fNoise.clear();
+    for( UInt_t i = begin; i < end; ++i ) {
+      Int_t istrip = buf.fStrip[buf.fOrder[i]];
+      if( fADCraw[istrip] != 0 and fADCcor[istrip] < fMinAmpl )
+	buf.fNoise.push_back( fADCcor[istrip] );
+    }
+    Double_t cm = 0;
+    if( !buf.fNoise.empty() ) {
+      cm = Median( buf.fNoise );
+      noisesum += cm;
+      ++n_noise;
+    }
+    for( UInt_t i = begin; i < end; ++i ) {
+      Int_t istrip = buf.fStrip[buf.fOrder[i]];
+      if( fADCraw[istrip] == 0 )  // null data
+	continue;
+      fADCcor[istrip] -= cm;
+      AddStrip( istrip );
+    }
+  }
+  if( n_noise > 0 )
+    fDnoise = noisesum/n_noise;
+}
+
 //_____________________________________________________________________________
 Int_t GEMPlane::GEMDecode( const THaEvData& evData )
 {
@@ -294,6 +603,7 @@ Int_t GEMPlane::GEMDecode( const THaEvData& evData )
 
   bool do_pedestal_subtraction = !fPed.empty();
   bool do_noise_subtraction    = TestBit(kDoNoise);
+  bool do_chip_noise           = TestBit(kDoChipNoise);
 
 #ifdef MCDATA
   const SimDecoder* simdata = 0;
@@ -302,11 +612,17 @@ Int_t GEMPlane::GEMDecode( const THaEvData& evData )
     simdata = static_cast<const SimDecoder*>(&evData);
   }
 #endif
-  Vflt_t samples;
-  if( fMaxSamp > 1 )
-    samples.reserve(fMaxSamp);
-
-  // Decode data
+  assert( fStripBuf and fStripBuf->fStrip.size() ==
+	  static_cast<vector<Int_t>::size_type>(fNelem) );
+  GEMStripBuffer& buf = *fStripBuf;
+  Float_t* s0  = buf.Get(GEMStripBuffer::kS0);
+  Float_t* s1  = buf.Get(GEMStripBuffer::kS1);
+  Float_t* s2  = buf.Get(GEMStripBuffer::kS2);
+  Float_t* ped = buf.Get(GEMStripBuffer::kPed);
+  assert( buf.fN == 0 );  // Clear() must have been called
+
+  // Decode data. First, gather the samples of all strips of this plane
+  // into the work buffer
   for( Int_t imod = 0; imod < fDetMap->GetSize(); ++imod ) {
     THaDetMap::Module * d = fDetMap->GetModule(imod);
 
@@ -317,8 +633,8 @@ Int_t GEMPlane::GEMDecode( const THaEvData& evData )
       if( chan < d->lo or chan > d->hi ) continue; // not part of this detector
 
       // Map channel number to strip number
-      Int_t istrip =
-	MapChannel( d->first + ((d->reverse) ? d->hi - chan : chan - d->lo) );
+      Int_t ihw = d->first + ((d->reverse) ? d->hi - chan : chan - d->lo);
+      Int_t istrip = MapChannel( ihw );
       // Test for duplicate istrip, if found, warn and skip
       assert( (istrip >= 0) and (istrip < fNelem) );
       if( fStripsSeen[istrip] ) {
@@ -341,63 +657,80 @@ Int_t GEMPlane::GEMDecode( const THaEvData& evData )
       ++fNrawStrips;
       nsamp = TMath::Min( nsamp, static_cast<Int_t>(fMaxSamp) );
 
-      // Integrate the signal over time and analyze pulse shape
-      StripData_t stripdata;
-      if( nsamp > 1 ) {
-	samples.clear();
-	for( Int_t isamp = 0; isamp < nsamp; ++isamp ) {
-	  Float_t fsamp = static_cast<Float_t>
-	    ( evData.GetData(d->crate, d->slot, chan, isamp) );
-	  samples.push_back( fsamp );
-	}
-	// Analyze the pulse shape
-	stripdata = ChargeDep(samples);
-      }
-      else {
-	stripdata.adcraw = stripdata.adc =
-	  static_cast<Float_t>( evData.GetData(d->crate, d->slot, chan, 0) );
-	stripdata.time = 0;
-	stripdata.pass = true;
-      }
-      // Skip null data
-      if( stripdata.adcraw == 0 )
-	continue;
-
-      // Save results for cluster finding later
-      fADCraw[istrip]  = stripdata.adcraw;
-      fADC[istrip]     = stripdata.adc;
-      fHitTime[istrip] = stripdata.time;
-
-      // Strip-by-strip pedestal subtraction
-      Float_t adc = stripdata.adc;
-      if( do_pedestal_subtraction )
-	adc -= fPed[istrip];
-
-      fADCcor[istrip] = adc;
-      fGoodHit[istrip] = not TestBit(kCheckPulseShape) or stripdata.pass;
+      // The pulse shape analysis uses the first three samples. Missing
+      // samples (nsamp = 2) are taken to be zero
+      UInt_t k = buf.fN++;
+      assert( k < buf.fStrip.size() );
+      s0[k] = static_cast<Float_t>
+	( evData.GetData(d->crate, d->slot, chan, 0) );
+      s1[k] = ( nsamp > 1 ) ? static_cast<Float_t>
+	( evData.GetData(d->crate, d->slot, chan, 1) ) : 0;
+      s2[k] = ( nsamp > 2 ) ? static_cast<Float_t>
+	( evData.GetData(d->crate, d->slot, chan, 2) ) : 0;
+      ped[k] = do_pedestal_subtraction ? fPed[istrip] : 0;
+      buf.fStrip[k] = istrip;
+      buf.fMod[k]   = imod;
+      buf.fChan[k]  = chan;
+      buf.fNsamp[k] = nsamp;
+      buf.fChip[k]  = ihw / fAPVsize;
+    }  // chans
+  }    // modules
 
-      if( do_noise_subtraction ) {
-	// Sum up ADCs that are likely not a hit
-	if( adc < fMinAmpl ) {
-	  noisesum += adc;
-	  n_noise++;
-	}
-      }
-      else {
-	// If no noise subtraction is done, then we can finish up with this
-	// strip number right here. Otherwise we need a second iteration below
-	AddStrip( istrip );
+  // Integrate the signals over time, analyze pulse shapes and subtract
+  // pedestals for all buffered strips at once
+  ChargeDep( buf );
+
+  const Float_t* adcraw = buf.Get(GEMStripBuffer::kADCraw);
+  const Float_t* adcint = buf.Get(GEMStripBuffer::kADC);
+  const Float_t* adccor = buf.Get(GEMStripBuffer::kADCcor);
+  const Float_t* pass   = buf.Get(GEMStripBuffer::kPass);
+  for( UInt_t k = 0; k < buf.fN; ++k ) {
+    Int_t istrip = buf.fStrip[k];
+    Float_t raw, adc;
+    Bool_t good;
+    if( buf.fNsamp[k] > 1 ) {
+      raw  = adcraw[k];
+      adc  = adccor[k];
+      good = (pass[k] != 0);
+    } else {
+      raw  = s0[k];
+      adc  = s0[k] - ped[k];
+      good = true;
+    }
+    // Skip null data
+    if( raw == 0 )
+      continue;
+
+    // Save results for cluster finding later
+    fADCraw[istrip]  = raw;
+    fADC[istrip]     = ( buf.fNsamp[k] > 1 ) ? adcint[k] : raw;
+    fHitTime[istrip] = 0;  // TODO
+
+    fADCcor[istrip] = adc;
+    fGoodHit[istrip] = not TestBit(kCheckPulseShape) or good;
+
+    if( do_noise_subtraction ) {
+      // Sum up ADCs that are likely not a hit
+      if( adc < fMinAmpl ) {
+	noisesum += adc;
+	n_noise++;
       }
+    } else if( !do_chip_noise ) {
+      // If no noise subtraction is done, then we can finish up with this
+      // strip number right here. Otherwise we need a second iteration below
+      AddStrip( istrip );
+    }
 
 #ifdef MCDATA
-      // If doing MC data, save the truth information for each strip
-      if( mc_data ) {
-	fMCHitList.push_back(istrip);
-	fMCHitInfo[istrip] = simdata->GetMCHitInfo(d->crate,d->slot,chan);
-      }
+    // If doing MC data, save the truth information for each strip
+    if( mc_data ) {
+      THaDetMap::Module * d = fDetMap->GetModule(buf.fMod[k]);
+      fMCHitList.push_back(istrip);
+      fMCHitInfo[istrip] =
+	simdata->GetMCHitInfo(d->crate,d->slot,buf.fChan[k]);
+    }
 #endif
-    }  // chans
-  }    // modules
+  }
 
   // Calculate average common-mode noise and subtract it from corrected
   // ADC values, if requested
@@ -406,13 +739,20 @@ Int_t GEMPlane::GEMDecode( const THaEvData& evData )
       fDnoise = noisesum/n_noise;
       assert( fDnoise < fMinAmpl );
     }
+    SubtractNoise( fADCcor, fNelem, fDnoise );
+    buf.fCorDirty = true;
     // Save strip numbers of corrected ADC data above threshold. Fill histograms.
     assert( fSigStrips.empty() );
-    for( Int_t i = 0; i < fNelem; i++ ) {
-      fADCcor[i] -= fDnoise;
-      AddStrip( i );
-    }
+#ifdef TESTCODE
+    if( TestBit(kDoHistos) ) {
+      for( Int_t i = 0; i < fNelem; i++ )
+	AddStrip( i );
+    } else
+#endif
+      FindSigStrips();
   }
+  else if( do_chip_noise )
+    SubtractChipNoise();
 
   fHitOcc    = static_cast<Double_t>(fNhitStrips) / fNelem;
   fOccupancy = static_cast<Double_t>(GetNsigStrips()) / fNelem;
@@ -444,208 +784,258 @@ Int_t GEMPlane::GEMDecode( const THaEvData& evData )
   // following valley: the bottom is found if the amplitude rises again
   // by (1+frac), so frac = 0.1 means: trigger on a rise above 110% etc.
 
-  // The active strip numbers must be sorted for the clustering algorithm
-  sort( ALL(fSigStrips) );
+  // The active strip numbers must be sorted for the clustering algorithm.
+  // FindSigStrips, used with noise subtraction, already finds them in order.
+  if( !do_noise_subtraction )
+    sort( ALL(fSigStrips) );
 
-  Double_t frac_down = 1.0 - fSplitFrac, frac_up = 1.0 + fSplitFrac;
-#ifndef NDEBUG
-  GEMHit* prevHit = 0;
+  nHits = FindClusters();
+
+  // Negative return value indicates potential problem
+  if( nHits > fMaxHits )
+    nHits = -nHits;
+
+  return nHits;
+}
+
+//_____________________________________________________________________________
+// Running sums over the strips of a cluster, used by GEMPlane::FindClusters
+struct GEMCluster {
+  Double_t xsum;     // Sum of strip position * ADC
+  Double_t adcsum;   // Sum of ADC
+  Int_t    first;    // First strip number
+  Int_t    last;     // Last strip number
+#ifdef MCDATA
+  Double_t mcpos;    // MC position of signal hit, or sum of background
+  Double_t mctime;   // MC time of signal hit, or earliest background time
+  Int_t    mctrack;  // MC track number of signal hit (0 = background only)
+  Int_t    num_bg;   // Largest number of background hits on a strip
 #endif
-  typedef Vint_t::iterator viter_t;
-  Vint_t splits;  // Strips with ampl split between 2 clusters
-  viter_t next = fSigStrips.begin();
-  while( next != fSigStrips.end() ) {
-    viter_t start = next, cur = next;
-    ++next;
-    assert( next == fSigStrips.end() or *next > *cur );
-    while( next != fSigStrips.end() and (*next - *cur) == 1  ) {
-      ++cur;
-      ++next;
-    }
-    // Now the cluster candidate is between start and cur
-    assert( *cur >= *start );
-    // The "type" parameter indicates the result of the cluster analysis:
-    // 0: clean (i.e. smaller than fMaxClusterSize, no further analysis)
-    // 1: large, maximum at right edge, not split
-    // 2: large, no clear minimum on the right side found, not split
-    // 3: split, well-defined peak found (may still be larger than maxsize)
-    Int_t  type = 0;
-    UInt_t size = *cur - *start + 1;
-    if( size > fMaxClusterSize ) {
-      Double_t maxadc = 0.0, minadc = kBig;
-      viter_t it = start, maxpos = start, minpos = start;
-      enum EStep { kFindMax = 1, kFindMin, kDone };
-      EStep step = kFindMax;
-      while( step != kDone and it != next ) {
-        Double_t adc = fADCcor[*it];
-        switch( step ) {
-          case kFindMax:
-            // Looking for maximum
-            if( adc > maxadc ) {
-              maxpos = it;
-              maxadc = adc;
-            } else if( adc < maxadc * frac_down ) {
-              assert( maxadc > 0.0 );
-              step = kFindMin;
-              continue;
-            }
-            break;
-          case kFindMin:
-            // Looking for minimum
-            if( adc < minadc ) {
-              minpos = it;
-              minadc = adc;
-            } else if( adc > minadc * frac_up ) {
-              assert( minadc < kBig );
-              step = kDone;
-            }
-            break;
-          case kDone:
-            assert( false );  // should never get here
-            break;
-        }
-        ++it;
-      }
-      if( step == kDone ) {
-        // Found maximum followed by minimum
-        assert( minpos != start );
-        assert( minpos != cur );
-        assert( *minpos > *maxpos );
-        // Split the cluster at the position of the minimum, assuming that
-        // the strip with the minimum amplitude is shared between both clusters
-        cur  = minpos;
-        next = minpos;
-        // In order not to double-count amplitude, we split the signal height
-        // of that strip evenly between the two clusters. This is a very
-        // crude way of doing what we really should be doing: "fitting" a peak
-        // shape and using the area and centroid of the curve
-	fADCcor[*minpos] /= 2.0;
-	splits.push_back(*minpos);
-      }
-      type = step;
-      size = *cur - *start + 1;
-      assert( *cur >= *start );
-    }
-    assert( size > 0 );
-    // Compute weighted position average. Again, a crude (but fast) substitute
-    // for fitting the centroid of the peak.
-    Double_t xsum = 0.0, adcsum = 0.0;
+
+  void Start( Int_t strip )
+  {
+    xsum = adcsum = 0.0;
+    first = last = strip;
 #ifdef MCDATA
-    Double_t mcpos = 0.0, mctime = kBig;
-    Int_t mctrack = 0, num_bg = 0;
+    mcpos = 0.0; mctime = kBig;
+    mctrack = num_bg = 0;
 #endif
-    for( ; start != next; ++start ) {
-      Int_t istrip = *start;
-      Double_t pos = GetStart() + istrip * GetPitch();
-      Double_t adc = fADCcor[istrip];
-      xsum   += pos * adc;
-      adcsum += adc;
+  }
+  void Add( Int_t strip, Double_t pos, Double_t adc )
+  {
+    // Add a strip. Strips must be added in ascending order
+    assert( strip >= last );
+    xsum   += pos * adc;
+    adcsum += adc;
+    last    = strip;
+  }
+  UInt_t GetSize() const { return last-first+1; }
 #ifdef MCDATA
-      // If doing MC data, analyze the strip truth information
-      if( mc_data ) {
-	MCHitInfo& mc = fMCHitInfo[istrip];
-	// This may be smaller than the actual total number of background hits
-	// contributing to the entire cluster, but counting them would involve
-	// lists of secondary particle numbers ... overkill for now
-	num_bg = TMath::Max( num_bg, mc.fContam );
-	// All primary particle hits in the cluster are from the same track
-	assert( mctrack == 0 || mc.fMCTrack == 0 || mctrack == mc.fMCTrack );
-	if( mctrack == 0 ) {
-	  if( mc.fMCTrack > 0 ) {
-	    // If the cluster contains a signal hit, save its info and be done
-	    mctrack = mc.fMCTrack;
-	    mcpos   = mc.fMCPos;
-	    mctime  = mc.fMCTime;
-	  }
-	  else {
-	    // If background hits only, compute position average
-	    mcpos  += mc.fMCPos;
-	    mctime  = TMath::Min( mctime, mc.fMCTime );
-	  }
-	}
+  void AddMC( const MCHitInfo& mc )
+  {
+    // Analyze the strip truth information
+    //
+    // This may be smaller than the actual total number of background hits
+    // contributing to the entire cluster, but counting them would involve
+    // lists of secondary particle numbers ... overkill for now
+    num_bg = TMath::Max( num_bg, mc.fContam );
+    // All primary particle hits in the cluster are from the same track
+    assert( mctrack == 0 || mc.fMCTrack == 0 || mctrack == mc.fMCTrack );
+    if( mctrack == 0 ) {
+      if( mc.fMCTrack > 0 ) {
+	// If the cluster contains a signal hit, save its info and be done
+	mctrack = mc.fMCTrack;
+	mcpos   = mc.fMCPos;
+	mctime  = mc.fMCTime;
+      }
+      else {
+	// If background hits only, compute position average
+	mcpos  += mc.fMCPos;
+	mctime  = TMath::Min( mctime, mc.fMCTime );
       }
-#endif // MCDATA
     }
-    assert( adcsum > 0.0 );
-    Double_t pos = xsum/adcsum;
+  }
+#endif
+};
+
+//_____________________________________________________________________________
+Int_t GEMPlane::FindClusters()
+{
+  // Find clusters of adjacent strips in fSigStrips, which must be sorted,
+  // and add a hit for each of them. Returns the number of hits.
+  //
+  // This is done in a single pass over the strips. The position and
+  // amplitude sums of the current cluster are accumulated while the
+  // peak/valley search for splitting it (see GEMDecode) runs along.
+  // Once the cluster is larger than fMaxClusterSize and a peak followed by
+  // a valley has been found, the part up to the valley is added as a hit
+  // right away, and a new cluster is started at the valley strip, which is
+  // shared by both. Only the strips from the valley to the current one are
+  // looked at again.
 
 #ifdef MCDATA
-    if( mc_data && mctrack == 0 ) {
-      mcpos /= static_cast<Double_t>(size);
-    }
+  bool mc_data = fTracker->TestBit(Tracker::kMCdata);
 #endif
-    // The resolution (sigma) of the position measurement depends on the
-    // cluster size. In particular, if the cluster consists of only a single
-    // hit, the resolution is much reduced
-    Double_t resolution = fResolution;
-    if( size == 1 ) {
-      resolution = TMath::Max( 0.25*GetPitch(), fResolution );
-      // The factor of 1/2*pitch is just a guess. Since with real GEMs
-      // there _should_ always be more than one strip per cluster, we must
-      // assume that the other strip(s) did not fire due to inefficiency.
-      // As a result, the error is bigger than it would be if only ever one
-      // strip fired per hit.
-//       resolution = TMath::Max( 0.5*GetPitch(), 2.0*fResolution );
-//     } else if( size == 2 ) {
-//       // Again, this is a guess, to be quantified with Monte Carlo
-//       resolution = 1.2*fResolution;
-    }
-
-    // Make a new hit
+  enum EStep { kFindMax = 1, kFindMin, kDone };
+  Double_t frac_down = 1.0 - fSplitFrac, frac_up = 1.0 + fSplitFrac;
+  Vint_t splits;  // Strips with ampl split between 2 clusters
+  GEMCluster cl, left;
 #ifndef NDEBUG
-    GEMHit* theHit = 0;
+  GEMHit* prevHit = 0;
 #endif
+  UInt_t nsig = fSigStrips.size(), i = 0, nHits = 0;
+  while( i < nsig ) {
+    // Start a new cluster candidate
+    EStep    step   = kFindMax;
+    Double_t maxadc = 0.0, minadc = kBig;
+    UInt_t   minidx = i;
+    bool     split  = false;
+    cl.Start( fSigStrips[i] );
+    for( ; i < nsig; ++i ) {
+      Int_t istrip = fSigStrips[i];
+      Double_t adc = fADCcor[istrip];
+      // Look for a maximum followed by a minimum, the "valley"
+      if( step == kFindMax ) {
+	if( adc > maxadc )
+	  maxadc = adc;
+	else if( adc < maxadc * frac_down ) {
+	  assert( maxadc > 0.0 );
+	  step = kFindMin;
+	}
+      }
+      if( step == kFindMin ) {
+	if( adc < minadc ) {
+	  minadc = adc;
+	  minidx = i;
+	  left   = cl;  // Sums of the strips before the valley
+	} else if( adc > minadc * frac_up ) {
+	  assert( minadc < kBig );
+	  step = kDone;
+	}
+      }
+      cl.Add( istrip, GetStart() + istrip * GetPitch(), adc );
 #ifdef MCDATA
-    if( !mc_data ) {
+      if( mc_data )
+	cl.AddMC( fMCHitInfo[istrip] );
 #endif
-#ifndef NDEBUG
-      theHit =
-#endif
-	new( (*fHits)[nHits++] ) GEMHit( pos,
-					 adcsum,
-					 size,
-					 type,
-					 resolution,
-					 this
-					 );
-#ifdef MCDATA
-    } else {
-      // Monte Carlo data
-#ifndef NDEBUG
-      theHit =
-#endif
-	new( (*fHits)[nHits++] ) MCGEMHit( pos,
-					   adcsum,
-					   size,
-					   type,
-					   resolution,
-					   this,
-					   mctrack,
-					   mcpos,
-					   mctime,
-					   num_bg
-					   );
+      if( step == kDone and cl.GetSize() > fMaxClusterSize ) {
+	split = true;
+	break;
+      }
+      if( i+1 == nsig or fSigStrips[i+1] - istrip != 1 ) {
+	++i;
+	break;
+      }
     }
-#endif // MCDATA
+    // The "type" of a hit indicates the result of the cluster analysis:
+    // 0: clean (i.e. smaller than fMaxClusterSize, no further analysis)
+    // 1: large, maximum at right edge, not split
+    // 2: large, no clear minimum on the right side found, not split
+    // 3: split, well-defined peak found (may still be larger than maxsize)
+    GEMHit* theHit;
+    if( split ) {
+      // Split the cluster at the position of the minimum, assuming that
+      // the strip with the minimum amplitude is shared between both
+      // clusters. In order not to double-count amplitude, we split the
+      // signal height of that strip evenly between the two clusters. This
+      // is a very crude way of doing what we really should be doing:
+      // "fitting" a peak shape and using the area and centroid of the curve
+      assert( minidx > 0 and fSigStrips[minidx] > left.first );
+      Int_t istrip = fSigStrips[minidx];
+      fADCcor[istrip] /= 2.0;
+      splits.push_back(istrip);
+      left.Add( istrip, GetStart() + istrip * GetPitch(), fADCcor[istrip] );
+#ifdef MCDATA
+      if( mc_data )
+	left.AddMC( fMCHitInfo[istrip] );
+#endif
+      theHit = AddCluster( left, kDone );
+      // Continue with the rest of the cluster, starting at the minimum
+      i = minidx;
+    } else
+      theHit = AddCluster( cl, (cl.GetSize() > fMaxClusterSize) ? step : 0 );
+    ++nHits;
 #ifndef NDEBUG
-    // Ensure hits are ordered by position (should be guaranteed by std::map)
+    // Ensure hits are ordered by position
     assert( (prevHit == 0) or (theHit->Compare(prevHit) > 0) );
     prevHit = theHit;
+#else
+    (void)theHit;
 #endif
   }
 
   // Undo amplitude splitting, if any, so fADCcor contains correct ADC values
-  for( viter_t it = splits.begin(); it != splits.end(); ++it ) {
+  for( Vint_t::iterator it = splits.begin(); it != splits.end(); ++it ) {
     fADCcor[*it] *= 2.0;
   }
 
-  // Negative return value indicates potential problem
-  if( nHits > fMaxHits )
-    nHits = -nHits;
-
   return nHits;
 }
 
+//_____________________________________________________________________________
+Double_t GEMPlane::ClusterResolution( UInt_t size ) const
+{
+  // The resolution (sigma) of the position measurement depends on the
+  // cluster size. In particular, if the cluster consists of only a single
+  // hit, the resolution is much reduced
+
+  Double_t resolution = fResolution;
+  if( size == 1 ) {
+    resolution = TMath::Max( 0.25*GetPitch(), fResolution );
+    // The factor of 1/2*pitch is just a guess. Since with real GEMs
+    // there _should_ always be more than one strip per cluster, we must
+    // assume that the other strip(s) did not fire due to inefficiency.
+    // As a result, the error is bigger than it would be if only ever one
+    // strip fired per hit.
+//     resolution = TMath::Max( 0.5*GetPitch(), 2.0*fResolution );
+//   } else if( size == 2 ) {
+//     // Again, this is a guess, to be quantified with Monte Carlo
+//     resolution = 1.2*fResolution;
+  }
+  return resolution;
+}
+
+//_____________________________________________________________________________
+GEMHit* GEMPlane::AddCluster( const GEMCluster& cl, UInt_t type )
+{
+  // Add a hit for the given cluster of strips to the hit array
+
+  UInt_t size = cl.GetSize();
+  assert( size > 0 and cl.adcsum > 0.0 );
+  // Weighted position average. Again, a crude (but fast) substitute
+  // for fitting the centroid of the peak.
+  Double_t pos = cl.xsum/cl.adcsum;
+
+  Double_t resolution = ClusterResolution( size );
+
+  // Construct the hit in place in the hit array
+#ifdef MCDATA
+  if( fTracker->TestBit(Tracker::kMCdata) ) {
+    Double_t mcpos = cl.mcpos;
+    if( cl.mctrack == 0 )
+      mcpos /= static_cast<Double_t>(size);
+    return new( (*fHits)[GetNhits()] ) MCGEMHit( pos,
+						 cl.adcsum,
+						 size,
+						 type,
+						 resolution,
+						 this,
+						 cl.mctrack,
+						 mcpos,
+						 cl.mctime,
+						 cl.num_bg
+						 );
+  }
+#endif
+  return new( (*fHits)[GetNhits()] ) GEMHit( pos,
+					     cl.adcsum,
+					     size,
+					     type,
+					     resolution,
+					     this
+					     );
+}
+
 //_____________________________________________________________________________
 Hit* GEMPlane::AddHitImpl( Double_t pos )
 {
@@ -689,6 +1079,93 @@ Hit* GEMPlane::AddHitImpl( Double_t pos )
   return theHit;
 }
 
+//_____________________________________________________________________________
+Int_t GEMPlane::LoadHits( const HitRecord* hits, const MCHitRecord* mchits,
+			  UInt_t n )
+{
+  // Fill the hit array from "n" recorded hits (clusters), instead of
+  // decoding and clustering the strip data. The cluster positions are
+  // recorded in strip units and converted with the current strip geometry.
+  // The resolution is computed from the cluster size as in AddCluster.
+
+  assert( hits or n == 0 );
+
+#ifdef MCDATA
+  bool mc_data = ( mchits != 0 and fTracker->TestBit(Tracker::kMCdata) );
+#endif
+  bool sorted = true;
+  GEMHit* prevHit = 0;
+  UInt_t nHits = GetNhits();
+  for( UInt_t i = 0; i < n; ++i ) {
+    const HitRecord& h = hits[i];
+    Double_t pos = GetStart() + h.fPos * GetPitch();
+    Double_t res = ClusterResolution( h.fSize );
+    GEMHit* theHit;
+#ifdef MCDATA
+    if( mc_data ) {
+      const MCHitRecord& m = mchits[i];
+      theHit = new( (*fHits)[nHits++] )
+	MCGEMHit( pos, h.fAmpl, h.fSize, h.fRaw, res, this,
+		  m.fMCTrack, m.fMCPos, m.fMCTime, m.fContam );
+    } else
+#endif
+      theHit = new( (*fHits)[nHits++] )
+	GEMHit( pos, h.fAmpl, h.fSize, h.fRaw, res, this );
+    if( sorted && prevHit && theHit->Compare(prevHit) < 0 )
+      sorted = false;
+    prevHit = theHit;
+  }
+  if( !sorted )
+    fHits->Sort();
+
+  // Negative return value indicates potential problem
+  if( nHits > fMaxHits )
+    return -nHits;
+
+  return nHits;
+}
+
+//_____________________________________________________________________________
+void GEMPlane::SaveHits( vector<HitRecord>& hits, vector<MCHitRecord>* mchits,
+			 UInt_t index ) const
+{
+  // Append the current hits (clusters) to "hits" for recording in a hit
+  // stream, with "index" as plane number, and their MC truth data to
+  // "mchits", if given
+
+  assert( index <= kMaxUShort );
+#ifdef MCDATA
+  bool mc_data = fTracker->TestBit(Tracker::kMCdata);
+#endif
+  for( Int_t i = 0; i < GetNhits(); ++i ) {
+    const GEMHit* hit = static_cast<const GEMHit*>( fHits->UncheckedAt(i) );
+    HitRecord h;
+    memset( &h, 0, sizeof(h) );
+    // Position in strip units, see LoadHits
+    h.fPos   = (hit->GetPos() - GetStart()) / GetPitch();
+    h.fRes   = hit->GetResolution();
+    h.fAmpl  = hit->GetADCsum();
+    h.fRaw   = hit->GetType();
+    h.fPlane = index;
+    h.fSize  = TMath::Min( hit->GetSize(), (UInt_t)kMaxUShort );
+    hits.push_back( h );
+    if( mchits ) {
+      MCHitRecord m;
+      memset( &m, 0, sizeof(m) );
+#ifdef MCDATA
+      if( mc_data ) {
+	const MCGEMHit* mchit = static_cast<const MCGEMHit*>(hit);
+	m.fMCTrack = mchit->fMCTrack;
+	m.fContam  = mchit->fContam;
+	m.fMCPos   = mchit->fMCPos;
+	m.fMCTime  = mchit->fMCTime;
+      }
+#endif
+      mchits->push_back( m );
+    }
+  }
+}
+
 //_____________________________________________________________________________
 Int_t GEMPlane::Decode( const THaEvData& evData )
 {
@@ -698,7 +1175,34 @@ Int_t GEMPlane::Decode( const THaEvData& evData )
     // Special "decoding" for dummy planes
     return DummyDecode( evData );
 
-  return GEMDecode( evData );
+  Int_t ret = GEMDecode( evData );
+
+  if( TestBit(kSparseStrips) )
+    FillSparseStrips();
+
+  return ret;
+}
+
+//_____________________________________________________________________________
+void GEMPlane::FillSparseStrips()
+{
+  // Copy the strip data of the strips with signal (fSigStrips) to the
+  // sparse output arrays. Usually only a small fraction of the fNelem
+  // strips has signal, so exporting these is much cheaper than the full
+  // arrays.
+
+  assert( fSigADCraw.empty() and fSigGoodHit.empty() );
+
+  UInt_t nsig = fSigStrips.size();
+  for( UInt_t i = 0; i < nsig; ++i ) {
+    Int_t istrip = fSigStrips[i];
+    assert( istrip >= 0 and istrip < fNelem );
+    fSigADCraw.push_back( fADCraw[istrip] );
+    fSigADC.push_back( fADC[istrip] );
+    fSigHitTime.push_back( fHitTime[istrip] );
+    fSigADCcor.push_back( fADCcor[istrip] );
+    fSigGoodHit.push_back( fGoodHit[istrip] );
+  }
 }
 
 //_____________________________________________________________________________
@@ -717,11 +1221,6 @@ Int_t GEMPlane::DefineVariables( EMode mode )
     { "nstrips",        "Num strips with hits > adc.min",   "GetNsigStrips()" },
     { "hitocc",         "strips > 0 / n_all_strips",        "fHitOcc" },
     { "occupancy",      "nstrips / n_all_strips",           "fOccupancy" },
-    { "strip.adcraw",   "Raw strip ADC sum",                "fADCraw" },
-    { "strip.adc",      "Deconvoluted strip ADC sum",       "fADC" },
-    { "strip.adc_c",    "Pedestal-sub strip ADC sum",       "fADCcor" },
-    { "strip.time",     "Leading time of strip signal (ns)","fHitTime" },
-    { "strip.good",     "Good pulse shape on strip",        "fGoodHit" },
     { "nhits",          "Num hits (clusters of strips)",    "GetNhits()" },
     { "noise",          "Noise level (avg below adc.min)",  "fDnoise" },
     { "ncoords",        "Num fit coords",                   "GetNcoords()" },
@@ -739,6 +1238,34 @@ Int_t GEMPlane::DefineVariables( EMode mode )
   if( ret != kOK )
     return ret;
 
+  if( !TestBit(kSparseStrips) ) {
+    // Per-strip data, arrays of size nstrips (all strips)
+    RVarDef stripvars[] = {
+      { "strip.adcraw",   "Raw strip ADC sum",                "fADCraw" },
+      { "strip.adc",      "Deconvoluted strip ADC sum",       "fADC" },
+      { "strip.adc_c",    "Pedestal-sub strip ADC sum",       "fADCcor" },
+      { "strip.time",     "Leading time of strip signal (ns)","fHitTime" },
+      { "strip.good",     "Good pulse shape on strip",        "fGoodHit" },
+      { 0 }
+    };
+    ret = DefineVarsFromList( stripvars, mode );
+  } else {
+    // Sparse per-strip data, only strips with signal (db "sparse_strips").
+    // strip.num holds the strip numbers
+    RVarDef stripvars[] = {
+      { "strip.num",      "Strip numbers with signal",        "fSigStrips" },
+      { "strip.adcraw",   "Raw strip ADC sum",                "fSigADCraw" },
+      { "strip.adc",      "Deconvoluted strip ADC sum",       "fSigADC" },
+      { "strip.adc_c",    "Pedestal-sub strip ADC sum",       "fSigADCcor" },
+      { "strip.time",     "Leading time of strip signal (ns)","fSigHitTime" },
+      { "strip.good",     "Good pulse shape on strip",        "fSigGoodHit" },
+      { 0 }
+    };
+    ret = DefineVarsFromList( stripvars, mode );
+  }
+  if( ret != kOK )
+    return ret;
+
 #ifdef MCDATA
   if( !fTracker->TestBit(Tracker::kMCdata) ) {
 #endif
@@ -808,7 +1335,8 @@ Int_t GEMPlane::ReadDatabase( const TDatime& date )
 
   // Set defaults
   TString mapping;
-  Int_t do_noise = 1, check_pulse_shape = 1;
+  Int_t do_noise = 1, check_pulse_shape = 1, apv_size = 128,
+    sparse_strips = 0;
   fMaxClusterSize = kMaxUInt;
   fMinAmpl   = 0.0;
   fSplitFrac = 0.0;
@@ -832,8 +1360,10 @@ Int_t GEMPlane::ReadDatabase( const TDatime& date )
       { "chanmap",        &fChanMap,        kIntV,    0, 1, gbl },
       { "pedestal",       &fPed,            kFloatV,  0, 1 },
       { "do_noise",       &do_noise,        kInt,     0, 1, gbl },
+      { "apv.nchan",      &apv_size,        kInt,     0, 1, gbl },
       { "adc.sigma",      &fAmplSigma,      kDouble,  0, 1, gbl },
       { "check_pulse_shape",&check_pulse_shape, kInt, 0, 1, gbl },
+      { "sparse_strips",  &sparse_strips,   kInt,     0, 1, gbl },
       { 0 }
     };
     status = LoadDB( file, date, request, fPrefix );
@@ -871,14 +1401,26 @@ Int_t GEMPlane::ReadDatabase( const TDatime& date )
     return kInitError;
   }
 
-  SetBit( kDoNoise, do_noise );
+  // do_noise = 1: event-wide noise average, 2: per-chip median
+  if( do_noise == 2 and apv_size <= 0 ) {
+    Error( Here(here), "Illegal number of channels per APV chip: %d. "
+	   "Fix database.", apv_size );
+    return kInitError;
+  }
+  fAPVsize = ( do_noise == 2 ) ? apv_size : fNelem;
+  SetBit( kDoNoise, do_noise != 0 and do_noise != 2 );
+  SetBit( kDoChipNoise, do_noise == 2 );
   SetBit( kCheckPulseShape, check_pulse_shape );
+  // sparse_strips = 1: export the strip data of strips with signal only,
+  // as arrays indexed like strip.num, instead of nstrips-sized arrays
+  SetBit( kSparseStrips, sparse_strips != 0 );
 
   SafeDelete(fADCraw);
   SafeDelete(fADC);
   SafeDelete(fHitTime);
   SafeDelete(fADCcor);
   SafeDelete(fGoodHit);
+  SafeDelete(fStripBuf);
 #ifdef MCDATA
   delete [] fMCHitInfo; fMCHitInfo = 0;
 #endif
@@ -892,7 +1434,15 @@ Int_t GEMPlane::ReadDatabase( const TDatime& date )
   fHitTime = new Float_t[fNelem];
   fADCcor = new Float_t[fNelem];
   fGoodHit = new Byte_t[fNelem];
+  fStripBuf = new GEMStripBuffer( fNelem, (fNelem+fAPVsize-1)/fAPVsize );
   fSigStrips.reserve(fNelem);
+  if( TestBit(kSparseStrips) ) {
+    fSigADCraw.reserve(fNelem);
+    fSigADC.reserve(fNelem);
+    fSigHitTime.reserve(fNelem);
+    fSigADCcor.reserve(fNelem);
+    fSigGoodHit.reserve(fNelem);
+  }
   fStripsSeen.resize(fNelem);
 
 #ifdef MCDATA
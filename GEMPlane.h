@@ -14,6 +14,10 @@
 
 namespace TreeSearch {
 
+  class GEMStripBuffer;
+  class GEMHit;
+  struct GEMCluster;
+
   class GEMPlane : public Plane {
   public:
     GEMPlane( const char* name, const char* description = "",
@@ -21,14 +25,19 @@ namespace TreeSearch {
     // For ROOT RTTI
     GEMPlane()
       : fMapType(kOneToOne), fMaxClusterSize(kMaxUInt), fMinAmpl(0),
-        fSplitFrac(0.5), fMaxSamp(10), fAmplSigma(1),
+        fSplitFrac(0.5), fMaxSamp(10), fAmplSigma(1), fAPVsize(128),
         fADCraw(0), fADC(0), fHitTime(0), fADCcor(0), fGoodHit(0),
         fDnoise(0), fNrawStrips(0), fNhitStrips(0), fHitOcc(0), fOccupancy(0),
-        fADCMap(0) {}
+        fADCMap(0), fStripBuf(0) {}
     virtual ~GEMPlane();
 
     virtual void    Clear( Option_t* opt="" );
     virtual Int_t   Decode( const THaEvData& );
+    virtual Int_t   LoadHits( const HitRecord* hits,
+			      const MCHitRecord* mchits, UInt_t n );
+    virtual void    SaveHits( std::vector<HitRecord>& hits,
+			      std::vector<MCHitRecord>* mchits,
+			      UInt_t index ) const;
     virtual void    Print( Option_t* opt="" ) const;
 
     virtual Int_t   Begin( THaRunBase* r=0 );
@@ -60,6 +69,8 @@ namespace TreeSearch {
     Vflt_t        fPed;         // [fNelem] Per-channel pedestal values
     TBits         fBadChan;     // Bad channel map
     Double_t      fAmplSigma;   // Sigma of hit amplitude distribution
+    UInt_t        fAPVsize;     // Channels per front-end chip, for
+                                // per-chip common-mode correction
 
     // Event data, hits etc.
     Float_t*      fADCraw;      // [fNelem] Integral of raw ADC samples
@@ -67,8 +78,17 @@ namespace TreeSearch {
     Float_t*      fHitTime;     // [fNelem] Leading-edge time of deconv signal (ns)
     Float_t*      fADCcor;      // [fNelem] fADC corrected for pedestal & noise
     Byte_t*       fGoodHit;     // [fNelem] Strip data passed pulse shape test
-    Double_t      fDnoise;      // Event-by-event noise (avg below fMinAmpl)
+    Double_t      fDnoise;      // Event-by-event noise (avg below fMinAmpl,
+                                // or average of per-chip medians)
     Vint_t        fSigStrips;   // Ordered strip numbers with signal (adccor > minampl)
+    // Strip data of fSigStrips only, for sparse output (db "sparse_strips").
+    // fSigGoodHit is not a Byte_t vector because the global variable system
+    // does not support those.
+    Vflt_t        fSigADCraw;   // fADCraw of fSigStrips
+    Vflt_t        fSigADC;      // fADC of fSigStrips
+    Vflt_t        fSigHitTime;  // fHitTime of fSigStrips
+    Vflt_t        fSigADCcor;   // fADCcor of fSigStrips
+    Vint_t        fSigGoodHit;  // fGoodHit of fSigStrips
     Vbool_t       fStripsSeen;  // Flags for duplicate strip number detection
 
     UInt_t        fNrawStrips;  // Statistics: strips with any data
@@ -79,7 +99,16 @@ namespace TreeSearch {
     // Optional diagnostics for TESTCODE, keep for binary compatibility
     TH1*          fADCMap;      // Histogram of strip numbers weighted by ADC
 
+    // Work space for decoding
+    GEMStripBuffer* fStripBuf;  //! Buffered strip data of current event
+
     void          AddStrip( Int_t istrip );
+    void          FindSigStrips();
+    void          FillSparseStrips();
+    void          SubtractChipNoise();
+    Int_t         FindClusters();
+    GEMHit*       AddCluster( const GEMCluster& cl, UInt_t type );
+    Double_t      ClusterResolution( UInt_t size ) const;
 
     // Support functions for dummy planes
     virtual Hit*  AddHitImpl( Double_t x );
@@ -92,7 +121,9 @@ namespace TreeSearch {
     // Bits for GEMPlanes
     enum {
       kDoNoise         = BIT(16), // Correct data for common-mode noise
-      kCheckPulseShape = BIT(17)  // Reject malformed ADC pulse shapes
+      kCheckPulseShape = BIT(17), // Reject malformed ADC pulse shapes
+      kDoChipNoise     = BIT(18), // Correct common-mode noise per APV chip
+      kSparseStrips    = BIT(19)  // Export strip data of fSigStrips only
     };
 
     ClassDef(GEMPlane,0)  // ADC-based readout plane coordinate direction
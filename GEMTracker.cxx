@@ -18,7 +18,6 @@
 
 #include "TString.h"
 #include "TMath.h"
-#include "TBits.h"
 
 #include <iostream>
 #include <algorithm>
@@ -263,6 +262,42 @@ UInt_t GEMTracker::GetCrateMapDBcols() const
   return 5;
 }
 
+//_____________________________________________________________________________
+Tracker* GEMTracker::MakeReplica() const
+{
+  // Create a new, uninitialized GEMTracker with the same name and apparatus,
+  // for concurrent processing of events in batch mode
+
+  return new GEMTracker( GetName(), GetTitle(), GetApparatus() );
+}
+
+//_____________________________________________________________________________
+static void GetRoadAmplitudes( const Rvec_t& roads, UInt_t nplanes,
+			       vector<Double_t>& ampl )
+{
+  // Fill 'ampl' with the hit amplitudes of the given roads, nplanes values
+  // per road, indexed by plane number. Planes without a hit (or with an
+  // amplitude too small to be useful) get zero.
+
+  ampl.assign( roads.size()*nplanes, 0.0 );
+  for( Rvec_t::size_type i = 0; i < roads.size(); ++i ) {
+    const Road::Pvec_t& points = roads[i]->GetPoints();
+    Double_t* a = &ampl[i*nplanes];
+    for( Road::Pvec_t::const_iterator it = points.begin();
+	 it != points.end(); ++it ) {
+      const Road::Point* p = *it;
+      assert( p and p->hit );
+      UInt_t num = p->hit->GetPlaneNum();
+      assert( num < nplanes );
+      assert( dynamic_cast<GEMHit*>(p->hit) );
+      Double_t adc = static_cast<GEMHit*>(p->hit)->GetADCsum();
+      assert( adc > 0.0 ); // ensured in Decoder
+      if( adc >= 1.0 )
+	a[num] = adc;
+    }
+  }
+}
+
 //_____________________________________________________________________________
 UInt_t GEMTracker::MatchRoadsCorrAmpl( vector<Rvec_t>& roads,
 		       UInt_t /* ncombos */,
@@ -273,6 +308,16 @@ UInt_t GEMTracker::MatchRoadsCorrAmpl( vector<Rvec_t>& roads,
   // detectors that measure some sort of amplitude (e.g. energy deposited)
   // for hits in some sort of shared readout plane.
   // Currently requires exactly two projections with identical number of planes.
+  //
+  // The hit amplitudes of each road are looked up only once. An x/y road
+  // pair can only be accepted if the amplitudes match in at least
+  // nplanes - fMaxCorrMismatches planes, so at least one of any
+  // fMaxCorrMismatches+1 planes must match. For these planes, the y-roads
+  // are sorted by log(amplitude), and for each x-road, only the y-roads
+  // whose amplitudes are within the cutoff in one of them are tested.
+  // The running time thus grows with the number of roads times log(number
+  // of roads) plus the number of near matches, instead of with the product
+  // of the numbers of x- and y-roads.
 
   vector<Rvec_t>::size_type nproj = roads.size();
   assert( nproj == 2 );
@@ -299,19 +344,104 @@ UInt_t GEMTracker::MatchRoadsCorrAmpl( vector<Rvec_t>& roads,
   assert( xplanes.front()->GetType() != yplanes.front()->GetType() );
 
   UInt_t nplanes = xplanes.size();
-  TBits xybits(nplanes), ybits(nplanes);
-  // Look at all possible combinations of x-roads and y-roads.
-  // Try to match them via the ADC amplitudes of the hits in the shared
-  // readout planes. Amplitudes should correlate well in the absence
-  // of pileup.
-  for( Rvec_t::iterator itx = roads[0].begin(); itx != roads[0].end();
-       ++itx ) {
-    Road* xroad = *itx;
-    const Road::Pvec_t& xpoints = xroad->GetPoints();
+  const Rvec_t& xroads = roads[0];
+  const Rvec_t& yroads = roads[1];
+  UInt_t nx = xroads.size(), ny = yroads.size();
+
+  // Hit amplitudes of all roads in the shared readout planes. Amplitudes
+  // should correlate well in the absence of pileup.
+  vector<Double_t> xampl, yampl;
+  GetRoadAmplitudes( xroads, nplanes, xampl );
+  GetRoadAmplitudes( yroads, nplanes, yampl );
+
+  // The cut is on the amplitude asymmetry, |x-y|/(x+y) < cutoff. In general,
+  // the sigma of the distribution can be amplitude-dependent, so the cutoff
+  // could be obtained via a calibration function that is a property of each
+  // readout plane, e.g.
+  // 	  Double_t xsigma = xplane->GetAmplSigma( xampl );
+  // 	  Double_t ysigma = yplane->GetAmplSigma( yampl );
+  // Apply overall scale factor ("number of sigmas") from the database
+  // 	  Double_t cutoff = fMaxCorrNsigma / yampl *
+  // 	    TMath::Sqrt( xsigma*xsigma + ysigma*ysigma*ratio*ratio );
+  Double_t cutoff = fMaxCorrNsigma;
+
+  // Equivalent cut on |log(x)-log(y)|, made a little wider for the
+  // candidate search to be safe from rounding. The exact cut is applied
+  // to the candidates below. A cutoff >= 1 accepts any amplitudes.
+  bool any_ampl = ( cutoff >= 1.0 );
+  Double_t logwin = any_ampl ? 0.0 :
+    TMath::Log( (1.0+cutoff)/(1.0-cutoff) ) * (1.0+1e-9) + 1e-9;
+
+  // Candidate y-roads for each x-road. If any combination of x- and y-roads
+  // may pass (too many allowed mismatches), test all of them.
+  typedef pair<Double_t,UInt_t> Key_t;  // (log amplitude, y-road index)
+  vector< vector<Key_t> > sorted;
+  vector<UInt_t> sortplane;             // Plane number of each sorted[k]
+  if( fMaxCorrMismatches < nplanes ) {
+    // Select the fMaxCorrMismatches+1 planes with the fewest y-hits
+    vector< pair<UInt_t,UInt_t> > ycount( nplanes, make_pair(0U,0U) );
+    for( UInt_t ip = 0; ip < nplanes; ++ip ) {
+      ycount[ip].second = ip;
+      for( UInt_t iy = 0; iy < ny; ++iy )
+	if( yampl[iy*nplanes+ip] > 0.0 )
+	  ++ycount[ip].first;
+    }
+    sort( ALL(ycount) );
+    sorted.resize( fMaxCorrMismatches+1 );
+    sortplane.resize( sorted.size() );
+    for( vector< vector<Key_t> >::size_type k = 0; k < sorted.size(); ++k ) {
+      UInt_t ip = sortplane[k] = ycount[k].second;
+      vector<Key_t>& keys = sorted[k];
+      keys.reserve( ycount[k].first );
+      for( UInt_t iy = 0; iy < ny; ++iy ) {
+	Double_t a = yampl[iy*nplanes+ip];
+	if( a > 0.0 )
+	  keys.push_back( make_pair( TMath::Log(a), iy ) );
+      }
+      sort( ALL(keys) );
+    }
+  }
+
+  vector<UInt_t> cand, seen( ny, kMaxUInt );
+  cand.reserve( ny );
+  for( UInt_t ix = 0; ix < nx; ++ix ) {
+    Road* xroad = xroads[ix];
     UInt_t xpat = xroad->GetPlanePattern();
-    for( Rvec_t::iterator ity = roads[1].begin(); ity != roads[1].end();
-	 ++ity ) {
-      Road* yroad = *ity;
+    const Double_t* xa = &xampl[ix*nplanes];
+
+    // Collect candidate y-roads, in their original order
+    cand.clear();
+    if( sorted.empty() ) {
+      for( UInt_t iy = 0; iy < ny; ++iy )
+	cand.push_back( iy );
+    } else {
+      for( vector< vector<Key_t> >::size_type k = 0; k < sorted.size();
+	   ++k ) {
+	const vector<Key_t>& keys = sorted[k];
+	Double_t a = xa[sortplane[k]];
+	if( a == 0.0 )
+	  continue;
+	vector<Key_t>::const_iterator it = keys.begin(), end = keys.end();
+	if( !any_ampl ) {
+	  Double_t loga = TMath::Log(a);
+	  it  = lower_bound( it, end, make_pair(loga-logwin, 0U) );
+	  end = upper_bound( it, end, make_pair(loga+logwin, kMaxUInt) );
+	}
+	for( ; it != end; ++it ) {
+	  UInt_t iy = it->second;
+	  if( seen[iy] != ix ) {
+	    seen[iy] = ix;
+	    cand.push_back( iy );
+	  }
+	}
+      }
+      sort( ALL(cand) );
+    }
+
+    for( vector<UInt_t>::const_iterator ic = cand.begin(); ic != cand.end();
+	 ++ic ) {
+      UInt_t iy = *ic;
+      Road* yroad = yroads[iy];
 
       // xpat and ypat are bitpatterns of the plane numbers that have hits.
       // The AND of these patters is the pattern of planes where both read-
@@ -319,72 +449,26 @@ UInt_t GEMTracker::MatchRoadsCorrAmpl( vector<Rvec_t>& roads,
       // are enough such common active planes, else all following work can
       // be skipped.
       UInt_t ypat = yroad->GetPlanePattern();
-      xybits.Set( nplanes, &xpat );
-      ybits.Set( nplanes, &ypat );
-      xybits &= ybits;
-      assert( xybits.CountBits() <= nplanes );
-      if( xybits.CountBits() + fMaxCorrMismatches < nplanes )
+      UInt_t nxy = NumberOfSetBits( xpat & ypat );
+      assert( nxy <= nplanes );
+      if( nxy + fMaxCorrMismatches < nplanes )
 	continue;
 
-      // For all points (=hits that yield the best fit) of this xroad,
-      // get the yroad point in the same plane (if available), then check
-      // if their ADC amplitudes approximately match (within a hard cut)
-      const Road::Pvec_t& ypoints = yroad->GetPoints();
-      Road::Pvec_t::const_iterator ityp = ypoints.begin();
+      // For all planes where both roads have a hit, check if their ADC
+      // amplitudes approximately match (within a hard cut)
+      const Double_t* ya = &yampl[iy*nplanes];
       UInt_t nmatches = 0;
       Double_t matchval = 0.0;
-      for( Road::Pvec_t::const_iterator itxp = xpoints.begin();
-	   itxp != xpoints.end(); ++itxp ) {
-	const Road::Point* xp = *itxp;
-	assert( xp and xp->hit );
-	const Plane* xplane = xp->hit->GetPlane();
-	assert( xplane );
-	UInt_t xnum = xplane->GetPlaneNum();
-	assert( xnum < xplanes.size() );
-	// No hit in the other readout direction of this plane?
-	if( not ybits.TestBitNumber(xnum) )
-	  continue;
-	// Move y-iterator forward until it gets to the same plane
-	const Road::Point* rtyp = *ityp;
-	assert( (ityp == ypoints.end()) or
-		(rtyp->hit->GetPlaneNum() != kMaxUInt) );
-	while( (ityp != ypoints.end()) and (rtyp = *ityp) and
-	       rtyp->hit->GetPlaneNum() != xnum ) {
-	  ++ityp;
-	}
-	// Must find a corresponding hit here, else bug in ybits test
-	assert( ityp != ypoints.end() );
-	if( ityp == ypoints.end() ) break;
-	const Road::Point* yp = *ityp;
-	assert( yp and yp->hit );
-	const Plane* yplane = yp->hit->GetPlane();
-	assert( yplane );
-	assert( yplane->GetPartner() == xplane );
-
-	// Get ratio of hit amplitudes
-	assert( dynamic_cast<GEMHit*>(xp->hit) );
-	assert( dynamic_cast<GEMHit*>(yp->hit) );
-	Double_t xampl = static_cast<GEMHit*>(xp->hit)->GetADCsum();
-	Double_t yampl = static_cast<GEMHit*>(yp->hit)->GetADCsum();
-	assert( (xampl > 0.0) and (yampl > 0.0) ); // ensured in Decoder
-	if( xampl < 1.0 or yampl < 1.0 )
+      for( UInt_t ip = 0; ip < nplanes; ++ip ) {
+	if( xa[ip] == 0.0 or ya[ip] == 0.0 )
 	  continue;
-	Double_t ratio = xampl/yampl;
-	Double_t asym = (xampl - yampl)/(xampl + yampl);
-	// Compute the cutoff. In general, the sigma of the distribution can
-	// be amplitude-dependent, so we get it via a calibration function
-	// that is a property of each readout plane
-	// 	  Double_t xsigma = xplane->GetAmplSigma( xampl );
-	// 	  Double_t ysigma = yplane->GetAmplSigma( yampl );
-	// Apply overall scale factor ("number of sigmas") from the database
-	// 	  Double_t cutoff = fMaxCorrNsigma / yampl *
-	// 	    TMath::Sqrt( xsigma*xsigma + ysigma*ysigma*ratio*ratio );
-	Double_t cutoff = fMaxCorrNsigma;
+	Double_t asym = (xa[ip] - ya[ip])/(xa[ip] + ya[ip]);
 #ifdef VERBOSE
 	if( fDebug > 3 ) {
-	  cout << xplane->GetName() << yplane->GetName()
-	       << " ampl = (" << xampl << ", " << yampl << ")"
-	       << ",\tratio = " << ratio
+	  const Plane* xplane = xplanes[ip];
+	  cout << xplane->GetName() << xplane->GetPartner()->GetName()
+	       << " ampl = (" << xa[ip] << ", " << ya[ip] << ")"
+	       << ",\tratio = " << xa[ip]/ya[ip]
 	       << ", asym = " << asym << endl;
 	}
 #endif
@@ -393,7 +477,7 @@ UInt_t GEMTracker::MatchRoadsCorrAmpl( vector<Rvec_t>& roads,
 	  matchval += TMath::Abs(asym);  // not really used later (yet)
 	  ++nmatches;
 	}
-      } //xpoints
+      } //planes
 
 #ifdef VERBOSE
       if( fDebug > 3 ) {
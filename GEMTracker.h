@@ -39,6 +39,7 @@ namespace TreeSearch {
 			       Rset_t& unique_found );
 
     virtual UInt_t GetCrateMapDBcols() const;
+    virtual Tracker* MakeReplica() const;
 
     virtual Plane* MakePlane( const char* name, const char* description = "",
 			      THaDetectorBase* parent = 0 ) const;
@@ -15,8 +15,39 @@
 #include <functional>
 #include <algorithm>
 
+// AVX2 code paths. Functions declared TREESEARCH_AVX2 are compiled for
+// AVX2 even if the rest of the code is compiled for an older architecture
+// (GCC >= 4.9 and Clang on x86), and must only be called if HaveAVX2().
+#if defined(__AVX2__) && !defined(__CINT__)
+# define TREESEARCH_HAVE_AVX2
+# define TREESEARCH_AVX2
+#elif defined(__GNUC__) && !defined(__CINT__) &&   \
+  (defined(__x86_64__) || defined(__i386__)) &&     \
+  (defined(__clang__) || __GNUC__ > 4 ||            \
+   (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# define TREESEARCH_HAVE_AVX2
+# define TREESEARCH_AVX2 __attribute__((target("avx2")))
+#endif
+
 namespace TreeSearch {
 
+#ifdef TREESEARCH_HAVE_AVX2
+  //___________________________________________________________________________
+  inline Bool_t HaveAVX2()
+  {
+    // True if the CPU supports AVX2. Checked once per process unless the
+    // code is compiled for AVX2 anyway.
+
+# ifdef __AVX2__
+    return true;
+# else
+    static const Bool_t have_avx2 =
+      ( __builtin_cpu_init(), __builtin_cpu_supports("avx2") != 0 );
+    return have_avx2;
+# endif
+  }
+#endif
+
   //___________________________________________________________________________
   template< typename VectorElem > inline void
   NthCombination( UInt_t n, const std::vector<std::vector<VectorElem> >& vec,
@@ -143,11 +174,53 @@ namespace TreeSearch {
     // Count number of bits set in 32-bit integer. From
     // http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetParallel
 
+#ifdef __GNUC__
+    return __builtin_popcount(v);  // Single instruction where available
+#else
     v = v - ((v >> 1) & 0x55555555);
     v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
     return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+#endif
   }
 
+  //___________________________________________________________________________
+  // Table of allowed plane occupancy patterns. The bitpattern of the plane
+  // numbers that have hits is the index into the table. All lookups are
+  // inline since they are done in the innermost loops of the tree search.
+  class PlaneCombos {
+  public:
+    enum { kMaxPlanes = 16, kNwords = (1U<<kMaxPlanes)/64 };
+
+    PlaneCombos( UInt_t nplanes, UInt_t minplanes )
+      : fNplanes(nplanes), fMinPlanes(minplanes)
+    {
+      assert( nplanes <= kMaxPlanes );
+      for( UInt_t i = 0; i < kNwords; ++i )
+	fBits[i] = 0;
+    }
+
+    void   Allow( UInt_t pattern ) {
+      assert( pattern < (1U<<fNplanes) );
+      fBits[pattern>>6] |= (ULong64_t)1 << (pattern&63);
+    }
+    // True if the given plane pattern is allowed
+    Bool_t IsAllowed( UInt_t pattern ) const {
+      assert( pattern < (1U<<fNplanes) );
+      return (fBits[pattern>>6] >> (pattern&63)) & 1;
+    }
+    // True if the given plane pattern has at least GetMinPlanes() planes
+    Bool_t HasMinPlanes( UInt_t pattern ) const {
+      return (UInt_t)NumberOfSetBits(pattern) >= fMinPlanes;
+    }
+    UInt_t GetNplanes()   const { return fNplanes; }
+    UInt_t GetMinPlanes() const { return fMinPlanes; }
+
+  private:
+    UInt_t    fNplanes;         // Number of planes (bits of the index)
+    UInt_t    fMinPlanes;       // Minimum number of planes for fitting
+    ULong64_t fBits[kNwords];   // Allowed patterns, one bit per pattern
+  };
+
 ///////////////////////////////////////////////////////////////////////////////
 
 } // end namespace TreeSearch
@@ -8,7 +8,7 @@
 
 #include "Hit.h"
 #include "Road.h"
-#include "TSeqCollection.h"
+#include "Hitpattern.h"
 
 #include <iostream>
 
@@ -17,7 +17,6 @@ using std::endl;
 using std::make_pair;
 
 ClassImp(TreeSearch::Hit)
-ClassImp(TreeSearch::HitPairIter)
 ClassImp(TreeSearch::HitSet)
 
 namespace TreeSearch {
@@ -68,191 +67,100 @@ Double_t FitCoord::GetChi2() const
 }
 
 //_____________________________________________________________________________
-HitPairIter::HitPairIter( const TSeqCollection* collA,
-			  const TSeqCollection* collB,
-			  Double_t maxdist )
-  : fCollA(collA), fCollB(collB), fIterA(0), fIterB(0),
-    fSaveIter(0), fSaveHit(0), fMaxDist(maxdist), fStarted(kFALSE),
-    fScanning(kFALSE)
+HitPairScanner::HitPairScanner( const Plane* A, const Plane* B,
+				Double_t maxdist )
+  : fA(A), fB(B), fNA(A ? A->GetNhits() : 0), fNB(B ? B->GetNhits() : 0),
+    fIA(0), fIB(0), fSave(0), fMaxDist(maxdist), fScanning(kFALSE)
 {
-  // Constructor
-
-  if( !fIterA && fCollA )
-    fIterA = fCollA->MakeIterator();
-  if( !fIterB && fCollB ) {
-    fIterB = fCollB->MakeIterator();
-    if( !fSaveIter )
-      fSaveIter = fCollB->MakeIterator();
-  }
-  // Initialize our state so we point to the first item
-  Next();
-}
-
-//_____________________________________________________________________________
-HitPairIter::HitPairIter( const HitPairIter& rhs )
-  : fCollA(rhs.fCollA), fCollB(rhs.fCollB), fIterA(0), fIterB(0),
-    fSaveIter(0), fSaveHit(rhs.fSaveHit),
-    fMaxDist(rhs.fMaxDist), fStarted(rhs.fStarted), fScanning(rhs.fScanning),
-    fCurrent(rhs.fCurrent), fNext(rhs.fNext)
-{
-  // Copy ctor
-
-  if( fCollA ) {
-    fIterA = fCollA->MakeIterator();
-    *fIterA = *rhs.fIterA;
-  }
-  if( fCollB ) {
-    fIterB = fCollB->MakeIterator();
-    *fIterB = *rhs.fIterB;
-    fSaveIter = fCollB->MakeIterator();
-    *fSaveIter = *rhs.fSaveIter;
-  }
-}
-
-//_____________________________________________________________________________
-HitPairIter& HitPairIter::operator=( const HitPairIter& rhs )
-{
-  // Assignment operator
+  // Constructor. The hits in both planes must be sorted by position.
 
-  if( this != &rhs ) {
-    fCollA     = rhs.fCollA;
-    fCollB     = rhs.fCollB;
-    fMaxDist   = rhs.fMaxDist;
-    fStarted   = rhs.fStarted;
-    fScanning  = rhs.fScanning;
-    fCurrent   = rhs.fCurrent;
-    fNext      = rhs.fNext;
-    delete fIterA;
-    delete fIterB;
-    delete fSaveIter;
-    if( fCollA ) {
-      fIterA = fCollA->MakeIterator();
-      *fIterA = *rhs.fIterA;
-    }
-    if( fCollB ) {
-      fIterB = fCollB->MakeIterator();
-      *fIterB = *rhs.fIterB;
-      fSaveIter = fCollB->MakeIterator();
-      *fSaveIter = *rhs.fSaveIter;
-    }
-  }
-  return *this;
 }
 
 //_____________________________________________________________________________
-HitPairIter::~HitPairIter()
+void HitPairScanner::Reset()
 {
-  // Destructor
-
-  delete fIterA;
-  delete fIterB;
-  delete fSaveIter;
-}
-
+  // Reset the scanner to the start
 
-//_____________________________________________________________________________
-void HitPairIter::Reset()
-{
-  // Reset the iterator to the start
-
-  fStarted = fScanning = kFALSE;
-  if( fIterA )
-    fIterA->Reset();
-  if( fIterB )
-    fIterB->Reset();
-  // Our initial state is to point to the first object
-  Next();
+  fIA = fIB = fSave = 0;
+  fScanning = kFALSE;
 }
 
-
 //_____________________________________________________________________________
-HitPairIter& HitPairIter::Next()
+Bool_t HitPairScanner::Next( HitPair_t& pair )
 {
-  // Return next pair of hits along the wire plane. If a hit in either
+  // Get the next pair of hits along the wire plane. If a hit in either
   // plane is unpaired (no matching hit on the other plane within maxdist)
-  // then only that hit is set in the returned pair object. If both
-  // hits returned are zero, then there are no more hits in either plane.
-
-  if( !fStarted ) {
-    fNext = make_pair( fIterA ? fIterA->Next() : 0,
-		       fIterB ? fIterB->Next() : 0 );
-    fStarted = kTRUE;
-  }
+  // then only that hit is set in the returned pair. Returns false if there
+  // are no more hits in either plane.
+  //
+  // A hit in A that overlaps several hits in B is paired with each of
+  // them; afterwards, B is rewound to the start of that scan, since those
+  // B hits may pair with the next A, too.
 
-  fCurrent = fNext;
-  Hit* hitA = static_cast<Hit*>( fCurrent.first );
-  Hit* hitB = static_cast<Hit*>( fCurrent.second );
+  Hit* hitA = (fIA < fNA) ? fA->GetHit(fIA) : 0;
+  Hit* hitB = (fIB < fNB) ? fB->GetHit(fIB) : 0;
+  pair = make_pair( hitA, hitB );
 
   if( hitA && hitB ) {
     switch( hitA->Compare(hitB,fMaxDist) ) {
     case -1: // A<B
-      fNext.first  = fIterA->Next();
-      fCurrent.second = 0;
+      ++fIA;
+      pair.second = 0;
       break;
     case  1: // A>B
-      fNext.second = fIterB->Next();
-      fCurrent.first = 0;
+      ++fIB;
+      pair.first = 0;
       break;
     default: // A==B
       {
-	// Found a pair
-	Hit* nextB = static_cast<Hit*>( fIterB->Next() );
-	if( !nextB || hitA->Compare(nextB,fMaxDist) < 0 ) {
-	  if( fScanning ) {
-	    // End of a scan of plane B with fixed hitA
-	    fScanning = kFALSE;
-	    // Return B to the point where we started the scan
-	    *fIterB = *fSaveIter;
-	    hitB = fSaveHit;
-	    // Advance to the next hit in A
-	    hitA = static_cast<Hit*>( fIterA->Next() );
-	    // Advance B until either B >= A or B == nextB (the hit in B that
-	    // ended the prior scan), whichever comes first.
-	    // The Bs for which saveB <= B < nextB have been paired with the
-	    // prior A in the prior scan and so can't be considered unpaired,
-	    // but they might pair with the new A, still.
-	    if( hitA ) {
-	      while( hitB != nextB && hitB->Compare(hitA,fMaxDist) < 0 )
-		hitB = static_cast<Hit*>( fIterB->Next() );
-	    } else {
-	      // Of course, if there are no more hits in A, we only have to
-	      // scan the rest of the Bs.
-	      hitB = nextB;
-	    }
-	    fNext = make_pair( hitA, hitB );
-
-	  } else {
-	    // This is the normal case: nextB > hitA (usually true for
-	    // small maxdist). So hitA/hitB are a pair, and
-	    // the next hits to consider are the next ones in each plane.
-	    fNext = make_pair( fIterA->Next(), nextB );
-	  }
+	// Found a pair. Look ahead to the next hit in B
+	Int_t inext = fIB+1;
+	if( inext == fNB || hitA->Compare(fB->GetHit(inext),fMaxDist) < 0 ) {
+	  ++fIA;
+	  if( fScanning && fIA < fNA ) {
+	    // End of a scan of plane B with fixed hitA. Return B to the
+	    // start of the scan and advance it until either B >= the new A
+	    // or B reaches inext, whichever comes first
+	    Hit* newA = fA->GetHit(fIA);
+	    fIB = fSave;
+	    while( fIB != inext &&
+		   fB->GetHit(fIB)->Compare(newA,fMaxDist) < 0 )
+	      ++fIB;
+	  } else
+	    fIB = inext;
+	  fScanning = kFALSE;
 	} else {
-	  // A==B and A==nextB, so more than one B matches this A.
-	  // Start scanning mode where we keep hitA fixed and walk along
-	  // B as long as B==A.
+	  // More than one B matches this A. Keep A fixed and walk along B
 	  if( !fScanning ) {
 	    fScanning = kTRUE;
-	    // Save the starting point of the scan. We have to save both
-	    // the iterator and the object because ROOT's TIterator
-	    // is rather dumb (no Current() method).
-	    *fSaveIter = *fIterB;
-	    fSaveHit = hitB;
+	    fSave = fIB;
 	  }
-	  // nextB != 0 and hitA == nextB guaranteed here, so the
-	  // next iteration will give hitA==hitB again.
-	  fNext.second = nextB;
+	  fIB = inext;
 	}
 	break;
       }
     }
   } else if( hitA ) {
-    fNext.first  = fIterA->Next();
+    ++fIA;
   } else if( hitB ) {
-    fNext.second = fIterB->Next();
-  }
+    ++fIB;
+  } else
+    return kFALSE;
 
-  return *this;
+  return kTRUE;
+}
+
+//_____________________________________________________________________________
+UInt_t HitPairScanner::Scan( std::vector<HitPair_t>& pairs )
+{
+  // Append all remaining hit pairs to 'pairs'. Returns the number of pairs
+
+  size_t n = pairs.size();
+  HitPair_t pair;
+  while( Next(pair) )
+    pairs.push_back(pair);
+
+  return pairs.size() - n;
 }
 
 //_____________________________________________________________________________
@@ -272,6 +180,49 @@ UInt_t HitSet::GetAltMatchValue( const Hset_t& hits )
   return curpat;
 }
 
+//_____________________________________________________________________________
+void HitSet::CollectHits( const Hitpattern* hitpat, const NodeDescriptor& nd,
+			  Hset_t& hits )
+{
+  // Add the hits in the bins of pattern nd in the given hitpattern to "hits".
+  // nd may be a coarse pattern above the bottom of the tree.
+
+  assert( hitpat and nd.GetNbits() == hitpat->GetNplanes() );
+  for( UInt_t i = 0; i < hitpat->GetNplanes(); ++i ) {
+    HitRange range = hitpat->GetHits( i, nd );
+    hits.insert( range.begin(), range.end() );
+  }
+}
+
+//_____________________________________________________________________________
+Bool_t HitSet::IsSimilarTo( const Hitpattern* hitpat, const NodeDescriptor& nd,
+			    UInt_t plane_pattern ) const
+{
+  // Same as IsSimilarTo(tryset) with maxdist == 0, where tryset holds the
+  // hits in the bins of pattern nd, whose plane occupancy is plane_pattern.
+  // Tests the hits of each bin directly, without building tryset.
+
+  assert( plane_pattern );
+  assert( hitpat and nd.GetNbits() == hitpat->GetNplanes() );
+
+  UInt_t intersection_pattern = 0;
+  for( UInt_t i = 0; i < hitpat->GetNplanes(); ++i ) {
+    HitRange range = hitpat->GetHits( i, nd[i] );
+    if( range.empty() )
+      continue;
+    HitRange::const_iterator it = range.begin();
+    for( ; it != range.end(); ++it ) {
+      if( hits.find(*it) != hits.end() )
+	break;
+    }
+    // A plane with hits, none of which is in this set, excludes a match
+    if( it == range.end() )
+      return false;
+    intersection_pattern |= 1U << (*it)->GetPlaneNum();
+  }
+  return plane_pattern == intersection_pattern;
+}
+
 //_____________________________________________________________________________
 Bool_t HitSet::IsSimilarTo( const HitSet& tryset, Int_t /* maxdist */ ) const
 {
@@ -323,6 +274,146 @@ Bool_t HitSet::IsSimilarTo( const HitSet& tryset, Int_t /* maxdist */ ) const
   return tryset.plane_pattern == intersection_pattern;
 }
 
+//_____________________________________________________________________________
+SortedHitVec::SortedHitVec( const SortedHitVec& orig )
+  : fData(fInline), fSize(0), fCapacity(kInline)
+{
+  // Copy constructor
+
+  Reserve( orig.fSize );
+  memcpy( fData, orig.fData, orig.fSize*sizeof(Hit*) );
+  fSize = orig.fSize;
+}
+
+//_____________________________________________________________________________
+SortedHitVec& SortedHitVec::operator=( const SortedHitVec& rhs )
+{
+  // Assignment
+
+  if( this != &rhs ) {
+    fSize = 0;
+    Reserve( rhs.fSize );
+    memcpy( fData, rhs.fData, rhs.fSize*sizeof(Hit*) );
+    fSize = rhs.fSize;
+  }
+  return *this;
+}
+
+//_____________________________________________________________________________
+void SortedHitVec::Reserve( UInt_t n )
+{
+  // Make room for at least n hits, moving the contents to the heap if needed
+
+  if( n <= fCapacity )
+    return;
+  Hit** buf = new Hit*[n];
+  memcpy( buf, fData, fSize*sizeof(Hit*) );
+  if( fData != fInline )
+    delete [] fData;
+  fData = buf;
+  fCapacity = n;
+}
+
+//_____________________________________________________________________________
+UInt_t SortedHitVec::merge( const SortedHitVec& other )
+{
+  // Add the hits of "other" that have no equivalent here, in linear time.
+  // Returns the bitpattern of the plane numbers of the added hits.
+
+  key_compare comp;
+
+  // Count the new hits
+  UInt_t nnew = 0, newpat = 0;
+  const_iterator a = begin(), b = other.begin();
+  while( b != other.end() ) {
+    if( a == end() or comp(*b,*a) ) {
+      ++nnew;
+      newpat |= 1U << (*b)->GetPlaneNum();
+      ++b;
+    } else if( comp(*a,*b) )
+      ++a;
+    else {
+      ++a; ++b;
+    }
+  }
+  if( nnew == 0 )
+    return 0;
+
+  // Merge from the back, so that each hit is moved at most once
+  if( fSize+nnew > fCapacity )
+    Reserve( std::max(fSize+nnew, 2*fCapacity) );
+  Hit** out = fData+fSize+nnew;
+  Hit** pa  = fData+fSize;
+  const_iterator pb = other.end();
+  while( pb != other.begin() ) {
+    if( pa != fData and !comp(*(pa-1),*(pb-1)) ) {
+      if( !comp(*(pb-1),*(pa-1)) )
+	--pb;  // Equivalent hits: keep ours
+      *--out = *--pa;
+    } else
+      *--out = *--pb;
+  }
+  assert( out == pa );  // The remaining hits are already in place
+  fSize += nnew;
+
+  return newpat;
+}
+
+//_____________________________________________________________________________
+void SortedHitVec::swap( SortedHitVec& rhs )
+{
+  // Exchange contents with rhs. Heap buffers are swapped without copying.
+
+  Bool_t inl = (fData == fInline), rhs_inl = (rhs.fData == rhs.fInline);
+  if( inl and rhs_inl ) {
+    std::swap_ranges( fInline, fInline+std::max(fSize,rhs.fSize),
+		      rhs.fInline );
+    std::swap( fSize, rhs.fSize );
+  } else if( !inl and !rhs_inl ) {
+    std::swap( fData, rhs.fData );
+    std::swap( fSize, rhs.fSize );
+    std::swap( fCapacity, rhs.fCapacity );
+  } else {
+    // One of the two uses the heap. The other one's hits move to its
+    // inline buffer and it takes over the heap buffer.
+    SortedHitVec& h = inl ? rhs : *this;
+    SortedHitVec& s = inl ? *this : rhs;
+    Hit** buf = h.fData;
+    UInt_t size = h.fSize, cap = h.fCapacity;
+    memcpy( h.fInline, s.fData, s.fSize*sizeof(Hit*) );
+    h.fData = h.fInline;
+    h.fSize = s.fSize;
+    h.fCapacity = kInline;
+    s.fData = buf;
+    s.fSize = size;
+    s.fCapacity = cap;
+  }
+}
+
+//_____________________________________________________________________________
+NodeArena::~NodeArena()
+{
+  // Destructor. Destroys all nodes and frees the memory blocks.
+
+  Clear();
+  for( std::vector<Node_t*>::size_type i = 0; i < fBlocks.size(); ++i )
+    ::operator delete( fBlocks[i] );
+}
+
+//_____________________________________________________________________________
+void NodeArena::Clear()
+{
+  // Destroy all nodes. The memory is kept for reuse.
+
+  for( UInt_t ib = 0; ib < fBlocks.size() and ib <= fBlock; ++ib ) {
+    Node_t* blk = fBlocks[ib];
+    UInt_t n = (ib < fBlock) ? (UInt_t)kBlockSize : fUsed;
+    for( UInt_t i = 0; i < n; ++i )
+      blk[i].~Node_t();
+  }
+  fBlock = fUsed = 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 } // end namespace TreeSearch
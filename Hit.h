@@ -10,21 +10,23 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "Plane.h"
-#include "TBits.h"
 #include "Node.h"   // for NodeDescriptor
-#include "Helper.h" // for NumberOfSetBits
+#include "Helper.h" // for NumberOfSetBits, PlaneCombos
 #include <utility>
 #include <set>
+#include <vector>
 #include <cassert>
 #include <functional>
 #include <iostream>
-
-class TSeqCollection;
-class TIterator;
+#include <iterator>
+#include <algorithm>
+#include <cstring>
+#include <new>
 
 namespace TreeSearch {
 
   class Road;
+  class Hitpattern;
   extern const Double_t kBig;
 
   class Hit : public TObject {
@@ -80,62 +82,35 @@ namespace TreeSearch {
   };
 
   //___________________________________________________________________________
-  // Utility class for iterating over one or two collections of hits.
-  // Used for generating hit patterns. If two collections are given, they
-  // are assumed to contain hits from adjacent planes with parallel
-  // (and usually staggered) wires, and hit pairs are returned for hits
-  // whose positions are within 'maxdist' of each other.
+  // Utility class for iterating over the hits of one or two planes.
+  // Used for generating hit patterns. If two planes are given, they are
+  // assumed to have parallel (and usually staggered) wires, and hit pairs
+  // are returned for hits whose positions are within 'maxdist' of each
+  // other. Walks the sorted hit arrays of the planes directly.
 
-  typedef std::pair<TObject*,TObject*> ObjPair_t;
+  typedef std::pair<Hit*,Hit*> HitPair_t;
 
-  class HitPairIter {
+  class HitPairScanner {
 
   public:
-    HitPairIter( const TSeqCollection* collA, const TSeqCollection* collB,
-		 Double_t maxdist );
-    HitPairIter( const HitPairIter& rhs );
-    HitPairIter& operator=( const HitPairIter& rhs );
-    virtual ~HitPairIter();
-
-    const TSeqCollection* GetCollection( Int_t n=0 ) const
-    { return (n==0) ? fCollA : fCollB; }
-    void Reset();
-
-    // Iterator functions.
-    HitPairIter& Next();
-    HitPairIter& operator++() { return Next(); }
-    const HitPairIter operator++(int) {
-      HitPairIter clone(*this);  Next();  return clone;
-    }
-    // Current value.
-    ObjPair_t  operator()() const  { return fCurrent; }
-    ObjPair_t& operator* ()        { return fCurrent; }
-    // Comparisons
-    bool operator==( const HitPairIter& rhs ) const {
-      return( fCollA == rhs.fCollA && fCollB == rhs.fCollB &&
-	      fCurrent == rhs.fCurrent );
-    }
-    bool operator!=( const HitPairIter& rhs ) const { return !(*this==rhs); }
-    operator bool() const
-    { return (fCurrent.first != 0 || fCurrent.second != 0); }
-    bool operator!() const { return !((bool)*this); }
+    HitPairScanner( const Plane* A, const Plane* B, Double_t maxdist );
+
+    void   Reset();
+    // Get the next pair. Returns false if there are no more hits
+    Bool_t Next( HitPair_t& pair );
+    // Append all remaining pairs to 'pairs'. Returns number of pairs added
+    UInt_t Scan( std::vector<HitPair_t>& pairs );
 
   private:
-    const TSeqCollection* fCollA;
-    const TSeqCollection* fCollB;
-    TIterator* fIterA;
-    TIterator* fIterB;
-    TIterator* fSaveIter;
-    Hit* fSaveHit;
-    Double_t fMaxDist;
-    Bool_t fStarted;
-    Bool_t fScanning;
-    ObjPair_t fCurrent;
-    ObjPair_t fNext;
-
-    HitPairIter();
-
-    ClassDef(HitPairIter,0)  // Iterator over two lists of hits
+    const Plane* fA;        // First plane
+    const Plane* fB;        // Second plane (may be zero)
+    Int_t     fNA;          // Number of hits in A
+    Int_t     fNB;          // Number of hits in B
+    Int_t     fIA;          // Index of next hit in A
+    Int_t     fIB;          // Index of next hit in B
+    Int_t     fSave;        // Index in B where the current scan started
+    Double_t  fMaxDist;     // Maximum distance of hits in a pair
+    Bool_t    fScanning;    // Scanning B for several matches of one A
   };
 
   //___________________________________________________________________________
@@ -186,30 +161,110 @@ namespace TreeSearch {
     ClassDef(FitCoord,2) // Coordinate information from road fit
   };
 
+  //___________________________________________________________________________
+  // Set of hits, ordered by Hit::PosIsLess, stored as a sorted array.
+  // Supports the parts of the std::set interface used for hit sets.
+  // Up to kInline hits are kept inside the object itself, so typical
+  // pattern hit sets need no heap allocation.
+
+  class SortedHitVec {
+  public:
+    typedef Hit*                                   value_type;
+    typedef Hit* const*                            iterator;
+    typedef Hit* const*                            const_iterator;
+    typedef std::reverse_iterator<const_iterator>  reverse_iterator;
+    typedef std::reverse_iterator<const_iterator>  const_reverse_iterator;
+    typedef UInt_t                                 size_type;
+    typedef Hit::PosIsLess                         key_compare;
+    enum { kInline = 16 };
+
+    SortedHitVec() : fData(fInline), fSize(0), fCapacity(kInline) {}
+    SortedHitVec( const SortedHitVec& orig );
+    SortedHitVec& operator=( const SortedHitVec& rhs );
+    ~SortedHitVec() { if( fData != fInline ) delete [] fData; }
+
+    const_iterator begin() const { return fData; }
+    const_iterator end()   const { return fData+fSize; }
+    reverse_iterator rbegin() const { return reverse_iterator(end()); }
+    reverse_iterator rend()   const { return reverse_iterator(begin()); }
+    size_type      size()  const { return fSize; }
+    Bool_t         empty() const { return (fSize == 0); }
+    void           clear()       { fSize = 0; }
+    key_compare    key_comp() const { return key_compare(); }
+
+    const_iterator find( Hit* hit ) const;
+    std::pair<iterator,bool> insert( Hit* hit );
+    template< typename InputIterator >
+    void insert( InputIterator first, InputIterator last ) {
+      for( ; first != last; ++first )
+	insert( *first );
+    }
+    UInt_t merge( const SortedHitVec& other );
+    void swap( SortedHitVec& rhs );
+
+  private:
+    Hit**    fData;              // Points to fInline or heap buffer
+    UInt_t   fSize;              // Number of hits stored
+    UInt_t   fCapacity;          // Size of buffer at fData
+    Hit*     fInline[kInline];   // Inline storage for small sets
+
+    void     Reserve( UInt_t n );
+  };
+
   //___________________________________________________________________________
   // Utility structure for storing sets of hits along with NodeDescriptors
 
-  typedef std::set<Hit*,Hit::PosIsLess> Hset_t;
+  typedef SortedHitVec Hset_t;
   struct HitSet {
+    // For the patterns found by the tree search, "hits" is not filled.
+    // Their hits are those in the pattern's hitpattern bins, or, for
+    // coarse patterns, all bins below them, and are collected only when
+    // needed (see CollectHits).
     Hset_t  hits;          // Hits associated with a pattern
     UInt_t  plane_pattern; // Bit pattern of plane numbers occupied by hits
     UInt_t  nplanes;       // number of active planes
+    UInt_t  nhits;         // number of hits
     mutable UInt_t used;   // Pattern has been assigned to a road
 
-    HitSet() : plane_pattern(0), nplanes(0), used(0) {}
+    HitSet() : plane_pattern(0), nplanes(0), nhits(0), used(0) {}
     virtual ~HitSet() {}
     void          CalculatePlanePattern();
-    static Bool_t CheckMatch( const Hset_t& hits, const TBits* bits );
-    Bool_t        CheckMatch( const TBits* bits ) const;
+    static Bool_t CheckMatch( const Hset_t& hits, const PlaneCombos* combos );
+    Bool_t        CheckMatch( const PlaneCombos* combos ) const;
+    static void   CollectHits( const Hitpattern* hitpat,
+			       const NodeDescriptor& nd, Hset_t& hits );
     static UInt_t GetMatchValue( const Hset_t& hits );
     static UInt_t GetAltMatchValue( const Hset_t& hits );
     Bool_t        IsSimilarTo( const HitSet& tryset, Int_t maxdist=0 ) const;
+    Bool_t        IsSimilarTo( const Hitpattern* hitpat,
+			       const NodeDescriptor& nd,
+			       UInt_t plane_pattern ) const;
 
     ClassDef(HitSet, 0)  // A set of hits associated with a pattern
   };
 
   typedef std::pair<NodeDescriptor,HitSet> Node_t;
 
+  //___________________________________________________________________________
+  // Bump allocator for the Node_t objects created during the tree search.
+  // Nodes are constructed in blocks of memory that are kept across events.
+  // Clear() destroys all nodes at once.
+  class NodeArena {
+  public:
+    NodeArena() : fBlock(0), fUsed(0) {}
+    ~NodeArena();
+    Node_t* New();
+    void    Clear();
+  private:
+    enum { kBlockSize = 512 };    // Nodes per block
+    std::vector<Node_t*> fBlocks; // Raw storage for kBlockSize nodes each
+    UInt_t  fBlock;               // Index of block currently being filled
+    UInt_t  fUsed;                // Nodes constructed in current block
+
+    NodeArena( const NodeArena& orig );
+    NodeArena& operator=( const NodeArena& rhs );
+  };
+
   //___________________________________________________________________________
   inline
   Int_t Hit::Compare( const TObject* obj ) const
@@ -243,6 +298,58 @@ namespace TreeSearch {
     return 0;
   }
 
+  //___________________________________________________________________________
+  inline
+  SortedHitVec::const_iterator SortedHitVec::find( Hit* hit ) const
+  {
+    // Find hit equivalent to the given one. Returns end() if none
+
+    key_compare comp;
+    const_iterator pos = std::lower_bound( begin(), end(), hit, comp );
+    if( pos != end() and !comp(hit,*pos) )
+      return pos;
+    return end();
+  }
+
+  //___________________________________________________________________________
+  inline
+  std::pair<SortedHitVec::iterator,bool> SortedHitVec::insert( Hit* hit )
+  {
+    // Insert hit unless an equivalent one is already present. Returns the
+    // position of the new or existing hit and whether the hit was inserted.
+
+    key_compare comp;
+    UInt_t idx = fSize;
+    // Hits are usually added in order
+    if( fSize > 0 and !comp(fData[fSize-1],hit) ) {
+      idx = std::lower_bound( begin(), end(), hit, comp ) - begin();
+      if( !comp(hit,fData[idx]) )
+	return std::make_pair( begin()+idx, false );
+    }
+    if( fSize == fCapacity )
+      Reserve( 2*fCapacity );
+    memmove( fData+idx+1, fData+idx, (fSize-idx)*sizeof(Hit*) );
+    fData[idx] = hit;
+    ++fSize;
+    return std::make_pair( begin()+idx, true );
+  }
+
+  //___________________________________________________________________________
+  inline
+  Node_t* NodeArena::New()
+  {
+    // Construct a new, empty node
+
+    if( fUsed == kBlockSize ) {
+      ++fBlock;
+      fUsed = 0;
+    }
+    if( fBlock == fBlocks.size() )
+      fBlocks.push_back( static_cast<Node_t*>
+			 (::operator new(kBlockSize*sizeof(Node_t))) );
+    return new( fBlocks[fBlock] + fUsed++ ) Node_t;
+  }
+
   //___________________________________________________________________________
   inline
   UInt_t HitSet::GetMatchValue( const Hset_t& hits )
@@ -260,23 +367,23 @@ namespace TreeSearch {
 
   //___________________________________________________________________________
   inline
-  Bool_t HitSet::CheckMatch( const Hset_t& hits, const TBits* bits )
+  Bool_t HitSet::CheckMatch( const Hset_t& hits, const PlaneCombos* combos )
   {
     // Check if the plane occupancy pattern of the given hits is marked as
-    // allowed in the given bitfield
+    // allowed in the given table
 
-    return bits->TestBitNumber( GetMatchValue(hits) );
+    return combos->IsAllowed( GetMatchValue(hits) );
   }
 
   //___________________________________________________________________________
   inline
-  Bool_t HitSet::CheckMatch( const TBits* bits ) const
+  Bool_t HitSet::CheckMatch( const PlaneCombos* combos ) const
   {
     // Check if the plane occupancy pattern of the hits in this hitset is
-    // marked as allowed in the given bitfield
+    // marked as allowed in the given table
 
     assert( plane_pattern || hits.empty() );
-    return bits->TestBitNumber(plane_pattern);
+    return combos->IsAllowed(plane_pattern);
   }
 
   //___________________________________________________________________________
@@ -287,6 +394,7 @@ namespace TreeSearch {
 
     plane_pattern = GetMatchValue(hits);
     nplanes = NumberOfSetBits(plane_pattern);
+    nhits = hits.size();
   }
 
   //___________________________________________________________________________
@@ -0,0 +1,490 @@
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+// TreeSearch::HitStreamWriter, TreeSearch::HitStreamReader                  //
+//                                                                           //
+// Hit streams hold the decoded hits of all planes of a Tracker, event by    //
+// event, as fixed-size binary records (see HitStream.h for the layout).     //
+// They can be loaded into the planes with Tracker::LoadEvent, which skips   //
+// the decoding, so the tracking code can be run on fixed input without a    //
+// decoder or raw data, e.g. for benchmarking. Trackers write them when the  //
+// database key "record_hits" is set.                                        //
+//                                                                           //
+// The writer buffers its output and keeps the event index in memory until   //
+// Close(), so recording adds little to the decoding time. The reader maps   //
+// the file into memory; the events it returns point directly into the      //
+// mapping, and any event can be looked up by number via the index.          //
+//                                                                           //
+// The files are written in the byte order of the machine writing them.      //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+#include "HitStream.h"
+#include "TError.h"
+#include <cstring>
+#include <cstddef>
+#include <cassert>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace TreeSearch {
+
+const char* const HitStream::kMagic      = "TSHITSTR";
+const char* const HitStream::kIndexMagic = "TSHITIDX";
+
+// Size of the output buffer of HitStreamWriter
+static const size_t kWriteBufSize = 1<<20;
+
+//_____________________________________________________________________________
+void HitEventBuffer::EndEvent( UInt_t evnum )
+{
+  // Close the current event. Its hits are all those added to GetHits()
+  // since the previous call. If there are any MC records, there must be
+  // one per hit.
+
+  EventRange ev;
+  ev.fEvNum = evnum;
+  ev.fFirst = 0;
+  if( !fEvents.empty() )
+    ev.fFirst = fEvents.back().fFirst + fEvents.back().fNhits;
+  assert( ev.fFirst <= fHits.size() );
+  ev.fNhits = fHits.size() - ev.fFirst;
+  assert( fMCHits.empty() or fMCHits.size() == fHits.size() );
+  fEvents.push_back( ev );
+}
+
+//_____________________________________________________________________________
+void HitEventBuffer::Clear()
+{
+  // Remove all events, keeping the allocated memory
+
+  fHits.clear();
+  fMCHits.clear();
+  fEvents.clear();
+}
+
+//_____________________________________________________________________________
+void HitEventBuffer::GetEvent( UInt_t i, HitEvent& event ) const
+{
+  // Return the i-th event in the buffer
+
+  assert( i < fEvents.size() );
+  const EventRange& ev = fEvents[i];
+  event.fEvNum  = ev.fEvNum;
+  event.fNhits  = ev.fNhits;
+  event.fHits   = ev.fNhits > 0 ? &fHits[ev.fFirst] : 0;
+  event.fMCHits = ( ev.fNhits > 0 and !fMCHits.empty() )
+    ? &fMCHits[ev.fFirst] : 0;
+}
+
+//_____________________________________________________________________________
+HitStreamWriter::HitStreamWriter()
+  : fFile(0), fNplanes(0), fHasMC(false), fNevents(0), fPos(0)
+{
+  // Constructor
+}
+
+//_____________________________________________________________________________
+HitStreamWriter::~HitStreamWriter()
+{
+  // Destructor. Closes the file.
+
+  Close();
+}
+
+//_____________________________________________________________________________
+Int_t HitStreamWriter::Open( const char* filename,
+			     const vector<string>& planes, Bool_t mc )
+{
+  // Create the file "filename" and write the stream header with the given
+  // plane names. If "mc" is true, each event must include MC records.
+  // Returns 0 on success, -1 on error.
+
+  static const char* const here = "TreeSearch::HitStreamWriter::Open";
+
+  Close();
+  if( planes.empty() or planes.size() > kMaxUShort ) {
+    ::Error( here, "Invalid number of planes %u",
+	     static_cast<UInt_t>(planes.size()) );
+    return -1;
+  }
+  fFile = fopen( filename, "wb" );
+  if( !fFile ) {
+    ::Error( here, "Cannot create hit stream file %s", filename );
+    return -1;
+  }
+  fBuffer.resize( kWriteBufSize );
+  setvbuf( fFile, &fBuffer[0], _IOFBF, fBuffer.size() );
+  fPos = 0;
+  fIndex.clear();
+  fNevents = 0;
+
+  HitStream::FileHeader hdr;
+  memset( &hdr, 0, sizeof(hdr) );
+  memcpy( hdr.fMagic, HitStream::kMagic, sizeof(hdr.fMagic) );
+  hdr.fVersion = HitStream::kVersion;
+  hdr.fFlags   = mc ? HitStream::kHasMC : 0;
+  hdr.fNplanes = planes.size();
+  hdr.fNameLen = HitStream::kNameLen;
+  bool ok = ( WriteRecords(&hdr, sizeof(hdr), 1) == 0 );
+  for( vector<string>::size_type i = 0; ok and i < planes.size(); ++i ) {
+    char name[HitStream::kNameLen];
+    memset( name, 0, sizeof(name) );
+    if( planes[i].size() >= sizeof(name) ) {
+      ::Error( here, "Plane name %s too long", planes[i].c_str() );
+      ok = false;
+      break;
+    }
+    planes[i].copy( name, planes[i].size() );
+    ok = ( WriteRecords(name, sizeof(name), 1) == 0 );
+  }
+  if( !ok ) {
+    ::Error( here, "Error writing header of hit stream file %s", filename );
+    fclose( fFile );
+    fFile = 0;
+    return -1;
+  }
+  fNplanes = planes.size();
+  fHasMC = mc;
+  return 0;
+}
+
+//_____________________________________________________________________________
+Int_t HitStreamWriter::WriteRecords( const void* data, size_t size, size_t n )
+{
+  // Write "n" records of "size" bytes. Returns 0 on success, -1 on error.
+
+  assert( fFile );
+  if( n == 0 )
+    return 0;
+  if( fwrite(data, size, n, fFile) != n )
+    return -1;
+  fPos += size*n;
+  return 0;
+}
+
+//_____________________________________________________________________________
+Int_t HitStreamWriter::WriteEvent( UInt_t evnum, const vector<HitRecord>& hits,
+				   const vector<MCHitRecord>* mchits )
+{
+  // Append one event. The hits must be grouped by plane. If the stream
+  // has MC data, "mchits" must hold one record per hit.
+  // Returns 0 on success, -1 on error.
+
+  HitEvent event;
+  event.fEvNum  = evnum;
+  event.fNhits  = hits.size();
+  event.fHits   = hits.empty() ? 0 : &hits[0];
+  event.fMCHits = ( mchits and !mchits->empty() ) ? &(*mchits)[0] : 0;
+  if( mchits and mchits->size() != hits.size() )
+    event.fMCHits = 0;
+  return WriteEvent( event );
+}
+
+//_____________________________________________________________________________
+Int_t HitStreamWriter::WriteEvent( const HitEvent& event )
+{
+  // Append one event. The hits must be grouped by plane. If the stream
+  // has MC data, the event must have MC records.
+  // Returns 0 on success, -1 on error.
+
+  static const char* const here = "TreeSearch::HitStreamWriter::WriteEvent";
+
+  if( !fFile )
+    return -1;
+  if( fHasMC and event.fNhits > 0 and !event.fMCHits ) {
+    ::Error( here, "Event %u: missing MC hit records", event.fEvNum );
+    return -1;
+  }
+#ifndef NDEBUG
+  for( UInt_t i = 0; i < event.fNhits; ++i )
+    assert( event.fHits[i].fPlane < fNplanes );
+#endif
+  HitStream::IndexEntry entry;
+  entry.fEvNum = event.fEvNum;
+  entry.fNhits = event.fNhits;
+  entry.fPos   = fPos;
+
+  HitStream::EventHeader evhdr;
+  evhdr.fEvNum = event.fEvNum;
+  evhdr.fNhits = event.fNhits;
+  bool ok = ( WriteRecords(&evhdr, sizeof(evhdr), 1) == 0 and
+	      WriteRecords(event.fHits, sizeof(HitRecord), event.fNhits) == 0
+	      and ( !fHasMC or WriteRecords(event.fMCHits, sizeof(MCHitRecord),
+					    event.fNhits) == 0 ) );
+  if( !ok ) {
+    ::Error( here, "Error writing event %u", event.fEvNum );
+    return -1;
+  }
+  fIndex.push_back( entry );
+  ++fNevents;
+  return 0;
+}
+
+//_____________________________________________________________________________
+Int_t HitStreamWriter::Close()
+{
+  // Write the event index and close the file.
+  // Returns 0 on success, -1 on error.
+
+  static const char* const here = "TreeSearch::HitStreamWriter::Close";
+
+  if( !fFile )
+    return 0;
+  HitStream::IndexHeader idxhdr;
+  memcpy( idxhdr.fMagic, HitStream::kIndexMagic, sizeof(idxhdr.fMagic) );
+  idxhdr.fNevents = fIndex.size();
+  ULong64_t idxpos = fPos;
+  bool ok = ( WriteRecords(&idxhdr, sizeof(idxhdr), 1) == 0 and
+	      ( fIndex.empty() or
+		WriteRecords(&fIndex[0], sizeof(HitStream::IndexEntry),
+			     fIndex.size()) == 0 ) );
+  // Point the file header to the index
+  if( ok )
+    ok = ( fseek(fFile, offsetof(HitStream::FileHeader, fIndexPos),
+		 SEEK_SET) == 0 and
+	   fwrite(&idxpos, sizeof(idxpos), 1, fFile) == 1 );
+  if( fclose(fFile) != 0 )
+    ok = false;
+  fFile = 0;
+  fIndex.clear();
+  fBuffer.clear();
+  if( !ok ) {
+    ::Error( here, "Error writing index of hit stream" );
+    return -1;
+  }
+  return 0;
+}
+
+//_____________________________________________________________________________
+HitStreamReader::HitStreamReader()
+  : fData(0), fSize(0), fHasMC(false), fCurrent(0)
+{
+  // Constructor
+}
+
+//_____________________________________________________________________________
+HitStreamReader::~HitStreamReader()
+{
+  // Destructor. Closes the file.
+
+  Close();
+}
+
+//_____________________________________________________________________________
+Int_t HitStreamReader::Open( const char* filename )
+{
+  // Map the hit stream file "filename" into memory, read its header and
+  // its event index. Returns 0 on success, -1 on error.
+
+  static const char* const here = "TreeSearch::HitStreamReader::Open";
+
+  Close();
+  int fd = open( filename, O_RDONLY );
+  if( fd < 0 ) {
+    ::Error( here, "Cannot open hit stream file %s", filename );
+    return -1;
+  }
+  struct stat st;
+  void* addr = MAP_FAILED;
+  if( fstat(fd, &st) == 0 and
+      st.st_size >= (off_t)sizeof(HitStream::FileHeader) )
+    addr = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if( addr == MAP_FAILED ) {
+    ::Error( here, "File %s is not a hit stream or cannot be mapped",
+	     filename );
+    return -1;
+  }
+  fData = static_cast<const char*>(addr);
+  fSize = st.st_size;
+
+  const HitStream::FileHeader* hdr =
+    reinterpret_cast<const HitStream::FileHeader*>(fData);
+  if( memcmp(hdr->fMagic, HitStream::kMagic, sizeof(hdr->fMagic)) != 0 ) {
+    ::Error( here, "File %s is not a hit stream", filename );
+    Close();
+    return -1;
+  }
+  if( hdr->fVersion != HitStream::kVersion or
+      hdr->fNameLen != HitStream::kNameLen ) {
+    ::Error( here, "Unsupported hit stream version %u in file %s",
+	     hdr->fVersion, filename );
+    Close();
+    return -1;
+  }
+  fHasMC = ( (hdr->fFlags & HitStream::kHasMC) != 0 );
+  ULong64_t start = sizeof(*hdr) + (ULong64_t)hdr->fNplanes*hdr->fNameLen;
+  if( start > fSize ) {
+    ::Error( here, "Error reading plane names from %s", filename );
+    Close();
+    return -1;
+  }
+  fPlaneNames.reserve( hdr->fNplanes );
+  for( UInt_t i = 0; i < hdr->fNplanes; ++i ) {
+    const char* name = fData + sizeof(*hdr) + i*hdr->fNameLen;
+    fPlaneNames.push_back( string(name, strnlen(name, hdr->fNameLen)) );
+  }
+
+  // Use the index if there is a valid one, else scan the events
+  const HitStream::IndexHeader* idxhdr =
+    reinterpret_cast<const HitStream::IndexHeader*>(fData+hdr->fIndexPos);
+  ULong64_t end = fSize;
+  if( hdr->fIndexPos >= start and
+      hdr->fIndexPos + sizeof(*idxhdr) <= fSize and
+      memcmp(idxhdr->fMagic, HitStream::kIndexMagic,
+	     sizeof(idxhdr->fMagic)) == 0 and
+      idxhdr->fNevents <= (fSize-hdr->fIndexPos-sizeof(*idxhdr))
+      / sizeof(HitStream::IndexEntry) ) {
+    const HitStream::IndexEntry* entries =
+      reinterpret_cast<const HitStream::IndexEntry*>(idxhdr+1);
+    fIndex.assign( entries, entries+idxhdr->fNevents );
+    // The events precede the index
+    end = hdr->fIndexPos;
+    if( !CheckIndex(start, end) ) {
+      ::Warning( here, "Invalid event index in %s. Scanning events.",
+		 filename );
+      fIndex.clear();
+    }
+  } else
+    ::Warning( here, "No event index in %s. Scanning events.", filename );
+  if( fIndex.empty() and BuildIndex(start, end) != 0 )
+    ::Warning( here, "File %s truncated. Using the first %u events.",
+	       filename, GetNevents() );
+
+  // Lookup table by event number
+  fByEvNum.reserve( fIndex.size() );
+  for( vector<HitStream::IndexEntry>::size_type i = 0; i < fIndex.size(); ++i )
+    fByEvNum.push_back( make_pair(fIndex[i].fEvNum, (UInt_t)i) );
+  sort( fByEvNum.begin(), fByEvNum.end() );
+  fCurrent = 0;
+  return 0;
+}
+
+//_____________________________________________________________________________
+Int_t HitStreamReader::BuildIndex( ULong64_t pos, ULong64_t end )
+{
+  // Build the event index by walking through the events between the file
+  // offsets "pos" and "end". Returns 0 if all data were complete events,
+  // -1 if the data end with an incomplete event.
+
+  assert( end <= fSize );
+  fIndex.clear();
+  size_t recsize = GetRecordSize();
+  while( pos + sizeof(HitStream::EventHeader) <= end ) {
+    const HitStream::EventHeader* evhdr =
+      reinterpret_cast<const HitStream::EventHeader*>(fData+pos);
+    ULong64_t next = pos + sizeof(*evhdr) + (ULong64_t)evhdr->fNhits*recsize;
+    if( next > end )
+      return -1;
+    HitStream::IndexEntry entry;
+    entry.fEvNum = evhdr->fEvNum;
+    entry.fNhits = evhdr->fNhits;
+    entry.fPos   = pos;
+    fIndex.push_back( entry );
+    pos = next;
+  }
+  return ( pos == end ) ? 0 : -1;
+}
+
+//_____________________________________________________________________________
+Bool_t HitStreamReader::CheckIndex( ULong64_t start, ULong64_t end ) const
+{
+  // Check that every entry of the event index read from the file refers to
+  // a complete event between the file offsets "start" and "end", with the
+  // same event number and hit count as in the event's header. GetEvent
+  // relies on this.
+
+  assert( end <= fSize );
+  size_t recsize = GetRecordSize();
+  for( size_t i = 0; i < fIndex.size(); ++i ) {
+    const HitStream::IndexEntry& entry = fIndex[i];
+    if( entry.fPos < start or entry.fPos > end or
+	end - entry.fPos < sizeof(HitStream::EventHeader) or
+	(end - entry.fPos - sizeof(HitStream::EventHeader)) / recsize
+	< entry.fNhits )
+      return false;
+    const HitStream::EventHeader* evhdr =
+      reinterpret_cast<const HitStream::EventHeader*>(fData+entry.fPos);
+    if( evhdr->fEvNum != entry.fEvNum or evhdr->fNhits != entry.fNhits )
+      return false;
+  }
+  return true;
+}
+
+//_____________________________________________________________________________
+Bool_t HitStreamReader::NextEvent( HitEvent& event )
+{
+  // Get the next event in file order. Returns false at the end of the file.
+
+  if( !GetEvent(fCurrent, event) )
+    return false;
+  ++fCurrent;
+  return true;
+}
+
+//_____________________________________________________________________________
+Bool_t HitStreamReader::GetEvent( UInt_t i, HitEvent& event ) const
+{
+  // Get the i-th event in the file. The hit arrays point into the file
+  // mapping. Returns false if there is no such event.
+
+  if( i >= fIndex.size() )
+    return false;
+  const HitStream::IndexEntry& entry = fIndex[i];
+  const char* p = fData + entry.fPos + sizeof(HitStream::EventHeader);
+  event.fEvNum  = entry.fEvNum;
+  event.fNhits  = entry.fNhits;
+  event.fHits   = entry.fNhits > 0 ? reinterpret_cast<const HitRecord*>(p) : 0;
+  event.fMCHits = ( fHasMC and entry.fNhits > 0 )
+    ? reinterpret_cast<const MCHitRecord*>(p+entry.fNhits*sizeof(HitRecord))
+    : 0;
+  return true;
+}
+
+//_____________________________________________________________________________
+Bool_t HitStreamReader::FindEvent( UInt_t evnum, HitEvent& event ) const
+{
+  // Get the event with event number "evnum". If the number occurs more than
+  // once, return the first one. Returns false if there is no such event.
+
+  vector<pair<UInt_t,UInt_t> >::const_iterator it =
+    lower_bound( fByEvNum.begin(), fByEvNum.end(), make_pair(evnum,0U) );
+  if( it == fByEvNum.end() or it->first != evnum )
+    return false;
+  return GetEvent( it->second, event );
+}
+
+//_____________________________________________________________________________
+void HitStreamReader::Close()
+{
+  // Unmap the file
+
+  if( fData ) {
+    munmap( const_cast<char*>(fData), fSize );
+    fData = 0;
+    fSize = 0;
+  }
+  fPlaneNames.clear();
+  fIndex.clear();
+  fByEvNum.clear();
+  fHasMC = false;
+  fCurrent = 0;
+}
+
+//_____________________________________________________________________________
+const char* HitStreamReader::GetPlaneName( UInt_t i ) const
+{
+  // Name of the i-th plane of the stream
+
+  assert( i < fPlaneNames.size() );
+  return fPlaneNames[i].c_str();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // end namespace TreeSearch
@@ -0,0 +1,223 @@
+#ifndef ROOT_TreeSearch_HitStream
+#define ROOT_TreeSearch_HitStream
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+// TreeSearch::HitStreamWriter, TreeSearch::HitStreamReader                  //
+//                                                                           //
+// Binary files of decoded hits, event by event, for replaying events        //
+// through the tracking code without raw data and decoder. The files have    //
+// an event index and are read via mmap, so that single events can be       //
+// accessed by event number without reading the rest of the file.            //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+#include "Rtypes.h"
+#include <vector>
+#include <string>
+#include <utility>
+#include <cstdio>
+
+namespace TreeSearch {
+
+  //___________________________________________________________________________
+  // Decoded hit as stored in a hit stream. The meaning of some fields
+  // depends on the kind of plane:
+  //
+  //              GEM strip planes         Wire planes
+  //   fPos       centroid (strip units)   wire number
+  //   fAmpl      ADC sum of cluster       drift time w/o TDC offset (s)
+  //   fElem      -                        wire number
+  //   fRaw       cluster analysis code    raw TDC value
+  //   fSize      number of strips         1
+  //
+  // Positions and times are stored relative to the plane geometry and
+  // wire TDC offsets, so that replaying a stream applies the current
+  // database, e.g. for re-tracking after alignment changes.
+  struct HitRecord {
+    Double_t fPos;    // Hit position relative to first sensor (pitches)
+    Double_t fRes;    // Position resolution (m), informational
+    Double_t fAmpl;   // Amplitude or drift time (see above)
+    Int_t    fElem;   // Sensor (wire) number
+    Int_t    fRaw;    // Raw data or analysis code (see above)
+    UShort_t fPlane;  // Index of the plane in the stream's plane list
+    UShort_t fSize;   // Number of sensors in hit
+    UInt_t   fSpare;  // Unused, keeps the record size a multiple of 8 bytes
+  };
+
+  //___________________________________________________________________________
+  // Monte Carlo truth information of a hit, if the stream has kHasMC
+  struct MCHitRecord {
+    Int_t    fMCTrack;  // MC track number generating the hit (0=noise)
+    Int_t    fContam;   // Number of background (noise) contributions
+    Double_t fMCPos;    // True MC track crossing position (m)
+    Double_t fMCTime;   // True hit time (s)
+  };
+
+  //___________________________________________________________________________
+  // One event read from a hit stream. The hits of each plane are stored
+  // contiguously, in the order they were decoded. The arrays belong to the
+  // object that returned the event and remain valid until it is closed
+  // or cleared.
+  struct HitEvent {
+    UInt_t             fEvNum;   // Event number
+    UInt_t             fNhits;   // Number of hits, all planes
+    const HitRecord*   fHits;    // [fNhits] The hits
+    const MCHitRecord* fMCHits;  // [fNhits] MC info of the hits, or 0
+    HitEvent() : fEvNum(0), fNhits(0), fHits(0), fMCHits(0) {}
+  };
+
+  //___________________________________________________________________________
+  // File layout, all parts 8-byte aligned:
+  //
+  //   FileHeader
+  //   nplanes x char[kNameLen]    plane names (0-padded)
+  //   for each event:
+  //     EventHeader
+  //     nhits x HitRecord
+  //     nhits x MCHitRecord       if flags & kHasMC
+  //   IndexHeader                 at FileHeader::fIndexPos
+  //   nevents x IndexEntry
+  //
+  // The index is written when the file is closed. Files without index,
+  // e.g. from an aborted recording, are indexed by the reader.
+  class HitStream {
+  public:
+    enum { kNameLen = 32, kVersion = 2 };
+    enum { kHasMC = BIT(0) };
+
+    struct FileHeader {
+      char      fMagic[8];  // "TSHITSTR"
+      UInt_t    fVersion;   // Format version (kVersion)
+      UInt_t    fFlags;     // kHasMC etc.
+      UInt_t    fNplanes;   // Number of plane names following
+      UInt_t    fNameLen;   // Length of each plane name field (kNameLen)
+      ULong64_t fIndexPos;  // File offset of event index, 0 = none
+    };
+    struct EventHeader {
+      UInt_t    fEvNum;     // Event number
+      UInt_t    fNhits;     // Number of hit records following
+    };
+    struct IndexHeader {
+      char      fMagic[8];  // "TSHITIDX"
+      ULong64_t fNevents;   // Number of index entries following
+    };
+    struct IndexEntry {
+      UInt_t    fEvNum;     // Event number
+      UInt_t    fNhits;     // Number of hits
+      ULong64_t fPos;       // File offset of the EventHeader
+    };
+
+    static const char* const kMagic;
+    static const char* const kIndexMagic;
+  };
+
+  //___________________________________________________________________________
+  // Hits of several events collected in memory, e.g. by the batch mode
+  // lanes of a Tracker until they can be written in order
+  class HitEventBuffer {
+  public:
+    HitEventBuffer() {}
+
+    // Add the hits appended to GetHits()/GetMCHits() since the last call
+    // as one event
+    void   EndEvent( UInt_t evnum );
+    void   Clear();
+
+    std::vector<HitRecord>&   GetHits()   { return fHits; }
+    std::vector<MCHitRecord>& GetMCHits() { return fMCHits; }
+    UInt_t GetNevents() const { return (UInt_t)fEvents.size(); }
+    void   GetEvent( UInt_t i, HitEvent& event ) const;
+
+  private:
+    struct EventRange {
+      UInt_t fEvNum;   // Event number
+      UInt_t fFirst;   // Index of first hit in fHits
+      UInt_t fNhits;   // Number of hits
+    };
+    std::vector<HitRecord>    fHits;    // Hits of all events
+    std::vector<MCHitRecord>  fMCHits;  // MC info of all events, if any
+    std::vector<EventRange>   fEvents;  // Events
+  };
+
+  //___________________________________________________________________________
+  class HitStreamWriter {
+  public:
+    HitStreamWriter();
+    ~HitStreamWriter();
+
+    Int_t  Open( const char* filename, const std::vector<std::string>& planes,
+		 Bool_t mc = false );
+    Int_t  WriteEvent( UInt_t evnum, const std::vector<HitRecord>& hits,
+		       const std::vector<MCHitRecord>* mchits = 0 );
+    Int_t  WriteEvent( const HitEvent& event );
+    Int_t  Close();
+
+    Bool_t IsOpen()      const { return fFile != 0; }
+    Bool_t HasMC()       const { return fHasMC; }
+    UInt_t GetNevents()  const { return fNevents; }
+
+  private:
+    FILE*     fFile;     // Output file
+    UInt_t    fNplanes;  // Number of planes
+    Bool_t    fHasMC;    // Write MC records
+    UInt_t    fNevents;  // Events written
+    ULong64_t fPos;      // Current file offset
+    std::vector<HitStream::IndexEntry> fIndex;  // Event index
+    std::vector<char>   fBuffer;  // I/O buffer
+
+    Int_t WriteRecords( const void* data, size_t size, size_t n );
+
+    // Prevent copying and assignment
+    HitStreamWriter( const HitStreamWriter& orig );
+    HitStreamWriter& operator=( const HitStreamWriter& rhs );
+  };
+
+  //___________________________________________________________________________
+  class HitStreamReader {
+  public:
+    HitStreamReader();
+    ~HitStreamReader();
+
+    Int_t  Open( const char* filename );
+    void   Close();
+
+    // Sequential access
+    Bool_t NextEvent( HitEvent& event );
+    void   Rewind() { fCurrent = 0; }
+
+    // Random access, by position in the file or by event number
+    Bool_t GetEvent( UInt_t i, HitEvent& event ) const;
+    Bool_t FindEvent( UInt_t evnum, HitEvent& event ) const;
+
+    Bool_t      IsOpen()     const { return fData != 0; }
+    Bool_t      HasMC()      const { return fHasMC; }
+    UInt_t      GetNevents() const { return (UInt_t)fIndex.size(); }
+    UInt_t      GetNplanes() const { return (UInt_t)fPlaneNames.size(); }
+    const char* GetPlaneName( UInt_t i ) const;
+
+  private:
+    const char* fData;     // Start of the memory-mapped file
+    size_t      fSize;     // File size
+    Bool_t      fHasMC;    // Stream has MC records
+    UInt_t      fCurrent;  // Index of next event for NextEvent
+    std::vector<std::string>  fPlaneNames;  // Names of the planes
+    std::vector<HitStream::IndexEntry> fIndex;  // Events in file order
+    std::vector<std::pair<UInt_t,UInt_t> > fByEvNum; // (evnum,index), sorted
+
+    Int_t  BuildIndex( ULong64_t start, ULong64_t end );
+    Bool_t CheckIndex( ULong64_t start, ULong64_t end ) const;
+    size_t GetRecordSize() const {
+      return sizeof(HitRecord) + (fHasMC ? sizeof(MCHitRecord) : 0);
+    }
+
+    // Prevent copying and assignment
+    HitStreamReader( const HitStreamReader& orig );
+    HitStreamReader& operator=( const HitStreamReader& rhs );
+  };
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // end namespace TreeSearch
+
+#endif
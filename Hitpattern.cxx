@@ -13,10 +13,15 @@
 #include "TError.h"
 #include "TMath.h"
 #include "MWDC.h"
+#include "Helper.h"
 
 #include <iostream>
 #include <stdexcept>
 #include <algorithm>
+#include <cstdlib>
+#ifdef TREESEARCH_HAVE_AVX2
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -31,7 +36,8 @@ const Double_t Hitpattern::kNResSig = 2.0;
 //_____________________________________________________________________________
 Hitpattern::Hitpattern( const PatternTree& pt )
   : fNlevels(pt.GetNlevels()), fNplanes(pt.GetNplanes()), fScale(0),
-    fOffset(0.5*pt.GetWidth()), fPattern(0)
+    fOffset(0.5*pt.GetWidth()), fBits(0), fStride(0), fNwords(0),
+    fMatchSiblings(0)
   , fMaxhitBin(0)
 {
   // Construct Hitpattern using paramaters of pattern tree
@@ -42,7 +48,7 @@ Hitpattern::Hitpattern( const PatternTree& pt )
 //_____________________________________________________________________________
 Hitpattern::Hitpattern( UInt_t nlevels, UInt_t nplanes, Double_t width )
   : fNlevels(nlevels), fNplanes(nplanes), fScale(0), fOffset(0.5*width),
-    fPattern(0)
+    fBits(0), fStride(0), fNwords(0), fMatchSiblings(0)
   , fMaxhitBin(0)
 {
   // Constructor
@@ -68,13 +74,19 @@ void Hitpattern::Init( Double_t width )
   assert( width >= 1e-2 );
   fScale = GetNbins() / width;
   fBinWidth = 1.0/fScale;
+  fMatchSiblings = Matcher::Select( fNplanes );
 
+  // One row of 64-bit words per 64 bit numbers (2*number of bins at deepest
+  // level in total), with rows padded to full cache lines
+  fStride = (fNplanes+7) & ~7U;
+  fNwords = ((2*GetNbins()+63)>>6) * fStride;
   try {
-    fPattern = new Bits*[fNplanes];
-    UInt_t nbins2 = 2*GetNbins();  // 2*number of bins at deepest level
-    for( UInt_t i=0; i<fNplanes; i++ )
-      fPattern[i] = new Bits( nbins2 );
-    fHits.resize( fNplanes*GetNbins() );
+    void* ptr = 0;
+    if( posix_memalign( &ptr, 64, fNwords*sizeof(ULong64_t) ) != 0 )
+      throw std::bad_alloc();
+    fBits = static_cast<ULong64_t*>(ptr);
+    memset( fBits, 0, fNwords*sizeof(ULong64_t) );
+    fBinRange.resize( fNplanes*GetNbins() );
   }
   catch ( std::bad_alloc& ) {
     ::Error( "Hitpattern::Hitpattern", "Out of memory trying to construct "
@@ -83,22 +95,38 @@ void Hitpattern::Init( Double_t width )
   }
 }
 
+//_____________________________________________________________________________
+void Hitpattern::CopyBits( const Hitpattern& orig )
+{
+  // Allocate bitmap and copy it from orig.
+  // Internal utility function called by copy ctor and assignment operator.
+
+  fStride  = orig.fStride;
+  fNwords  = orig.fNwords;
+  fTouched = orig.fTouched;
+  if( orig.fBits ) {
+    void* ptr = 0;
+    if( posix_memalign( &ptr, 64, fNwords*sizeof(ULong64_t) ) != 0 )
+      throw std::bad_alloc();
+    fBits = static_cast<ULong64_t*>(ptr);
+    memcpy( fBits, orig.fBits, fNwords*sizeof(ULong64_t) );
+  }
+}
+
 //_____________________________________________________________________________
 Hitpattern::Hitpattern( const Hitpattern& orig )
 try
   : fNlevels(orig.fNlevels), fNplanes(orig.fNplanes),
     fScale(orig.fScale), fBinWidth(orig.fBinWidth), fOffset(orig.fOffset),
-    fPattern(0), fHits(orig.fHits), fHitList(orig.fHitList)
+    fBits(0), fStride(0), fNwords(0),
+    fMatchSiblings(orig.fMatchSiblings), fBinRange(orig.fBinRange),
+    fBinHits(orig.fBinHits), fHitList(orig.fHitList)
   , fMaxhitBin(orig.fMaxhitBin)
 {
   // Copy ctor
 
-  if( fNplanes > 0 ) {
-    fPattern = new Bits*[fNplanes];
-    for( UInt_t i=fNplanes; i--; )
-      fPattern[i] = new Bits(*orig.fPattern[i]);
-  }
-  assert( fHits.size() == fNplanes*GetNbins() );
+  CopyBits( orig );
+  assert( fBinRange.size() == fNplanes*GetNbins() );
 }
 catch ( std::bad_alloc ) {
   ::Error( "Hitpattern::Hitpattern", "Out of memory trying to copy Hitpattern "
@@ -117,14 +145,12 @@ Hitpattern& Hitpattern::operator=( const Hitpattern& rhs )
     fScale   = rhs.fScale;
     fBinWidth= rhs.fBinWidth;
     fOffset  = rhs.fOffset;
-    delete fPattern; fPattern = 0;
-    if( fNplanes > 0 ) {
-      fPattern = new Bits*[fNplanes];
-      for( UInt_t i=fNplanes; i--; )
-	fPattern[i] = new Bits(*rhs.fPattern[i]);
-    }
-    fHits = rhs.fHits;
-    assert( fHits.size() == fNplanes*GetNbins() );
+    fMatchSiblings = rhs.fMatchSiblings;
+    free( fBits ); fBits = 0;
+    CopyBits( rhs );
+    fBinRange = rhs.fBinRange;
+    assert( fBinRange.size() == fNplanes*GetNbins() );
+    fBinHits = rhs.fBinHits;
     fHitList = rhs.fHitList;
 #ifdef TESTCODE
     fMaxhitBin = rhs.fMaxhitBin;
@@ -138,26 +164,75 @@ Hitpattern::~Hitpattern()
 {
   // Destructor
 
-  for( UInt_t i=fNplanes; i; )
-    delete fPattern[--i];
-  delete [] fPattern;
+  free( fBits );
 }
 
 //_____________________________________________________________________________
-inline
-void Hitpattern::AddHit( UInt_t plane, UInt_t bin, Hit* hit )
+// Sort hit list by plane/bin index
+struct ByBinIdx
+  : public binary_function< pair<UInt_t,Hit*>, pair<UInt_t,Hit*>, bool >
+{
+  bool operator() ( const pair<UInt_t,Hit*>& a,
+		    const pair<UInt_t,Hit*>& b ) const
+  { return ( a.first < b.first ); }
+};
+
+//_____________________________________________________________________________
+void Hitpattern::BuildHitIndex()
 {
-  // Add hit for given bin in plane to the hit arrays
-  assert(hit);
-  UInt_t idx = MakeIdx( plane, bin );
-  fHits[idx].push_back( hit );
-  // Even though this may record the same idx multiple times, it performs
-  // better than anything more fancy (like e.g. a set)
-  fHitList.push_back( idx );
+  // Build the bin -> hits index from the hits recorded by AddHit.
+  // Called by Fill(). For each bin, the hits remain in the order in which
+  // they were added.
+
+  stable_sort( fHitList.begin(), fHitList.end(), ByBinIdx() );
+  fBinHits.resize( fHitList.size() );
+  for( vsiz_t i = 0; i < fHitList.size(); ) {
+    UInt_t idx = fHitList[i].first;
+    assert( idx < fBinRange.size());
+    vsiz_t start = i;
+    for( ; i < fHitList.size() and fHitList[i].first == idx; ++i )
+      fBinHits[i] = fHitList[i].second;
+    fBinRange[idx] = make_pair( (UInt_t)start, (UInt_t)i );
 #ifdef TESTCODE
-  if( fMaxhitBin < (UInt_t)fHits[idx].size() )
-    fMaxhitBin = fHits[idx].size();
+    if( fMaxhitBin < (UInt_t)(i-start) )
+      fMaxhitBin = i-start;
 #endif
+  }
+}
+
+//_____________________________________________________________________________
+HitRange Hitpattern::GetHits( UInt_t plane, UInt_t lo, UInt_t hi ) const
+{
+  // Get the hits that set any of the bins [lo,hi) at the highest resolution
+  // in the given plane, ordered by bin. Hits that set several of these
+  // bins occur once per bin. Valid after Fill().
+
+  assert( plane < fNplanes and lo <= hi and hi <= GetNbins() );
+  UInt_t base = plane << (fNlevels-1);
+  vector< pair<UInt_t,Hit*> >::const_iterator
+    b = lower_bound( fHitList.begin(), fHitList.end(),
+		     make_pair(base+lo,(Hit*)0), ByBinIdx() ),
+    e = lower_bound( b, fHitList.end(),
+		     make_pair(base+hi,(Hit*)0), ByBinIdx() );
+  if( b == e )
+    return HitRange();
+  return HitRange( &fBinHits[0] + (b-fHitList.begin()),
+		   &fBinHits[0] + (e-fHitList.begin()) );
+}
+
+//_____________________________________________________________________________
+HitRange Hitpattern::GetHits( UInt_t plane, const NodeDescriptor& nd ) const
+{
+  // Get the hits in the bin of pattern nd in the given plane. For patterns
+  // above the bottom of the tree, these are the hits in all highest-
+  // resolution bins below the pattern's bin (see GetHits(plane,lo,hi)).
+
+  assert( nd.depth < fNlevels );
+  UInt_t sh = fNlevels-1 - nd.depth;
+  if( sh == 0 )
+    return GetHits( plane, nd[plane] );
+  UInt_t bin = nd[plane];
+  return GetHits( plane, bin << sh, (bin+1) << sh );
 }
 
 //_____________________________________________________________________________
@@ -165,17 +240,28 @@ void Hitpattern::Clear( Option_t* )
 {
   // Clear the hitpattern
 
-  for( UInt_t i=fNplanes; i; )
-    fPattern[--i]->FastClear();
-
-  // For speed, clear only arrays that are actually filled
-  for( vector<UInt_t>::iterator it = fHitList.begin(); it != fHitList.end();
-       ++it ) {
-    UInt_t idx = *it;
-    assert( idx < fHits.size());
-    fHits[idx].clear();
+  // Zero only the words that were set, unless they are a sizable fraction
+  // of the bitmap
+  if( 4*fTouched.size() > fNwords )
+    memset( fBits, 0, fNwords*sizeof(ULong64_t) );
+  else {
+    for( vector<UInt_t>::iterator it = fTouched.begin(); it != fTouched.end();
+	 ++it ) {
+      assert( *it < fNwords );
+      fBits[*it] = 0;
+    }
+  }
+  fTouched.clear();
+
+  // For speed, clear only index entries that are actually filled
+  for( vector< pair<UInt_t,Hit*> >::iterator it = fHitList.begin();
+       it != fHitList.end(); ++it ) {
+    UInt_t idx = it->first;
+    assert( idx < fBinRange.size());
+    fBinRange[idx] = make_pair(0U,0U);
   }
   fHitList.clear();
+  fBinHits.clear();
 
 #ifdef TESTCODE
   fMaxhitBin = 0;
@@ -208,6 +294,7 @@ Int_t Hitpattern::Fill( const vector<Plane*>& planes )
 #endif
     ntot += ScanHits( plane );
   }
+  BuildHitIndex();
 
   return ntot;
 }
@@ -219,7 +306,11 @@ UInt_t Hitpattern::GetBinsSet() const
   // Return number of bins set at the highest resolution
   UInt_t n = 0, nbins = GetNbins();
   for( UInt_t i=fNplanes; i; ) {
-    n += fPattern[--i]->CountBits( nbins );
+    --i;
+    for( UInt_t bit = nbins; bit < 2*nbins; ++bit ) {
+      if( TestBit(i,bit) )
+	++n;
+    }
   }
   return n;
 }
@@ -246,9 +337,8 @@ void Hitpattern::SetPositionRange( Double_t start, Double_t end,
   if( hi >= nbins )
     hi = nbins-1;
 
-  // Save the hit pointer(s) in the hit array so that we can efficiently
+  // Save the hit pointer(s) in the hit list so that we can efficiently
   // retrieve later the hit(s) that caused the bits to be set.
-  // NB: This is quite expensive
   if( hit ) {
     for( Int_t i = lo; i <= hi; ++i )
       AddHit( plane, i, hit );
@@ -257,7 +347,7 @@ void Hitpattern::SetPositionRange( Double_t start, Double_t end,
   // Loop through the tree levels, starting at the highest resolution.
   // In practice, we usually have hi-lo <= 1 even at the highest resolution.
   while (true) {
-    fPattern[plane]->SetBitRange( lo+nbins, hi+nbins );
+    SetBitRange( plane, lo+nbins, hi+nbins );
     nbins >>= 1;
     if( nbins == 0 ) break;
     lo >>= 1;
@@ -300,6 +390,193 @@ Int_t Hitpattern::ScanHits( Plane* pl, Plane* )
 }
 
 
+//_____________________________________________________________________________
+// Implementations of ContainsPatterns. Siblings<N> is specialized for
+// patterns of N planes, with the plane loops fully unrolled by the compiler.
+// Siblings<0> handles any number of planes.
+struct Hitpattern::Matcher {
+  template< UInt_t N >
+  static void Siblings( const Hitpattern& hp, const PatternTree& tree,
+			UInt_t first, UInt_t n, UInt_t depth, UInt_t shift,
+			Bool_t mirrored, UInt_t* matchval );
+#ifdef TREESEARCH_HAVE_AVX2
+  template< UInt_t N >
+  static UInt_t SiblingsAVX2( const Hitpattern& hp, const PatternTree& tree,
+			      UInt_t first, UInt_t n, UInt_t depth,
+			      UInt_t shift, Bool_t mirrored,
+			      UInt_t* matchval );
+#endif
+  static SiblingMatcher_t Select( UInt_t nplanes );
+};
+
+#ifdef TREESEARCH_HAVE_AVX2
+//_____________________________________________________________________________
+template< UInt_t N > TREESEARCH_AVX2
+UInt_t Hitpattern::Matcher::SiblingsAVX2( const Hitpattern& hp,
+					  const PatternTree& tree,
+					  UInt_t first, UInt_t n,
+					  UInt_t depth, UInt_t shift,
+					  Bool_t mirrored, UInt_t* matchval )
+{
+  // Vector part of Siblings. Tests eight siblings at a time, using gathered
+  // loads of their pattern bits, with the lanes beyond the last sibling
+  // masked off. Returns the number of siblings done (n rounded up to a
+  // multiple of 8).
+
+  const UInt_t nplanes = (N > 0) ? N : hp.fNplanes;
+  const ULong64_t* bits = hp.fBits;
+  const UInt_t rowlen = hp.fStride;
+  const UInt_t stride = tree.GetPatternSize()*sizeof(UInt_t);
+  UInt_t k = 0;
+  const int* nodes = reinterpret_cast<const int*>( &tree.GetNode(first) );
+  const char* base = reinterpret_cast<const char*>( &tree.GetPattern(0) );
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i low5 = _mm256_set1_epi32(31);
+  const __m256i rowlen2 = _mm256_set1_epi32(2*rowlen);
+  const __m256i lane = _mm256_setr_epi32(0,1,2,3,4,5,6,7);
+  const __m256i patmask =
+    _mm256_set1_epi32(PatternTree::kNodePatternMask);
+  const __m256i vstride = _mm256_set1_epi32(stride);
+  const __m256i pmir = _mm256_set1_epi32(mirrored ? 1 : 0);
+  const __m256i start = _mm256_set1_epi32( (1U<<depth) + (shift<<1) );
+  for( ; k < n; k += 8 ) {
+    const __m256i mask =
+      _mm256_cmpgt_epi32( _mm256_set1_epi32(n-k), lane );
+    // The node words are contiguous. They hold the link type and the
+    // index of the pattern record
+    __m256i node = _mm256_maskload_epi32( nodes+k, mask );
+    __m256i type =
+      _mm256_srli_epi32( node, PatternTree::kNodeTypeShift );
+    __m256i recoff = _mm256_mullo_epi32(
+      _mm256_and_si256(node,patmask), vstride );
+    // Mirroring state and start bit number of each child pattern
+    __m256i mir = _mm256_xor_si256( pmir, _mm256_and_si256(
+			       _mm256_srli_epi32(type,1), one) );
+    __m256i startpos = _mm256_add_epi32( start, _mm256_xor_si256(
+			       mir, _mm256_and_si256(type,one)) );
+    // All ones for mirrored patterns, whose bits are subtracted
+    __m256i sign = _mm256_sub_epi32( zero, mir );
+    __m256i match = zero;
+    for( UInt_t i = 0; i < nplanes; ++i ) {
+      // Pattern bit i (upper half of the word ending with bits[i])
+      __m256i bit = _mm256_srli_epi32( _mm256_mask_i32gather_epi32(
+	  zero, reinterpret_cast<const int*>(base+4+2*i), recoff, mask, 1 ),
+				       16 );
+      bit = _mm256_sub_epi32( _mm256_xor_si256(bit,sign), sign );
+      __m256i pos = _mm256_add_epi32( startpos, bit );
+      // Gather the 32-bit halves of the bitmap words holding these bits
+      // (x86 is little-endian)
+      const int* words = reinterpret_cast<const int*>( bits + i );
+      __m256i idx = _mm256_add_epi32(
+	_mm256_mullo_epi32( _mm256_srli_epi32(pos,6), rowlen2 ),
+	_mm256_and_si256( _mm256_srli_epi32(pos,5), one ) );
+      __m256i w = _mm256_mask_i32gather_epi32( zero, words, idx, mask, 4 );
+      w = _mm256_and_si256( _mm256_srlv_epi32(w,
+				     _mm256_and_si256(pos,low5)), one );
+      match = _mm256_or_si256( match, _mm256_slli_epi32(w,i) );
+    }
+    _mm256_maskstore_epi32( reinterpret_cast<int*>(matchval+k), mask,
+			    match );
+  }
+  return k;
+}
+#endif
+
+//_____________________________________________________________________________
+template< UInt_t N >
+void Hitpattern::Matcher::Siblings( const Hitpattern& hp,
+				    const PatternTree& tree, UInt_t first,
+				    UInt_t n, UInt_t depth, UInt_t shift,
+				    Bool_t mirrored, UInt_t* matchval )
+{
+  // Batched version of ContainsPattern. Compare the "n" consecutive nodes
+  // of the pointer-free "tree" starting at index "first", i.e. the
+  // children of a node at depth-1 with the given shift and mirroring state,
+  // to the hitpattern. The plane occupancy bitpattern for child k is
+  // returned in matchval[k].
+  //
+  // On CPUs with AVX2, eight siblings are tested at a time (see
+  // SiblingsAVX2).
+
+  const UInt_t nplanes = (N > 0) ? N : hp.fNplanes;
+  const ULong64_t* bits = hp.fBits;
+  const UInt_t rowlen = hp.fStride;
+  assert( depth < hp.fNlevels );
+  assert( tree.GetNplanes() == nplanes and hp.fNplanes == nplanes );
+
+  UInt_t k = 0;
+
+  // The bins of all siblings lie within the bins of their parent, so in
+  // each plane, every child uses one of the same pair of bins 2b, 2b+1 at
+  // this depth. If, in every plane, either both or neither of the pair are
+  // set, all siblings have the same occupancy pattern, which then follows
+  // from the first child alone. This is common where the hits are wide
+  // compared to the bins, and it saves the individual comparisons.
+  if( depth > 0 and n > 1 ) {
+    UInt_t node = tree.GetNode(first);
+    UInt_t type = PatternTree::NodeType(node);
+    const UShort_t* pbits =
+      tree.GetPattern( node & PatternTree::kNodePatternMask ).bits;
+    Bool_t mir = mirrored xor ((type & 2) != 0);
+    UInt_t startpos = (1U<<depth) + (shift << 1) + (mir xor (type & 1));
+    UInt_t full = 0, i = 0;
+    for( ; i < nplanes; ++i ) {
+      UInt_t pos = mir ? startpos - pbits[i] : startpos + pbits[i];
+      UInt_t pair = (bits[(pos>>6)*rowlen + i] >> (pos & 62)) & 3;
+      if( pair == 3 )
+	full |= (1U<<i);
+      else if( pair != 0 )
+	break;
+    }
+    if( i == nplanes ) {
+      for( ; k < n; ++k )
+	matchval[k] = full;
+      return;
+    }
+  }
+
+#ifdef TREESEARCH_HAVE_AVX2
+  // Groups of one or two nodes are faster to do with scalar code. The
+  // gathers address the pattern records with signed 32-bit byte offsets.
+  if( n > 2 and HaveAVX2() and
+      tree.GetNpatterns() <= kMaxInt/(tree.GetPatternSize()*sizeof(UInt_t)) )
+    k = SiblingsAVX2<N>( hp, tree, first, n, depth, shift, mirrored,
+			 matchval );
+#endif
+  for( ; k < n; ++k ) {
+    // Same as ContainsPattern
+    UInt_t node = tree.GetNode(first+k);
+    UInt_t type = PatternTree::NodeType(node);
+    const UShort_t* pbits =
+      tree.GetPattern( node & PatternTree::kNodePatternMask ).bits;
+    Bool_t mir = mirrored xor ((type & 2) != 0);
+    UInt_t startpos = (1U<<depth) + (shift << 1) + (mir xor (type & 1));
+    UInt_t match = 0;
+    for( UInt_t i = 0; i < nplanes; ++i ) {
+      UInt_t pos = mir ? startpos - pbits[i] : startpos + pbits[i];
+      assert( pos < (2U<<depth) );
+      match |= ((bits[(pos>>6)*rowlen + i] >> (pos & 63)) & 1) << i;
+    }
+    matchval[k] = match;
+  }
+}
+
+//_____________________________________________________________________________
+Hitpattern::SiblingMatcher_t Hitpattern::Matcher::Select( UInt_t nplanes )
+{
+  // Return the ContainsPatterns implementation for the given number of
+  // planes. Specialized for the plane counts of the usual configurations.
+
+  switch( nplanes ) {
+  case 4:  return &Siblings<4>;
+  case 5:  return &Siblings<5>;
+  case 6:  return &Siblings<6>;
+  case 8:  return &Siblings<8>;
+  default: return &Siblings<0>;
+  }
+}
+
 //_____________________________________________________________________________
 void Hitpattern::Print( Option_t* ) const
 {
@@ -310,48 +587,43 @@ void Hitpattern::Print( Option_t* ) const
 
 
 //_____________________________________________________________________________
-void Bits::ResetBitRange( UInt_t lo, UInt_t hi )
+void Hitpattern::ResetBitRange( UInt_t plane, UInt_t lo, UInt_t hi )
 {
   // Reset (zero) range of bits from lo to hi (inclusive, i.e. [lo,hi])
+  // in the given plane
 
   if( hi<lo ) return;
-  UChar_t mask = ~((1U<<(lo&7))-1);
-  lo >>= 3;
-  if( lo >= fNbytes ) return;
-  UChar_t mask2 = (1U<<((hi&7)+1))-1;
-  hi >>= 3;
-  if( hi >= fNbytes ) {
-    hi = fNbytes-1;
-    mask2 = 0xFF;
-  }
-  if( lo < hi ) {
-    fAllBits[hi] &= (0xFF ^ mask2);
-    memset( fAllBits+lo+1, 0, hi-lo-1 );
+  UInt_t wlo = WordIdx(plane,lo), whi = WordIdx(plane,hi);
+  ULong64_t mask  = ~0ULL << (lo&63);
+  ULong64_t mask2 = ~0ULL >> (63-(hi&63));
+  if( wlo < whi ) {
+    fBits[whi] &= ~mask2;
+    for( UInt_t w = wlo+fStride; w < whi; w += fStride )
+      fBits[w] = 0;
   } else {
     mask &= mask2;
   }
-  fAllBits[lo] &= (0xFF ^ mask);
+  fBits[wlo] &= ~mask;
 }
 
 //_____________________________________________________________________________
-void Bits::SetBitRange( UInt_t lo, UInt_t hi )
+void Hitpattern::SetBitRange( UInt_t plane, UInt_t lo, UInt_t hi )
 {
   // Set range of bits from lo to hi (inclusive, i.e. [lo,hi])
+  // in the given plane
 
   if( hi<lo ) return;
-  SetBitNumber( hi ); // expands array if necessary
-  if( lo==hi ) return;
-  UChar_t mask  = ~((1U<<(lo&7))-1);
-  UChar_t mask2 = (1U<<(hi&7))-1;
-  lo >>= 3;
-  hi >>= 3;
-  if( lo < hi ) {
-    fAllBits[hi] |= mask2;
-    memset( fAllBits+lo+1, 0xFF, hi-lo-1 );
+  UInt_t wlo = WordIdx(plane,lo), whi = WordIdx(plane,hi);
+  ULong64_t mask  = ~0ULL << (lo&63);
+  ULong64_t mask2 = ~0ULL >> (63-(hi&63));
+  if( wlo < whi ) {
+    SetWordBits( whi, mask2 );
+    for( UInt_t w = wlo+fStride; w < whi; w += fStride )
+      SetWordBits( w, ~0ULL );
   } else {
     mask &= mask2;
   }
-  fAllBits[lo] |= mask;
+  SetWordBits( wlo, mask );
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -9,7 +9,6 @@
 //                                                                           //
 ///////////////////////////////////////////////////////////////////////////////
 
-#include "TBits.h"
 #include "TMath.h"
 #include "TreeWalk.h"
 #include "Pattern.h"
@@ -22,26 +21,27 @@
 
 namespace TreeSearch {
 
-  //___________________________________________________________________________
-  // Extended version of TBits that supports setting and resetting bit ranges
-  class Bits : public TBits {
-  public:
-    explicit Bits( UInt_t nbits = 8 ) : TBits(nbits) {}
-    explicit Bits( const TBits& orig ) : TBits(orig) {}
-//    Bits& operator=( const TBits& rhs ) {
-//      TBits::operator=(rhs); return *this;
-//    }
-    virtual ~Bits() {}
-    void ResetBitRange( UInt_t lo, UInt_t hi );
-    void SetBitRange( UInt_t lo, UInt_t hi );
-    void FastClear() { memset(fAllBits,0,fNbytes); }
-    ClassDef(Bits,1)  // TBits container with range setting methods
-  };
-
   class PatternTree;
   class Plane;
   class Hit;
 
+  //___________________________________________________________________________
+  // Read-only view of the hits associated with one hitpattern bin
+  class HitRange {
+  public:
+    typedef Hit* const* const_iterator;
+    HitRange() : fBegin(0), fEnd(0) {}
+    HitRange( const_iterator b, const_iterator e ) : fBegin(b), fEnd(e) {}
+    const_iterator begin() const { return fBegin; }
+    const_iterator end()   const { return fEnd; }
+    Bool_t         empty() const { return (fBegin == fEnd); }
+    UInt_t         size()  const { return (UInt_t)(fEnd-fBegin); }
+    Hit*           front() const { assert(!empty()); return *fBegin; }
+  private:
+    const_iterator fBegin;
+    const_iterator fEnd;
+  };
+
   //___________________________________________________________________________
   class Hitpattern {
 
@@ -56,12 +56,26 @@ namespace TreeSearch {
     virtual Int_t ScanHits( Plane* A, Plane* B = 0 );
 
     std::pair<UInt_t,UInt_t> ContainsPattern( const NodeDescriptor& nd ) const;
+    void     ContainsPatterns( const PatternTree& tree, UInt_t first, UInt_t n,
+			       UInt_t depth, UInt_t shift, Bool_t mirrored,
+			       UInt_t* matchval ) const {
+      // Compare n sibling nodes of the tree to the hitpattern. Dispatched
+      // to the implementation for the number of planes, selected in Init.
+      assert( fMatchSiblings );
+      fMatchSiblings( *this, tree, first, n, depth, shift, mirrored,
+		      matchval );
+    }
 
-    const std::vector<TreeSearch::Hit*>&  GetHits( UInt_t plane,
-						   UInt_t bin ) const {
-      // Get array of hits that set the given bin in the given plane
-      return fHits[ MakeIdx(plane,bin) ];
+    HitRange GetHits( UInt_t plane, UInt_t bin ) const {
+      // Get array of hits that set the given bin in the given plane.
+      // Valid after Fill().
+      const std::pair<UInt_t,UInt_t>& r = fBinRange[ MakeIdx(plane,bin) ];
+      if( r.first == r.second )
+	return HitRange();
+      return HitRange( &fBinHits[0]+r.first, &fBinHits[0]+r.second );
     }
+    HitRange GetHits( UInt_t plane, UInt_t lo, UInt_t hi ) const;
+    HitRange GetHits( UInt_t plane, const NodeDescriptor& nd ) const;
     UInt_t   GetNbins()   const { return 1U<<(fNlevels-1); }
     UInt_t   GetNlevels() const { return fNlevels; }
     UInt_t   GetNplanes() const { return fNplanes; }
@@ -104,25 +118,66 @@ namespace TreeSearch {
     Double_t fScale;    // 1/(bin resolution) = 2^(fNlevels-1)/width (1/m)
     Double_t fBinWidth; // 1/fScale (meters per bin)
     Double_t fOffset;   // Offset of zero hit position wrt zero det coord (m)
-    Bits**   fPattern;  // [fNplanes] pattern at all fNlevels resolutions
 
-    // Storage for saving pointers to the hits that set each active bin at
-    // max level in each plane. Since each plane has the same number of
-    // levels, each plane/bin combination can be represented with a
-    // single index (see MakeIdx below).
-    std::vector< std::vector<Hit*> > fHits;
-    // The plane/bin indices set in fHits. Used for fast clearing
-    std::vector<UInt_t> fHitList;
+    // Bitmap of all planes at all fNlevels resolutions. Bit numbers are
+    // bin + 2^depth, as in the pattern tree. The bits of all planes for a
+    // range of 64 bit numbers are stored in consecutive words (one "row"),
+    // so a 64-byte cache line holds the bits of up to 8 planes.
+    ULong64_t* fBits;   // [fNwords] 64-byte aligned bitmap
+    UInt_t   fStride;   // Words per row (fNplanes rounded up to 8)
+    UInt_t   fNwords;   // Total number of words in fBits
+
+    // ContainsPatterns implementation for fNplanes planes
+    typedef void (*SiblingMatcher_t)( const Hitpattern&, const PatternTree&,
+				      UInt_t, UInt_t, UInt_t, UInt_t, Bool_t,
+				      UInt_t* );
+    struct Matcher;     // Defined in implementation
+    SiblingMatcher_t fMatchSiblings; //! Selected by number of planes
+    // Indices of the words of fBits that have been set. Used for fast clearing
+    std::vector<UInt_t> fTouched;
+
+    UInt_t WordIdx( UInt_t plane, UInt_t bitnum ) const {
+      // Return index into fBits of the word holding the given bit
+      assert( plane<fNplanes && bitnum < 2*GetNbins() );
+      return (bitnum>>6)*fStride + plane;
+    }
+    Bool_t TestBit( UInt_t plane, UInt_t bitnum ) const {
+      return (fBits[WordIdx(plane,bitnum)] >> (bitnum&63)) & 1;
+    }
+    void   SetWordBits( UInt_t idx, ULong64_t mask ) {
+      ULong64_t& word = fBits[idx];
+      if( word == 0 )
+	fTouched.push_back( idx );
+      word |= mask;
+    }
+    void   SetBitRange( UInt_t plane, UInt_t lo, UInt_t hi );
+    void   ResetBitRange( UInt_t plane, UInt_t lo, UInt_t hi );
+
+    // Index of the hits that set each active bin at max level in each
+    // plane. Since each plane has the same number of levels, each plane/bin
+    // combination can be represented with a single index (see MakeIdx
+    // below). The hits for index idx are fBinHits[i] for i in the range
+    // [fBinRange[idx].first,fBinRange[idx].second). Built by BuildHitIndex
+    // from fHitList after filling.
+    std::vector< std::pair<UInt_t,UInt_t> > fBinRange;
+    std::vector<Hit*> fBinHits;
+    // The plane/bin indices and hits recorded while filling.
+    // Also used for fast clearing of fBinRange.
+    std::vector< std::pair<UInt_t,Hit*> > fHitList;
 
     UInt_t MakeIdx( UInt_t plane, UInt_t bin ) const {
-      // Return index into fHits corresponding to the given plane and bin
+      // Return index into fBinRange corresponding to the given plane and bin
       assert( plane<fNplanes && bin<GetNbins() );
       UInt_t idx = (plane<<(fNlevels-1)) + bin;
-      assert( idx < fHits.size());
+      assert( idx < fBinRange.size());
       return idx;
     }
 
-    void AddHit( UInt_t plane, UInt_t bin, Hit* hit );
+    void AddHit( UInt_t plane, UInt_t bin, Hit* hit ) {
+      assert(hit);
+      fHitList.push_back( std::make_pair(MakeIdx(plane,bin), hit) );
+    }
+    void BuildHitIndex();
 
     // Only needed for TESTCODE
     UInt_t  fMaxhitBin;  // Maximum depth of hit array per bin
@@ -131,6 +186,7 @@ namespace TreeSearch {
 
   private:
     void Init( Double_t width );
+    void CopyBits( const Hitpattern& orig );
 
     ClassDef(Hitpattern,0)  // Tracker hitpattern at multiple resolutions
   };
@@ -146,7 +202,7 @@ namespace TreeSearch {
      assert( depth < fNlevels && plane < fNplanes );
      UInt_t offset = 1U<<depth;
      assert( bin < offset );
-     return fPattern[plane]->TestBitNumber( bin + offset );
+     return TestBit( plane, bin + offset );
    }
 
   //___________________________________________________________________________
@@ -161,8 +217,7 @@ namespace TreeSearch {
      UInt_t bin = TMath::FloorNint( fScale*pos );
      if( bin < 0 || bin >= GetNbins() )
        return kFALSE;
-     return
-   fPattern[plane]->TestBitNumber( (bin>>(fNlevels-depth-1))+(1U<<depth) );
+       return TestBit( plane, (bin>>(fNlevels-depth-1))+(1U<<depth) );
    }
 #endif
 
@@ -182,22 +237,22 @@ namespace TreeSearch {
     UInt_t matchval = 0, nmatch = 0;
     // The start bit number of the tree pattern we are comparing to
     UInt_t startpos = offs + nd.shift;
-    Pattern* pat = nd.link->GetPattern();
+    assert( nd.GetNbits() == fNplanes );
     // Pointer to the last element of the pattern's bit array + 1
-    UShort_t* bitnum = pat->GetBits() + fNplanes;
+    const UShort_t* bitnum = nd.bits + fNplanes;
     // Check if the pattern's bits are set in the hitpattern, plane by plane
     if( nd.mirrored ) {
       assert( startpos < (offs<<1) );
       for( UInt_t i=fNplanes; i; ) {
-	if( fPattern[--i]->TestBitNumber(startpos - *--bitnum) ) {
+	if( TestBit(--i,startpos - *--bitnum) ) {
 	  matchval |= (1U<<i);
 	  ++nmatch;
 	}
       }
     } else {
-      assert( startpos + pat->GetWidth() < (offs<<1) );
+      assert( startpos + nd.GetWidth() < (offs<<1) );
       for( UInt_t i=fNplanes; i; ) {
-	if( fPattern[--i]->TestBitNumber(startpos + *--bitnum) ) {
+	if( TestBit(--i,startpos + *--bitnum) ) {
 	  matchval |= (1U<<i);
 	  ++nmatch;
 	}
@@ -99,6 +99,7 @@ Int_t HitpatternLR::Fill( const vector<Plane*>& planes )
     }
 #endif
   }
+  BuildHitIndex();
 
   return ntot;
 }
@@ -116,33 +117,46 @@ Int_t HitpatternLR::ScanHits( Plane* A, Plane* B )
   // Returns number of hits processed
 
   if( !A ) return 0;
-  UInt_t planeA = A->GetAltPlaneNum();
-  assert( planeA < fNplanes );
+  assert( A->GetAltPlaneNum() < fNplanes );
   Double_t maxdist = 0.0;
-  UInt_t planeB = fNplanes;
   if( B ) {
     maxdist = A->GetMaxSlope() * (B->GetZ() - A->GetZ());
-    planeB = B->GetAltPlaneNum();
-    assert( planeB < fNplanes );
+    assert( B->GetAltPlaneNum() < fNplanes );
   }
   assert( A->GetTracker() );
   bool do_single_hits =
     ( A->GetTracker()->TestBit(MWDC::kPairsOnly) == kFALSE || B == 0 );
 
-  Int_t nhits = 0;
+  // Collect all hit pairs first, then set the bins for all of them
+  fPairs.clear();
+  HitPairScanner scanner( A, B, maxdist );
+  Int_t nhits = scanner.Scan( fPairs );
+  SetPairs( A, B, maxdist, do_single_hits );
+
+  return nhits;
+}
+
+//_____________________________________________________________________________
+void HitpatternLR::SetPairs( Plane* A, Plane* B, Double_t maxdist,
+			     Bool_t singles )
+{
+  // Set the bins for the hit pairs in fPairs, found by ScanHits for planes
+  // A and B. Unpaired hits are only recorded if 'singles' is true.
 
-  HitPairIter it( A->GetHits(), B ? B->GetHits() : 0, maxdist );
-  while( it ) {
-    // At least one hit found
-    nhits++;
-    assert( !(*it).first  || dynamic_cast<WireHit*>((*it).first)  ); // @suppress("Field cannot be resolved")
-    assert( !(*it).second || dynamic_cast<WireHit*>((*it).second) ); // @suppress("Field cannot be resolved")
-    WireHit* hitA = static_cast<WireHit*>((*it).first);
-    WireHit* hitB = static_cast<WireHit*>((*it).second);
+  UInt_t planeA = A->GetAltPlaneNum();
+  UInt_t planeB = B ? B->GetAltPlaneNum() : fNplanes;
+  // Don't record the pseudo-hits in dummy planes
+  bool dummyA = A->IsDummy(), dummyB = B && B->IsDummy();
+
+  for( vector<HitPair_t>::const_iterator it = fPairs.begin();
+       it != fPairs.end(); ++it ) {
+    assert( !it->first  || dynamic_cast<WireHit*>(it->first)  ); // @suppress("Field cannot be resolved")
+    assert( !it->second || dynamic_cast<WireHit*>(it->second) ); // @suppress("Field cannot be resolved")
+    WireHit* hitA = static_cast<WireHit*>(it->first);
+    WireHit* hitB = static_cast<WireHit*>(it->second);
     assert( hitA || hitB );
-    // Don't record the pseudo-hits in dummy planes
-    WireHit* recA = A->IsDummy() ? 0 : hitA;
-    WireHit* recB = B->IsDummy() ? 0 : hitB;
+    WireHit* recA = dummyA ? 0 : hitA;
+    WireHit* recB = dummyB ? 0 : hitB;
     if( hitA && hitB ) {
       // A pair of hits registered in partner planes. One or more combinations
       // of hit positions may be within maxdist of each other.
@@ -174,7 +188,7 @@ Int_t HitpatternLR::ScanHits( Plane* A, Plane* B )
 	}
       }
     }
-    else if( do_single_hits ) {
+    else if( singles ) {
       // Unpaired hit in only one plane
       if( hitA ) {
 	SetPosition( hitA->GetPosL()+fOffset, hitA->GetResolution(),
@@ -188,12 +202,9 @@ Int_t HitpatternLR::ScanHits( Plane* A, Plane* B )
 		     planeB, recB );
       }
     }
-    ++it;
   }
-  return nhits;
 }
 
-
 ///////////////////////////////////////////////////////////////////////////////
 
 } // end namespace TreeSearch
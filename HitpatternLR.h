@@ -10,6 +10,8 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "Hitpattern.h"
+#include "Hit.h"         // for HitPair_t
+#include <vector>
 
 namespace TreeSearch {
 
@@ -25,6 +27,11 @@ namespace TreeSearch {
     virtual Int_t Fill( const std::vector<TreeSearch::Plane*>& planes );
     virtual Int_t ScanHits( Plane* A, Plane* B = 0 );
 
+  private:
+    std::vector<HitPair_t> fPairs;  //! Scratch buffer for ScanHits
+
+    void SetPairs( Plane* A, Plane* B, Double_t maxdist, Bool_t singles );
+
     ClassDef(HitpatternLR,0)  // Hitpattern filled by L/R-ambiguous wire hits
   };
 
@@ -0,0 +1,117 @@
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+// TreeSearch::LineFit                                                       //
+//                                                                           //
+// Kernel for fitting many hit combinations that differ only in the point    //
+// selected in one plane, as done by Road::Fit for each combination of the   //
+// points in the other planes. On CPUs with AVX2, four combinations are      //
+// fit at a time in the lanes of the vector registers. The results are       //
+// identical to fitting each combination with FitSums_t.                     //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+#include "LineFit.h"
+#include "Helper.h"
+#ifdef TREESEARCH_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+namespace TreeSearch {
+
+#ifdef TREESEARCH_HAVE_AVX2
+//_____________________________________________________________________________
+TREESEARCH_AVX2
+static UInt_t FitLineCombosAVX2( const Double_t* xs, const Double_t* zs,
+				 const Double_t* ws, UInt_t nsel,
+				 Double_t z, const Double_t* x,
+				 const Double_t* w, UInt_t n, Double_t* a1,
+				 Double_t* a2, Double_t* chi2 )
+{
+  // Vector part of FitLineCombos. Fits the combinations with the points
+  // k = 0..4*(n/4)-1, four at a time, and returns the number done.
+
+  UInt_t k = 0;
+  const __m256d vz = _mm256_set1_pd(z), vzz = _mm256_set1_pd(z*z);
+  const __m256d one = _mm256_set1_pd(1.0);
+  for( ; k+4 <= n; k += 4 ) {
+    __m256d vx = _mm256_loadu_pd(x+k);
+    __m256d vw = _mm256_loadu_pd(w+k);
+    __m256d t11 = vw;
+    __m256d t12 = _mm256_mul_pd(vz,vw);
+    __m256d t22 = _mm256_mul_pd(vzz,vw);
+    __m256d g1  = _mm256_mul_pd(vx,vw);
+    __m256d g2  = _mm256_mul_pd(_mm256_mul_pd(vx,vz),vw);
+    for( UInt_t j = 0; j < nsel; ++j ) {
+      t11 = _mm256_add_pd( t11, _mm256_set1_pd(ws[j]) );
+      t12 = _mm256_add_pd( t12, _mm256_set1_pd(zs[j]*ws[j]) );
+      t22 = _mm256_add_pd( t22, _mm256_set1_pd(zs[j]*zs[j]*ws[j]) );
+      g1  = _mm256_add_pd( g1,  _mm256_set1_pd(xs[j]*ws[j]) );
+      g2  = _mm256_add_pd( g2,  _mm256_set1_pd(xs[j]*zs[j]*ws[j]) );
+    }
+    __m256d iD  = _mm256_div_pd( one, _mm256_sub_pd(_mm256_mul_pd(t11,t22),
+						    _mm256_mul_pd(t12,t12)) );
+    __m256d b1 = _mm256_mul_pd( _mm256_sub_pd(_mm256_mul_pd(g1,t22),
+					      _mm256_mul_pd(g2,t12)), iD );
+    __m256d b2 = _mm256_mul_pd( _mm256_sub_pd(_mm256_mul_pd(g2,t11),
+					      _mm256_mul_pd(g1,t12)), iD );
+    // Residual of point k ...
+    __m256d d = _mm256_sub_pd( _mm256_add_pd(b1,_mm256_mul_pd(b2,vz)), vx );
+    __m256d c = _mm256_mul_pd( _mm256_mul_pd(d,d), vw );
+    // ... and of the other points
+    for( UInt_t j = 0; j < nsel; ++j ) {
+      d = _mm256_sub_pd( _mm256_add_pd(b1, _mm256_mul_pd(b2,
+			   _mm256_set1_pd(zs[j]))), _mm256_set1_pd(xs[j]) );
+      c = _mm256_add_pd( c, _mm256_mul_pd( _mm256_mul_pd(d,d),
+					   _mm256_set1_pd(ws[j]) ) );
+    }
+    _mm256_storeu_pd( a1+k, b1 );
+    _mm256_storeu_pd( a2+k, b2 );
+    _mm256_storeu_pd( chi2+k, c );
+  }
+  return k;
+}
+#endif
+
+//_____________________________________________________________________________
+void FitLineCombos( const Double_t* xs, const Double_t* zs,
+		    const Double_t* ws, UInt_t nsel,
+		    Double_t z, const Double_t* x, const Double_t* w,
+		    UInt_t n, Double_t* a1, Double_t* a2, Double_t* chi2 )
+{
+  // Fit x = a1 + a2*z to point k of the n points (x,z), followed by the
+  // nsel points (xs,zs), for k = 0..n-1.
+  //
+  // The sums and the chi2 are accumulated over the points in this order,
+  // with the same operations as FitSums_t::Add/Solve, in all lanes. The
+  // results are therefore the same with and without SIMD and do not depend
+  // on the order in which the caller enumerates the combinations. The chi2
+  // is computed from the residuals (rather than from the sums, which might
+  // seem faster, but is subject to cancellation).
+
+  UInt_t k = 0;
+#ifdef TREESEARCH_HAVE_AVX2
+  if( HaveAVX2() )
+    k = FitLineCombosAVX2( xs, zs, ws, nsel, z, x, w, n, a1, a2, chi2 );
+#endif
+  for( ; k < n; ++k ) {
+    FitSums_t t;
+    t.Add( x[k], z, w[k] );
+    for( UInt_t j = 0; j < nsel; ++j )
+      t.Add( xs[j], zs[j], ws[j] );
+    Double_t b1, b2;
+    t.Solve( b1, b2 );
+    Double_t d = b1 + b2*z - x[k];
+    Double_t c = d*d * w[k];
+    for( UInt_t j = 0; j < nsel; ++j ) {
+      d = b1 + b2*zs[j] - xs[j];
+      c += d*d * ws[j];
+    }
+    a1[k] = b1;
+    a2[k] = b2;
+    chi2[k] = c;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // end namespace TreeSearch
@@ -0,0 +1,111 @@
+#ifndef ROOT_TreeSearch_LineFit
+#define ROOT_TreeSearch_LineFit
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+// TreeSearch::LineFit                                                       //
+//                                                                           //
+// Weighted least-squares fits of straight lines to hit coordinates          //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+#include "Rtypes.h"
+#include <vector>
+#include <cassert>
+
+namespace TreeSearch {
+
+  //___________________________________________________________________________
+  // Sums for fitting x = a1 + a2*z to points (x_i,z_i) with weights w_i.
+  // Notation from: Review of Particle Properties, PRD 50, 1277 (1994)
+  struct FitSums_t {
+    Double_t S11;  // sum w
+    Double_t S12;  // sum w*z
+    Double_t S22;  // sum w*z^2
+    Double_t G1;   // sum w*x
+    Double_t G2;   // sum w*x*z
+    Double_t Sxx;  // sum w*x^2
+
+    FitSums_t() : S11(0), S12(0), S22(0), G1(0), G2(0), Sxx(0) {}
+    void Clear() { S11 = S12 = S22 = G1 = G2 = Sxx = 0; }
+    void Add( Double_t x, Double_t z, Double_t w )
+    {
+      // Add point (x,z) with weight w
+      S11 += w;
+      S12 += z * w;
+      S22 += z * z * w;
+      G1  += x * w;
+      G2  += x * z * w;
+      Sxx += x * x * w;
+    }
+    void Solve( Double_t& a1, Double_t& a2, Double_t* V = 0 ) const
+    {
+      // Fit parameters (intercept a1, slope a2) and, if requested, their
+      // covariance matrix V (V11, V12=V21, V22)
+      Double_t iD = 1.0/(S11*S22 - S12*S12);
+      a1 = (G1*S22 - G2*S12)*iD;
+      a2 = (G2*S11 - G1*S12)*iD;
+      if( V ) {
+	V[0] =  S22*iD;
+	V[1] = -S12*iD;
+	V[2] =  S11*iD;
+      }
+    }
+    Bool_t MinChi2Above( Double_t bound ) const
+    {
+      // True if the chi2 of the best fit of the points is certainly greater
+      // than "bound". The chi2 is computed from the sums as
+      // Sxx - a1*G1 - a2*G2, which is subject to cancellation, so be
+      // generous with the tolerance.
+      Double_t a1, a2;
+      Solve( a1, a2 );
+      Double_t chi2 = Sxx - a1*G1 - a2*G2;
+      return ( chi2 - 1e-9*Sxx > bound );
+    }
+  };
+
+  //___________________________________________________________________________
+  // Hit coordinates for fitting in structure-of-arrays layout, grouped by
+  // plane. All points of a plane have the same z. Weights are 1/sigma^2.
+  class FitPoints {
+  public:
+    FitPoints() : fStart(1,0) {}
+
+    void   Clear()
+    { fX.clear(); fW.clear(); fZ.clear(); fStart.assign(1,0); }
+    void   AddPlane( Double_t z )
+    { fZ.push_back(z); fStart.push_back(fStart.back()); }
+    void   AddPoint( Double_t x, Double_t w )
+    { assert(!fZ.empty()); fX.push_back(x); fW.push_back(w); ++fStart.back(); }
+
+    UInt_t GetNplanes() const { return fZ.size(); }
+    UInt_t GetNpoints( UInt_t plane ) const
+    { return fStart[plane+1] - fStart[plane]; }
+    Double_t        GetZ( UInt_t plane ) const { return fZ[plane]; }
+    const Double_t* GetX( UInt_t plane ) const { return &fX[fStart[plane]]; }
+    const Double_t* GetW( UInt_t plane ) const { return &fW[fStart[plane]]; }
+
+  private:
+    std::vector<Double_t> fX;      // x coordinates of all points
+    std::vector<Double_t> fW;      // Weights of all points
+    std::vector<Double_t> fZ;      // z coordinate of each plane
+    std::vector<UInt_t>   fStart;  // Index of first point of each plane
+  };
+
+  //___________________________________________________________________________
+  // Fit kernel. Fits each of the "n" points (x[k],z) with weights w[k],
+  // followed by the "nsel" points (xs,zs,ws), summed in that order. The
+  // fit parameters and chi2 for point k are returned in a1[k], a2[k] and
+  // chi2[k], identical to those from FitSums_t for the same point order.
+  // Several combinations are evaluated in parallel if SIMD instructions
+  // are available.
+  void FitLineCombos( const Double_t* xs, const Double_t* zs,
+		      const Double_t* ws, UInt_t nsel,
+		      Double_t z, const Double_t* x, const Double_t* w,
+		      UInt_t n, Double_t* a1, Double_t* a2, Double_t* chi2 );
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // end namespace TreeSearch
+
+#endif
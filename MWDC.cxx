@@ -79,6 +79,21 @@ Int_t MWDC::Decode( const THaEvData& evdata )
     }
   }   // modules
 
+  // Distribute the data channels with hits to the planes' modules. Each
+  // channel should belong to at most one module of one plane.
+  for( vector<SlotMap_t>::size_type is = 0; is < fSlotMap.size(); ++is ) {
+    const SlotMap_t& sm = fSlotMap[is];
+    Int_t nchan = evdata.GetNumChan( sm.crate, sm.slot );
+    for( Int_t ichan = 0; ichan < nchan; ++ichan ) {
+      Int_t chan = evdata.GetNextChan( sm.crate, sm.slot, ichan );
+      if( chan < 0 or chan >= static_cast<Int_t>(sm.chan.size()) )
+	continue;
+      const ChanTarget_t& t = sm.chan[chan];
+      if( t.plane )
+	t.plane->AddChannel( t.imod, chan );
+    }
+  }
+
   // Standard decoding: decode all projections and fill hitpatterns
   Tracker::Decode( evdata );
 
@@ -174,6 +189,11 @@ THaAnalysisObject::EStatus MWDC::Init( const TDatime& date )
   // Reference map set up correctly and without conflicts
   fRefTime.assign( fRefMap->GetSize(), kBig );
 
+  // Set up the lookup table for distributing the data channels to the planes
+  if( !MakeSlotMap() && fDebug > 0 )
+    Info( Here(here), "Channel lookup table not used, decoding each "
+	  "plane's modules separately" );
+
 #ifdef MCDATA
   // Set up handler for MC data aware of LR hits
   if( TestBit(kMCdata) ) {
@@ -185,6 +205,63 @@ THaAnalysisObject::EStatus MWDC::Init( const TDatime& date )
   return fStatus = kOK;
 }
 
+//_____________________________________________________________________________
+Bool_t MWDC::MakeSlotMap()
+{
+  // Build the table that maps the crate/slot/channel of each data channel
+  // to the plane and detector map module it belongs to.
+  // With this table, Decode reads the channels with hits of each slot once
+  // and hands them to the planes, instead of every plane scanning every
+  // channel of each of its modules' slots. This matters when modules are
+  // shared by several planes or the detector maps use one module per channel.
+  // If a channel is assigned to more than one plane, the table is not
+  // used, and each plane decodes its modules as before.
+  // Returns true if the table is in use.
+
+  static const char* const here = "MakeSlotMap";
+
+  fSlotMap.clear();
+  for( vwsiz_t iplane = 0; iplane < fPlanes.size(); ++iplane ) {
+    if( fPlanes[iplane]->IsDummy() )
+      continue;
+    assert( dynamic_cast<WirePlane*>(fPlanes[iplane]) );
+    WirePlane* plane = static_cast<WirePlane*>(fPlanes[iplane]);
+    THaDetMap* planeMap = plane->GetDetMap();
+    for( Int_t imod = 0; imod < planeMap->GetSize(); ++imod ) {
+      THaDetMap::Module* d = planeMap->GetModule(imod);
+      if( d->lo < 0 or d->hi < d->lo )
+	continue;
+      vector<SlotMap_t>::size_type is = 0;
+      while( is < fSlotMap.size() and
+	     (fSlotMap[is].crate != d->crate or fSlotMap[is].slot != d->slot) )
+	++is;
+      if( is == fSlotMap.size() ) {
+	SlotMap_t sm;
+	sm.crate = d->crate;
+	sm.slot  = d->slot;
+	fSlotMap.push_back( sm );
+      }
+      vector<ChanTarget_t>& chan = fSlotMap[is].chan;
+      if( chan.size() <= static_cast<UInt_t>(d->hi) ) {
+	ChanTarget_t none = { 0, -1 };
+	chan.resize( d->hi+1, none );
+      }
+      for( Int_t ich = d->lo; ich <= d->hi; ++ich ) {
+	if( chan[ich].plane ) {
+	  Warning( Here(here), "Channel cr/sl/ch=%u/%u/%d used by planes "
+		   "\"%s\" and \"%s\". Check database.", d->crate, d->slot,
+		   ich, chan[ich].plane->GetName(), plane->GetName() );
+	  fSlotMap.clear();
+	  return false;
+	}
+	chan[ich].plane = plane;
+	chan[ich].imod  = imod;
+      }
+    }
+  }
+  return !fSlotMap.empty();
+}
+
 //_____________________________________________________________________________
 THaAnalysisObject::EStatus MWDC::PartnerPlanes()
 {
@@ -332,6 +409,15 @@ UInt_t MWDC::GetCrateMapDBcols() const
   return 6;
 }
 
+//_____________________________________________________________________________
+Tracker* MWDC::MakeReplica() const
+{
+  // Create a new, uninitialized MWDC with the same name and apparatus,
+  // for concurrent processing of events in batch mode
+
+  return new MWDC( GetName(), GetTitle(), GetApparatus() );
+}
+
 #ifdef MCDATA
 //_____________________________________________________________________________
 void MWDC::LRPointUpdater::UpdateHit( Podd::MCTrackPoint* pt, Hit* hit,
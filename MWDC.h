@@ -11,6 +11,8 @@
 
 namespace TreeSearch {
 
+  class WirePlane;
+
   class MWDC : public Tracker {
   public:
     MWDC( const char* name, const char* description = "",
@@ -22,6 +24,7 @@ namespace TreeSearch {
 
     Double_t        GetRefTime( UInt_t i ) const
     { return (i<(UInt_t)fRefMap->GetSize()) ? fRefTime[i] : kBig; }
+    Bool_t          HasChanLookup() const { return !fSlotMap.empty(); }
 
     // Analysis control flags. Set via database.
     enum {
@@ -35,7 +38,23 @@ namespace TreeSearch {
     THaDetMap*     fRefMap;      // Map of reference channels for VME readout
     vector<float>  fRefTime;     // [fRefMap->GetSize()] ref channel data
 
+    // Lookup table of the data channels of all planes, so that Decode can
+    // read the channels with hits of each crate/slot once
+    struct ChanTarget_t {
+      WirePlane*   plane;        // Plane the channel belongs to, 0 if none
+      Int_t        imod;         // Index of module in plane's detector map
+    };
+    struct SlotMap_t {
+      Int_t        crate;
+      Int_t        slot;
+      std::vector<ChanTarget_t> chan;  // Indexed by channel number
+    };
+    std::vector<SlotMap_t> fSlotMap;   //! Data channel lookup table
+
+    Bool_t         MakeSlotMap();
+
     virtual UInt_t GetCrateMapDBcols() const;
+    virtual Tracker* MakeReplica() const;
 
     virtual Plane* MakePlane( const char* name, const char* description = "",
 			      THaDetectorBase* parent = 0 ) const;
@@ -17,7 +17,7 @@ void NodeDescriptor::Print() const
   // Print bit contents of the pattern of this NodeDescriptor
 
   cout << "(" << (UInt_t)depth << "/" << (mirrored ? "-" : "+") << ") ";
-  for( UInt_t i=0; i<link->GetPattern()->GetNbits(); i++ ) {
+  for( UInt_t i=0; i<nbits; i++ ) {
     cout << (*this)[i] << " ";
   }
   cout << endl;
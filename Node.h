@@ -15,36 +15,52 @@ namespace TreeSearch {
   // Structure to describe a tree node (an actual pattern, including shifts
   // and mirroring)
   struct NodeDescriptor {
-    Link*    link;     // Linked-list node pointing to a base pattern
-    Pattern* parent;   // Parent node
+    Link*    link;     // Linked-list node pointing to a base pattern (or 0)
+    Pattern* parent;   // Parent node (or 0)
+    const UShort_t* bits; // [nbits] Bits of the base pattern
+    UShort_t nbits;    // Number of bits (=planes) of the base pattern
     UShort_t shift;    // Shift of the base pattern to its actual position
     Bool_t   mirrored; // Pattern is mirrored
     UChar_t  depth;    // Current recursion depth
 
     NodeDescriptor( Link* ln, Pattern* p, UShort_t shft, Bool_t mir,
 		    UChar_t dep )
-      : link(ln), parent(p), shift(shft), mirrored(mir), depth(dep)
-    { assert(ln && ln->GetPattern()); }
-    NodeDescriptor() : link(0), parent(0), shift(0), mirrored(0), depth(0) {}
+      : link(ln), parent(p), bits(0), nbits(0), shift(shft), mirrored(mir),
+	depth(dep)
+    {
+      assert(ln && ln->GetPattern());
+      bits  = ln->GetPattern()->GetBits();
+      nbits = ln->GetPattern()->GetNbits();
+    }
+    // Descriptor for a node of a pointer-free tree (see PatternTree),
+    // which has no Link and Pattern objects
+    NodeDescriptor( const UShort_t* bts, UShort_t nbts, UShort_t shft,
+		    Bool_t mir, UChar_t dep )
+      : link(0), parent(0), bits(bts), nbits(nbts), shift(shft),
+	mirrored(mir), depth(dep)
+    { assert(bits && nbits > 0); }
+    NodeDescriptor() : link(0), parent(0), bits(0), nbits(0), shift(0),
+		       mirrored(0), depth(0) {}
     ~NodeDescriptor() {}
 
-    UShort_t Start() const { return shift; }
-    UShort_t End()   const { return (*this)[link->GetPattern()->GetNbits()-1];}
+    UShort_t Start()   const { return shift; }
+    UShort_t End()     const { return (*this)[nbits-1]; }
+    UInt_t   GetNbits() const { return nbits; }
+    UInt_t   GetWidth() const { return bits[nbits-1]-bits[0]; }
     void     Print() const;
 
     // operator[] returns actual bit value in the i-th plane
     UShort_t  operator[](UInt_t i) const {
       if( i == 0 ) return shift;
-      Pattern& pat = *(link->GetPattern());
-      if( mirrored ) return shift - pat[i];
-      else           return shift + pat[i];
+      assert( i < nbits );
+      if( mirrored ) return shift - bits[i];
+      else           return shift + bits[i];
     }
     // Comparison operators
     bool operator<( const NodeDescriptor& rhs ) const {
       if( shift < rhs.shift ) return true;
       if( shift > rhs.shift ) return false;
-      UInt_t nb = link->GetPattern()->GetNbits();
-      for( UInt_t i = 1; i < nb; ++i ) {
+      for( UInt_t i = 1; i < nbits; ++i ) {
 	if( (*this)[i] < rhs[i] )  return true;
 	if( (*this)[i] > rhs[i] )  return false;
       }
@@ -53,8 +69,7 @@ namespace TreeSearch {
     bool operator<=( const NodeDescriptor& rhs ) const {
       if( shift < rhs.shift ) return true;
       if( shift > rhs.shift ) return false;
-      UInt_t nb = link->GetPattern()->GetNbits();
-      for( UInt_t i = 1; i < nb; ++i ) {
+      for( UInt_t i = 1; i < nbits; ++i ) {
 	if( (*this)[i] < rhs[i] )  return true;
 	if( (*this)[i] > rhs[i] )  return false;
       }
@@ -67,8 +82,9 @@ namespace TreeSearch {
       return !operator<(rhs);
     }
     bool operator==( const NodeDescriptor& rhs ) const {
+      assert( nbits == rhs.nbits );
       return ( shift == rhs.shift && mirrored == rhs.mirrored &&
-	       *(link->GetPattern()) == *(rhs.link->GetPattern()) );
+	       0 == memcmp( bits, rhs.bits, nbits*sizeof(UShort_t) ) );
     }
     bool operator!=( const NodeDescriptor& rhs ) const {
       return !operator==(rhs);
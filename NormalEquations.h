@@ -0,0 +1,156 @@
+#ifndef ROOT_TreeSearch_NormalEquations
+#define ROOT_TreeSearch_NormalEquations
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+// TreeSearch::NormalEquations                                               //
+//                                                                           //
+// Fixed-size normal equations (At W A) b = (At W) y of a linear least       //
+// squares fit with N parameters, solved by Cholesky decomposition.          //
+// Everything is kept on the stack. The arithmetic is that of ROOT's         //
+// TDecompChol, so results are the same as with TMatrixDSym/TDecompChol.     //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+#include "Rtypes.h"
+#include "TMath.h"
+#include <cassert>
+#include <cfloat>
+
+namespace TreeSearch {
+
+  template< UInt_t N > class NormalEquations {
+  public:
+    NormalEquations() { Clear(); }
+
+    void Clear()
+    {
+      for( UInt_t j = 0; j < N; ++j ) {
+	for( UInt_t k = 0; k < N; ++k )
+	  fU[j][k] = 0;
+	fB[j] = 0;
+      }
+      fDecomposed = false;
+    }
+    void Add( const Double_t* a, Double_t y, Double_t w = 1.0 )
+    {
+      // Add measurement y with weight w and row a[0..N-1] of the design
+      // matrix A. Only the upper triangle of AtA is filled.
+      assert( !fDecomposed );
+      for( UInt_t j = 0; j < N; ++j ) {
+	for( UInt_t k = j; k < N; ++k )
+	  fU[j][k] += a[j] * w * a[k];
+	fB[j] += a[j] * w * y;
+      }
+    }
+    // Direct access to elements of AtA (upper triangle, j <= k) and Aty
+    Double_t& AtA( UInt_t j, UInt_t k )
+    { assert( j <= k and k < N and !fDecomposed ); return fU[j][k]; }
+    Double_t& Aty( UInt_t j )
+    { assert( j < N and !fDecomposed ); return fB[j]; }
+
+    Bool_t Solve( Double_t* b );
+    Bool_t Invert( Double_t* covar ) const;
+
+  private:
+    Double_t fU[N][N];    // Upper triangle of AtA, then its Cholesky factor
+    Double_t fB[N];       // Aty
+    Bool_t   fDecomposed; // fU holds the Cholesky factor
+
+    Bool_t Decompose();
+    Bool_t Substitute( Double_t* b ) const;
+  };
+
+  //___________________________________________________________________________
+  template< UInt_t N > inline
+  Bool_t NormalEquations<N>::Decompose()
+  {
+    // Cholesky decomposition AtA = Ut U, in place. Returns false if AtA is
+    // not positive-definite.
+
+    for( UInt_t icol = 0; icol < N; ++icol ) {
+      Double_t ujj = fU[icol][icol];
+      for( UInt_t irow = 0; irow < icol; ++irow )
+	ujj -= fU[irow][icol] * fU[irow][icol];
+      if( ujj <= 0 )
+	return false;
+      ujj = TMath::Sqrt(ujj);
+      fU[icol][icol] = ujj;
+      for( UInt_t j = icol+1; j < N; ++j ) {
+	for( UInt_t i = 0; i < icol; ++i )
+	  fU[icol][j] -= fU[i][j] * fU[i][icol];
+      }
+      for( UInt_t j = icol+1; j < N; ++j )
+	fU[icol][j] /= ujj;
+    }
+    fDecomposed = true;
+    return true;
+  }
+
+  //___________________________________________________________________________
+  template< UInt_t N > inline
+  Bool_t NormalEquations<N>::Substitute( Double_t* b ) const
+  {
+    // Solve Ut U x = b for x, in place, using the Cholesky factor
+
+    assert( fDecomposed );
+    // Forward substitution with Ut
+    for( UInt_t i = 0; i < N; ++i ) {
+      if( fU[i][i] < DBL_EPSILON )
+	return false;
+      Double_t r = b[i];
+      for( UInt_t j = 0; j < i; ++j )
+	r -= fU[j][i] * b[j];
+      b[i] = r / fU[i][i];
+    }
+    // Back substitution with U
+    for( UInt_t i = N; i--; ) {
+      Double_t r = b[i];
+      for( UInt_t j = i+1; j < N; ++j )
+	r -= fU[i][j] * b[j];
+      b[i] = r / fU[i][i];
+    }
+    return true;
+  }
+
+  //___________________________________________________________________________
+  template< UInt_t N > inline
+  Bool_t NormalEquations<N>::Solve( Double_t* b )
+  {
+    // Solve the normal equations. The fitted parameters are returned
+    // in b[0..N-1]. Returns false if the decomposition failed.
+
+    if( !fDecomposed and !Decompose() )
+      return false;
+    for( UInt_t j = 0; j < N; ++j )
+      b[j] = fB[j];
+    return Substitute( b );
+  }
+
+  //___________________________________________________________________________
+  template< UInt_t N > inline
+  Bool_t NormalEquations<N>::Invert( Double_t* covar ) const
+  {
+    // Get the inverse of AtA, i.e. the covariance matrix of the fitted
+    // parameters, in covar[N*N] (row-major). Requires a successful Solve().
+
+    assert( fDecomposed );
+    if( !fDecomposed )
+      return false;
+    for( UInt_t k = 0; k < N; ++k ) {
+      Double_t col[N];
+      for( UInt_t j = 0; j < N; ++j )
+	col[j] = ( j == k ) ? 1.0 : 0.0;
+      if( !Substitute(col) )
+	return false;
+      for( UInt_t j = 0; j < N; ++j )
+	covar[j*N+k] = col[j];
+    }
+    return true;
+  }
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // end namespace TreeSearch
+
+#endif
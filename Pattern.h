@@ -36,6 +36,7 @@ namespace TreeSearch {
   //___________________________________________________________________________
   class Pattern {
     friend class PatternGenerator;
+    friend class PatternTree;
     friend class NodeVisitor;
   private:
     UShort_t*  fBits;        // [fNbits] Bit numbers set in each plane
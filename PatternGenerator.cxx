@@ -6,13 +6,16 @@
 
 #include "PatternGenerator.h"
 #include "PatternTree.h"
+#include "TaskPool.h"
+#include "StageProfile.h"
 #include "TMath.h"
 #include "TString.h"
 #include "TError.h"
 #include <iostream>
 #include <stdexcept>
-#include <ctime>
 #include <cassert>
+#include <algorithm>
+#include <deque>
 #if ROOT_VERSION_CODE < ROOT_VERSION(5,8,0)
 #include <cstdlib>   // for atof()
 #endif
@@ -106,15 +109,296 @@ ChildIter& ChildIter::operator++()
   return *this;
 }
 
+//_____________________________________________________________________________
+// Map from hash values to nonzero indices. Open addressing with linear
+// probing. Its size is proportional to the number of entries, not to the
+// range of hash values.
+class SlotIndex {
+public:
+  struct Slot {
+    UInt_t key;  // Hash value
+    UInt_t idx;  // Index stored for key, 0 if slot empty
+    Slot() : key(0), idx(0) {}
+  };
+
+  SlotIndex() : fSlots(1024), fNused(0) {}
+
+  // Slot for key, or the empty slot where key would be inserted
+  Slot* Lookup( UInt_t key ) {
+    size_t mask = fSlots.size()-1;
+    for( size_t i = Mix(key) & mask; ; i = (i+1) & mask ) {
+      Slot* slot = &fSlots[i];
+      if( !slot->idx or slot->key == key )
+	return slot;
+    }
+  }
+  // Fill an empty slot found by Lookup. Invalidates all slot pointers.
+  void Insert( Slot* slot, UInt_t key, UInt_t idx ) {
+    assert( !slot->idx and idx );
+    slot->key = key;
+    slot->idx = idx;
+    if( 2*(++fNused) > fSlots.size() )
+      Grow();
+  }
+  const vector<Slot>& GetSlots() const { return fSlots; }
+
+private:
+  vector<Slot>    fSlots;  // Open-addressing table, size is a power of 2
+  size_t          fNused;  // Number of filled slots
+
+  static UInt_t Mix( UInt_t hash ) {
+    // Spread consecutive hash values over the slots
+    UInt_t h = hash * 0x9E3779B1U;
+    return h ^ (h >> 16);
+  }
+  void Grow() {
+    vector<Slot> old( 2*fSlots.size() );
+    old.swap( fSlots );
+    for( size_t i = 0; i < old.size(); ++i ) {
+      if( old[i].idx )
+	*Lookup( old[i].key ) = old[i];
+    }
+  }
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 
 } //end namespace
 
 namespace TreeSearch {
 
+// Use the sparse hash table with kAutoHash if the perfect one would be bigger
+static const ULong64_t kMaxPerfectHashBytes = 1ULL << 26;
+
+//_____________________________________________________________________________
+// Build-time index entry of a pattern
+class PatternGenerator::HashNode {
+public:
+  Pattern* fPattern;    // Bit pattern treenode
+  UInt_t   fMinDepth;   // Minimum valid depth for this pattern (<=16)
+
+  HashNode() : fPattern(0), fMinDepth(kMaxUInt) {}
+  Pattern* GetPattern() const { return fPattern; }
+  void     UsedAtDepth( UInt_t depth ) {
+    if( depth < fMinDepth ) fMinDepth = depth;
+  }
+};
+
+//_____________________________________________________________________________
+// Index of patterns by their (unique) hash value. Nodes never move once
+// created.
+class PatternGenerator::HashTable {
+public:
+  virtual ~HashTable() {}
+  // Node for the given hash value, or 0 if no such node has been created
+  virtual HashNode* Find( UInt_t hash ) = 0;
+  // Node for the given hash value, created empty if necessary
+  virtual HashNode* Get( UInt_t hash ) = 0;
+  // All stored patterns, ordered by hash value
+  virtual void      GetPatterns( vector<Pattern*>& pats ) const = 0;
+  virtual ULong64_t GetNbytes() const = 0;
+
+  class Perfect;
+  class Sparse;
+};
+
+//_____________________________________________________________________________
+// Perfect hash table (no collisions), the fastest way to do the pattern
+// lookup during build. All possible nodes are allocated up front.
+class PatternGenerator::HashTable::Perfect
+  : public PatternGenerator::HashTable {
+public:
+  explicit Perfect( ULong64_t size )
+    : fNodes(new HashNode[size]), fSize(size) {}
+  virtual ~Perfect() { delete [] fNodes; }
+
+  virtual HashNode* Find( UInt_t hash ) {
+    assert( hash < fSize );
+    return fNodes+hash;
+  }
+  virtual HashNode* Get( UInt_t hash ) {
+    return Find(hash);
+  }
+  virtual void GetPatterns( vector<Pattern*>& pats ) const {
+    for( ULong64_t i = 0; i < fSize; ++i ) {
+      Pattern* pat = fNodes[i].GetPattern();
+      if( pat )
+	pats.push_back(pat);
+    }
+  }
+  virtual ULong64_t GetNbytes() const {
+    return fSize * sizeof(HashNode);
+  }
+
+private:
+  HashNode* fNodes;
+  ULong64_t fSize;
+};
+
+//_____________________________________________________________________________
+// Sparse hash table. Its size is proportional to the number of patterns,
+// not to the range of hash values. The slot index stores indices into a
+// node store that never moves its elements.
+class PatternGenerator::HashTable::Sparse
+  : public PatternGenerator::HashTable {
+public:
+  virtual HashNode* Find( UInt_t hash ) {
+    SlotIndex::Slot* slot = fIndex.Lookup( hash );
+    return slot->idx ? &fNodes[slot->idx-1] : 0;
+  }
+  virtual HashNode* Get( UInt_t hash ) {
+    SlotIndex::Slot* slot = fIndex.Lookup( hash );
+    if( !slot->idx ) {
+      fNodes.push_back( HashNode() );
+      fIndex.Insert( slot, hash, (UInt_t)fNodes.size() );
+      return &fNodes.back();
+    }
+    return &fNodes[slot->idx-1];
+  }
+  virtual void GetPatterns( vector<Pattern*>& pats ) const {
+    vector< pair<UInt_t,Pattern*> > keyed;
+    const vector<SlotIndex::Slot>& slots = fIndex.GetSlots();
+    for( size_t j = 0; j < slots.size(); ++j ) {
+      const SlotIndex::Slot& slot = slots[j];
+      Pattern* pat = slot.idx ? fNodes[slot.idx-1].GetPattern() : 0;
+      if( pat )
+	keyed.push_back( make_pair(slot.key,pat) );
+    }
+    sort( keyed.begin(), keyed.end() );
+    for( size_t i = 0; i < keyed.size(); ++i )
+      pats.push_back( keyed[i].second );
+  }
+  virtual ULong64_t GetNbytes() const {
+    return fIndex.GetSlots().size() * sizeof(SlotIndex::Slot)
+      + fNodes.size() * sizeof(HashNode);
+  }
+
+private:
+  SlotIndex       fIndex;  // Node index by hash value
+  deque<HashNode> fNodes;  // Node store
+};
+
+//_____________________________________________________________________________
+// Child candidates of the patterns that the build may expand, generated
+// level by level before the depth-first build. The candidates of a pattern
+// are the children from ChildIter, in the same order, that pass LineTest and
+// the slope test at the deepest level. Every child list of the build is a
+// subset of them, selected by the build with the same rules as without the
+// cache, so the tree is the same either way.
+class PatternGenerator::ChildCache {
+public:
+  struct Child {
+    UInt_t pattern;   // Index of child pattern
+    Int_t  type;      // Child type (shifted/mirrored), see ChildIter
+  };
+
+  explicit ChildCache( UInt_t nplanes ) : fNplanes(nplanes), fFirst(1,0) {}
+
+  // Index of the pattern with the given hash, added if new
+  UInt_t Add( const UShort_t* bits, UInt_t hash ) {
+    SlotIndex::Slot* slot = fIndex.Lookup( hash );
+    if( slot->idx )
+      return slot->idx-1;
+    UInt_t idx = GetNpatterns();
+    fBits.insert( fBits.end(), bits, bits+fNplanes );
+    fHash.push_back( hash );
+    fIndex.Insert( slot, hash, idx+1 );
+    return idx;
+  }
+  // Index of the pattern with the given hash, or -1 if unknown
+  Int_t  Find( UInt_t hash ) {
+    SlotIndex::Slot* slot = fIndex.Lookup( hash );
+    return slot->idx ? (Int_t)slot->idx-1 : -1;
+  }
+  // Append candidate to the pattern following the last expanded one
+  void   AddChild( UInt_t pattern, Int_t type ) {
+    Child c = { pattern, type };
+    fChildren.push_back( c );
+  }
+  // Close the child list of the pattern following the last expanded one
+  void   EndChildren() { fFirst.push_back( (UInt_t)fChildren.size() ); }
+
+  UInt_t GetNpatterns() const { return (UInt_t)fHash.size(); }
+  UInt_t GetNexpanded() const { return (UInt_t)fFirst.size()-1; }
+  const UShort_t* GetBits( UInt_t i ) const { return &fBits[i*fNplanes]; }
+  UInt_t GetHash( UInt_t i ) const { return fHash[i]; }
+  const Child* GetFirstChild( UInt_t i ) const {
+    assert( i < GetNexpanded() );
+    return fChildren.empty() ? 0 : &fChildren[0] + fFirst[i];
+  }
+  UInt_t GetNchildren( UInt_t i ) const {
+    assert( i < GetNexpanded() );
+    return fFirst[i+1]-fFirst[i];
+  }
+
+private:
+  UInt_t           fNplanes;   // Number of planes per pattern
+  vector<UShort_t> fBits;      // Bits of pattern i at [i*fNplanes]
+  vector<UInt_t>   fHash;      // Hash value of pattern i
+  vector<UInt_t>   fFirst;     // Candidates of pattern i are fChildren
+                               // [fFirst[i],fFirst[i+1]), for expanded i
+  vector<Child>    fChildren;  // Candidate lists
+  SlotIndex        fIndex;     // Pattern index by hash value
+};
+
+//_____________________________________________________________________________
+// Generation of the child candidates of a range of patterns of a ChildCache,
+// for the TaskPool. The results are kept with the task until they are merged
+// into the cache, so the tasks of a level can run concurrently.
+class PatternGenerator::ExpandTask : public Task {
+public:
+  ExpandTask( const PatternGenerator* gen, const ChildCache* cache )
+    : fBegin(0), fEnd(0), fGen(gen), fCache(cache) {}
+
+  void SetRange( UInt_t begin, UInt_t end ) { fBegin = begin; fEnd = end; }
+  virtual void Run( UInt_t );
+
+  // Results
+  UInt_t           fBegin;     // First pattern to expand
+  UInt_t           fEnd;       // One past last pattern to expand
+  vector<UInt_t>   fNchildren; // Number of candidates per pattern
+  vector<UShort_t> fBits;      // Bits of candidates, fNplanes each
+  vector<UInt_t>   fHash;      // Hash value of candidates
+  vector<Int_t>    fType;      // Type of candidates
+
+private:
+  const PatternGenerator* fGen;
+  const ChildCache*       fCache;
+};
+
+//_____________________________________________________________________________
+void PatternGenerator::ExpandTask::Run( UInt_t )
+{
+  // Generate the candidates of the patterns in [fBegin,fEnd)
+
+  UInt_t nplanes = fGen->fNplanes;
+  UInt_t maxdepth = fGen->fNlevels-1;
+  fNchildren.clear();
+  fBits.clear();
+  fHash.clear();
+  fType.clear();
+  Pattern parent( nplanes );
+  for( UInt_t i = fBegin; i < fEnd; ++i ) {
+    memcpy( parent.GetBits(), fCache->GetBits(i), nplanes*sizeof(UShort_t) );
+    UInt_t n = 0;
+    for( ChildIter it( parent ); it; ++it ) {
+      Pattern& child = *it;
+      if( fGen->SlopeTest(child.GetWidth(), maxdepth) and
+	  fGen->LineTest(child) ) {
+	fBits.insert( fBits.end(), child.GetBits(), child.GetBits()+nplanes );
+	fHash.push_back( fGen->Hash(child) );
+	fType.push_back( it.type() );
+	++n;
+      }
+    }
+    fNchildren.push_back( n );
+  }
+}
+
 //_____________________________________________________________________________
 PatternGenerator::PatternGenerator()
-  : fNlevels(0), fNplanes(0), fMaxSlope(0)
+  : fNlevels(0), fNplanes(0), fMaxSlope(0), fNthreads(1),
+    fHashType(kAutoHash), fHashTable(0), fChildCache(0), fRoot(0)
 {
   // Constructor
 
@@ -135,11 +419,16 @@ void PatternGenerator::DeleteTree()
   // Delete the build tree along with its hash table.
   // Internal utility function.
 
-  for( vector<HashNode>::iterator it = fHashTable.begin();
-       it != fHashTable.end(); ++it ) {
-    delete (*it).GetPattern();
+  if( fHashTable ) {
+    vector<Pattern*> pats;
+    fHashTable->GetPatterns( pats );
+    for( vector<Pattern*>::iterator it = pats.begin(); it != pats.end(); ++it )
+      delete *it;
+    delete fHashTable;
+    fHashTable = 0;
   }
-  fHashTable.clear();
+  delete fChildCache; fChildCache = 0;
+  fRoot = 0;
   ClearStatistics();
 }
 
@@ -151,25 +440,27 @@ void PatternGenerator::CalcStatistics()
   // calculated once the tree is complete.
 
   ClearStatistics();
+  if( !fHashTable )
+    return;
 
-  for( vector<HashNode>::const_iterator it = fHashTable.begin();
-       it != fHashTable.end(); ++it ) {
+  vector<Pattern*> pats;
+  fHashTable->GetPatterns( pats );
+  for( vector<Pattern*>::const_iterator it = pats.begin();
+       it != pats.end(); ++it ) {
     // Each hashnode points to a unique pattern by construction of the table
-    Pattern* pat = (*it).GetPattern();
-    if( pat ) {
-      // Count patterns
-      fStats.nPatterns++;
-      // Count child nodes and length of child list
-      Link* ln = pat->fChild;
-      UInt_t list_length = 0;
-      while( ln ) {
-	fStats.nLinks++;
-	list_length++;
-	ln = ln->Next();
-      }
-      if( list_length > fStats.MaxChildListLength )
-	fStats.MaxChildListLength = list_length;
-    } // if pattern
+    Pattern* pat = *it;
+    // Count patterns
+    fStats.nPatterns++;
+    // Count child nodes and length of child list
+    Link* ln = pat->fChild;
+    UInt_t list_length = 0;
+    while( ln ) {
+      fStats.nLinks++;
+      list_length++;
+      ln = ln->Next();
+    }
+    if( list_length > fStats.MaxChildListLength )
+      fStats.MaxChildListLength = list_length;
   } // hashtable elements
 
   // Count the root node's link, too
@@ -179,7 +470,7 @@ void PatternGenerator::CalcStatistics()
     fStats.nPatterns * sizeof(Pattern)
     + fStats.nPatterns * fNplanes * sizeof(UShort_t)
     + fStats.nLinks * sizeof(Link);
-  fStats.nHashBytes = fHashTable.size() * sizeof(HashNode);
+  fStats.nHashBytes = fHashTable->GetNbytes();
 }
 
 //_____________________________________________________________________________
@@ -195,12 +486,12 @@ void PatternGenerator::Print( Option_t* opt, ostream& os ) const
 
   // Dump all stored patterns, using Pattern::print()
   if( *opt == 'D' ) {
-    for( vector<HashNode>::const_iterator it = fHashTable.begin();
-	 it != fHashTable.end(); ++it ) {
-      Pattern* pat = (*it).GetPattern();
-      if( pat )
-	pat->Print( true, os );
-    }
+    vector<Pattern*> pats;
+    if( fHashTable )
+      fHashTable->GetPatterns( pats );
+    for( vector<Pattern*>::const_iterator it = pats.begin();
+	 it != pats.end(); ++it )
+      (*it)->Print( true, os );
     return;
   }
 
@@ -220,7 +511,6 @@ void PatternGenerator::Print( Option_t* opt, ostream& os ) const
      << ", bytes = " << fStats.nBytes
      << endl;
   os << "maxlinklen = " << fStats.MaxChildListLength
-     << ", hashsize = " << fHashTable.size()
      << ", hashbytes = " << fStats.nHashBytes
      << endl;
   os << "time = " << fStats.BuildTime << " s" << endl;
@@ -245,20 +535,46 @@ PatternTree* PatternGenerator::Generate( TreeParam_t parameters )
   fNplanes  = fZ.size();
   fMaxSlope = parameters.maxslope();
 
-  // Benchmark the build
-  clock_t cpu_ticks = clock();
+  // Benchmark the build (wall-clock time)
+  ULong64_t t0 = StageProfile::ReadClock();
+
+  // Set up the pattern index. With many planes and levels, the perfect hash
+  // table becomes too large for the available memory
+  ULong64_t hashsize = 1ULL << (fNlevels-1 + fNplanes-2);
+  bool sparse = ( fHashType == kSparseHash or
+		  (fHashType == kAutoHash and
+		   hashsize * sizeof(HashNode) > kMaxPerfectHashBytes) );
+  try {
+    if( sparse )
+      fHashTable = new HashTable::Sparse;
+    else
+      fHashTable = new HashTable::Perfect( hashsize );
+  }
+  catch( bad_alloc& ) {
+    ::Error( here, "Out of memory allocating hash table of %llu entries",
+	     hashsize );
+    fHashTable = 0;
+    return 0;
+  }
 
   // Start with the trivial all-zero root node at depth 0.
-  Pattern* root = new Pattern( fNplanes );
-  HashNode* hroot = AddHash( root );
+  fRoot = new Pattern( fNplanes );
+  HashNode* hroot = fHashTable->Get( Hash(*fRoot) );
+  hroot->fPattern = fRoot;
+
+  // With several threads, generate the child candidates of all patterns
+  // in parallel first. The recursive build then only has to link them.
+  if( fNthreads > 1 )
+    FillChildCache();
 
   // Generate the tree recursively
   MakeChildNodes( hroot, 1 );
+  delete fChildCache; fChildCache = 0;
 
   // Calculate tree statistics (number of patterns, links etc.)
-  cpu_ticks = clock() - cpu_ticks;
+  ULong64_t ticks = StageProfile::ReadClock() - t0;
   CalcStatistics();
-  fStats.BuildTime = static_cast<Double_t>(cpu_ticks)/CLOCKS_PER_SEC;
+  fStats.BuildTime = 1e-6*StageProfile::ToUs(ticks);
 
   //FIXME: TEST
   // Print tree statistics
@@ -275,13 +591,13 @@ PatternTree* PatternGenerator::Generate( TreeParam_t parameters )
   }
   if( tree ) {
     // Copy all base patterns of the build tree to the PatternTree
-    Link root_link(root,0,0);
+    Link root_link(fRoot,0,0);
     TreeWalk walk(fNlevels);
     PatternTree::CopyPattern copy(tree);
     cout << "Filling tree..." << flush;
     NodeVisitor::ETreeOp ret = walk( &root_link, copy );
     cout << "done" << endl;
-    if( ret == NodeVisitor::kError ) {
+    if( ret == NodeVisitor::kError or tree->MakeIndex() != 0 ) {
       ::Error( here, "Unable to create PatternTree structure" );
       delete tree;
       return 0;
@@ -349,44 +665,13 @@ UInt_t PatternGenerator::Hash( const Pattern& pat ) const
   return hash;
 }
 
-//_____________________________________________________________________________
-PatternGenerator::HashNode* PatternGenerator::AddHash( Pattern* pat )
-{
-  // Add given pattern to the hash table
-
-  // This implements a perfect hash table (no collisions), the fastest way to
-  // do the pattern lookup during build.
-  assert(pat);
-  if( fHashTable.empty() )
-    fHashTable.resize( (1U << (fNlevels-1)) * (1U << (fNplanes-2)) );
-
-  HashNode& h = fHashTable[ Hash(*pat) ];
-  assert(h.fPattern == 0); // Overwriting exisiting entries should never happen
-  h.fPattern = pat;
-
-  return &h;
-}
-
-//_____________________________________________________________________________
-PatternGenerator::HashNode* PatternGenerator::Find( const Pattern& pat )
-{
-  // Search for the given pattern in the current database
-
-  HashNode& h = fHashTable[ Hash(pat) ];
-  if( h.fPattern ) {
-    if( pat == *h.fPattern )
-      return &h;
-    // A hash collision for valid patterns should never happen
-    assert( LineTest(pat) == false );
-  }
-  return 0;
-}
-
 //_____________________________________________________________________________
 inline
-bool PatternGenerator::SlopeTest( const Pattern& pat, UInt_t depth ) const
+bool PatternGenerator::SlopeTest( UInt_t width, UInt_t depth ) const
 {
-  UInt_t width = pat.GetWidth();
+  // Check if a pattern of the given width at the given depth is within
+  // maxslope
+
   return ( width < 2 or
 	   TMath::Abs((double)(width-1) / (double)(1<<depth)) <= fMaxSlope );
 }
@@ -495,6 +780,108 @@ bool PatternGenerator::LineTest( const Pattern& pat ) const
   return true;
 }
 
+//_____________________________________________________________________________
+PatternGenerator::HashNode* PatternGenerator::Find( const Pattern& pat,
+						   UInt_t hash )
+{
+  // Search for the given pattern, whose hash value is "hash", in the
+  // current database
+
+  HashNode* h = fHashTable->Find( hash );
+  if( h and h->fPattern ) {
+    if( pat == *h->fPattern )
+      return h;
+    // A hash collision for valid patterns should never happen
+    assert( LineTest(pat) == false );
+  }
+  return 0;
+}
+
+//_____________________________________________________________________________
+void PatternGenerator::LinkChild( Pattern* parent, const Pattern& child,
+				  UInt_t hash, Int_t type, UInt_t depth,
+				  bool line_ok )
+{
+  // Add the given child pattern, with hash value "hash", to the child list
+  // of the parent at the given depth, if the child is valid there.
+  // If line_ok is set, the child is known to pass LineTest().
+
+  // Pattern already exists?
+  HashNode* node = Find( child, hash );
+  if( node ) {
+    Pattern* pat = node->GetPattern();
+    assert(pat);
+    // If the pattern has only been tested at a higher depth, we need to
+    // redo the slope test since the slope is larger now at lower depth
+    if( depth >= node->fMinDepth or SlopeTest(pat->GetWidth(), depth) ) {
+      // Only add a reference to the existing pattern
+      parent->AddChild( pat, type );
+    }
+  } else if( SlopeTest(child.GetWidth(), depth) and
+	     (line_ok or LineTest(child)) ) {
+    // If the pattern is new, check it for consistency with maxslope and
+    // the straight line condition.
+    Pattern* pat = new Pattern( child );
+    node = fHashTable->Get( hash );
+    assert( node->fPattern == 0 );
+    node->fPattern = pat;
+    parent->AddChild( pat, type );
+  }
+}
+
+//_____________________________________________________________________________
+void PatternGenerator::FillChildCache()
+{
+  // Generate the child candidates (see ChildCache) of all patterns that
+  // the recursive build may expand, using fNthreads threads. These are
+  // the patterns within fNlevels-2 generations of the root through
+  // candidate links. Each level is split into tasks that run concurrently.
+  // Their results are merged in order, so the cache does not depend on the
+  // number of threads.
+
+  delete fChildCache;
+  fChildCache = new ChildCache( fNplanes );
+  fChildCache->Add( fRoot->GetBits(), Hash(*fRoot) );
+
+  TaskPool* pool = TaskPool::Acquire( fNthreads );
+  UInt_t ntasks = 4*pool->GetNthreads();
+  vector<Task*> tasks;
+  for( UInt_t k = 0; k < ntasks; ++k )
+    tasks.push_back( new ExpandTask(this, fChildCache) );
+
+  UInt_t begin = 0, end = 1;
+  for( UInt_t level = 0; level+1 < fNlevels and begin < end; ++level ) {
+    // Split the patterns of this level into tasks of similar size
+    UInt_t n = end-begin;
+    UInt_t nrun = TMath::Min( n, ntasks );
+    for( UInt_t k = 0; k < nrun; ++k )
+      static_cast<ExpandTask*>(tasks[k])->SetRange( begin + k*n/nrun,
+						     begin + (k+1)*n/nrun );
+    pool->Run( tasks, nrun );
+
+    // Merge the candidates into the cache, adding the new patterns as
+    // the next level
+    for( UInt_t k = 0; k < nrun; ++k ) {
+      const ExpandTask* t = static_cast<ExpandTask*>(tasks[k]);
+      UInt_t ic = 0;
+      for( UInt_t i = 0; i < t->fNchildren.size(); ++i ) {
+	for( UInt_t j = 0; j < t->fNchildren[i]; ++j, ++ic ) {
+	  UInt_t idx = fChildCache->Add( &t->fBits[ic*fNplanes],
+					 t->fHash[ic] );
+	  fChildCache->AddChild( idx, t->fType[ic] );
+	}
+	fChildCache->EndChildren();
+      }
+    }
+    begin = end;
+    end = fChildCache->GetNpatterns();
+  }
+
+  for( UInt_t k = 0; k < ntasks; ++k )
+    delete tasks[k];
+  TaskPool::Release( pool );
+}
+
 //_____________________________________________________________________________
 void PatternGenerator::MakeChildNodes( HashNode* pnode, UInt_t depth )
 {
@@ -509,33 +896,29 @@ void PatternGenerator::MakeChildNodes( HashNode* pnode, UInt_t depth )
   if( depth >= fNlevels )
     return;
 
-  // If not already done, generate the child patterns of this parent
+  // If not already done, generate the child patterns of this parent,
+  // from the precomputed candidates if available
   Pattern* parent = pnode->GetPattern();
   assert(parent);
   if( !parent->fChild ) {
-    ChildIter it( *parent );
-    while( it ) {
-      Pattern& child = *it;
-
-      // Pattern already exists?
-      HashNode* node = Find( child );
-      if( node ) {
-	Pattern* pat = node->GetPattern();
-	assert(pat);
-	// If the pattern has only been tested at a higher depth, we need to
-	// redo the slope test since the slope is larger now at lower depth
-	if( depth >= node->fMinDepth or SlopeTest(*pat, depth)) {
-	  // Only add a reference to the existing pattern
-	  parent->AddChild( pat, it.type() );
-	}
-      } else if( SlopeTest(child, depth) and LineTest(child) ) {
-	// If the pattern is new, check it for consistency with maxslope and
-	// the straight line condition.
-	Pattern* pat = new Pattern( child );
-	AddHash( pat );
-	parent->AddChild( pat, it.type() );
+    if( fChildCache ) {
+      Int_t ip = fChildCache->Find( Hash(*parent) );
+      assert( ip >= 0 and (UInt_t)ip < fChildCache->GetNexpanded() );
+      const ChildCache::Child* c = fChildCache->GetFirstChild(ip);
+      UInt_t n = fChildCache->GetNchildren(ip);
+      Pattern child( fNplanes );
+      for( UInt_t i = 0; i < n; ++i, ++c ) {
+	memcpy( child.GetBits(), fChildCache->GetBits(c->pattern),
+		fNplanes*sizeof(UShort_t) );
+	LinkChild( parent, child, fChildCache->GetHash(c->pattern), c->type,
+		   depth, true );
+      }
+    } else {
+      ChildIter it( *parent );
+      while( it ) {
+	LinkChild( parent, *it, Hash(*it), it.type(), depth, false );
+	++it;
       }
-      ++it;
     }
   }
 
@@ -25,50 +25,58 @@ namespace TreeSearch {
     PatternTree* Generate( UInt_t maxdepth, Double_t detector_width,
 			   const char* zpos, Double_t maxslope );
 
+    // Index used for looking up patterns during the build. The perfect hash
+    // is fastest, but its size grows as 2^(maxdepth+nplanes-2). kAutoHash
+    // selects the sparse table when the perfect one would be too large.
+    enum EHashType { kAutoHash, kPerfectHash, kSparseHash };
+
+    // Number of threads to use for the build (default 1). The tree does
+    // not depend on it.
+    void  SetNthreads( UInt_t n )      { fNthreads = (n > 0) ? n : 1; }
+    void  SetHashType( EHashType t )   { fHashType = t; }
+
     struct Statistics_t {
       UInt_t nPatterns, nLinks, nBytes, MaxChildListLength, nHashBytes;
       ULong64_t nAllPatterns;
       Double_t  BuildTime;
     };
 
-    Pattern* GetRoot() const { return fHashTable[0].fPattern; }
+    Pattern* GetRoot() const { return fRoot; }
     const Statistics_t& GetStatistics() const { return fStats; }
 
     void  Print( Option_t* opt="", std::ostream& os = std::cout ) const;
 
   private:
 
-    class HashNode {
-      friend class PatternGenerator;
-    private:
-      Pattern* fPattern;    // Bit pattern treenode
-      UInt_t   fMinDepth;   // Minimum valid depth for this pattern (<=16)
-      void     UsedAtDepth( UInt_t depth ) {
-	if( depth < fMinDepth ) fMinDepth = depth;
-      }
-    public:
-      explicit HashNode( Pattern* pat = 0 )
-        : fPattern(pat), fMinDepth(kMaxUInt) {}
-      Pattern* GetPattern() const { return fPattern; }
-    };
+    class HashNode;    // Build-time index entry of a pattern
+    class HashTable;   // Index of patterns, perfect or sparse
+    class ChildCache;  // Precomputed child candidates of patterns
+    class ExpandTask;  // Candidate generation for part of a level
 
     UInt_t         fNlevels;     // Number of levels of the tree (0-nlevels-1)
     UInt_t         fNplanes;     // Number of hitpattern planes
     Double_t       fMaxSlope;    // Max allowed slope, normalized units (0-1)
     vector<double> fZ;           // z positions of planes, normalized (0-1)
+    UInt_t         fNthreads;    // Number of threads for building
+    EHashType      fHashType;    // Requested type of hash table
 
-    vector<HashNode> fHashTable; // Hashtab for indexing patterns during build
+    HashTable*     fHashTable;   //! Index of patterns during build
+    ChildCache*    fChildCache;  //! Child candidates, if built in parallel
+    Pattern*       fRoot;        //! Root node of the build tree
     Statistics_t   fStats;       // Tree statistics
 
-    HashNode* AddHash( Pattern* pat );
     void      CalcStatistics();
     void      ClearStatistics();
     void      DeleteTree();
-    HashNode* Find( const Pattern& pat );
+    void      FillChildCache();
+    HashNode* Find( const Pattern& pat, UInt_t hash );
+    HashNode* Find( const Pattern& pat ) { return Find( pat, Hash(pat) ); }
     UInt_t    Hash( const Pattern& pat ) const;
+    void      LinkChild( Pattern* parent, const Pattern& child, UInt_t hash,
+			 Int_t type, UInt_t depth, bool line_ok );
     bool      LineTest( const Pattern& pat ) const;
     void      MakeChildNodes( HashNode* parent, UInt_t depth );
-    bool      SlopeTest( const Pattern& pat, UInt_t depth ) const;
+    bool      SlopeTest( UInt_t width, UInt_t depth ) const;
 
     ClassDef(PatternGenerator,0)   // Generator for pattern template database
 
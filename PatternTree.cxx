@@ -6,11 +6,22 @@
 
 #include "PatternTree.h"
 #include "Pattern.h"
-//#include "TreeFile.h"
 #include "TError.h"
+#include "TMath.h"
+#include "TString.h"
+#include "TSystem.h"
 #include <iostream>
+#include <fstream>
 #include <stdexcept>
 #include <sstream>
+#include <cstring>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -18,11 +29,74 @@ ClassImp(TreeSearch::PatternTree)
 
 namespace TreeSearch {
 
+// Tree file format identifier and version. Increment the version whenever
+// the file layout or the pattern generation algorithm changes.
+static const char     kTreeFileMagic[4] = { 'T', 'S', 'P', 'T' };
+static const UShort_t kTreeFileVersion  = 6;
+static const UShort_t kByteOrderMark    = 0x0102;
+
+// Tree layout profile file (see PatternTree::WriteProfile). The header is
+// followed by nnodes match counts (UInt_t), in native byte order.
+static const char     kProfileMagic[4]   = { 'T', 'S', 'P', 'P' };
+static const UShort_t kProfileVersion    = 1;
+struct TreeProfileHeader {
+  char     magic[4];    // kProfileMagic
+  UShort_t version;     // kProfileVersion
+  UShort_t byteorder;   // kByteOrderMark as written
+  UInt_t   nnodes;      // Number of node records of the profiled tree
+  UInt_t   checksum;    // PatternTree::GetChecksum of the profiled tree
+};
+
+// Tree file header. The header is followed by the node words and then the
+// FlatPattern records.
+// Everything is stored in the native byte order of the machine that wrote
+// the file, so that the data can be used directly from a memory mapping.
+// Files with a different byte order are rejected (and the tree is
+// regenerated).
+struct TreeFileHeader {
+  char     magic[4];    // kTreeFileMagic
+  UShort_t version;     // kTreeFileVersion
+  UShort_t byteorder;   // kByteOrderMark as written
+  UShort_t maxdepth;    // Tree parameters (normalized)
+  UShort_t nplanes;
+  UInt_t   npatterns;   // Number of FlatPattern records
+  UInt_t   nnodes;      // Number of nodes
+  UInt_t   patsize;     // Size of a FlatPattern record (in units of UInt_t)
+  UInt_t   srcchecksum; // Checksum of the layout this tree was reordered
+                        // from by a profile (0 = not reordered)
+  UInt_t   spare;       // Unused, keeps the Doubles aligned
+  Double_t width;
+  Double_t maxslope;
+  Double_t zpos[16];    // [nplanes]
+};
+
+//_____________________________________________________________________________
+static inline size_t TreeDataSize( UInt_t nnodes, UInt_t npatterns,
+				   UInt_t patsize )
+{
+  // Size of the pointer-free representation of a tree (in units of UInt_t)
+
+  return nnodes + static_cast<size_t>(npatterns) * patsize;
+}
+
+//_____________________________________________________________________________
+static inline size_t TreeFileSize( UInt_t nnodes, UInt_t npatterns,
+				   UInt_t patsize )
+{
+  // Expected size of a tree file with the given contents
+
+  return sizeof(TreeFileHeader) +
+    TreeDataSize(nnodes, npatterns, patsize) * sizeof(UInt_t);
+}
+
 //_____________________________________________________________________________
 PatternTree::PatternTree( const TreeParam_t& param, UInt_t nPatterns,
 			  UInt_t nLinks )
 try
-  : fParameters(param), fParamOK(false), fNpat(0), fNlnk(0), fNbit(0)
+  : fParameters(param), fParamOK(false), fNpat(0), fNlnk(0), fNbit(0),
+    fNodeData(0), fPatData(0), fPatSize(PatternSize(param.zpos().size())),
+    fNnodes(0), fNflatPat(0), fMapAddr(0), fMapLen(0), fSrcChecksum(0),
+    fNusers(0)
 {
   // Constructor.
 
@@ -46,26 +120,279 @@ PatternTree::~PatternTree()
 {
   // Destructor
 
+  if( fMapAddr )
+    munmap( fMapAddr, fMapLen );
 }
 
 //_____________________________________________________________________________
 PatternTree* PatternTree::Read( const char* filename, const TreeParam_t& tp )
 {
-  // Read tree from file
+  // Read tree from binary file written by Write().
+  //
+  // The file is memory-mapped read-only, and the tree is used directly from
+  // the mapping without copying. Hence, all processes on a machine that read
+  // the same file share a single copy of it in the page cache.
+  //
+  // Returns a new PatternTree object if successful. Returns 0 if the file
+  // does not exist, is corrupt, or was written for tree parameters different
+  // from "tp". In all of these cases, the caller should regenerate the tree.
+
+  static const char* const here = "PatternTree::Read";
+
+  if( !filename || !*filename )
+    return 0;
+
+  TreeParam_t param(tp);
+  if( param.Normalize() != 0 )
+    return 0;
+
+  int fd = open( filename, O_RDONLY );
+  if( fd < 0 )
+    return 0;  // No such file - not an error
+  struct stat st;
+  if( fstat(fd, &st) != 0 or
+      static_cast<size_t>(st.st_size) < sizeof(TreeFileHeader) ) {
+    close(fd);
+    ::Warning( here, "File %s is not a pattern tree file. Ignored.",
+	       filename );
+    return 0;
+  }
+  size_t len = st.st_size;
+  void* addr = mmap( 0, len, PROT_READ, MAP_SHARED, fd, 0 );
+  close(fd);
+  if( addr == MAP_FAILED ) {
+    ::Warning( here, "Cannot map pattern tree file %s. Ignored.", filename );
+    return 0;
+  }
+
+  const TreeFileHeader* hdr = static_cast<const TreeFileHeader*>(addr);
+  PatternTree* tree = 0;
+  if( memcmp(hdr->magic, kTreeFileMagic, sizeof(kTreeFileMagic)) != 0 ) {
+    ::Warning( here, "File %s is not a pattern tree file. Ignored.",
+	       filename );
+    goto fail;
+  }
+  if( hdr->version != kTreeFileVersion or hdr->byteorder != kByteOrderMark ) {
+    // Old format or written on a machine with different byte order
+    ::Warning( here, "Pattern tree file %s has unsupported format. "
+	       "Ignored.", filename );
+    goto fail;
+  }
+  if( hdr->nplanes == 0 or hdr->nplanes > 16 or hdr->nnodes == 0 or
+      hdr->npatterns == 0 or hdr->npatterns > kNodePatternMask+1U or
+      hdr->patsize != PatternSize(hdr->nplanes) or
+      len != TreeFileSize(hdr->nnodes, hdr->npatterns, hdr->patsize) )
+    goto corrupt;
+
+  // The parameters in the file are normalized (the tree was written by
+  // a PatternTree object). If they disagree with the requested ones, the
+  // detector geometry or search depth changed, so this file is stale.
+  if( !param.Matches( TreeParam_t(hdr->maxdepth, hdr->width, hdr->maxslope,
+				  vector<Double_t>(hdr->zpos,
+						   hdr->zpos+hdr->nplanes)) ) )
+    goto fail;
 
   try {
+    tree = new PatternTree( param );
+  }
+  catch ( bad_alloc& ) {
+    tree = 0;
+  }
+  if( !tree or !tree->IsOK() )
+    goto fail;
+
+  tree->fNodeData = reinterpret_cast<const UInt_t*>
+    ( static_cast<const char*>(addr) + sizeof(TreeFileHeader) );
+  tree->fPatData  = tree->fNodeData + hdr->nnodes;
+  tree->fNnodes   = hdr->nnodes;
+  tree->fNflatPat = hdr->npatterns;
+  tree->fMapAddr  = addr;
+  tree->fMapLen   = len;
+  tree->fSrcChecksum = hdr->srcchecksum;
+  assert( tree->fPatSize == hdr->patsize );
+
+  // Guard against corrupt files: all indices must be in range
+  for( UInt_t i = 0; i < tree->fNnodes; ++i ) {
+    if( (tree->GetNode(i) & kNodePatternMask) >= tree->fNflatPat )
+      goto corrupt;
+  }
+  for( UInt_t i = 0; i < tree->fNflatPat; ++i ) {
+    const FlatPattern& pat = tree->GetPattern(i);
+    if( pat.child > tree->fNnodes or
+	pat.nchild > tree->fNnodes - pat.child or pat.bits[0] != 0 )
+      goto corrupt;
+  }
+
+  return tree;
+
+ corrupt:
+  ::Warning( here, "Pattern tree file %s is corrupt. Ignored.", filename );
+ fail:
+  if( tree ) {
+    // Mapping is released by the destructor if it was already taken over
+    if( tree->fMapAddr )
+      addr = 0;
+    delete tree;
+  }
+  if( addr )
+    munmap( addr, len );
+  return 0;
+}
+
+//_____________________________________________________________________________
+static vector<PatternTree*>& TreeRegistry()
+{
+  // The registered trees, in order of registration
+
+  static vector<PatternTree*> registry;
+  return registry;
+}
+
+//_____________________________________________________________________________
+PatternTree* PatternTree::Acquire( const TreeParam_t& param )
+{
+  // Return the registered tree for the given parameters, if any, and count
+  // the caller as one of its users. "param" must be normalized.
+  // Returns 0 if no tree with matching parameters is registered.
+
+  vector<PatternTree*>& registry = TreeRegistry();
+  for( vector<PatternTree*>::iterator it = registry.begin();
+       it != registry.end(); ++it ) {
+    PatternTree* tree = *it;
+    if( tree->fParameters.Matches(param) ) {
+      assert( tree->fNusers > 0 );
+      ++tree->fNusers;
+      return tree;
+    }
+  }
+  return 0;
+}
+
+//_____________________________________________________________________________
+void PatternTree::Register( PatternTree* tree )
+{
+  // Make "tree" available to others via Acquire. The caller becomes its
+  // first user.
+
+  assert( tree and tree->fNusers == 0 and tree->IsOK() );
+  tree->fNusers = 1;
+  TreeRegistry().push_back( tree );
+}
+
+//_____________________________________________________________________________
+void PatternTree::Release( PatternTree* tree )
+{
+  // Release a tree obtained from Acquire or passed to Register. Deletes it
+  // when the last user is gone. Unregistered trees are deleted right away.
 
-    // TODO: implement
+  if( !tree )
+    return;
+  if( tree->fNusers > 0 and --tree->fNusers > 0 )
+    return;
+  vector<PatternTree*>& registry = TreeRegistry();
+  vector<PatternTree*>::iterator it = find( registry.begin(), registry.end(),
+					    tree );
+  if( it != registry.end() )
+    registry.erase( it );
+  delete tree;
+}
+
+//_____________________________________________________________________________
+Int_t PatternTree::MakeIndex()
+{
+  // Build the pointer-free representation of the tree (node words and
+  // FlatPattern records) from the pointer-based pattern and link arrays.
+  // Must be called once after the tree has been filled with CopyPattern.
+  // Returns 0 on success, != 0 on error.
+
+  static const char* const here = "PatternTree::MakeIndex";
+
+  if( fMapAddr or fPatterns.empty() or fLinks.empty() or
+      fNpat != fPatterns.size() or fNlnk != fLinks.size() ) {
+    ::Error( here, "Tree not filled. Call expert." );
+    return -1;
+  }
+  if( fPatterns.size() > kNodePatternMask+1U ) {
+    ::Error( here, "Too many patterns (%u). Call expert.",
+	     (UInt_t)fPatterns.size() );
+    return -3;
+  }
+  UInt_t nnodes = fLinks.size(), npat = fPatterns.size();
+  try {
+    fNodeBuf.assign( TreeDataSize(nnodes, npat, fPatSize), 0 );
   }
   catch ( bad_alloc& ) {
-    ::Error( "PatternTree::Read", "Out of memory trying to read "
-	     "%u patterns, %u links", 0,0 );
-    // TODO: clean up
+    ::Error( here, "Out of memory trying to index %u links",
+	     (UInt_t)fLinks.size() );
+    fNodeBuf.clear();
+    return -2;
   }
+  // CopyPattern guarantees that the child links of each pattern are
+  // contiguous, so the nodes can be stored in the same order as the
+  // corresponding links, and child link indices carry over. Likewise, the
+  // FlatPatterns are stored in the order of the patterns.
+  UInt_t nplanes = GetNplanes();
+  Link* first_lnk = &fLinks.front();
+  Pattern* first_pat = &fPatterns.front();
+  for( vlsz_t i = 0; i < fLinks.size(); ++i ) {
+    Link& ln = fLinks[i];
+    Pattern* pat = ln.GetPattern();
+    assert( pat and pat >= first_pat and pat - first_pat < (Long_t)npat );
+    fNodeBuf[i] =
+      (pat - first_pat) | (static_cast<UInt_t>(ln.Type()) << kNodeTypeShift);
+  }
+  for( vpsz_t i = 0; i < fPatterns.size(); ++i ) {
+    Pattern* pat = &fPatterns[i];
+    assert( pat->GetNbits() == nplanes );
+    FlatPattern* fpat = reinterpret_cast<FlatPattern*>
+      ( &fNodeBuf[nnodes + i*fPatSize] );
+    Int_t nchild = pat->GetNchildren();
+    if( nchild > kMaxUShort ) {
+      ::Error( here, "Too many child nodes (%d). Call expert.", nchild );
+      fNodeBuf.clear();
+      return -3;
+    }
+    fpat->child  = pat->GetChild() ? pat->GetChild() - first_lnk : 0;
+    fpat->nchild = nchild;
+    memcpy( fpat->bits, pat->GetBits(), nplanes*sizeof(UShort_t) );
+  }
+  fNodeData = &fNodeBuf.front();
+  fPatData  = fNodeData + nnodes;
+  fNnodes   = nnodes;
+  fNflatPat = npat;
+
+  // The pointer-based copy is not used for tracking. Release its memory,
+  // which is several times that of the pointer-free representation.
+  vector<Link>().swap( fLinks );
+  vector<Pattern>().swap( fPatterns );
+  vector<UShort_t>().swap( fBits );
 
   return 0;
 }
 
+//_____________________________________________________________________________
+static inline Bool_t AlmostEqual( Double_t a, Double_t b )
+{
+  return ( TMath::Abs(a-b) <= 1e-9 * TMath::Max(1.0, TMath::Abs(a)) );
+}
+
+//_____________________________________________________________________________
+Bool_t TreeParam_t::Matches( const TreeParam_t& rhs ) const
+{
+  // Return true if "rhs" describes the same tree as this. Both parameter
+  // sets are expected to be normalized.
+
+  if( fMaxdepth != rhs.fMaxdepth or fZpos.size() != rhs.fZpos.size() )
+    return false;
+  if( !AlmostEqual(fWidth, rhs.fWidth) or
+      !AlmostEqual(fMaxslope, rhs.fMaxslope) )
+    return false;
+  for( vector<Double_t>::size_type i = 0; i < fZpos.size(); ++i ) {
+    if( !AlmostEqual(fZpos[i], rhs.fZpos[i]) )
+      return false;
+  }
+  return true;
+}
 
 //_____________________________________________________________________________
 Int_t TreeParam_t::Normalize()
@@ -138,18 +465,28 @@ void PatternTree::Print( Option_t* opt, ostream& os )
   // dump n-tuples of all actual patterns, one per line ("L")
   if( *opt == 'P' or *opt == 'L' ) {
     PrintPattern print(os, (*opt == 'L'));
-    walk( GetRoot(), print );
+    walk( *this, print );
     return;
   }
 
   // Count all actual patterns
   if( *opt == 'C' ) {
     CountPattern count;
-    walk( GetRoot(), count );
+    walk( *this, count );
     os << "Total pattern count = " << count.GetCount() << endl;
     return;
   }
 
+  // Size of the pointer-free representation
+  ULong64_t nbytes = sizeof(UInt_t) * ( (ULong64_t)fNnodes +
+					(ULong64_t)fNflatPat*fPatSize );
+  os << "nodes = " << fNnodes
+     << ", patterns = " << fNflatPat
+     << ", bytes = " << nbytes;
+  if( fNnodes > 0 )
+    os << " (" << (Double_t)nbytes/fNnodes << " per node)";
+  os << endl;
+
   // Basic info
 //   os << "tree: nlevels = " << fNlevels
 //      << ", nplanes = " << fNplanes
@@ -175,24 +512,304 @@ void PatternTree::Print( Option_t* opt, ostream& os )
 //_____________________________________________________________________________
 Int_t PatternTree::Write( const char* filename )
 {
-  // Write tree to binary file
+  // Write tree to binary file. The file contains a header with a format
+  // identifier, version number, and the (normalized) tree parameters,
+  // followed by the nodes and FlatPatterns of the tree (see TreeFileHeader
+  // above). Read() uses the header to reject files that
+  // were made for a different geometry.
+  //
+  // The data are first written to a temporary file, which is then renamed,
+  // so that concurrent jobs never see a partially written file.
+
+  static const char* const here = "PatternTree::Write";
+
+  if( !filename || !*filename ) {
+    ::Error( here, "Invalid file name" );
+    return -1;
+  }
+  if( fNnodes == 0 ) {
+    ::Error( here, "Tree is empty or not indexed, nothing to write" );
+    return -1;
+  }
 
-  // TODO: write header
+  TreeFileHeader hdr;
+  memset( &hdr, 0, sizeof(hdr) );
+  const vector<Double_t>& zpos = fParameters.zpos();
+  memcpy( hdr.magic, kTreeFileMagic, sizeof(kTreeFileMagic) );
+  hdr.version   = kTreeFileVersion;
+  hdr.byteorder = kByteOrderMark;
+  hdr.maxdepth  = fParameters.maxdepth();
+  hdr.nplanes   = zpos.size();
+  hdr.npatterns = fNflatPat;
+  hdr.nnodes    = fNnodes;
+  hdr.patsize   = fPatSize;
+  hdr.srcchecksum = fSrcChecksum;
+  hdr.width     = fParameters.width();
+  hdr.maxslope  = fParameters.maxslope();
+  assert( zpos.size() <= sizeof(hdr.zpos)/sizeof(hdr.zpos[0]) );
+  copy( zpos.begin(), zpos.end(), hdr.zpos );
+
+  TString tmpname(filename);
+  tmpname += Form( ".%d.tmp", gSystem->GetPid() );
+  Int_t ret = 0;
+  {
+    ofstream outf( tmpname.Data(), ios::out|ios::binary|ios::trunc );
+    if( !outf ) {
+      ::Error( here, "Error opening treefile %s", tmpname.Data() );
+      return -1;
+    }
+    outf.write( reinterpret_cast<const char*>(&hdr), sizeof(hdr) );
+    outf.write( reinterpret_cast<const char*>(fNodeData),
+		TreeDataSize(fNnodes, fNflatPat, fPatSize) * sizeof(UInt_t) );
+    outf.close();
+    if( outf.fail() )
+      ret = -1;
+  }
+  if( ret == 0 and gSystem->Rename( tmpname.Data(), filename ) != 0 ) {
+    ::Error( here, "Error renaming %s to %s", tmpname.Data(), filename );
+    ret = -1;
+  }
+  if( ret != 0 )
+    gSystem->Unlink( tmpname.Data() );
+
+  return ret;
+}
+
+//_____________________________________________________________________________
+UInt_t PatternTree::GetChecksum() const
+{
+  // Checksum (32-bit FNV-1a) of the nodes and FlatPatterns. Identifies the
+  // layout of the tree, which changes with Reorder.
+
+  UInt_t sum = 2166136261U;
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(fNodeData);
+  const unsigned char* end =
+    p + TreeDataSize(fNnodes, fNflatPat, fPatSize) * sizeof(UInt_t);
+  for( ; p != end; ++p ) {
+    sum ^= *p;
+    sum *= 16777619U;
+  }
+  return sum;
+}
+
+//_____________________________________________________________________________
+namespace {
+  // Order node records by descending match count
+  struct CountGreater {
+    const vector<UInt_t>& fCounts;
+    explicit CountGreater( const vector<UInt_t>& counts ) : fCounts(counts) {}
+    bool operator() ( UInt_t a, UInt_t b ) const
+    { return fCounts[a] > fCounts[b]; }
+  };
+}
+
+//_____________________________________________________________________________
+static void PlaceBlock( const PatternTree& tree, UInt_t first, UInt_t n,
+			const vector<UInt_t>& counts, vector<UInt_t>& order,
+			vector<UInt_t>& blockpos )
+{
+  // Append the nodes of the sibling block [first,first+n) to "order",
+  // most frequently matched first, then the child blocks of these nodes
+  // in the same order, depth-first. Blocks shared by several parents are
+  // placed when first reached, i.e. after their hottest parent.
+  // blockpos[first] is set to the new position of the block.
+
+  assert( blockpos[first] == kMaxUInt );
+  UInt_t start = order.size();
+  blockpos[first] = start;
+  for( UInt_t i = first; i < first+n; ++i )
+    order.push_back(i);
+  stable_sort( order.begin()+start, order.end(), CountGreater(counts) );
+  for( UInt_t k = start; k < start+n; ++k ) {
+    const PatternTree::FlatPattern& pat = tree.GetNodePattern( order[k] );
+    if( pat.nchild > 0 and blockpos[pat.child] == kMaxUInt )
+      PlaceBlock( tree, pat.child, pat.nchild, counts, order, blockpos );
+  }
+}
+
+//_____________________________________________________________________________
+Int_t PatternTree::Reorder( const vector<UInt_t>& counts )
+{
+  // Rearrange the nodes according to the profile "counts" (one match count
+  // per node, as collected by NodeMatchCounter). Within each sibling block,
+  // the nodes are sorted by descending count, so that the search touches
+  // the most frequently matching patterns first, and the blocks of the
+  // hottest subtrees are stored right after their parents. The FlatPatterns
+  // are stored in the order in which the new node array first refers to
+  // them. The tree itself (and hence the search result) is unchanged.
+  //
+  // The tree must not be in use by others. A memory-mapped tree is copied
+  // into memory. Returns 0 on success, != 0 on error.
+
+  static const char* const here = "PatternTree::Reorder";
+
+  if( fNnodes == 0 or counts.size() != fNnodes ) {
+    ::Error( here, "Profile does not match tree (%u nodes vs. %u). "
+	     "Call expert.", (UInt_t)counts.size(), fNnodes );
+    return -1;
+  }
+  assert( fNusers == 0 );
+
+  vector<UInt_t> order, blockpos, patpos, newbuf;
+  try {
+    order.reserve( fNnodes );
+    blockpos.assign( fNnodes, kMaxUInt );
+    patpos.assign( fNflatPat, kMaxUInt );
+    newbuf.resize( TreeDataSize(fNnodes, fNflatPat, fPatSize) );
+  }
+  catch ( bad_alloc& ) {
+    ::Error( here, "Out of memory trying to reorder %u nodes", fNnodes );
+    return -2;
+  }
+  // Node 0 is the root node, which stays in place
+  PlaceBlock( *this, 0, 1, counts, order, blockpos );
+
+  // Every node must be placed exactly once. Otherwise sibling blocks
+  // overlap, which CopyPattern never does.
+  if( order.size() != fNnodes ) {
+    ::Error( here, "Inconsistent tree (%u of %u nodes reachable). "
+	     "Call expert.", (UInt_t)order.size(), fNnodes );
+    return -3;
+  }
+  UInt_t npat = 0;
+  for( UInt_t k = 0; k < fNnodes; ++k ) {
+    UInt_t node = GetNode( order[k] );
+    UInt_t ipat = node & kNodePatternMask;
+    if( patpos[ipat] == kMaxUInt ) {
+      patpos[ipat] = npat;
+      FlatPattern* pat = reinterpret_cast<FlatPattern*>
+	( &newbuf[fNnodes + npat*fPatSize] );
+      memcpy( pat, &GetPattern(ipat), fPatSize*sizeof(UInt_t) );
+      if( pat->nchild > 0 )
+	pat->child = blockpos[pat->child];
+      ++npat;
+    }
+    newbuf[k] = patpos[ipat] | (node & ~kNodePatternMask);
+  }
+  if( npat != fNflatPat ) {
+    ::Error( here, "Inconsistent tree (%u of %u patterns reachable). "
+	     "Call expert.", npat, fNflatPat );
+    return -3;
+  }
+
+  fSrcChecksum = GetChecksum();
+  fNodeBuf.swap( newbuf );
+  fNodeData = &fNodeBuf.front();
+  fPatData  = fNodeData + fNnodes;
+  if( fMapAddr ) {
+    munmap( fMapAddr, fMapLen );
+    fMapAddr = 0;
+    fMapLen = 0;
+  }
+  return 0;
+}
+
+//_____________________________________________________________________________
+Int_t PatternTree::WriteProfile( const char* filename,
+				 const vector<UInt_t>& counts ) const
+{
+  // Write the node match counts "counts" of this tree to a profile file,
+  // for use with ApplyProfile. As in Write, the file is replaced
+  // atomically.
+
+  static const char* const here = "PatternTree::WriteProfile";
+
+  if( !filename || !*filename ) {
+    ::Error( here, "Invalid file name" );
+    return -1;
+  }
+  if( fNnodes == 0 or counts.size() != fNnodes ) {
+    ::Error( here, "Profile does not match tree (%u nodes vs. %u). "
+	     "Call expert.", (UInt_t)counts.size(), fNnodes );
+    return -1;
+  }
+
+  TreeProfileHeader hdr;
+  memset( &hdr, 0, sizeof(hdr) );
+  memcpy( hdr.magic, kProfileMagic, sizeof(kProfileMagic) );
+  hdr.version   = kProfileVersion;
+  hdr.byteorder = kByteOrderMark;
+  hdr.nnodes    = fNnodes;
+  hdr.checksum  = GetChecksum();
+
+  TString tmpname(filename);
+  tmpname += Form( ".%d.tmp", gSystem->GetPid() );
+  Int_t ret = 0;
+  {
+    ofstream outf( tmpname.Data(), ios::out|ios::binary|ios::trunc );
+    if( !outf ) {
+      ::Error( here, "Error opening profile file %s", tmpname.Data() );
+      return -1;
+    }
+    outf.write( reinterpret_cast<const char*>(&hdr), sizeof(hdr) );
+    outf.write( reinterpret_cast<const char*>(&counts.front()),
+		fNnodes * sizeof(UInt_t) );
+    outf.close();
+    if( outf.fail() )
+      ret = -1;
+  }
+  if( ret == 0 and gSystem->Rename( tmpname.Data(), filename ) != 0 ) {
+    ::Error( here, "Error renaming %s to %s", tmpname.Data(), filename );
+    ret = -1;
+  }
+  if( ret != 0 )
+    gSystem->Unlink( tmpname.Data() );
 
-  size_t index_size = sizeof(Int_t);
-  vpsz_t npatt = fPatterns.size();
-  if( npatt < (1U<<8) )
-    index_size = 1;
-  else if( npatt < (1U<<16) )
-    index_size = 2;
-  WritePattern write(filename,index_size);
-  TreeWalk walk( GetNlevels() );
-  Int_t ret = walk( GetRoot(), write );
-  if( ret != NodeVisitor::kError )
-    ret = 0;
   return ret;
 }
 
+//_____________________________________________________________________________
+Int_t PatternTree::ApplyProfile( const char* filename )
+{
+  // Reorder the tree according to the profile in the given file, written
+  // by WriteProfile. Returns 1 if the tree was reordered, 0 if there is
+  // nothing to do (no such file, or the profile was already applied to
+  // this tree, e.g. when read back from its cache file), and < 0 if the
+  // profile cannot be used (stale or corrupt file, or error).
+
+  static const char* const here = "PatternTree::ApplyProfile";
+
+  if( !filename || !*filename )
+    return 0;
+  ifstream inf( filename, ios::in|ios::binary );
+  if( !inf )
+    return 0;  // No such file - not an error
+
+  TreeProfileHeader hdr;
+  inf.read( reinterpret_cast<char*>(&hdr), sizeof(hdr) );
+  if( !inf or
+      memcmp(hdr.magic, kProfileMagic, sizeof(kProfileMagic)) != 0 or
+      hdr.version != kProfileVersion or hdr.byteorder != kByteOrderMark ) {
+    ::Warning( here, "File %s is not a tree profile or has unsupported "
+	       "format. Ignored.", filename );
+    return -1;
+  }
+  if( fSrcChecksum != 0 and hdr.checksum == fSrcChecksum )
+    return 0;  // Already applied
+  if( hdr.nnodes != fNnodes or hdr.checksum != GetChecksum() ) {
+    ::Warning( here, "Tree profile %s was recorded with a different tree. "
+	       "Ignored. Record a new profile.", filename );
+    return -1;
+  }
+  vector<UInt_t> counts;
+  try {
+    counts.resize( fNnodes );
+  }
+  catch ( bad_alloc& ) {
+    ::Error( here, "Out of memory trying to read profile %s", filename );
+    return -2;
+  }
+  inf.read( reinterpret_cast<char*>(&counts.front()),
+	    fNnodes * sizeof(UInt_t) );
+  if( !inf ) {
+    ::Warning( here, "Tree profile %s is corrupt. Ignored.", filename );
+    return -1;
+  }
+  if( Reorder(counts) != 0 )
+    return -2;
+  return 1;
+}
+
 //_____________________________________________________________________________
 void
 PatternTree::CopyPattern::AddChild( Pattern* node, Pattern* child, Int_t type )
@@ -29,6 +29,7 @@ namespace TreeSearch {
     Double_t width()    const { return fWidth; }
     Double_t maxslope() const { return fMaxslope; }
     const vector<Double_t>& zpos() const { return fZpos; }
+    Bool_t   Matches( const TreeParam_t& rhs ) const;
   private:
     UInt_t    fMaxdepth;    // Depth of tree
     Bool_t    fNormalized;  // maxslope and zpos are normalized
@@ -43,20 +44,91 @@ namespace TreeSearch {
 		 UInt_t nPatterns = 0, UInt_t nLinks = 0 );
     virtual ~PatternTree();
     // TODO: copy c'tor, assignment (see below)
-    // TODO: implement Read()
 
     static PatternTree* Read( const char* filename, const TreeParam_t& param );
 
+    // Process-wide registry of trees. Projections with identical tree
+    // parameters share the same (read-only) tree. Acquire returns a
+    // registered tree matching "param", or 0. Register adds a new tree.
+    // Each Acquire and Register must be matched by a Release, which deletes
+    // the tree when it is no longer used. Release also deletes unregistered
+    // trees. Not thread-safe; intended for use during initialization.
+    static PatternTree* Acquire( const TreeParam_t& param );
+    static void         Register( PatternTree* tree );
+    static void         Release( PatternTree* tree );
+    UInt_t GetNusers()  const { return fNusers; }
+
     void   Print( Option_t* opt="", std::ostream& os = std::cout );
     Int_t  Write( const char* filename );
 
     Bool_t IsOK()       const { return fParamOK; }
+    Bool_t IsMapped()   const { return (fMapAddr != 0); }
     UInt_t GetNlevels() const { return fParameters.maxdepth()+1; }
     UInt_t GetNplanes() const { return fParameters.zpos().size(); }
     const TreeParam_t& GetParameters() const { return fParameters; }
     Link*  GetRoot() { return fLinks.empty() ? 0 : &fLinks.front(); }
     Double_t GetWidth() const { return fParameters.width(); }
 
+    // Pointer-free, relocatable representation of the tree, optimized for
+    // fast traversal. The tree is stored as an array of 32-bit node words,
+    // one per link of the pointer-based tree, followed by an array of
+    // fixed-size records of the distinct base patterns. A node word holds
+    // the index of the linked pattern record and, in its upper two bits,
+    // the link type. Each pattern record holds the pattern bits and the
+    // index range of the child nodes, which are contiguous, so all nodes
+    // referring to the same base pattern share both. Node 0 is the root.
+    // The pattern bits are stored unpacked. Every base pattern also occurs
+    // at the deepest level, where the offsets between planes need up to
+    // maxdepth bits, so a short per-plane delta code would rarely apply.
+    // This is also the layout of the tree file, so a tree read from file
+    // can be used directly from a read-only memory mapping, shared by all
+    // processes using the same file.
+    struct FlatPattern {
+      UInt_t   child;     // Index of first child node
+      UShort_t nchild;    // Number of child nodes
+      UShort_t bits[1];   // [nplanes] Pattern bits (actual size varies)
+    };
+    enum { kNodeTypeShift = 30, kNodePatternMask = (1<<kNodeTypeShift)-1 };
+    UInt_t   GetNpatterns() const { return fNflatPat; }
+    UInt_t   GetNnodes()    const { return fNnodes; }
+    UInt_t   GetPatternSize() const { return fPatSize; }
+    // Node i. The nodes are contiguous, so this also gives the address of
+    // the node array for vector loads.
+    const UInt_t& GetNode( UInt_t i ) const {
+      assert( i < fNnodes );
+      return fNodeData[i];
+    }
+    // Link type of a node (bit 0: shift, bit 1: mirrored)
+    static UInt_t NodeType( UInt_t node ) { return node >> kNodeTypeShift; }
+    const FlatPattern& GetPattern( UInt_t ipat ) const {
+      assert( ipat < fNflatPat );
+      return *reinterpret_cast<const FlatPattern*>( fPatData + ipat*fPatSize );
+    }
+    const FlatPattern& GetNodePattern( UInt_t i ) const {
+      return GetPattern( GetNode(i) & kNodePatternMask );
+    }
+    // Size of a FlatPattern record in units of UInt_t
+    static UInt_t PatternSize( UInt_t nplanes ) {
+      return (sizeof(UInt_t) + (nplanes+1)*sizeof(UShort_t) + sizeof(UInt_t)-1)
+	/ sizeof(UInt_t);
+    }
+
+    // Build the pointer-free representation after copying a tree
+    Int_t  MakeIndex();
+
+    // Profile-guided layout. A profile holds the number of times the tree
+    // search descended into each node record (see NodeMatchCounter),
+    // summed over many events. Reorder stores the siblings of each block
+    // most frequently matched first, followed by the child blocks of the
+    // hottest nodes, depth-first. The checksum identifies the layout a
+    // profile was recorded with (and the one a tree was reordered from).
+    UInt_t GetChecksum()       const;
+    UInt_t GetSourceChecksum() const { return fSrcChecksum; }
+    Int_t  Reorder( const vector<UInt_t>& counts );
+    Int_t  WriteProfile( const char* filename,
+			 const vector<UInt_t>& counts ) const;
+    Int_t  ApplyProfile( const char* filename );
+
     // Copy an arbitrary tree into the PatternTree array structures
     class CopyPattern : public NodeVisitor {
     public:
@@ -79,6 +151,7 @@ namespace TreeSearch {
     TreeParam_t      fParameters; // Tree parameters (levels, width, depth)
     Bool_t           fParamOK;    // Flag: Parameters are tested valid
 
+    // Pointer-based copy of the tree, released by MakeIndex
     vector<Pattern>  fPatterns;   // Array of all patterns
     vector<Link>     fLinks;      // Array of all links
     vector<UShort_t> fBits;       // Array of all pattern bits
@@ -89,6 +162,19 @@ namespace TreeSearch {
     vlsz_t           fNlnk;       // Current link count
     vsiz_t           fNbit;       // Current bit count
 
+    // Pointer-free representation. Points either to fNodeBuf (generated
+    // trees) or into the memory-mapped tree file.
+    vector<UInt_t>   fNodeBuf;    // Storage for nodes and FlatPatterns
+    const UInt_t*    fNodeData;   //! Start of node words in use
+    const UInt_t*    fPatData;    //! Start of FlatPattern records in use
+    UInt_t           fPatSize;    // Size of one FlatPattern (units of UInt_t)
+    UInt_t           fNnodes;     // Number of nodes
+    UInt_t           fNflatPat;   // Number of FlatPattern records
+    void*            fMapAddr;    //! Start address of file mapping, if any
+    size_t           fMapLen;     // Length of file mapping
+    UInt_t           fSrcChecksum; // Layout checksum before Reorder (0=none)
+    UInt_t           fNusers;     //! Number of users, if registered
+
     // Disallow copying and assignment for now. The vectors can NOT be copied
     // directly since they contain pointers to the other vectors' elements!
     PatternTree( const PatternTree& orig );
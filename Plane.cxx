@@ -13,6 +13,7 @@
 #include "Tracker.h"
 #include "Projection.h"
 #include "Road.h"
+#include "HitStream.h"
 
 #include "ha_compiledata.h"  // for ANALYZER_VERSION
 #include "THaDetMap.h"
@@ -29,6 +30,8 @@
 #include <iostream>
 #include <string>
 #include <stdexcept>
+#include <cstring>
+#include <algorithm>
 
 using namespace std;
 using namespace Podd;
@@ -116,6 +119,47 @@ Hit* Plane::AddHitImpl( Double_t )
   return 0;
 }
 
+//_____________________________________________________________________________
+Int_t Plane::LoadHits( const HitRecord*, const MCHitRecord*, UInt_t )
+{
+  // Fill the hit array from "n" recorded hits (see HitStream), instead of
+  // decoding raw data. "mchits" holds their MC truth data, if any.
+  // Returns the number of hits, negative if too many, like Decode.
+  // Must be overridden by derived classes. The default does nothing.
+
+  static const char* const here = "LoadHits";
+
+  Error( Here(here), "Loading recorded hits not supported by class %s",
+	 ClassName() );
+  return 0;
+}
+
+//_____________________________________________________________________________
+void Plane::SaveHits( vector<HitRecord>& hits, vector<MCHitRecord>* mchits,
+		      UInt_t index ) const
+{
+  // Append the current hits to "hits" for recording in a hit stream, with
+  // "index" as plane number. If "mchits" is given, append their MC truth
+  // data as well. Derived classes should override this to store their
+  // specific hit data. The default stores position and resolution only.
+
+  assert( index <= kMaxUShort );
+  for( Int_t i = 0; i < GetNhits(); ++i ) {
+    const Hit* hit = static_cast<const Hit*>( fHits->UncheckedAt(i) );
+    HitRecord h;
+    memset( &h, 0, sizeof(h) );
+    h.fPos   = hit->GetPos();
+    h.fRes   = hit->GetResolution();
+    h.fPlane = index;
+    hits.push_back( h );
+    if( mchits ) {
+      MCHitRecord m;
+      memset( &m, 0, sizeof(m) );
+      mchits->push_back( m );
+    }
+  }
+}
+
 //_____________________________________________________________________________
 FitCoord* Plane::AddFitCoord( const FitCoord& coord )
 {
@@ -152,6 +196,8 @@ void Plane::Clear( Option_t* opt )
 
   fHits->Clear(opt);
   fFitCoords->Clear(opt);
+  // The hit position cache is rebuilt from the new event's hits
+  fHitPos.clear();
 #ifdef MCDATA
   if( fMCHitInfo ) {
     assert( fTracker->TestBit(Tracker::kMCdata) );
@@ -470,6 +516,23 @@ Double_t Plane::GetMaxSlope() const
   return fProjection ? fProjection->GetMaxSlope() : kBig;
 }
 
+//_____________________________________________________________________________
+const vector<Double_t>& Plane::GetHitPositions() const
+{
+  // Return the positions of the hits in fHits, in the same order (i.e.
+  // sorted). Position lookups, e.g. FindHitWithLowerBound, search this
+  // contiguous array instead of the hit objects. It is built on first use
+  // after Clear() or after hits have been added, normally once per event.
+
+  Int_t nhits = GetNhits();
+  if( static_cast<Int_t>(fHitPos.size()) != nhits ) {
+    fHitPos.resize( nhits );
+    for( Int_t i = 0; i < nhits; ++i )
+      fHitPos[i] = GetHit(i)->GetPos();
+  }
+  return fHitPos;
+}
+
 //_____________________________________________________________________________
 Int_t Plane::FindHitWithLowerBound( Double_t x ) const
 {
@@ -477,23 +540,8 @@ Int_t Plane::FindHitWithLowerBound( Double_t x ) const
   // similar to std::lower_bound(). This finds the index in fHits of the
   // first hit with position >= x.
 
-  Int_t last = GetNhits();
-  Int_t first = 0;
-
-  if( last > 0 ) {
-    Int_t len = last - first;
-    while( len > 0 ) {
-      Int_t half = len >> 1;
-      Int_t middle = first + half;
-      if( GetHit(middle)->GetPos() < x ) {
-	first = middle + 1;
-	len -= half + 1;
-      } else
-	len = half;
-    }
-    assert( first <= last );
-  }
-  return first;
+  const vector<Double_t>& hitpos = GetHitPositions();
+  return lower_bound( hitpos.begin(), hitpos.end(), x ) - hitpos.begin();
 }
 
 //_____________________________________________________________________________
@@ -502,37 +550,35 @@ Hit* Plane::FindNearestHitAndPos( Double_t x, Double_t& pmin ) const
   // Find the hit with position closest to x. Return pointer to the hit object
   // found and the position of this hit (which may be different from
   // hit->GetPos() in case of hits with left-right ambiguity, for example).
-  //
-  // This is a generic implementation that works for any type of readout
-  // that provides single position information, such readout plane strips.
 
   pmin = kBig;
   if( GetNhits() == 0 )
     return 0;
 
-  const Int_t pos = FindHitWithLowerBound( x );
+  return NearestHitAndPos( x, FindHitWithLowerBound(x), pmin );
+}
+
+//_____________________________________________________________________________
+Hit* Plane::NearestHitAndPos( Double_t x, Int_t pos, Double_t& pmin ) const
+{
+  // Find the hit with position closest to x, given the index 'pos' of the
+  // first hit with position >= x (see FindHitWithLowerBound). There must
+  // be at least one hit.
+  //
+  // This is a generic implementation that works for any type of readout
+  // that provides single position information, such readout plane strips.
+
+  const vector<Double_t>& hitpos = GetHitPositions();
+  Int_t nhits = hitpos.size();
+  assert( nhits > 0 and pos >= 0 and pos <= nhits );
 
   // Decide whether the hit >= x or the first one < x are closest.
-  Hit *hnext = 0, *hprev = 0;
-  if( pos < GetNhits() ) {
-    hnext = GetHit(pos);
-    assert( hnext && hnext->GetPos() >= x );
-  }
-  if( pos > 0 ) {
-    hprev = GetHit(pos-1);
-    assert( hprev && hprev->GetPos() < x );
-    if( hnext ) {
-      assert( hprev->GetPos() < hnext->GetPos() );
-      if( x - hprev->GetPos() < hnext->GetPos() - x )
-	hnext = 0;
-      else
-	hprev = 0;
-    }
-  }
-  assert( (hprev != 0) xor (hnext != 0) );
-  Hit* hmin = ( hnext != 0 ) ? hnext : hprev;
-  pmin = hmin->GetPos();
-  return hmin;
+  if( pos == nhits or
+      (pos > 0 and x - hitpos[pos-1] < hitpos[pos] - x) )
+    --pos;
+  assert( pos == 0 or hitpos[pos-1] < x );
+  pmin = hitpos[pos];
+  return GetHit(pos);
 }
 
 //_____________________________________________________________________________
@@ -543,21 +589,81 @@ void Plane::RecordNearestHits( const THaTrack* track, const Rvec_t& roads )
   // The given roads are the ones generating the given track.
   // This routine is used for efficiency and alignment studies and testing.
 
-  assert( !roads.empty() );
-
   // Search for the hit with position closest to the track crossing
   // position in this plane. The hits are sorted by position, so
   // the search can be made fast.
-  Double_t z     = GetZ();
-  Double_t cosa  = GetProjection()->GetCosAngle();
-  Double_t sina  = GetProjection()->GetSinAngle();
-  Double_t slope = track->GetDTheta()*cosa + track->GetDPhi()*sina;
-  Double_t x     = track->GetDX()*cosa + track->GetDY()*sina + slope*z;
-
-  // Find the hit (hmin) and its coordinate of closest approach (pmin).
   // Details depend on the type of detector technology (wires, strips).
-  Double_t pmin;
-  Hit* hmin = FindNearestHitAndPos( x, pmin );
+  Double_t slope, pmin;
+  Hit* hmin = FindNearestHitAndPos( GetTrackCrossing(track,slope), pmin );
+
+  AddNearestHitCoord( track, roads, hmin, pmin );
+}
+
+//_____________________________________________________________________________
+void Plane::RecordNearestHits( const vector<THaTrack*>& tracks,
+			       const vector<Rvec_t>& roads )
+{
+  // Same as RecordNearestHits for a single track, for all the given
+  // tracks at once. 'roads[i]' are the roads generating 'tracks[i]'.
+  // The track crossing positions are sorted and then looked up in a single
+  // forward pass over the sorted hit positions. The hits are recorded
+  // in the order of the tracks.
+
+  assert( tracks.size() == roads.size() );
+  UInt_t ntracks = tracks.size();
+  if( ntracks == 0 )
+    return;
+
+  // Track crossing positions, with the index of their track, sorted
+  vector< pair<Double_t,UInt_t> > crossings( ntracks );
+  Double_t slope;
+  for( UInt_t i = 0; i < ntracks; ++i )
+    crossings[i] = make_pair( GetTrackCrossing(tracks[i],slope), i );
+  sort( crossings.begin(), crossings.end() );
+
+  vector<Hit*> hmin( ntracks, static_cast<Hit*>(0) );
+  vector<Double_t> pmin( ntracks, kBig );
+  const vector<Double_t>& hitpos = GetHitPositions();
+  if( !hitpos.empty() ) {
+    vector<Double_t>::const_iterator lb = hitpos.begin();
+    for( UInt_t k = 0; k < ntracks; ++k ) {
+      Double_t x = crossings[k].first;
+      UInt_t   i = crossings[k].second;
+      // The crossings are sorted, so the search continues where the
+      // previous one ended
+      lb = lower_bound( lb, hitpos.end(), x );
+      hmin[i] = NearestHitAndPos( x, lb - hitpos.begin(), pmin[i] );
+    }
+  }
+  for( UInt_t i = 0; i < ntracks; ++i )
+    AddNearestHitCoord( tracks[i], roads[i], hmin[i], pmin[i] );
+}
+
+//_____________________________________________________________________________
+Double_t Plane::GetTrackCrossing( const THaTrack* track,
+				  Double_t& slope ) const
+{
+  // Return the position where the given track crosses this plane and the
+  // track's slope, in the coordinate system of the plane's projection
+
+  Double_t cosa = GetProjection()->GetCosAngle();
+  Double_t sina = GetProjection()->GetSinAngle();
+  slope = track->GetDTheta()*cosa + track->GetDPhi()*sina;
+  return track->GetDX()*cosa + track->GetDY()*sina + slope*GetZ();
+}
+
+//_____________________________________________________________________________
+void Plane::AddNearestHitCoord( const THaTrack* track, const Rvec_t& roads,
+				Hit* hmin, Double_t pmin )
+{
+  // Record the hit (hmin) nearest to the given track and its coordinate
+  // of closest approach (pmin) in the plane's fit coordinates array
+
+  assert( !roads.empty() );
+
+  Double_t slope;
+  Double_t x = GetTrackCrossing( track, slope );
+  Double_t z = GetZ();
 
   // The road vector does not necessarily contain all projections, so
   // search for the road of the type of this readout plane, taking advantage
@@ -605,65 +711,67 @@ Hit* Plane::FindNearestMCHitAndPos( Double_t x, Int_t mctrack,
 				    Double_t& pmin ) const
 {
   // Same as FindNearestHitAndPos, but assume the hits are from MC data and
-  // require that the hit returned originates from MC track 'mctrack'
+  // require that the hit returned originates from MC track 'mctrack'.
+  // Distances are computed from the array of hit positions, so only hits
+  // whose MC info needs checking are accessed.
 
   Int_t end = GetNhits();
   pmin = kBig;
   if( end == 0 )
     return 0;
 
+  const vector<Double_t>& hitpos = GetHitPositions();
   Int_t pos = FindHitWithLowerBound( x );
   if( pos == end ) --pos;
   assert( pos >= 0 );
-  Hit* hit = GetHit(pos);
 
   // We need the dynamic_cast here because Hits use multiple inheritance
   // to bring in the MCHitInfo
-  MCHitInfo* mcinfo = dynamic_cast<Podd::MCHitInfo*>(hit);
+  MCHitInfo* mcinfo = dynamic_cast<Podd::MCHitInfo*>(GetHit(pos));
   assert( mcinfo );
+  Int_t found = pos;
   if( mcinfo->fMCTrack != mctrack ) {
     // We have a hit, but it's not from the indicated track. Search nearby hits
-    hit = 0;
+    found = -1;
     Int_t down = pos, up = pos;
-    Hit *hitD = 0, *hitU = 0;
+    Int_t iD = -1, iU = -1;
     while( --down >= 0 or ++up < end ) {
-      if( down >= 0 and not hitD ) {
-	Hit* hcur = GetHit(down);
-	if( hitU and
-	    TMath::Abs(hcur->GetPos()-x) > TMath::Abs(hitU->GetPos()-x) )
+      if( down >= 0 and iD < 0 ) {
+	if( iU >= 0 and
+	    TMath::Abs(hitpos[down]-x) > TMath::Abs(hitpos[iU]-x) )
 	  break;
-	mcinfo = dynamic_cast<Podd::MCHitInfo*>(hcur);
+	mcinfo = dynamic_cast<Podd::MCHitInfo*>(GetHit(down));
 	if( mcinfo->fMCTrack == mctrack ) {
-	  hitD = hcur;
+	  iD = down;
 	}
       }
-      if( up < end and not hitU ) {
-	Hit* hcur = GetHit(up);
-	if( hitD and
-	    TMath::Abs(hcur->GetPos()-x) > TMath::Abs(hitD->GetPos()-x) )
+      if( up < end and iU < 0 ) {
+	if( iD >= 0 and
+	    TMath::Abs(hitpos[up]-x) > TMath::Abs(hitpos[iD]-x) )
 	  break;
-	mcinfo = dynamic_cast<Podd::MCHitInfo*>(hcur);
+	mcinfo = dynamic_cast<Podd::MCHitInfo*>(GetHit(up));
 	if( mcinfo->fMCTrack == mctrack ) {
-	  hitU = hcur;
+	  iU = up;
 	}
       }
-      if( hitD and hitU )
+      if( iD >= 0 and iU >= 0 )
 	break;
     }
-    if( hitD ) {
-      if( hitU ) {
-	hit = (TMath::Abs(hitU->GetPos()-x) > TMath::Abs(hitD->GetPos()-x))
-	  ? hitD : hitU;
+    if( iD >= 0 ) {
+      if( iU >= 0 ) {
+	found = (TMath::Abs(hitpos[iU]-x) > TMath::Abs(hitpos[iD]-x))
+	  ? iD : iU;
       } else
-	hit = hitD;
+	found = iD;
     } else
-      hit = hitU;
+      found = iU;
   }
 
-  if( hit )
-    pmin = hit->GetPos();
+  if( found < 0 )
+    return 0;
 
-  return hit;
+  pmin = hitpos[found];
+  return GetHit(found);
 }
 #endif // MCDATA
 
@@ -33,6 +33,8 @@ namespace TreeSearch {
   class Hit;
   class FitCoord;
   class Road;
+  struct HitRecord;
+  struct MCHitRecord;
   extern const Double_t kBig;
 
   class Plane : public THaSubDetector {
@@ -57,6 +59,11 @@ namespace TreeSearch {
 
     virtual void    Clear( Option_t* opt="" );
     virtual Int_t   Decode( const THaEvData& ) = 0;
+    virtual Int_t   LoadHits( const HitRecord* hits,
+			      const MCHitRecord* mchits, UInt_t n );
+    virtual void    SaveHits( std::vector<HitRecord>& hits,
+			      std::vector<MCHitRecord>* mchits,
+			      UInt_t index ) const;
     virtual void    Print( Option_t* opt="" ) const;
 
     virtual Int_t   Begin( THaRunBase* r=0 );
@@ -68,6 +75,8 @@ namespace TreeSearch {
     virtual Hit*    FindNearestHitAndPos( Double_t x, Double_t& pos ) const;
     virtual void    RecordNearestHits( const THaTrack* track,
 				       const std::vector<TreeSearch::Road*>& roads );
+    virtual void    RecordNearestHits( const std::vector<THaTrack*>& tracks,
+		  const std::vector<std::vector<TreeSearch::Road*> >& roads );
     virtual std::pair<Int_t,Int_t>
                     FindHitsInRange( Double_t xmin, Double_t xmax ) const;
 #ifdef MCDATA
@@ -96,6 +105,7 @@ namespace TreeSearch {
 
     Hit*            GetHit(Int_t i)  const;
     TSeqCollection* GetHits()        const { return fHits; }
+    const std::vector<Double_t>& GetHitPositions() const;
     Int_t           GetNhits()       const { return fHits->GetLast()+1; }
     TSeqCollection* GetCoords()      const { return fFitCoords; }
     Int_t           GetNcoords()     const { return fFitCoords->GetLast()+1; }
@@ -168,6 +178,15 @@ namespace TreeSearch {
     // Event data, hits etc.
     TClonesArray* fHits;        // Cluster data (groups of hits)
     TClonesArray* fFitCoords;   // Cluster coordinates used by good road fits
+    mutable std::vector<Double_t> fHitPos; //! Positions of fHits, same order
+
+    virtual Hit*  NearestHitAndPos( Double_t x, Int_t pos,
+				    Double_t& pmin ) const;
+    Double_t      GetTrackCrossing( const THaTrack* track,
+				    Double_t& slope ) const;
+    void          AddNearestHitCoord( const THaTrack* track,
+				      const std::vector<TreeSearch::Road*>& roads,
+				      Hit* hmin, Double_t pmin );
 
     Int_t ReadDatabaseCommon( const TDatime& date );
 
@@ -20,17 +20,13 @@
 
 #include "TMath.h"
 #include "TString.h"
-#include "TBits.h"
 #include "TError.h"
 
 #include <iostream>
 #include <sstream>
 #include <algorithm>
 #include <utility>
-#ifdef TESTCODE
-#include "TStopwatch.h"
 #include <cstring>
-#endif
 
 using namespace std;
 
@@ -44,6 +40,11 @@ static const UInt_t kMinFitPlanes = 3;
 // Parameter for angle consistency check in SetAngle (rad)
 static const Double_t kAngleTolerance = 1.0 * TMath::DegToRad();
 
+// Names of the profiled stages, in the order of Projection::EStage
+static const char* const kStageNames[] = {
+  "fill", "search", "roads", "fit2d", 0
+};
+
 //_____________________________________________________________________________
 Projection::Projection( EProjType type, const char* name, Double_t angle,
 			THaDetectorBase* parent )
@@ -53,8 +54,12 @@ Projection::Projection( EProjType type, const char* name, Double_t angle,
     fMinFitPlanes(kMinFitPlanes), fMaxMiss(0), fRequire1of2(false),
     fPlaneCombos(0), fAltPlaneCombos(0), fMaxPat(kMaxUInt),
     fFrontMaxBinDist(kMaxUInt), fBackMaxBinDist(kMaxUInt), fHitMaxDist(0),
-    fConfLevel(1e-3), fHitpattern(0), fRoads(0), fNgoodRoads(0),
-    fRoadCorners(0), fTrkStat(kTrackOK)
+    fConfLevel(1e-3), fCoarseDepth(0), fCoarseMaxHits(kMaxUInt),
+    fSplitDepth(0), fTaskPool(0), fNtasks(0),
+    fDoProfile(false), fUseTreeProfile(false), fRecordTreeProfile(false),
+    fHitpattern(0), fRoads(0), fNgoodRoads(0),
+    fRoadCorners(0), fTrkStat(kTrackOK), fNsearch(0), fNaborted(0),
+    fTsearch(0), fTaborted(0)
 {
   // Constructor
 
@@ -66,10 +71,14 @@ Projection::Projection( EProjType type, const char* name, Double_t angle,
   fTitle.Append(" projection");
   fRoads = new TClonesArray("TreeSearch::Road", 3);
   R__ASSERT(fRoads);
+  fProfile.Init( kStageNames );
 
 #ifdef TESTCODE
   size_t nbytes = (char*)&t_track - (char*)&n_hits + sizeof(t_track);
   memset( &n_hits, 0, nbytes );
+#else
+  size_t nbytes = (char*)&t_track - (char*)&t_fill + sizeof(t_track);
+  memset( &t_fill, 0, nbytes );
 #endif
 
   ResetBit( kHaveDummies );
@@ -84,11 +93,14 @@ Projection::~Projection()
     RemoveVariables();
   delete fRoads;
   delete fRoadCorners;
-  delete fPatternTree;
+  PatternTree::Release( fPatternTree );
   delete fHitpattern;
   if( fAltPlaneCombos != fPlaneCombos )
     delete fAltPlaneCombos;
   delete fPlaneCombos;
+  SetTaskPool(0);
+  for( vector<Task*>::size_type i = 0; i < fSearchTasks.size(); ++i )
+    delete fSearchTasks[i];
 }
 
 //_____________________________________________________________________________
@@ -159,8 +171,15 @@ void Projection::Clear( Option_t* )
   if( fHitpattern )
     fHitpattern->Clear();
 
-  fRoads->Delete();
-  DeleteContainer( fPatternsFound );
+  // Keep the Road objects and their buffers for reuse (see Road::Init)
+  fRoads->Clear("C");
+  fPatternsFound.clear();
+  fCoarseFound.clear();
+  fWindow.active = false;
+  fNodeArena.Clear();
+  for( vector<NodeArena*>::size_type i = 0; i < fWorkerArena.size(); ++i )
+    fWorkerArena[i]->Clear();
+  fNtasks = 0;
   fNgoodRoads = 0;
   fTrkStat = kTrackOK;
 
@@ -170,27 +189,78 @@ void Projection::Clear( Option_t* )
 #ifdef TESTCODE
   size_t nbytes = (char*)&t_track - (char*)&n_hits + sizeof(t_track);
   memset( &n_hits, 0, nbytes );
+#else
+  if( fDoProfile ) {
+    size_t nbytes = (char*)&t_track - (char*)&t_fill + sizeof(t_track);
+    memset( &t_fill, 0, nbytes );
+  }
+#endif
+}
+
+//_____________________________________________________________________________
+Int_t Projection::Begin( THaRunBase* )
+{
+  // Reset run statistics
+
+  fNsearch = fNaborted = 0;
+  fTsearch = fTaborted = 0;
+  fProfile.Reset();
+  return 0;
+}
+
+//_____________________________________________________________________________
+Int_t Projection::End( THaRunBase* )
+{
+  // Report how many tree searches were stopped early because of too many
+  // patterns (noisy events)
+
+  static const char* const here = "End";
+
+  if( fNaborted > 0 ) {
+    Info( Here(here), "%u of %u tree searches stopped after finding more "
+	  "than %u patterns", fNaborted, fNsearch, fMaxPat );
+#ifdef TESTCODE
+    UInt_t ncomplete = fNsearch - fNaborted;
+    Info( Here(here), "Mean search time: complete %.1lf us, stopped %.1lf us",
+	  ncomplete > 0 ? fTsearch/ncomplete : 0.0, fTaborted/fNaborted );
 #endif
+  }
+
+  // Save the tree layout profile for the next initialization with
+  // tree_profile set
+  if( fRecordTreeProfile and fPatternTree and !fNodeCounts.empty() ) {
+    TString proffile = GetTreeFileName( ".tprof" );
+    if( fPatternTree->WriteProfile( proffile.Data(), fNodeCounts ) == 0 )
+      Info( Here(here), "Wrote pattern tree profile to %s", proffile.Data() );
+    else
+      Warning( Here(here), "Cannot write pattern tree profile %s",
+	       proffile.Data() );
+  }
+  return 0;
+}
+
+//_____________________________________________________________________________
+void Projection::AddNodeCounts( const Projection& other )
+{
+  // Add the tree profile recorded by "other", which must search the same
+  // tree, e.g. a batch mode replica of this projection
+
+  if( fNodeCounts.empty() or other.fPatternTree != fPatternTree or
+      other.fNodeCounts.size() != fNodeCounts.size() )
+    return;
+  for( vector<UInt_t>::size_type i = 0; i < fNodeCounts.size(); ++i )
+    fNodeCounts[i] += other.fNodeCounts[i];
 }
 
 //_____________________________________________________________________________
 Int_t Projection::Decode( const THaEvData& evdata )
 {
-  // Decode all planes belonging to this projection
+  // Decode all planes belonging to this projection. Returns the total
+  // number of hits, negative if any plane overflowed.
 
   Int_t sum = 0;
-  bool err = false;
-  for( vplsiz_t i = 0; i < GetNallPlanes(); ++i ) {
-    Plane* pl = fAllPlanes[i];
-    Int_t nhits = pl->Decode( evdata );
-    if( nhits < 0 ) {
-      err = true;
-      sum -= nhits;
-    } else
-      sum += nhits;
-  }
-  if( err )
-    return -sum;
+  for( vplsiz_t i = 0; i < GetNallPlanes(); ++i )
+    sum = AddPlaneHits( sum, fAllPlanes[i]->Decode(evdata) );
 
   return sum;
 }
@@ -213,7 +283,8 @@ void Projection::Reset( Option_t* opt )
   fIsInit = kFALSE;
   fMaxSlope = fWidth = 0.0;
   delete fHitpattern; fHitpattern = 0;
-  delete fPatternTree; fPatternTree = 0;
+  PatternTree::Release( fPatternTree ); fPatternTree = 0;
+  fNodeCounts.clear();
   if( fAltPlaneCombos != fPlaneCombos ) {
     delete fAltPlaneCombos; fAltPlaneCombos = 0;
   }
@@ -230,7 +301,8 @@ void Projection::Reset( Option_t* opt )
 }
 
 //_____________________________________________________________________________
-void Projection::MakePlaneCombos( const vpl_t& planes, TBits*& combos ) const
+void Projection::MakePlaneCombos( const vpl_t& planes,
+				  PlaneCombos*& combos ) const
 {
   // Utility function to fill fPlaneCombos and fAltPlaneCombos according
   // to the configuration parameters fMaxMiss, fRequire1of2, and plane
@@ -238,8 +310,8 @@ void Projection::MakePlaneCombos( const vpl_t& planes, TBits*& combos ) const
 
   assert( combos == 0 );
   UInt_t nc = 1U << planes.size();
-  combos = new TBits( nc );
-  combos->SetBitNumber( nc-1 );  // Always allow full occupancy
+  combos = new PlaneCombos( planes.size(), planes.size()-fMaxMiss );
+  combos->Allow( nc-1 );  // Always allow full occupancy
   for( UInt_t i = 1; i <= fMaxMiss; ++i ) {
     UniqueCombo c( planes.size(), i );
     while( c ) {
@@ -273,7 +345,7 @@ void Projection::MakePlaneCombos( const vpl_t& planes, TBits*& combos ) const
       assert( bitval < nc );
       if( k == planes.size() ) {
 	// No objections were raised (in the loop over k) over this bitval
-	combos->SetBitNumber( bitval );
+	combos->Allow( bitval );
       }
       ++c; // next UniqueCombo
     }
@@ -412,24 +484,58 @@ THaAnalysisObject::EStatus Projection::Init( const TDatime& date )
     if( tp.Normalize() != 0 )
       return fStatus = kInitError;
 
-    // Attempt to read the pattern database from file
+    // If another projection, possibly of another Tracker, already uses a
+    // tree with the same parameters, share it. Otherwise, attempt to read
+    // the pattern database from its cache file.
     assert( fPatternTree == 0 );
-    //TODO: Make the file name
-    // const char* filename = "test.tree";
-    // fPatternTree = PatternTree::Read( filename, tp );
-
-    // If the tree cannot not be read (or the parameters mismatch), then
-    // create it from scratch (takes a few seconds)
-    // if( !fPatternTree ) {
-      PatternGenerator pg;
-      fPatternTree = pg.Generate( tp );
+    fPatternTree = PatternTree::Acquire( tp );
+    if( fPatternTree ) {
+      if( fDebug > 0 )
+	Info( Here(here), "Sharing pattern tree for projection \"%s\" "
+	      "(%u users)", GetName(), fPatternTree->GetNusers() );
+    } else {
+      TString filename = GetTreeFileName( ".tree" );
+      fPatternTree = PatternTree::Read( filename.Data(), tp );
       if( fPatternTree ) {
-	// Write the freshly-generated tree to file
-	// FIXME: hmmm... we don't necesarily have write permission to DB_DIR
-	//       fPatternTree->Write( filename );
-      } else
-	return fStatus = kInitError;
-    // }
+	if( fDebug > 0 )
+	  Info( Here(here), "Read pattern tree for projection \"%s\" from %s",
+		GetName(), filename.Data() );
+      } else {
+	// If the tree cannot not be read (or the parameters mismatch), then
+	// create it from scratch (takes a few seconds). Use as many threads
+	// as the parent Tracker will use for tracking.
+	PatternGenerator pg;
+	Tracker* tracker = dynamic_cast<Tracker*>(fDetector);
+	if( tracker )
+	  pg.SetNthreads( tracker->GetMaxThreads() );
+	fPatternTree = pg.Generate( tp );
+	if( !fPatternTree )
+	  return fStatus = kInitError;
+	// Write the freshly-generated tree to file. Failure to do so only
+	// means that the tree will have to be regenerated next time.
+	if( fPatternTree->Write( filename.Data() ) != 0 )
+	  Warning( Here(here), "Cannot write pattern tree cache file %s. "
+		   "Continuing without cache.", filename.Data() );
+      }
+      // Optimize the memory layout of the tree with the profile recorded
+      // in an earlier run, if any. Cache the result, so that the tree
+      // does not have to be reordered again.
+      if( fUseTreeProfile ) {
+	TString proffile = GetTreeFileName( ".tprof" );
+	Int_t ret = fPatternTree->ApplyProfile( proffile.Data() );
+	if( ret < -1 )
+	  return fStatus = kInitError;
+	if( ret > 0 ) {
+	  if( fDebug > 0 )
+	    Info( Here(here), "Reordered pattern tree for projection \"%s\" "
+		  "with profile %s", GetName(), proffile.Data() );
+	  if( fPatternTree->Write( filename.Data() ) != 0 )
+	    Warning( Here(here), "Cannot write pattern tree cache file %s. "
+		     "Continuing without cache.", filename.Data() );
+	}
+      }
+      PatternTree::Register( fPatternTree );
+    }
 
     // Set up a hitpattern object with the parameters of this projection
     assert( fHitpattern == 0 );
@@ -439,6 +545,9 @@ THaAnalysisObject::EStatus Projection::Init( const TDatime& date )
       return fStatus = kInitError;
     assert( GetNallPlanes() == fHitpattern->GetNplanes() );
 
+    if( fRecordTreeProfile )
+      fNodeCounts.assign( fPatternTree->GetNnodes(), 0 );
+
     // Determine maximum search distance (in bins) for combining patterns,
     // separately for front and back planes since they can have different
     // parameters. This is the max distance of bins that can belong to the
@@ -547,7 +656,11 @@ Int_t Projection::ReadDatabase( const TDatime& date )
   fMaxMiss = 0;
   fMaxPat  = kMaxUInt;
   fConfLevel = 1e-3;
-  Int_t req1of2 = 0, disable_chi2 = 0;
+  fSplitDepth = 0;
+  fCoarseDepth = 0;
+  fCoarseMaxHits = kMaxUInt;
+  Int_t req1of2 = 0, disable_chi2 = 0, flat_roads = 1, profile = 0;
+  Int_t tree_profile = 0, record_tree_profile = 0;
 
   Int_t gbl = Plane::GetDBSearchLevel(fPrefix);
   const DBRequest request[] = {
@@ -560,6 +673,13 @@ Int_t Projection::ReadDatabase( const TDatime& date )
     { "req1of2",         &req1of2,       kInt,    0, 1, gbl },
     { "maxpat",          &fMaxPat,       kUInt,   0, 1, gbl },
     { "disable_chi2",    &disable_chi2,  kInt,    0, 1, gbl },
+    { "split_depth",     &fSplitDepth,   kUInt,   0, 1, gbl },
+    { "coarse_depth",    &fCoarseDepth,  kUInt,   0, 1, gbl },
+    { "coarse_maxhits",  &fCoarseMaxHits,kUInt,   0, 1, gbl },
+    { "flat_roads",      &flat_roads,    kInt,    0, 1, gbl },
+    { "profile",         &profile,       kInt,    0, 1, gbl },
+    { "tree_profile",    &tree_profile,  kInt,    0, 1, gbl },
+    { "record_tree_profile", &record_tree_profile, kInt, 0, 1, gbl },
     { 0 }
   };
 
@@ -575,6 +695,17 @@ Int_t Projection::ReadDatabase( const TDatime& date )
   }
   ++fNlevels; // The number of levels is maxdepth+1
 
+  if( fSplitDepth >= fNlevels ) {
+    Warning( Here(here), "split_depth = %u exceeds search_depth = %u. "
+	     "Parallel tree search disabled.", fSplitDepth, fNlevels-1 );
+    fSplitDepth = 0;
+  }
+  if( fCoarseDepth+1 >= fNlevels ) {
+    Warning( Here(here), "coarse_depth = %u must be less than search_depth "
+	     "= %u. Coarse search disabled.", fCoarseDepth, fNlevels-1 );
+    fCoarseDepth = 0;
+  }
+
   // If angle read, set it, otherwise keep default from call to constructor
   if( angle < kBig )
     SetAngle( angle*TMath::DegToRad() );
@@ -595,6 +726,10 @@ Int_t Projection::ReadDatabase( const TDatime& date )
   }
 
   fRequire1of2 = (req1of2 != 0);
+  SetBit( kFlatRoads, flat_roads != 0 );
+  fDoProfile = (profile != 0);
+  fUseTreeProfile = (tree_profile != 0);
+  fRecordTreeProfile = (record_tree_profile != 0);
 
   // If any planes defined, update their coordinate offset
   // based on our possibly new angle
@@ -631,10 +766,7 @@ Int_t Projection::DefineVariables( EMode mode )
     { "n_roads", "Number of roads before filter",   "n_roads"    },
     { "n_dupl",  "Number of duplicate roads removed",   "n_dupl"    },
     { "n_badfits", "Number of roads found",   "n_badfits"    },
-    { "t_treesearch", "Time in TreeSearch (us)", "t_treesearch" },
-    { "t_roads", "Time in MakeRoads (us)", "t_roads" },
-    { "t_fit", "Time for fitting Roads (us)", "t_fit" },
-    { "t_track", "Total time in Track (us)", "t_track" },
+    { "n_alloc", "Number of road buffer allocations", "n_alloc" },
     { "rd.nfits", "Number of acceptable fits in road",
                                          "fRoads.TreeSearch::Road.fNfits" },
 #endif
@@ -680,6 +812,19 @@ Int_t Projection::DefineVariables( EMode mode )
     DefineVarsFromList( vars_evtdisp, mode );
   }
 
+  // Stage times, if measured
+  if( DoTiming() ) {
+    RVarDef vars_timing[] = {
+      { "t_fill",       "Time filling hitpattern (us)", "t_fill" },
+      { "t_treesearch", "Time in TreeSearch (us)",      "t_treesearch" },
+      { "t_roads",      "Time in MakeRoads (us)",       "t_roads" },
+      { "t_fit",        "Time for fitting Roads (us)",  "t_fit" },
+      { "t_track",      "Total time in Track (us)",     "t_track" },
+      { 0 }
+    };
+    DefineVarsFromList( vars_timing, mode );
+  }
+
 #ifdef MCDATA
   // Additional variables for MC input data
   if( TestBit(kMCdata) ) {
@@ -707,8 +852,13 @@ Int_t Projection::FillHitpattern()
   // Fill this projection's hitpattern from hits in the planes.
   // Returns the total number of hits processed.
 
+  ULong64_t t0 = DoTiming() ? StageProfile::ReadClock() : 0;
+
   Int_t ntot = fHitpattern->Fill( fAllPlanes );
 
+  if( DoTiming() )
+    t_fill = fProfile.Lap( kFillStage, t0 );
+
 #ifdef TESTCODE
   n_hits = ntot;
   n_bins = fHitpattern->GetBinsSet();
@@ -739,14 +889,33 @@ Int_t Projection::Track()
   assert( fPatternsFound.empty() );
   assert( GetTrackingStatus() == kTrackOK );
 
+  Bool_t timing = DoTiming();
+  ULong64_t t0 = 0, tstart = 0;
+  if( timing )
+    t0 = tstart = StageProfile::ReadClock();
+
+  // The search stops as soon as more than fMaxPat patterns are found
+  NodeVisitor::ETreeOp walkret;
+  if( fTaskPool and fSplitDepth > 0 and !fRecordTreeProfile )
+    // Search the subtrees below fSplitDepth in parallel
+    walkret = SplitSearch();
+  else {
+    ComparePattern compare( fHitpattern, fAltPlaneCombos, &fPatternsFound,
+			    &fNodeArena, fDummyPlanePattern, fMaxPat,
+			    fCoarseDepth, fCoarseMaxHits, &fWindow );
+    fTreeWalk.SetNlevels( fNlevels );
+    if( fRecordTreeProfile ) {
+      // Count the matches of each tree node for the layout profile
+      NodeMatchCounter counter( compare, fNodeCounts );
+      walkret = fTreeWalk( *fPatternTree, counter );
+    } else
+      walkret = fTreeWalk( *fPatternTree,
+			   static_cast<SiblingVisitor&>(compare) );
 #ifdef TESTCODE
-  TStopwatch timer, timer_tot;
+    n_test = compare.GetNtest();
 #endif
-
-  ComparePattern compare( fHitpattern, fAltPlaneCombos, &fPatternsFound,
-			  fDummyPlanePattern );
-  TreeWalk walk( fNlevels );
-  walk( fPatternTree->GetRoot(), compare );
+  }
+  ++fNsearch;
 
 #ifdef VERBOSE
   if( fDebug > 0 ) {
@@ -758,13 +927,15 @@ Int_t Projection::Track()
     cout << endl;
   }
 #endif
+  if( timing )
+    t_treesearch = fProfile.Lap( kSearchStage, t0 );
 #ifdef TESTCODE
-  t_treesearch = 1e6*timer.RealTime();
+  if( walkret == NodeVisitor::kAbort )
+    fTaborted += t_treesearch;
+  else
+    fTsearch += t_treesearch;
 
-  n_test = compare.GetNtest();
   n_pat  = fPatternsFound.size();
-
-  timer.Start();
 #endif
 
   if( fPatternsFound.empty() ) {
@@ -773,7 +944,8 @@ Int_t Projection::Track()
   }
   // Die if too many patterns - noisy event
   if( (UInt_t)fPatternsFound.size() > fMaxPat ) {
-    // TODO: keep statistics
+    assert( walkret == NodeVisitor::kAbort );
+    ++fNaborted;
     fTrkStat = kTooManyPatterns;
     ret = -1;
     goto quit;
@@ -796,36 +968,33 @@ Int_t Projection::Track()
   n_roads = GetNroads();
 #endif
 
-  // This seems to cost much more than it gains
-//   // Check for indentical roads or roads that include each other.
-//   // Any roads that are eliminated are marked as void.
-//   if( GetNroads() > 1 ) {
-//     if( RemoveDuplicateRoads() )
-//       // Remove empty slots caused by removed duplicate roads
-//       fRoads->Compress();
-//   }
-
-// #ifdef VERBOSE
-//   if( fDebug > 0 ) {
-//     if( !fRoads->IsEmpty() ) {
-//       Int_t nroads = GetNroads();
-//       cout << nroads << " road";
-//       if( nroads>1 ) cout << "s";
-//       cout << " after filter" << endl;
-//     }
-//   }
-// #endif
-#ifdef TESTCODE
-  t_roads = 1e6*timer.RealTime();
-  timer.Start();
+  // Check for indentical roads or roads that include each other.
+  // Any roads that are eliminated are removed, along with their event
+  // display corners.
+  if( GetNroads() > 1 )
+    RemoveDuplicateRoads();
+
+#ifdef VERBOSE
+  if( fDebug > 0 ) {
+    if( !fRoads->IsEmpty() ) {
+      Int_t nroads = GetNroads();
+      cout << nroads << " road";
+      if( nroads>1 ) cout << "s";
+      cout << " after filter" << endl;
+    }
+  }
 #endif
+  if( timing )
+    t_roads = fProfile.Lap( kRoadsStage, t0 );
 
   // Fit hit positions in the roads to straight lines
   FitRoads();
 
+  if( timing )
+    t_fit = fProfile.Lap( kFitStage, t0 );
 #ifdef TESTCODE
-  t_fit   = 1e6*timer.RealTime();
-  t_track = 1e6*timer_tot.RealTime();
+  for( UInt_t i = 0; i < GetNroads(); ++i )
+    n_alloc += GetRoad(i)->GetNalloc();
 #endif
 
 #ifdef VERBOSE
@@ -842,6 +1011,8 @@ Int_t Projection::Track()
   ret = GetNgoodRoads();
 
  quit:
+  if( timing )
+    t_track = StageProfile::ToUs( StageProfile::ReadClock() - tstart );
 #ifdef VERBOSE
   if( fDebug > 0 ) {
     cout << "------------ end of projection  " << GetName()
@@ -854,13 +1025,15 @@ Int_t Projection::Track()
 
 //_____________________________________________________________________________
 #ifdef VERBOSE
-static void PrintNode( const Node_t& node )
+static void PrintNode( const Node_t& node, const Hitpattern* hitpat )
 {
   const HitSet& hs = node.second;
-  cout << " npl/nhits= " << hs.nplanes << "/" << hs.hits.size()
+  Hset_t hits;
+  HitSet::CollectHits( hitpat, node.first, hits );
+  cout << " npl/nhits= " << hs.nplanes << "/" << hs.nhits
        << "  hitpos= ";
   UInt_t ipl = 0;
-  for( Hset_t::iterator ihit = hs.hits.begin(); ihit != hs.hits.end(); ) {
+  for( Hset_t::iterator ihit = hits.begin(); ihit != hits.end(); ) {
     Hit* hit = *ihit;
     assert( hit->GetPlaneNum() != kMaxUInt );
     while( ipl < hit->GetPlaneNum() ) { cout << "--/"; ++ipl; }
@@ -870,10 +1043,10 @@ static void PrintNode( const Node_t& node )
       if( seq )  cout << " ";
       cout << hit->GetPos();
       seq = true;
-    } while( ++ihit != hs.hits.end() and (hit = *ihit) and hit->GetPlaneNum() == ipl );
-    if( ipl != node.first.link->GetPattern()->GetNbits()-1 ) {
+    } while( ++ihit != hits.end() and (hit = *ihit) and hit->GetPlaneNum() == ipl );
+    if( ipl != node.first.GetNbits()-1 ) {
       cout << "/";
-      if( ihit == hs.hits.end() )
+      if( ihit == hits.end() )
 	cout << "--";
     }
     ++ipl;
@@ -882,11 +1055,14 @@ static void PrintNode( const Node_t& node )
   node.first.Print();
 }
 
-inline
-static void PrintNodeP( const Node_t* node )
-{
-  PrintNode( *node );
-}
+struct PrintNodeP {
+  explicit PrintNodeP( const Hitpattern* hitpat ) : fHitpattern(hitpat) {}
+  void operator() ( const Node_t* node ) const
+  {
+    PrintNode( *node, fHitpattern );
+  }
+  const Hitpattern* fHitpattern;
+};
 
 #endif
 
@@ -901,8 +1077,8 @@ struct MostPlanes : public binary_function< Node_t*, Node_t*, bool >
     // decreasing number of hits, then ascending bin numbers
     if( a->second.nplanes != b->second.nplanes )
       return (a->second.nplanes > b->second.nplanes);
-    return (a->second.hits.size() != b->second.hits.size()) ?
-      (a->second.hits.size() > b->second.hits.size()) :
+    return (a->second.nhits != b->second.nhits) ?
+      (a->second.nhits > b->second.nhits) :
       (a->first < b->first);
   }
 };
@@ -916,6 +1092,19 @@ struct BinIsLess : public binary_function< Node_t*, Node_t*, bool >
   }
 };
 
+class IdxBinIsLess : public binary_function< UInt_t, UInt_t, bool >
+{
+public:
+  // Same as BinIsLess, for indices into a vector of patterns
+  explicit IdxBinIsLess( const vector<Node_t*>& nodes ) : fNodes(nodes) {}
+  bool operator() ( UInt_t a, UInt_t b ) const
+  {
+    return ( fNodes[a]->first < fNodes[b]->first );
+  }
+private:
+  const vector<Node_t*>& fNodes;
+};
+
 //_____________________________________________________________________________
 Int_t Projection::MakeRoads()
 {
@@ -923,10 +1112,72 @@ Int_t Projection::MakeRoads()
   //
   // This is the primary de-cloning algorithm. It finds clusters of patterns
   // that share active wires (hits).
+  //
+  // Two implementations of the road search are available, selected with
+  // the kFlatRoads bit (database key "flat_roads"). Both give identical
+  // roads.
+  //
+  // Coarse patterns from dense regions of the tree (see "coarse_depth")
+  // are not clustered. Each of them becomes a road by itself, after the
+  // roads of the regular patterns.
+
+  if( fCoarseDepth > 0 ) {
+    // Move the coarse patterns out of the way of the road building
+    NodeVec_t::iterator jt = fPatternsFound.begin();
+    for( NodeVec_t::iterator it = fPatternsFound.begin();
+	 it != fPatternsFound.end(); ++it ) {
+      if( (*it)->first.depth+1 < fNlevels )
+	fCoarseFound.push_back( *it );
+      else
+	*jt++ = *it;
+    }
+    fPatternsFound.erase( jt, fPatternsFound.end() );
+  }
 
   // Sort patterns according to MostPlanes (see above)
   sort( ALL(fPatternsFound), MostPlanes() );
 
+#ifdef TESTCODE
+  Int_t size = fRoads->GetSize();
+#endif
+  if( TestBit(kFlatRoads) )
+    MakeRoadsFlat();
+  else
+    MakeRoadsSet();
+  for( NodeVec_t::iterator it = fCoarseFound.begin();
+       it != fCoarseFound.end(); ++it ) {
+    Road* rd = static_cast<Road*>( fRoads->ConstructedAt(GetNroads()) );
+    rd->Init( **it, this );
+    FinishRoad( rd );
+  }
+#ifdef TESTCODE
+  // Count reallocations of the array of Roads
+  if( fRoads->GetSize() != size )
+    ++n_alloc;
+#endif
+
+#ifdef VERBOSE
+  if( fDebug > 2 ) {
+    cout << "Generated roads: " << endl;
+    for( UInt_t i = 0; i < GetNroads(); ++i ) {
+      const Road* rd = GetRoad(i);
+      const Road::NodeList_t& ndlst = rd->GetPatterns();
+      for_each( ALL(ndlst), PrintNodeP(fHitpattern) );
+      cout << "--------------------------------------------" << endl;
+    }
+  }
+#endif
+
+  return 0;
+}
+
+//_____________________________________________________________________________
+void Projection::MakeRoadsSet()
+{
+  // Build roads from fPatternsFound, which must be sorted by MostPlanes.
+  // Uses a std::set of the patterns, ordered by bin number, as the lookup
+  // index for similar patterns.
+
   // Copy patterns to secondary key sorted by bin number only. This key
   // greatly improves lookup speed of potential similar patterns
   typedef set<const Node_t*,BinIsLess> BinOrdNodes_t;
@@ -942,11 +1193,11 @@ Int_t Projection::MakeRoads()
 #ifdef VERBOSE
   if( fDebug > 2 ) {
     cout << fPatternsFound.size() << " patterns found:" << endl;
-    for_each( ALL(fPatternsFound), PrintNodeP );
+    for_each( ALL(fPatternsFound), PrintNodeP(fHitpattern) );
 
     cout << "--------------------------------------------" << endl;
     cout << nodelookup.size() << " patterns sorted by bin:" << endl;
-    for_each( ALL(nodelookup), PrintNodeP );
+    for_each( ALL(nodelookup), PrintNodeP(fHitpattern) );
   }
 #endif
 
@@ -960,7 +1211,8 @@ Int_t Projection::MakeRoads()
       continue;
 
     // Start a new road with next unused pattern
-    Road* rd = new( (*fRoads)[GetNroads()] ) Road(nd1,this);
+    Road* rd = static_cast<Road*>( fRoads->ConstructedAt(GetNroads()) );
+    rd->Init( nd1, this );
 
     // Try to add similar patterns to this road (cf. HitSet::IsSimilarTo)
     // Since only patterns with front bin numbers near the start pattern
@@ -1014,36 +1266,147 @@ Int_t Projection::MakeRoads()
     }
     nodelookup.erase( jt );
 
-    // Update the "used" flags of the road's component patterns
-    rd->Finish();
-
-    // If event display enabled, export the road's corner coordinates
-    if( TestBit(kEventDisplay) ) {
-      assert( fRoads->GetLast() == fRoadCorners->GetLast()+1 );
-      new( (*fRoadCorners)[fRoads->GetLast()] ) Road::Corners(rd);
-    }
+    FinishRoad( rd );
   }
   assert( nodelookup.empty() );
+}
+
+//_____________________________________________________________________________
+void Projection::MakeRoadsFlat()
+{
+  // Build roads from fPatternsFound, which must be sorted by MostPlanes.
+  // Same algorithm as MakeRoadsSet, but the lookup index is a flat array of
+  // the patterns sorted by bin number. Patterns that have been added to a
+  // road are unlinked from a doubly-linked list threaded through the array,
+  // so that the scans skip them in constant time. This avoids the node
+  // allocations and pointer chasing of the std::set.
+
+  UInt_t npat = (UInt_t)fPatternsFound.size();
+  if( npat == 0 )
+    return;
+
+  // Patterns sorted by bin number, given as indices into fPatternsFound,
+  // and the inverse mapping
+  vector<UInt_t>& bybin = fRoadIdx.bybin;
+  vector<UInt_t>& rank  = fRoadIdx.rank;
+  vector<UInt_t>& prev  = fRoadIdx.prev;
+  vector<UInt_t>& next  = fRoadIdx.next;
+  bybin.resize(npat);
+  rank.resize(npat);
+  prev.resize(npat);
+  next.resize(npat);
+  for( UInt_t i = 0; i < npat; ++i )
+    bybin[i] = i;
+  IdxBinIsLess byidx( fPatternsFound );
+  sort( ALL(bybin), byidx );
+  for( UInt_t k = 0; k < npat; ++k ) {
+    rank[bybin[k]] = k;
+    prev[k] = k-1;       // kMaxUInt for the first element
+    next[k] = k+1;       // npat for the last element
+    // Bin numbers must be unique (cf. assert in MakeRoadsSet)
+    assert( k == 0 or byidx(bybin[k-1],bybin[k]) );
+  }
+  const UInt_t kNone = kMaxUInt, kEnd = npat;
 
 #ifdef VERBOSE
   if( fDebug > 2 ) {
-    cout << "Generated roads: " << endl;
-    for( UInt_t i = 0; i < GetNroads(); ++i ) {
-      const Road* rd = GetRoad(i);
-      const Road::NodeList_t& ndlst = rd->GetPatterns();
-      for_each( ALL(ndlst), PrintNodeP );
-      cout << "--------------------------------------------" << endl;
-    }
+    cout << npat << " patterns found:" << endl;
+    for_each( ALL(fPatternsFound), PrintNodeP(fHitpattern) );
+
+    cout << "--------------------------------------------" << endl;
+    cout << npat << " patterns sorted by bin:" << endl;
+    for( UInt_t k = 0; k < npat; ++k )
+      PrintNode( *fPatternsFound[bybin[k]], fHitpattern );
   }
 #endif
 
-  return 0;
+  // Build roads starting with patterns that have the most active planes.
+  // These tend to yield the best track candidates.
+  for( UInt_t i = 0; i < npat; ++i ) {
+    const Node_t& nd1 = *fPatternsFound[i];
+
+    if( nd1.second.used )
+      continue;
+
+    // Start a new road with next unused pattern
+    Road* rd = static_cast<Road*>( fRoads->ConstructedAt(GetNroads()) );
+    rd->Init( nd1, this );
+
+    // Position of the start pattern in the bin index
+    UInt_t jt = rank[i];
+    assert( prev[jt] == kNone or next[prev[jt]] == jt ); // must be linked
+
+    // Test patterns in direction of decreasing front bin number index,
+    // beginning with the road start pattern, until they are too far away.
+    // Rescan if the road has grown, as in MakeRoadsSet.
+    while( rd->HasGrown() ) {
+      rd->ClearGrow();
+      UInt_t jr = prev[jt];
+      while( jr != kNone ) {
+	const Node_t& nd = *fPatternsFound[bybin[jr]];
+	if( !rd->IsInFrontRange(nd) )
+	  break;
+	UInt_t jp = prev[jr];
+	if( rd->Add(nd) )
+	  UnlinkRoadIdx( jr, kEnd );
+	jr = jp;
+      }
+    }
+    // Repeat in the forward direction along the index
+    rd->SetGrow();
+    while( rd->HasGrown() ) {
+      rd->ClearGrow();
+      UInt_t jf = next[jt];
+      while( jf != kEnd ) {
+	const Node_t& nd = *fPatternsFound[bybin[jf]];
+	if( !rd->IsInFrontRange(nd) )
+	  break;
+	UInt_t jn = next[jf];
+	if( rd->Add(nd) )
+	  UnlinkRoadIdx( jf, kEnd );
+	jf = jn;
+      }
+    }
+    UnlinkRoadIdx( jt, kEnd );
+
+    FinishRoad( rd );
+  }
+}
+
+//_____________________________________________________________________________
+void Projection::UnlinkRoadIdx( UInt_t k, UInt_t end )
+{
+  // Remove element k from the linked list of the flat road index
+
+  vector<UInt_t>& prev = fRoadIdx.prev;
+  vector<UInt_t>& next = fRoadIdx.next;
+  if( prev[k] != kMaxUInt )
+    next[prev[k]] = next[k];
+  if( next[k] != end )
+    prev[next[k]] = prev[k];
+}
+
+//_____________________________________________________________________________
+void Projection::FinishRoad( Road* rd )
+{
+  // Complete a new road built by MakeRoads
+
+  // Update the "used" flags of the road's component patterns
+  rd->Finish();
+
+  // If event display enabled, export the road's corner coordinates
+  if( TestBit(kEventDisplay) ) {
+    assert( fRoads->GetLast() == fRoadCorners->GetLast()+1 );
+    new( (*fRoadCorners)[fRoads->GetLast()] ) Road::Corners(rd);
+  }
 }
 
 //_____________________________________________________________________________
 Bool_t Projection::RemoveDuplicateRoads()
 {
-  // Check for identical roads or roads that include each other
+  // Check for identical roads or roads that include each other and remove
+  // the duplicates from fRoads and fRoadCorners. Returns true if any were
+  // removed.
 
   // This runs in ~O(N^2) time, but if N>1, it is typically only 2-5.
   bool changed = false, restart = true;
@@ -1058,13 +1421,13 @@ Bool_t Projection::RemoveDuplicateRoads()
 	if( !rd2 )
 	  continue;
 	if( rd->Include(rd2) ) {
-	  fRoads->RemoveAt(j);
+	  RemoveRoad(j);
 	  changed = restart = true;
 #ifdef TESTCODE
 	  ++n_dupl;
 #endif
 	} else if( rd2->Include(rd) ) {
-	  fRoads->RemoveAt(i);
+	  RemoveRoad(i);
 	  changed = restart = true;
 #ifdef TESTCODE
 	  ++n_dupl;
@@ -1077,9 +1440,28 @@ Bool_t Projection::RemoveDuplicateRoads()
 	break;
     }
   }
+  // Remove the empty slots left by removed roads
+  if( changed ) {
+    fRoads->Compress();
+    if( TestBit(kEventDisplay) )
+      fRoadCorners->Compress();
+  }
   return changed;
 }
 
+//_____________________________________________________________________________
+void Projection::RemoveRoad( UInt_t i )
+{
+  // Remove road i from fRoads, along with its event display corners, which
+  // are kept in step with fRoads. Leaves an empty slot in both arrays.
+
+  fRoads->RemoveAt(i);
+  if( TestBit(kEventDisplay) ) {
+    assert( fRoadCorners and i < (UInt_t)fRoadCorners->GetSize() );
+    fRoadCorners->RemoveAt(i);
+  }
+}
+
 //_____________________________________________________________________________
 Bool_t Projection::FitRoads()
 {
@@ -1131,6 +1513,20 @@ const char* Projection::GetDBFileName() const
   return fDetector ? fDetector->GetDBFileName() : GetPrefix();
 }
 
+//_____________________________________________________________________________
+TString Projection::GetTreeFileName( const char* ext ) const
+{
+  // Name of the pattern tree cache file (ext = ".tree") or of a related
+  // file. It is derived from the detector's database file name and the
+  // projection name. The file is kept in the current directory since we
+  // don't necessarily have write permission to DB_DIR.
+
+  TString filename( GetDBFileName() );
+  filename.Append( GetName() );
+  filename.Append( ext );
+  return filename;
+}
+
 //_____________________________________________________________________________
 Double_t Projection::GetZsize() const
 {
@@ -1235,6 +1631,217 @@ EProjType Projection::NameToType( const char* name )
 }
 
 
+//_____________________________________________________________________________
+// Search of the subtrees of one group of sibling nodes, run as a task in
+// one of the worker threads. The matches found are kept in the task and
+// are stored in the worker's NodeArena.
+class Projection::SubtreeSearch : public Task {
+public:
+  explicit SubtreeSearch( Projection* proj )
+    : fProj(proj), fFirst(0), fN(0), fDepth(0), fShift(0), fMirrored(false),
+      fRet(NodeVisitor::kRecurse), fNtest(0) { assert(fProj); }
+
+  void Set( UInt_t first, UInt_t n, UInt_t depth, UInt_t shift,
+	    Bool_t mirrored )
+  {
+    fFirst = first; fN = n; fDepth = depth; fShift = shift;
+    fMirrored = mirrored;
+  }
+  virtual void Run( UInt_t worker )
+  {
+    assert( worker < fProj->fWorkerArena.size() );
+    fMatches.clear();
+    ComparePattern compare( fProj->fHitpattern, fProj->fAltPlaneCombos,
+			    &fMatches, fProj->fWorkerArena[worker],
+			    fProj->fDummyPlanePattern, fProj->fMaxPat,
+			    fProj->fCoarseDepth, fProj->fCoarseMaxHits,
+			    &fProj->fWindow );
+    fWalk.SetNlevels( fProj->fNlevels );
+    fRet = fWalk( *fProj->fPatternTree, compare, fFirst, fN, fDepth, fShift,
+		 fMirrored );
+#ifdef TESTCODE
+    fNtest = compare.GetNtest();
+#endif
+  }
+
+  Projection*  fProj;       // Projection to search
+  UInt_t       fFirst;      // Start group: first node record
+  UInt_t       fN;          // Start group: number of nodes
+  UInt_t       fDepth;      // Start group: tree depth
+  UInt_t       fShift;      // Shift of the group's parent node
+  Bool_t       fMirrored;   // Mirroring state of the group's parent node
+  NodeVec_t    fMatches;    // Patterns found in the subtrees
+  NodeVisitor::ETreeOp fRet; // Result of the tree walk
+  TreeWalk     fWalk;       // Tree iterator, keeps its buffers between runs
+  UInt_t       fNtest;      // Number of pattern comparisons (TESTCODE)
+};
+
+//_____________________________________________________________________________
+// SiblingVisitor for the top part of a split tree search. Compares the
+// nodes above the split depth with the hitpattern as usual, but turns
+// each group of siblings at the split depth into a SubtreeSearch task.
+class Projection::CollectSubtrees : public SiblingVisitor {
+public:
+  CollectSubtrees( Projection* proj, ComparePattern& compare )
+    : fProj(proj), fCompare(compare) { assert(fProj); }
+
+  virtual NodeVisitor::ETreeOp
+  operator() ( const PatternTree& tree, UInt_t first, UInt_t n,
+	       UInt_t depth, UInt_t shift, Bool_t mirrored,
+	       NodeVisitor::ETreeOp* ops )
+  {
+    if( depth < fProj->fSplitDepth )
+      return fCompare( tree, first, n, depth, shift, mirrored, ops );
+
+    vector<Task*>& tasks = fProj->fSearchTasks;
+    if( fProj->fNtasks == tasks.size() )
+      tasks.push_back( new SubtreeSearch(fProj) );
+    static_cast<SubtreeSearch*>( tasks[fProj->fNtasks++] )
+      ->Set( first, n, depth, shift, mirrored );
+    for( UInt_t k = 0; k < n; ++k )
+      ops[k] = NodeVisitor::kSkipChildNodes;
+    return NodeVisitor::kRecurse;
+  }
+
+private:
+  Projection*     fProj;     // Projection being searched
+  ComparePattern& fCompare;  // Comparison for the nodes above split depth
+};
+
+//_____________________________________________________________________________
+NodeVisitor::ETreeOp Projection::SplitSearch()
+{
+  // Tree search in parallel. The search is split at depth fSplitDepth into
+  // independent searches of the subtrees of each group of matching sibling
+  // nodes, which are executed by the worker threads of fTaskPool.
+  //
+  // The matches of the subtrees are concatenated in tree order, so
+  // fPatternsFound ends up identical to that of the single-threaded search.
+  // Each subtree search stops once it has found more than fMaxPat patterns;
+  // the others carry on, but their results are discarded once the total
+  // exceeds fMaxPat.
+
+  assert( fTaskPool and fSplitDepth > 0 and fSplitDepth < fNlevels );
+  assert( fNtasks == 0 and fPatternsFound.empty() );
+
+  // Search the top part of the tree and collect the subtrees
+  ComparePattern compare( fHitpattern, fAltPlaneCombos, &fPatternsFound,
+			  &fNodeArena, fDummyPlanePattern, fMaxPat,
+			  fCoarseDepth, fCoarseMaxHits, &fWindow );
+  CollectSubtrees collect( this, compare );
+  fTreeWalk.SetNlevels( fNlevels );
+  NodeVisitor::ETreeOp ret = fTreeWalk( *fPatternTree, collect );
+#ifdef TESTCODE
+  n_test = compare.GetNtest();
+#endif
+  if( ret == NodeVisitor::kError )
+    return ret;
+  // Matches are only found at the bottom of the tree, except for coarse
+  // patterns above the split depth. These end up ahead of the subtree
+  // matches, which does not change the roads built from them.
+  assert( fPatternsFound.empty() or
+	  (fCoarseDepth > 0 and fCoarseDepth < fSplitDepth) );
+
+  fTaskPool->Run( fSearchTasks, fNtasks );
+
+  // Merge the results in the order the subtrees were collected
+  size_t npat = 0;
+  for( UInt_t k = 0; k < fNtasks; ++k ) {
+    SubtreeSearch* task = static_cast<SubtreeSearch*>( fSearchTasks[k] );
+    npat += task->fMatches.size();
+#ifdef TESTCODE
+    n_test += task->fNtest;
+#endif
+    if( task->fRet == NodeVisitor::kError )
+      ret = NodeVisitor::kError;
+  }
+  if( ret == NodeVisitor::kError )
+    return ret;
+  fPatternsFound.reserve( min(npat, (size_t)fMaxPat+1) );
+  for( UInt_t k = 0; k < fNtasks; ++k ) {
+    const NodeVec_t& matches =
+      static_cast<SubtreeSearch*>( fSearchTasks[k] )->fMatches;
+    fPatternsFound.insert( fPatternsFound.end(), ALL(matches) );
+    if( fPatternsFound.size() > fMaxPat ) {
+      ret = NodeVisitor::kAbort;
+      break;
+    }
+  }
+  return ret;
+}
+
+//_____________________________________________________________________________
+void Projection::SetSearchWindow( Double_t front_lo, Double_t front_hi,
+				  Double_t back_lo, Double_t back_hi )
+{
+  // Restrict the tracking of the current event to tracks crossing the
+  // front plane between front_lo and front_hi and the back plane between
+  // back_lo and back_hi (m, along the projection axis). Subtrees of the
+  // pattern tree outside of this region are not searched, and only
+  // roads inside it are passed on to 3D matching.
+  // The window is reset by Clear().
+
+  assert( fHitpattern );
+  if( front_lo > front_hi ) swap( front_lo, front_hi );
+  if( back_lo > back_hi )   swap( back_lo, back_hi );
+
+  // Bin numbers as computed by Hitpattern::SetPosition
+  Double_t scale = fHitpattern->GetBinScale();
+  Double_t off   = fHitpattern->GetOffset();
+  Int_t maxbin   = fHitpattern->GetNbins()-1;
+  Int_t bins[4] = { TMath::FloorNint( scale*(front_lo+off) ),
+		    TMath::FloorNint( scale*(front_hi+off) ),
+		    TMath::FloorNint( scale*(back_lo+off) ),
+		    TMath::FloorNint( scale*(back_hi+off) ) };
+  for( Int_t i = 0; i < 4; ++i )
+    bins[i] = TMath::Max( 0, TMath::Min( bins[i], maxbin ) );
+
+  fWindow.front    = fFirstPlaneNum;
+  fWindow.back     = fLastPlaneNum;
+  fWindow.front_lo = bins[0];
+  fWindow.front_hi = bins[1];
+  fWindow.back_lo  = bins[2];
+  fWindow.back_hi  = bins[3];
+  fWindow.active   = true;
+}
+
+//_____________________________________________________________________________
+Bool_t Projection::IsInSearchWindow( const Road* rd ) const
+{
+  // Test if the fitted road crosses the front and back planes inside the
+  // search window. Always true if no window is set.
+
+  assert( rd );
+  if( !fWindow.active )
+    return true;
+
+  Double_t scale = fHitpattern->GetBinScale();
+  Double_t off   = fHitpattern->GetOffset();
+  Int_t fb = TMath::FloorNint( scale*(rd->GetPos(GetPlaneZ(0))+off) );
+  Int_t bb = TMath::FloorNint( scale*(rd->GetPos(GetPlaneZ(GetNplanes()-1))
+				      +off) );
+  return ( fb >= (Int_t)fWindow.front_lo and fb <= (Int_t)fWindow.front_hi
+	   and
+	   bb >= (Int_t)fWindow.back_lo  and bb <= (Int_t)fWindow.back_hi );
+}
+
+//_____________________________________________________________________________
+void Projection::SetTaskPool( TaskPool* pool )
+{
+  // Use the worker threads of "pool" for the tree search, provided that
+  // split_depth is set. pool = 0 disables parallel search.
+
+  for( vector<NodeArena*>::size_type i = 0; i < fWorkerArena.size(); ++i )
+    delete fWorkerArena[i];
+  fWorkerArena.clear();
+  fTaskPool = pool;
+  if( fTaskPool ) {
+    fWorkerArena.reserve( fTaskPool->GetNthreads() );
+    for( UInt_t i = 0; i < fTaskPool->GetNthreads(); ++i )
+      fWorkerArena.push_back( new NodeArena );
+  }
+}
+
 //_____________________________________________________________________________
 NodeVisitor::ETreeOp
 Projection::ComparePattern::operator() ( const NodeDescriptor& nd )
@@ -1242,46 +1849,184 @@ Projection::ComparePattern::operator() ( const NodeDescriptor& nd )
   // Test if the pattern from the database that is given by NodeDescriptor
   // is present in the current event's hitpattern
 
+  // Patterns outside of the region of interest cannot give a track
+  if( fWindow and !fWindow->Overlaps(nd, fHitpattern->GetNlevels()) )
+    return kSkipChildNodes;
+
 #ifdef TESTCODE
   ++fNtest;
 #endif
   // Compute the match pattern and see if it is allowed
   pair<UInt_t,UInt_t> match = fHitpattern->ContainsPattern(nd);
-  if( fPlaneCombos->TestBitNumber(match.first)  ) {
-    if( nd.depth < fHitpattern->GetNlevels()-1 )
-      return kRecurse;
+  if( fPlaneCombos->IsAllowed(match.first) ) {
+    if( nd.depth < fHitpattern->GetNlevels()-1 ) {
+      if( nd.depth != fCoarseDepth or fCoarseDepth == 0 or !IsDense(nd) )
+	return kRecurse;
+
+      // Too many hits below this node to resolve them efficiently
+      AddCoarseMatch( nd );
+      return ( fMatches->size() > fMaxMatches ) ? kAbort : kSkipChildNodes;
+    }
 
     // Found a match at the bottom of the pattern tree
-    Node_t* node = new Node_t;
-    node->first = nd;
-
-    // Collect all hits associated with the pattern's bins and save them
-    // in the node's HitSet.
-    for( UInt_t i = 0; i < fHitpattern->GetNplanes(); ++i ) {
-      const vector<Hit*>& hits = fHitpattern->GetHits( i, nd[i] );
-      assert( hits.empty() or
-	      (hits.front()->GetAltPlaneNum() == i and
-	       not hits.front()->GetPlane()->IsDummy()) );
-      node->second.hits.insert( ALL(hits) );
+    AddMatch( nd, match.first, match.second );
+    if( fMatches->size() > fMaxMatches )
+      return kAbort;
+  }
+  return kSkipChildNodes;
+}
+
+//_____________________________________________________________________________
+NodeVisitor::ETreeOp
+Projection::ComparePattern::operator() ( const PatternTree& tree,
+					 UInt_t first, UInt_t n, UInt_t depth,
+					 UInt_t shift, Bool_t mirrored,
+					 ETreeOp* ops )
+{
+  // Test if the n sibling patterns starting at node record "first" of the
+  // given tree are present in the current event's hitpattern. Same logic
+  // as the single-node version above.
+
+#ifdef TESTCODE
+  fNtest += n;
+#endif
+  if( fMatchval.size() < n )
+    fMatchval.resize(n);
+  fHitpattern->ContainsPatterns( tree, first, n, depth, shift, mirrored,
+				 &fMatchval[0] );
+  bool bottom = ( depth+1 >= fHitpattern->GetNlevels() );
+  bool coarse = ( fCoarseDepth > 0 and depth == fCoarseDepth and !bottom );
+  for( UInt_t k = 0; k < n; ++k ) {
+    UInt_t matchval = fMatchval[k];
+    if( !fPlaneCombos->IsAllowed(matchval) ) {
+      ops[k] = kSkipChildNodes;
+      continue;
     }
-    assert( (HitSet::GetAltMatchValue(node->second.hits) xor
-	     fDummyPlanePattern) == match.first );
-    if( fDummyPlanePattern != 0 ) {
-      // If dummy planes are present, then match is given with respect to
-      // Plane::GetAltPlaneNum(). We need to calculate the node's
-      // plane_pattern and nplanes explicitly wrt to Plane::GetPlaneNum()
-      node->second.CalculatePlanePattern();
-    } else {
-      // No dummy planes, less work :)
-      node->second.plane_pattern = match.first;
-      node->second.nplanes = match.second;
+    if( !bottom and !coarse and !fWindow ) {
+      ops[k] = kRecurse;
+      continue;
+    }
+    UInt_t node = tree.GetNode(first+k);
+    UInt_t type = PatternTree::NodeType(node);
+    Bool_t mir = mirrored xor ((type & 2) != 0);
+    UInt_t sh = (shift << 1) + (mir xor (type & 1));
+    const UShort_t* pbits =
+      tree.GetPattern( node & PatternTree::kNodePatternMask ).bits;
+    NodeDescriptor nd( pbits, tree.GetNplanes(), sh, mir, depth );
+    if( fWindow and !fWindow->Overlaps(nd, fHitpattern->GetNlevels()) ) {
+      ops[k] = kSkipChildNodes;
+      continue;
+    }
+    if( !bottom and !coarse ) {
+      ops[k] = kRecurse;
+      continue;
     }
+    if( coarse ) {
+      if( !IsDense(nd) ) {
+	ops[k] = kRecurse;
+	continue;
+      }
+      AddCoarseMatch( nd );
+    } else
+      AddMatch( nd, matchval, NumberOfSetBits(matchval) );
+    ops[k] = kSkipChildNodes;
+    if( fMatches->size() > fMaxMatches )
+      return kAbort;
+  }
+  return kRecurse;
+}
 
-    // Add the pointer to the new node to the vector of results
-    //TODO: stop if max num of patterns reached
-    fMatches->push_back( node );
+//_____________________________________________________________________________
+void Projection::ComparePattern::AddMatch( const NodeDescriptor& nd,
+					   UInt_t matchval, UInt_t nmatch )
+{
+  // Record a match of pattern nd at the bottom of the pattern tree.
+  // matchval and nmatch are the plane occupancy bitpattern and the number
+  // of planes with hits, as returned by Hitpattern::ContainsPattern.
+
+  Node_t* node = fArena->New();
+  node->first = nd;
+
+  // Record only the pattern's plane occupancy and number of hits. The hits
+  // themselves stay in the hitpattern bins until a road needs them
+  // (see HitSet::CollectHits). Most matches are merged into a road, so
+  // this saves building a hit set for each of them.
+  HitSet& hs = node->second;
+  Hit::PosIsLess comp;
+#ifndef NDEBUG
+  UInt_t altpattern = 0;
+#endif
+  for( UInt_t i = 0; i < fHitpattern->GetNplanes(); ++i ) {
+    HitRange hits = fHitpattern->GetHits( i, nd[i] );
+    if( hits.empty() )
+      continue;
+    assert( hits.front()->GetAltPlaneNum() == i and
+	    not hits.front()->GetPlane()->IsDummy() );
+#ifndef NDEBUG
+    altpattern |= 1U << i;
+#endif
+    hs.plane_pattern |= 1U << hits.front()->GetPlaneNum();
+    // Count distinct hits, as a set of these hits would hold them
+    for( HitRange::const_iterator it = hits.begin(); it != hits.end(); ++it ) {
+      HitRange::const_iterator jt = hits.begin();
+      while( jt != it and (comp(*jt,*it) or comp(*it,*jt)) )
+	++jt;
+      if( jt == it )
+	++hs.nhits;
+    }
   }
-  return kSkipChildNodes;
+  assert( (altpattern xor fDummyPlanePattern) == matchval );
+  if( fDummyPlanePattern != 0 ) {
+    // If dummy planes are present, then match is given with respect to
+    // Plane::GetAltPlaneNum(). The plane_pattern computed above is with
+    // respect to Plane::GetPlaneNum().
+    hs.nplanes = NumberOfSetBits( hs.plane_pattern );
+  } else {
+    // No dummy planes, less work :)
+    assert( hs.plane_pattern == matchval );
+    hs.nplanes = nmatch;
+  }
+
+  // Add the pointer to the new node to the vector of results
+  fMatches->push_back( node );
+}
+
+//_____________________________________________________________________________
+Bool_t Projection::ComparePattern::IsDense( const NodeDescriptor& nd ) const
+{
+  // Test if there are more than fCoarseMaxHits hits in the bins below
+  // pattern nd, summed over all planes. Hits spanning several bins are
+  // counted once per bin, which is good enough for an occupancy cut.
+
+  UInt_t nhits = 0;
+  for( UInt_t i = 0; i < fHitpattern->GetNplanes(); ++i ) {
+    nhits += fHitpattern->GetHits( i, nd ).size();
+    if( nhits > fCoarseMaxHits )
+      return true;
+  }
+  return false;
+}
+
+//_____________________________________________________________________________
+void Projection::ComparePattern::AddCoarseMatch( const NodeDescriptor& nd )
+{
+  // Record a match of pattern nd above the bottom of the pattern tree that
+  // is not refined further because its region holds too many hits. The
+  // "super-pattern" covers all highest-resolution bins below nd and
+  // becomes a road of its own (see Projection::MakeRoads).
+
+  Node_t* node = fArena->New();
+  node->first = nd;
+
+  fCoarseHits.clear();
+  HitSet::CollectHits( fHitpattern, nd, fCoarseHits );
+  HitSet& hs = node->second;
+  hs.plane_pattern = HitSet::GetMatchValue( fCoarseHits );
+  hs.nplanes = NumberOfSetBits( hs.plane_pattern );
+  hs.nhits = fCoarseHits.size();
+  assert( hs.nplanes > 0 );
+
+  fMatches->push_back( node );
 }
 
 //_____________________________________________________________________________
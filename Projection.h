@@ -10,6 +10,8 @@
 #include "THaAnalysisObject.h"
 #include "TreeWalk.h"   // for NodeVisitor
 #include "Hit.h"        // for Node_t
+#include "TaskPool.h"   // for Task
+#include "StageProfile.h"
 #include "Types.h"
 #include "TMath.h"
 #include "TClonesArray.h"
@@ -23,7 +25,6 @@
 #include <string>
 
 class THaDetectorBase;
-class TBits;
 
 namespace TreeSearch {
 
@@ -31,6 +32,7 @@ namespace TreeSearch {
   class PatternTree;
   class Road;
   class Plane;
+  class PlaneCombos;
 
   typedef std::vector<Plane*>            vpl_t;
   typedef std::vector<Plane*>::size_type vplsiz_t;
@@ -47,17 +49,23 @@ namespace TreeSearch {
         fFirstPlaneNum(0), fLastPlaneNum(0), fMinFitPlanes(0), fMaxMiss(0),
         fRequire1of2(false), fPlaneCombos(0), fAltPlaneCombos(0),
         fMaxPat(kMaxUInt), fFrontMaxBinDist(0), fBackMaxBinDist(0),
-        fHitMaxDist(0), fConfLevel(0.001), fHitpattern(0),
-        fRoads(0), fNgoodRoads(0), fRoadCorners(0), fTrkStat(kTrackOK),
+        fHitMaxDist(0), fConfLevel(0.001), fCoarseDepth(0),
+        fCoarseMaxHits(kMaxUInt), fSplitDepth(0), fTaskPool(0),
+        fNtasks(0), fDoProfile(false), fUseTreeProfile(false),
+        fRecordTreeProfile(false), fHitpattern(0), fRoads(0), fNgoodRoads(0),
+        fRoadCorners(0), fTrkStat(kTrackOK),
         n_hits(0), n_bins(0), n_binhits(0), maxhits_bin(0),
-        n_test(0), n_pat(0), n_roads(0), n_dupl(0), n_badfits(0),
-        t_treesearch(0), t_roads(0), t_fit(0), t_track(0) {} // ROOT RTTI
+        n_test(0), n_pat(0), n_roads(0), n_dupl(0), n_badfits(0), n_alloc(0),
+        t_fill(0), t_treesearch(0), t_roads(0), t_fit(0), t_track(0),
+        fNsearch(0), fNaborted(0), fTsearch(0), fTaborted(0) {} // ROOT RTTI
     virtual ~Projection();
 
     void            AddPlane( Plane* pl, Plane* partner = 0 );
     void            AddDummyPlane( Plane* pl, Plane* partner = 0 );
     virtual void    Clear( Option_t* opt="" );
+    virtual Int_t   Begin( THaRunBase* r=0 );
     virtual Int_t   Decode( const THaEvData& );
+    virtual Int_t   End( THaRunBase* r=0 );
     virtual EStatus Init( const TDatime& date );
     // EStatus         InitLevel2( const TDatime& date );
     virtual void    Print( Option_t* opt="" ) const;
@@ -68,6 +76,7 @@ namespace TreeSearch {
     Int_t           MakeRoads();
 
     static EProjType NameToType( const char* name );
+    static Int_t     AddPlaneHits( Int_t sum, Int_t nhits );
 
     Double_t        GetAngle()        const;
     const TVector2& GetAxis()         const { return fAxis; }
@@ -85,8 +94,10 @@ namespace TreeSearch {
     UInt_t          GetNpatterns()    const;
     UInt_t          GetNplanes()      const { return (UInt_t)fPlanes.size(); }
     UInt_t          GetNroads()       const;
-    TBits*          GetPlaneCombos()  const { return fPlaneCombos; }
+    const PlaneCombos* GetPlaneCombos() const { return fPlaneCombos; }
     Plane*          GetPlane ( UInt_t plane ) const { return fPlanes[plane]; }
+    UInt_t          GetNallPlanes() const { return (UInt_t)fAllPlanes.size(); }
+    Plane*          GetAllPlane( UInt_t i )   const { return fAllPlanes[i]; }
     Double_t        GetPlaneZ( UInt_t plane ) const;
     Road*           GetRoad  ( UInt_t i )     const;
     Double_t        GetSinAngle()     const { return fAxis.Y(); }
@@ -100,15 +111,55 @@ namespace TreeSearch {
     UInt_t          GetLastPlaneNum()      const { return fLastPlaneNum; }
 
     void            SetPatternTree( PatternTree* pt ) { fPatternTree = pt; }
+    void            SetTaskPool( TaskPool* pool );
+    UInt_t          GetSplitDepth()   const { return fSplitDepth; }
+    UInt_t          GetCoarseDepth()  const { return fCoarseDepth; }
+
+    // Region of interest of the current event, e.g. from a trigger
+    // detector. Positions along the projection axis in the front and back
+    // planes (m). Only patterns and roads crossing these windows are
+    // considered. Must be set after Clear() and before Track().
+    struct SearchWindow {
+      Bool_t active;              // Window in use
+      UInt_t front, back;         // Front/back plane numbers in patterns
+      UInt_t front_lo, front_hi;  // Allowed front bins [lo,hi]
+      UInt_t back_lo, back_hi;    // Allowed back bins [lo,hi]
+      SearchWindow() : active(false), front(0), back(0), front_lo(0),
+		       front_hi(0), back_lo(0), back_hi(0) {}
+      Bool_t Overlaps( const NodeDescriptor& nd, UInt_t nlevels ) const {
+	// True if the bins of pattern nd in the front and back planes
+	// overlap the window
+	UInt_t sh = nlevels-1 - nd.depth;
+	UInt_t fb = nd[front], bb = nd[back];
+	return ( (fb << sh) <= front_hi and ((fb+1) << sh) > front_lo and
+		 (bb << sh) <= back_hi  and ((bb+1) << sh) > back_lo );
+      }
+    };
+    void            SetSearchWindow( Double_t front_lo, Double_t front_hi,
+				     Double_t back_lo, Double_t back_hi );
+    void            ClearSearchWindow() { fWindow.active = false; }
+    Bool_t          HasSearchWindow() const { return fWindow.active; }
+    Bool_t          IsInSearchWindow( const Road* rd ) const;
 
     const vpl_t&    GetListOfPlanes() const { return fPlanes; }
 
+    // Stage latencies, filled if DoTiming()
+    StageProfile&       GetProfile()       { return fProfile; }
+    const StageProfile& GetProfile() const { return fProfile; }
+    Bool_t          DoTiming() const;
+    void            SetProfiling( Bool_t enable ) { fDoProfile = enable; }
+
+    // Tree layout profile, if recording (db "record_tree_profile")
+    const std::vector<UInt_t>& GetNodeCounts() const { return fNodeCounts; }
+    void            AddNodeCounts( const Projection& other );
+
     Bool_t          DoingChisqTest() const  { return TestBit(kDoChi2); }
 
     // Analysis control flags
     enum {
       kEventDisplay = BIT(14), // Support event display
       kHaveDummies  = BIT(15), // Dummy planes present
+      kFlatRoads    = BIT(16), // Use flat index in MakeRoads (else std::set)
       kDoChi2       = BIT(22)  // Apply chi2 cut to 2D fits
 #ifdef MCDATA
     , kMCdata       = BIT(23)  // Assume input is Monte Carlo data
@@ -173,8 +224,8 @@ namespace TreeSearch {
     UInt_t           fMinFitPlanes;  // Min num of planes required for fitting
     UInt_t           fMaxMiss;       // Allowed number of missing planes
     Bool_t           fRequire1of2;   // Require hit in at least one plane of a pair
-    TBits*           fPlaneCombos;   // Allowed plane occupancy patterns
-    TBits*           fAltPlaneCombos;// Allowed plane patterns including dummies
+    PlaneCombos*     fPlaneCombos;   // Allowed plane occupancy patterns
+    PlaneCombos*     fAltPlaneCombos;// Allowed plane patterns including dummies
 
     // Road construction control
     UInt_t           fMaxPat;        // Sanity cut on number of patterns
@@ -187,9 +238,35 @@ namespace TreeSearch {
     Double_t         fConfLevel;     // Requested confidence level for chi2 cut
     vec_pdbl_t       fChisqLimits;   // lo/hi onfidence interval limits on Chi2
 
+    // Coarse search of dense regions
+    UInt_t           fCoarseDepth;   // Depth of coarse patterns (0=off)
+    UInt_t           fCoarseMaxHits; // Max hits below a node at fCoarseDepth
+                                     // for refining it further
+
+    // Parallel tree search
+    UInt_t           fSplitDepth;    // Tree depth where search is split (0=off)
+    TaskPool*        fTaskPool;      //! Worker threads for split search
+    std::vector<NodeArena*> fWorkerArena; //! Storage for matches, per worker
+    std::vector<Task*> fSearchTasks; //! Subtree searches (reused)
+    UInt_t           fNtasks;        // Subtree searches in current event
+    TreeWalk         fTreeWalk;      //! Tree iterator of the search
+
+    // Profiling
+    Bool_t           fDoProfile;     // Record stage latencies (db "profile")
+    StageProfile     fProfile;       //! Latencies of the Track() stages
+    enum EStage { kFillStage = 0, kSearchStage, kRoadsStage, kFitStage };
+
+    // Profile-guided tree layout
+    Bool_t           fUseTreeProfile;    // Reorder tree by recorded profile
+    Bool_t           fRecordTreeProfile; // Record profile (serial search)
+    std::vector<UInt_t> fNodeCounts;     //! Match counts per tree node
+
     // Event-by-event results
     Hitpattern*      fHitpattern;    // Hitpattern of current event
     NodeVec_t        fPatternsFound; // Patterns found by TreeSearch
+    NodeArena        fNodeArena;     // Storage for fPatternsFound
+    NodeVec_t        fCoarseFound;   // Coarse patterns, split off by MakeRoads
+    SearchWindow     fWindow;        // Region of interest (reset by Clear)
     TClonesArray*    fRoads;         // Roads found by MakeRoads
     UInt_t           fNgoodRoads;    // Good roads in fRoads
     TClonesArray*    fRoadCorners;   // Road corners, for event display
@@ -197,50 +274,100 @@ namespace TreeSearch {
 
     // Statistics (only needed for TESTCODE, but kept for binary compatibility)
     UInt_t n_hits, n_bins, n_binhits, maxhits_bin;
-    UInt_t n_test, n_pat, n_roads, n_dupl, n_badfits;
-    Double_t t_treesearch, t_roads, t_fit, t_track;
+    UInt_t n_test, n_pat, n_roads, n_dupl, n_badfits, n_alloc;
+    // Stage times (us), filled if DoTiming()
+    Double_t t_fill, t_treesearch, t_roads, t_fit, t_track;
+
+    // Run statistics of the tree search
+    UInt_t   fNsearch;       // Tree searches done
+    UInt_t   fNaborted;      // Searches stopped early (more than fMaxPat)
+    Double_t fTsearch;       // Time in complete searches (us, TESTCODE only)
+    Double_t fTaborted;      // Time in stopped searches (us, TESTCODE only)
+
+    // Work space for MakeRoadsFlat
+    struct RoadIdx_t {
+      std::vector<UInt_t> bybin;  // Pattern indices sorted by bin number
+      std::vector<UInt_t> rank;   // Inverse of bybin
+      std::vector<UInt_t> prev;   // Linked list of unused patterns in bybin
+      std::vector<UInt_t> next;
+    };
+    RoadIdx_t        fRoadIdx;       //! Lookup index for MakeRoadsFlat
 
     Bool_t  FitRoads();
+    void    MakeRoadsSet();
+    void    MakeRoadsFlat();
+    void    UnlinkRoadIdx( UInt_t k, UInt_t end );
+    void    FinishRoad( Road* rd );
     Bool_t  RemoveDuplicateRoads();
+    void    RemoveRoad( UInt_t i );
     void    SetAngle( Double_t a );
-    UInt_t  GetNallPlanes() const { return (UInt_t)fAllPlanes.size(); }
 
     virtual Hitpattern* MakeHitpattern( const PatternTree& ) const;
-    virtual void MakePlaneCombos( const vpl_t& planes, TBits*& combos ) const;
+    virtual void MakePlaneCombos( const vpl_t& planes,
+				  PlaneCombos*& combos ) const;
 
     // Podd interface
     virtual Int_t ReadDatabase( const TDatime& date );
     virtual Int_t DefineVariables( EMode mode = kDefine );
     virtual const char* GetDBFileName() const;
     virtual void MakePrefix();
+    TString GetTreeFileName( const char* ext ) const;
+
+    NodeVisitor::ETreeOp SplitSearch();
 
     // NodeVisitor class for comparing patterns in the tree with the
     // hitpattern. Matches represent candidates for track roads and are
-    // added to the list of roads for further analysis
-    class ComparePattern : public NodeVisitor {
+    // added to the list of roads for further analysis.
+    // As a SiblingVisitor, compares all children of a node in one batch.
+    class ComparePattern : public NodeVisitor, public SiblingVisitor {
     public:
-      ComparePattern( const Hitpattern* hitpat, const TBits* combos,
-		      NodeVec_t* matches, UInt_t dummypattern = 0 )
+      ComparePattern( const Hitpattern* hitpat, const PlaneCombos* combos,
+		      NodeVec_t* matches, NodeArena* arena,
+		      UInt_t dummypattern = 0, UInt_t maxmatch = kMaxUInt,
+		      UInt_t coarsedepth = 0, UInt_t coarsemaxhits = kMaxUInt,
+		      const SearchWindow* window = 0 )
 	: fHitpattern(hitpat), fPlaneCombos(combos), fMatches(matches),
-	  fDummyPlanePattern(dummypattern)
+	  fArena(arena), fDummyPlanePattern(dummypattern),
+	  fMaxMatches(maxmatch), fCoarseDepth(coarsedepth),
+	  fCoarseMaxHits(coarsemaxhits),
+	  fWindow( (window and window->active) ? window : 0 )
 #ifdef TESTCODE
 	, fNtest(0)
 #endif
-      { assert(fHitpattern && fPlaneCombos && fMatches); }
+      { assert(fHitpattern && fPlaneCombos && fMatches && fArena); }
       virtual ETreeOp operator() ( const NodeDescriptor& nd );
+      virtual ETreeOp operator() ( const PatternTree& tree, UInt_t first,
+				   UInt_t n, UInt_t depth, UInt_t shift,
+				   Bool_t mirrored, ETreeOp* ops );
 #ifdef TESTCODE
       UInt_t GetNtest() const { return fNtest; }
 #endif
     private:
+      void AddMatch( const NodeDescriptor& nd, UInt_t matchval,
+		     UInt_t nmatch );
+      Bool_t IsDense( const NodeDescriptor& nd ) const;
+      void AddCoarseMatch( const NodeDescriptor& nd );
+
+      std::vector<UInt_t> fMatchval;   // Batch match results
       const Hitpattern* fHitpattern;   // Hitpattern to compare to
-      const TBits*      fPlaneCombos;  // Allowed plane occupancy patterns
+      const PlaneCombos* fPlaneCombos; // Allowed plane occupancy patterns
       NodeVec_t*        fMatches;      // Set of matching patterns
+      NodeArena*        fArena;        // Allocator for fMatches
       UInt_t            fDummyPlanePattern;  // Dummy plane # bitpattern
+      UInt_t            fMaxMatches;   // Stop search above this many matches
+      UInt_t            fCoarseDepth;  // Depth of density test (0=off)
+      UInt_t            fCoarseMaxHits;// Max hits in a node at fCoarseDepth
+      Hset_t            fCoarseHits;   // Work space for AddCoarseMatch
+      const SearchWindow* fWindow;     // Region of interest, if any
 #ifdef TESTCODE
       UInt_t fNtest;  // Number of pattern comparisons
 #endif
     };
 
+    // Helper classes for SplitSearch, defined in implementation
+    class SubtreeSearch;
+    class CollectSubtrees;
+
   private:
     // Prevent default copying, assignment
     Projection( const Projection& orig );
@@ -258,6 +385,19 @@ namespace TreeSearch {
     return TMath::ATan2( fAxis.Y(), fAxis.X() );
   }
 
+  //___________________________________________________________________________
+  inline
+  Int_t Projection::AddPlaneHits( Int_t sum, Int_t nhits )
+  {
+    // Add the Plane::Decode result 'nhits' to the hit count 'sum' of a
+    // projection. Negative values indicate overflow. The result is negative
+    // if any plane overflowed, and its magnitude is the total hit count.
+
+    if( sum >= 0 and nhits >= 0 )
+      return sum + nhits;
+    return -( (sum < 0 ? -sum : sum) + (nhits < 0 ? -nhits : nhits) );
+  }
+
   //___________________________________________________________________________
   inline const pdbl_t& Projection::GetChisqLimits( UInt_t i ) const
   {
@@ -265,11 +405,23 @@ namespace TreeSearch {
     return fChisqLimits[i];
   }
 
+  //___________________________________________________________________________
+  inline Bool_t Projection::DoTiming() const
+  {
+    // True if the stage times are measured. TESTCODE always needs them.
+#ifdef TESTCODE
+    return kTRUE;
+#else
+    return fDoProfile;
+#endif
+  }
+
   //___________________________________________________________________________
   inline
   UInt_t Projection::GetNpatterns() const
   {
-    return static_cast<UInt_t>( fPatternsFound.size() );
+    // Number of patterns found, including coarse ones (see MakeRoads)
+    return static_cast<UInt_t>( fPatternsFound.size()+fCoarseFound.size() );
   }
 
   //___________________________________________________________________________
@@ -18,13 +18,11 @@
 #endif
 
 #include "TMath.h"
-#include "TBits.h"
 #include "TVector2.h"
 
 #include <iostream>
 #include <algorithm>
 #include <numeric>
-#include <map>
 #include <utility>
 #include <stdexcept>
 
@@ -43,6 +41,8 @@ typedef Hset_t::iterator siter_t;
 // Number of points for trapezoid test
 static const size_t kNcorner = 5;
 static const UInt_t kMaxNhitCombos = 1000;
+// Maximum number of planes in a road fit (= bits in plane pattern)
+static const UInt_t kMaxFitPlanes = 8*sizeof(UInt_t);
 
 //_____________________________________________________________________________
 static inline
@@ -93,30 +93,52 @@ struct BuildInfo_t {
   const Projection* fProjection;
 
   BuildInfo_t( const Projection* proj ) : fOuterBits(0), fProjection(proj) {}
-  BuildInfo_t( const Node_t& node, const Projection* proj )
-    : fCluster(node.second),
-      fOuterBits(GetOuterBits(node.second.plane_pattern)), fProjection(proj)
-  {
-    // Construct from given start pattern/hitset
+  void Reset( const Projection* proj ) {
+    // Reset for building a new, empty cluster. Keeps allocated memory.
+    fCluster.hits.clear();
+    fCluster.plane_pattern = fCluster.nplanes = fCluster.nhits = 0;
+    fCluster.used = 0;
+    fLimits.clear();
+    fOuterBits = 0;
+    fProjection = proj;
+  }
+  void Reset( const Node_t& node, const Projection* proj ) {
+    // Reset for building a cluster from the given start pattern/hitset
     const NodeDescriptor& nd = node.first;
+    Reset( proj );
+    fCluster.plane_pattern = node.second.plane_pattern;
+    fCluster.nplanes = node.second.nplanes;
+    fCluster.nhits = node.second.nhits;
+    fOuterBits = GetOuterBits( fCluster.plane_pattern );
+    CollectHits( node );
     UInt_t last  = fProjection->GetLastPlaneNum()+1;
     UInt_t dmpat = fProjection->GetDummyPlanePattern();
     assert( (fCluster.plane_pattern > 0) and (fCluster.nplanes > 0) );
-    assert( last <= nd.link->GetPattern()->GetNbits() );
+    assert( last <= nd.GetNbits() );
     assert( last-1 >= fProjection->GetFirstPlaneNum() );
+    // Coarse patterns above the bottom of the tree cover 2^sh bins
+    // at the highest resolution
+    UInt_t sh = fProjection->GetHitpattern()->GetNlevels()-1 - nd.depth;
     fLimits.reserve( fProjection->GetNplanes() );
     for( UInt_t i = fProjection->GetFirstPlaneNum(); i < last; ++i ) {
       if( not TESTBIT(dmpat,i) )
-	fLimits.push_back( make_pair(nd[i], nd[i]+1) );
+	fLimits.push_back( make_pair(nd[i] << sh, (nd[i]+1) << sh) );
     }
     assert( fLimits.size() == fProjection->GetNplanes() );
   }
+  void CollectHits( const Node_t& node ) {
+    // Set the cluster hits to the hits of the given tree search pattern
+    fCluster.hits.clear();
+    HitSet::CollectHits( fProjection->GetHitpattern(), node.first,
+			 fCluster.hits );
+    assert( fCluster.hits.size() == node.second.nhits );
+  }
   void ExpandWidth( const NodeDescriptor& nd ) {
     // Widen the bin ranges using the bins in the given pattern
     UInt_t last  = fProjection->GetLastPlaneNum()+1;
     UInt_t npl   = fProjection->GetNplanes();
     UInt_t dmpat = fProjection->GetDummyPlanePattern();
-    assert( last <= nd.link->GetPattern()->GetNbits() );
+    assert( last <= nd.GetNbits() );
     assert( last-1 >= fProjection->GetFirstPlaneNum() );
     assert( fLimits.size() == npl or fLimits.empty() );
     if( fLimits.empty() )
@@ -165,9 +187,9 @@ Road::Road( const Projection* proj )
     fNMCTrackHitsFit(0), fMCTrackPlanePatternFit(0),
 #endif
     fPos(kBig), fSlope(kBig), fChi2(kBig), fDof(kMaxUInt), fGood(false),
-    fTrack(0), fBuild(0), fGrown(false), fTrkStat(kTrackOK)
+    fTrack(0), fBuild(0), fBuildStore(0), fGrown(false), fTrkStat(kTrackOK)
 #ifdef TESTCODE
-  , fNfits(0)
+  , fNfits(0), fNalloc(0)
 #endif
 {
   // Construct empty road
@@ -177,56 +199,109 @@ Road::Road( const Projection* proj )
   memset( fCornerX, 0, kNcorner*sizeof(Double_t) );
   fV[2] = fV[1] = fV[0] = kBig;
   fPoints.reserve( fProjection->GetNplanes() );
-  fBuild = new BuildInfo_t(fProjection);
+  fBuild = fBuildStore = new BuildInfo_t(fProjection);
 }
 
 //_____________________________________________________________________________
 Road::Road( const Node_t& nd, const Projection* proj )
-  : TObject(), fPatterns(1,&nd), fPlanePattern(0), fProjection(proj),
-    fZL(kBig), fZU(kBig),
+  : TObject(), fPlanePattern(0), fProjection(proj), fZL(kBig), fZU(kBig),
 #ifdef MCDATA
     fNMCTrackHits(0), fMCTrackPlanePattern(0),
     fNMCTrackHitsFit(0), fMCTrackPlanePatternFit(0),
 #endif
     fPos(kBig), fSlope(kBig), fChi2(kBig),
-    fDof(kMaxUInt), fGood(false), fTrack(0), fBuild(0), fGrown(true),
-    fTrkStat(kTrackOK)
+    fDof(kMaxUInt), fGood(false), fTrack(0), fBuild(0), fBuildStore(0),
+    fGrown(false), fTrkStat(kTrackOK)
 #ifdef TESTCODE
-  , fNfits(0)
+  , fNfits(0), fNalloc(0)
 #endif
 {
   // Construct from pattern
 
+  Init( nd, proj );
+}
+
+//_____________________________________________________________________________
+void Road::Init( const Node_t& nd, const Projection* proj )
+{
+  // Start building this road from pattern nd. The road must be empty,
+  // i.e. newly constructed or cleared. Memory allocated by earlier use of
+  // this object is reused.
+
+  fProjection = proj;
   assert( fProjection );   // Invalid Projection* pointer
-  assert( CheckMatch(nd.second.hits) ); // Start pattern must be a good match
+  assert( CheckMatch(nd.second) ); // Start pattern must be a good match
+  assert( fPatterns.empty() and fHits.empty() and !fBuild );
 
+  fPatterns.push_back( &nd );
+  fZL = fZU = kBig;
   memset( fCornerX, 0, kNcorner*sizeof(Double_t) );
   fV[2] = fV[1] = fV[0] = kBig;
   fPoints.reserve( fProjection->GetNplanes() );
-  fBuild = new BuildInfo_t(nd,fProjection);
+  if( !fBuildStore ) {
+    fBuildStore = new BuildInfo_t(fProjection);
+#ifdef TESTCODE
+    ++fNalloc;
+#endif
+  }
+  fBuild = fBuildStore;
+  fBuild->Reset(nd,fProjection);
+  fGrown = true;
 
 #ifdef VERBOSE
   if( fProjection->GetDebug() > 3 ) {
     cout << "New Road:" << endl;
     nd.first.Print();
-    PrintHits(nd.second.hits);
+    PrintHits(fBuild->fCluster.hits);
   }
 #endif
 }
 
+//_____________________________________________________________________________
+void Road::Clear( Option_t* )
+{
+  // Reset this road to the empty state, keeping allocated memory for
+  // reuse with Init(). Called by TClonesArray::Clear("C").
+
+  fPatterns.clear();
+  fHits.clear();
+  fPoints.clear();
+  fPointBuf.clear();
+  fPointPtr.clear();
+  fFitCoord.clear();
+  fCoords.Clear();
+  fPlanePattern = 0;
+#ifdef MCDATA
+  fNMCTrackHits = fMCTrackPlanePattern = 0;
+  fNMCTrackHitsFit = fMCTrackPlanePatternFit = 0;
+#endif
+  fV[2] = fV[1] = fV[0] = fChi2 = fSlope = fPos = kBig;
+  fDof = kMaxUInt;
+  fSums.Clear();
+  fGood = false;
+  fTrack = 0;
+  fBuild = 0;
+  fGrown = false;
+  fTrkStat = kTrackOK;
+  fNfits = 0;
+#ifdef TESTCODE
+  fNalloc = 0;
+#endif
+}
+
 //_____________________________________________________________________________
 Road::Road( const Road& orig ) :
   TObject(orig), fPatterns(orig.fPatterns), fHits(orig.fHits),
-  fPlanePattern(orig.fPlanePattern),
+  fCoords(orig.fCoords), fPlanePattern(orig.fPlanePattern),
 #ifdef MCDATA
   fNMCTrackHits(orig.fNMCTrackHits),
   fMCTrackPlanePattern(orig.fMCTrackPlanePattern),
   fNMCTrackHitsFit(orig.fNMCTrackHitsFit),
   fMCTrackPlanePatternFit(orig.fMCTrackPlanePatternFit),
 #endif
-  fGrown(orig.fGrown), fTrkStat(orig.fTrkStat)
+  fBuildStore(0), fGrown(orig.fGrown), fTrkStat(orig.fTrkStat)
 #ifdef TESTCODE
-  , fNfits(orig.fNfits)
+  , fNfits(orig.fNfits), fNalloc(0)
 #endif
 {
   // Copy constructor
@@ -237,7 +312,7 @@ Road::Road( const Road& orig ) :
   CopyPointData( orig );
 
   if( orig.fBuild )
-    fBuild = new BuildInfo_t( *orig.fBuild );
+    fBuild = fBuildStore = new BuildInfo_t( *orig.fBuild );
   else
     fBuild = 0;
 }
@@ -256,9 +331,8 @@ Road& Road::operator=( const Road& rhs )
     size_t nbytes = (char*)&fTrack - (char*)&fProjection + sizeof(fTrack);
     memcpy( &fProjection, &rhs.fProjection, nbytes );
 
-    fFitCoord.clear();
-    DeleteContainerOfContainers( fPoints );
     CopyPointData( rhs );
+    fCoords = rhs.fCoords;
     fPlanePattern = rhs.fPlanePattern;
 #ifdef MCDATA
     fNMCTrackHits = rhs.fNMCTrackHits;
@@ -267,10 +341,13 @@ Road& Road::operator=( const Road& rhs )
     fMCTrackPlanePatternFit = rhs.fMCTrackPlanePatternFit;
 #endif
 
-    delete fBuild;
-    if( rhs.fBuild )
-      fBuild = new BuildInfo_t( *rhs.fBuild );
-    else
+    if( rhs.fBuild ) {
+      if( fBuildStore )
+	*fBuildStore = *rhs.fBuild;
+      else
+	fBuildStore = new BuildInfo_t( *rhs.fBuild );
+      fBuild = fBuildStore;
+    } else
       fBuild = 0;
 
     fGrown   = rhs.fGrown;
@@ -287,9 +364,7 @@ Road::~Road()
 {
   // Destructor
 
-  DeleteContainerOfContainers( fPoints );
-  delete fBuild;
-
+  delete fBuildStore;
 }
 
 //_____________________________________________________________________________
@@ -298,53 +373,37 @@ void Road::CopyPointData( const Road& orig )
   // Copy fPoints and fFitCoord. Used by copy c'tor and assignment operator.
   // Creates actual copies of Points because they are managed by the Roads.
 
-  if( orig.fPoints.empty() )
-    assert( orig.fFitCoord.empty() ); // Can't have fit coord but no points :-/
-  else {
-    typedef map<Point*,Point*> Pmap_t;
-    Pmap_t xref;
-    fPoints.resize( orig.fPoints.size() );
-    for( vector<Pvec_t>::size_type i = 0; i < orig.fPoints.size(); ++i ) {
-      const Pvec_t& old_planepoints = orig.fPoints[i];
-      fPoints[i].reserve( old_planepoints.size() );
-      for( Pvec_t::const_iterator it = old_planepoints.begin(); it !=
-	     old_planepoints.end(); ++it ) {
-	Point* old_point = *it;
-	Point* new_point = new Point( *old_point );
-	fPoints[i].push_back( new_point );
-	// It gets a bit tricky here: To be able to copy the fFitCoord, which
-	// contain pointers to some of the Points in fPoints, we need to keep
-	// track of which old point was copied to which new point.
-#ifndef NDEBUG
-	pair<Pmap_t::iterator,bool> ins =
-#endif
-	xref.insert( make_pair(old_point,new_point) );
-	assert( ins.second );  // Duplicate points should never occur
-      }
-    }
-
-    // Copy fit coordinates (hits used in best fit)
-    fFitCoord.reserve( orig.fFitCoord.size() );
-    // The copied FitCoord must reference the corresponding copied Points
-    for( Pvec_t::const_iterator it = orig.fFitCoord.begin(); it !=
-	   orig.fFitCoord.end(); ++it ) {
-      Point* old_point = *it;
-      Pmap_t::iterator found = xref.find( old_point );
-      assert( found != xref.end() );
-      fFitCoord.push_back( (*found).second );
-    }
+  assert( !orig.fPoints.empty() or orig.fFitCoord.empty() );
+  // Copy the Points, then translate the pointers, which reference the
+  // Points of orig, by their position in orig.fPointBuf
+  fPointBuf = orig.fPointBuf;
+  fPointPtr.resize( orig.fPointPtr.size() );
+  const Point* obuf = orig.fPointBuf.empty() ? 0 : &orig.fPointBuf[0];
+  for( Pvec_t::size_type i = 0; i < orig.fPointPtr.size(); ++i )
+    fPointPtr[i] = &fPointBuf[ orig.fPointPtr[i] - obuf ];
+  fPoints.resize( orig.fPoints.size() );
+  for( vector<PointRange>::size_type i = 0; i < orig.fPoints.size(); ++i ) {
+    const PointRange& r = orig.fPoints[i];
+    Pvec_t::size_type first = r.begin() - &orig.fPointPtr[0];
+    fPoints[i] = PointRange( &fPointPtr[first], &fPointPtr[first]+r.size() );
   }
+
+  // Copy fit coordinates (hits used in best fit). The copied FitCoord must
+  // reference the corresponding copied Points
+  fFitCoord.resize( orig.fFitCoord.size() );
+  for( Pvec_t::size_type i = 0; i < orig.fFitCoord.size(); ++i )
+    fFitCoord[i] = &fPointBuf[ orig.fFitCoord[i] - obuf ];
 }
 
 //_____________________________________________________________________________
 inline
-Bool_t Road::CheckMatch( const Hset_t& hits ) const
+Bool_t Road::CheckMatch( const HitSet& set ) const
 {
   // Return true if the hits from the given set either cover all planes
   // or, if planes are missing, the pattern of missing planes is allowed
   // (based on what level of matching the user requests via the database)
 
-  return HitSet::CheckMatch( hits, fProjection->GetPlaneCombos() );
+  return set.CheckMatch( fProjection->GetPlaneCombos() );
 }
 
 //_____________________________________________________________________________
@@ -355,7 +414,7 @@ Bool_t Road::IsInBackRange( const Node_t& nd ) const
   UInt_t bdist = fProjection->GetBinMaxDistB();
 
   assert( fBuild && !fBuild->fLimits.empty() );
-  assert( last < nd.first.link->GetPattern()->GetNbits() );
+  assert( last < nd.first.GetNbits() );
   assert( not TESTBIT(fProjection->GetDummyPlanePattern(), last) );
 
   // If there is no actual hit in the back plane, assume the pattern is in range.
@@ -375,7 +434,7 @@ Bool_t Road::IsInFrontRange( const Node_t& nd ) const
   UInt_t fdist = fProjection->GetBinMaxDistF();
 
   assert( fBuild && !fBuild->fLimits.empty() );
-  assert( first < nd.first.link->GetPattern()->GetNbits() );
+  assert( first < nd.first.GetNbits() );
   assert( not TESTBIT(fProjection->GetDummyPlanePattern(), first) );
 
   // See comment above. If there is no front hit, assume the pattern is in range.
@@ -400,12 +459,14 @@ Bool_t Road::Add( const Node_t& nd )
   assert( fPatterns.empty() || IsInFrontRange(nd) );
 
   const HitSet& new_set  = nd.second;
-  const Hset_t& new_hits = nd.second.hits;
+  const Hitpattern* hitpat = fProjection->GetHitpattern();
 
 #ifdef VERBOSE
   if( fProjection->GetDebug() > 3 ) {
     cout << "Adding:" << endl;
     nd.first.Print();
+    Hset_t new_hits;
+    HitSet::CollectHits( hitpat, nd.first, new_hits );
     PrintHits(new_hits);
   }
 #endif
@@ -416,21 +477,22 @@ Bool_t Road::Add( const Node_t& nd )
 
   if( fPatterns.empty() ) {
     // If this is the first pattern, initialize the cluster
-    assert( CheckMatch(new_hits) );
+    assert( CheckMatch(new_set) );
     assert( new_set.nplanes > 0 && new_set.plane_pattern > 0 );
     fBuild->fCluster = new_set;
+    fBuild->CollectHits( nd );
     fBuild->ExpandWidth( nd.first );
     fBuild->fOuterBits = GetOuterBits( fBuild->fCluster.plane_pattern );
     fGrown = true;
 #ifdef VERBOSE
     if( fProjection->GetDebug() > 3 ) {
       cout << "New cluster:" << endl;
-      PrintHits( new_hits );
+      PrintHits( fBuild->fCluster.hits );
     }
 #endif
   }
   else if( IsInBackRange(nd) and
-	   fBuild->fCluster.IsSimilarTo(new_set,hitdist) ) {
+	   fBuild->fCluster.IsSimilarTo(hitpat,nd.first,new_set.plane_pattern) ) {
     // Accept this pattern if and only if it is a subset of the cluster
     // NB: IsSimilarTo() is a looser match than std::includes(). The new
     // pattern may have extra hits
@@ -438,13 +500,10 @@ Bool_t Road::Add( const Node_t& nd )
     // If hitdist > 0, grow the cluster with possible new hits found
     if( hitdist > 0 ) {
       UInt_t outer_bits = fBuild->fOuterBits;
-      for( siter_t it = new_hits.begin(); it != new_hits.end(); ++it ) {
-        Hit* hit = *it;
-	pair< siter_t, bool > ins = fBuild->fCluster.hits.insert(hit);
-	assert( !ins.second or hit->GetPlaneNum() != kMaxUInt );
-	if( ins.second and TESTBIT(outer_bits,hit->GetPlaneNum()) )
-	  fGrown = true;
-      }
+      Hset_t new_hits;
+      HitSet::CollectHits( hitpat, nd.first, new_hits );
+      if( (fBuild->fCluster.hits.merge(new_hits) & outer_bits) != 0 )
+	fGrown = true;
       // Growing clusters are expanded even for lower match levels
       // if they contain hits in the first and last active bins
       if( (outer_bits & new_set.plane_pattern) == outer_bits )
@@ -482,7 +541,7 @@ void Road::Finish()
   // Finish building the road
 
   assert(fBuild);   // Road must be incomplete to be able to Finish()
-  for( list<const Node_t*>::iterator it = fPatterns.begin(); it !=
+  for( NodeList_t::iterator it = fPatterns.begin(); it !=
 	 fPatterns.end(); ++it ) {
     (**it).second.used = 1;
 #ifdef VERBOSE
@@ -556,8 +615,8 @@ void Road::Finish()
   assert( fCornerX[0] < fCornerX[1] );
   assert( fCornerX[3] < fCornerX[2] );
 
-  // All done. Put the tools away
-  delete fBuild; fBuild = 0;
+  // All done. Put the tools away (fBuildStore keeps them for reuse)
+  fBuild = 0;
   fGrown = false;
 
   return;
@@ -576,7 +635,8 @@ Bool_t Road::Include( const Road* other )
 
   assert( other and !fBuild and fProjection == other->fProjection );
 
-  if( includes(ALL(fHits), ALL(other->fHits), fHits.key_comp()) ) {
+  if( other->fHits.size() <= fHits.size() and
+      includes(ALL(fHits), ALL(other->fHits), fHits.key_comp()) ) {
     // Widen the road bundaries
     fCornerX[0] = min( fCornerX[0], other->fCornerX[0] );
     fCornerX[1] = max( fCornerX[1], other->fCornerX[1] );
@@ -592,7 +652,7 @@ Bool_t Road::Include( const Road* other )
       other->fCornerX[1] < fCornerX[1] + eps and
       fCornerX[3] < other->fCornerX[3] + eps and
       other->fCornerX[2] < fCornerX[2] + eps ) {
-    fHits.insert( ALL(other->fHits) );
+    fHits.merge( other->fHits );
     return true;
   }
 
@@ -605,9 +665,16 @@ Bool_t Road::CollectCoordinates()
   // Gather hit positions that lie within the Road area.
   // Return true if the plane occupancy pattern of the selected points
   // is allowed by Projection::fPlaneCombos, otherwise false.
-  // Results are in fPoints.
+  // Results are in fPoints, and their coordinates also in fCoords.
 
-  DeleteContainerOfContainers( fPoints );
+#ifdef TESTCODE
+  size_t cap[3] = { fPointBuf.capacity(), fPointPtr.capacity(),
+		    fPoints.capacity() };
+#endif
+  fPoints.clear();
+  fPointBuf.clear();
+  fPointPtr.clear();
+  fCoords.Clear();
 
 #ifdef VERBOSE
   if( fProjection->GetDebug() > 3 ) {
@@ -622,12 +689,15 @@ Bool_t Road::CollectCoordinates()
   Bool_t good = true;
 #ifdef MCDATA
   Bool_t mcdata = fProjection->TestBit(Projection::kMCdata);
-  TBits mcpattern;
+  UInt_t mcpattern = 0;
 #endif
 
-  // Collect the hit coordinates within this Road
-  TBits planepattern;
+  // Collect the hit coordinates within this Road. The Points go into
+  // fPointBuf, which may still be reallocated here, so fPoints is set up
+  // afterwards from the index of the first Point of each plane.
+  UInt_t planepattern = 0;
   UInt_t last_np = kMaxUInt;
+  UInt_t pstart[PlaneCombos::kMaxPlanes+1], npl = 0;
   for( siter_t it = fHits.begin(); it != fHits.end(); ++it ) {
     Hit* hit = const_cast<Hit*>(*it);
     // Skip all hits from planes in calibration mode - these are not fitted
@@ -643,10 +713,12 @@ Bool_t Road::CollectCoordinates()
       if( TMath::IsInside( x, z, kNcorner, &fCornerX[0], zp )) {
 	if( np != last_np ) {
 	  // The hits are sorted by ascending plane number, so fPoints gets
-	  // one element vector per plane
+	  // one range of Points per plane
 	  assert( last_np == kMaxUInt or np > last_np );
-	  fPoints.push_back( Pvec_t() );
-	  planepattern.SetBitNumber(np);
+	  assert( npl < PlaneCombos::kMaxPlanes );
+	  pstart[npl++] = fPointBuf.size();
+	  fCoords.AddPlane( z );
+	  SETBIT( planepattern, np );
 #ifdef MCDATA
 	  if( mcdata ) {
 	    MCHitInfo* mcinfo = dynamic_cast<Podd::MCHitInfo*>(hit);
@@ -654,35 +726,48 @@ Bool_t Road::CollectCoordinates()
 	    // TODO: currently does not distinguish between different MC tracks
 	    // We assume anything with fMCtrack != 0 is _the_ MC signal track
 	    if( mcinfo->fMCTrack != 0 )
-	      mcpattern.SetBitNumber(np);
+	      SETBIT( mcpattern, np );
 	  }
 #endif
 	  last_np = np;
 	}
-	fPoints.back().push_back( new Point(x, z, hit) );
+	fPointBuf.push_back( Point(x, z, hit) );
+	assert( z == fCoords.GetZ(fCoords.GetNplanes()-1) );
+	fCoords.AddPoint( x, 1.0 / ( hit->GetResolution() *
+				     hit->GetResolution() ) );
       }
     } while( i );
   }
+  pstart[npl] = fPointBuf.size();
+  fPointPtr.resize( fPointBuf.size() );
+  for( Pvec_t::size_type k = 0; k < fPointBuf.size(); ++k )
+    fPointPtr[k] = &fPointBuf[k];
+  fPoints.resize( npl );
+  for( UInt_t k = 0; k < npl; ++k )
+    fPoints[k] = PointRange( &fPointPtr[0]+pstart[k],
+			     &fPointPtr[0]+pstart[k+1] );
+#ifdef TESTCODE
+  fNalloc += (fPointBuf.capacity() != cap[0]) +
+    (fPointPtr.capacity() != cap[1]) + (fPoints.capacity() != cap[2]);
+#endif
+
   // Check if this matchpattern is acceptable
-  UInt_t patternvalue = 0;
-  assert( planepattern.GetNbytes() <= sizeof(patternvalue) );
-  planepattern.Get( &patternvalue );
-  good = fProjection->GetPlaneCombos()->TestBitNumber(patternvalue)
+  const PlaneCombos* combos = fProjection->GetPlaneCombos();
+  assert( combos->GetMinPlanes() == fProjection->GetMinFitPlanes() );
+  good = combos->IsAllowed(planepattern)
     // Need at least MinFitPlanes planes for fitting
-    and planepattern.CountBits() >= fProjection->GetMinFitPlanes();
+    and combos->HasMinPlanes(planepattern);
 
 #ifdef MCDATA
   if( mcdata ) {
-    fNMCTrackHits = mcpattern.CountBits();
-    assert( mcpattern.GetNbytes() <= sizeof(fMCTrackPlanePattern) );
-    fMCTrackPlanePattern = 0;
-    mcpattern.Get( &fMCTrackPlanePattern );
+    fNMCTrackHits = NumberOfSetBits(mcpattern);
+    fMCTrackPlanePattern = mcpattern;
   }
 #endif
 #ifdef VERBOSE
   if( fProjection->GetDebug() > 3 ) {
     cout << "Collected:" << endl;
-    vector<Pvec_t>::reverse_iterator ipl = fPoints.rbegin();
+    vector<PointRange>::reverse_iterator ipl = fPoints.rbegin();
     for( UInt_t i = fProjection->GetNplanes(); i--; ) {
       cout << " pl= " << i;
       assert( ipl == fPoints.rend() or !ipl->empty() );
@@ -696,7 +781,7 @@ Bool_t Road::CollectCoordinates()
       else {
 	Double_t z = ipl->front()->z;
 	cout << " z=" << z << "\t x=";
-	for( Pvec_t::iterator it = (*ipl).begin(); it != ipl->end(); ++it ) {
+	for( PointRange::iterator it = (*ipl).begin(); it != ipl->end(); ++it ) {
 	  Road::Point* pt = *it;
 	  cout << " " << pt->x;
 	  assert( pt->z == z );
@@ -734,6 +819,7 @@ Bool_t Road::Fit()
 #endif
     fV[2]= fV[1] = fV[0] = fChi2 = fSlope = fPos = kBig;
     fDof = kMaxUInt;
+    fSums.Clear();
   }
   fGood = false;
   fTrkStat = kTrackOK;
@@ -752,7 +838,7 @@ Bool_t Road::Fit()
   UInt_t n_combinations;
   try {
     n_combinations = accumulate( ALL(fPoints),
-				 (UInt_t)1, SizeMul<Pvec_t>() );
+				 (UInt_t)1, SizeMul<PointRange>() );
   }
   catch( overflow_error& ) {
     fTrkStat = kTooManyHitCombos;
@@ -767,108 +853,145 @@ Bool_t Road::Fit()
   Bool_t mcdata = fProjection->TestBit(Projection::kMCdata);
 #endif
 
-  // Loop over all combinations of hits in the planes
-  vector<Pvec_t>::size_type npts = fPoints.size();
-  Pvec_t selected;
-  selected.reserve( npts );
+  // Loop over all combinations of hits in the planes.
+  //
+  // The combinations are enumerated in the order of NthCombination (first
+  // plane varying fastest) by an odometer over the planes, starting with
+  // the last plane. The fit sums for the points selected in the planes
+  // processed so far are kept per level and updated with one point per
+  // step. Since the minimum chi2 of a subset of the points cannot exceed
+  // that of the full set, a partial combination whose chi2 is already
+  // above the current best chi2, or above the upper limit of the chi2
+  // confidence interval, cannot yield a new best (or acceptable) fit,
+  // and all of its completions are skipped. The partial sums serve only
+  // for this test. Once points are selected in all planes but the first,
+  // the fits with each of the points of the first plane are done together
+  // by the fit kernel, FitLineCombos, which takes its inputs from the
+  // structure-of-arrays copy of the coordinates and sums the points in
+  // plane order, so that the results are the same as when fitting each
+  // combination in turn.
+  vector<PointRange>::size_type npts = fPoints.size();
+  assert( npts <= kMaxFitPlanes and npts == fCoords.GetNplanes() );
   fDof = npts-2;
   pdbl_t chi2_interval;
-  if( fProjection->DoingChisqTest() )
+  bool chi2_test = fProjection->DoingChisqTest();
+  if( chi2_test )
     chi2_interval = fProjection->GetChisqLimits(fDof);
-  vector<Double_t> w(npts);
-  for( UInt_t i = 0; i < n_combinations; ++i ) {
-    NthCombination( i, fPoints, selected );
-    assert( selected.size() == npts );
-
-    // Do linear fit of the points, assuming uncorrelated measurements (x_i)
-    // and different resolutions for each point.
-    // We fit x = a1 + a2*z (z independent).
-    // Notation from: Review of Particle Properties, PRD 50, 1277 (1994)
-    Double_t S11 = 0, S12 = 0, S22 = 0, G1 = 0, G2 = 0, chi2 = 0;
-    UInt_t pat = 0;
-#ifdef MCDATA
-    UInt_t mcpat = 0, nmcplanes = 0;
-#endif
-    for( Pvec_t::size_type j = 0; j < npts; j++) {
-      Point* p = selected[j];
-      Double_t r = w[j] = 1.0 / ( p->res() * p->res() );
-      S11 += r;
-      S12 += p->z * r;
-      S22 += p->z * p->z * r;
-      G1  += p->x * r;
-      G2  += p->x * p->z * r;
-    }
-    Double_t D   = S11*S22 - S12*S12;
-    Double_t iD  = 1.0/D;
-    Double_t a1  = (G1*S22 - G2*S12)*iD;  // Intercept
-    Double_t a2  = (G2*S11 - G1*S12)*iD;  // Slope
-    // Covariance matrix of the fitted parameters
-    Double_t V[3] = { S22*iD, -S12*iD, S11*iD };
-    for( Pvec_t::size_type j = 0; j < npts; j++) {
-      Point* p = selected[j];
-      Double_t d = a1 + a2*p->z - p->x;
-      chi2 += d*d * w[j];
-      // Must never use two points in the same plane
-      assert( p->hit->GetPlaneNum() != kMaxUInt );
-      assert( (pat & (1U << p->hit->GetPlaneNum())) == 0 );
-      pat |= 1U << p->hit->GetPlaneNum();
-#ifdef MCDATA
-      if( mcdata ) {
-	MCHitInfo* mcinfo = dynamic_cast<Podd::MCHitInfo*>(p->hit);
-	assert( mcinfo );
-	// TODO: see CollectCoordinates
-	if( mcinfo->fMCTrack != 0 ) {
-	  mcpat |= 1U << p->hit->GetPlaneNum();
-	  ++nmcplanes;
+  FitSums_t sums[kMaxFitPlanes];  // sums[l]: sums for levels 0..l-1
+  UInt_t    ipt[kMaxFitPlanes];   // Selected point for each level
+  // Coordinates of the selected point, by plane
+  Double_t  xs[kMaxFitPlanes], zs[kMaxFitPlanes], ws[kMaxFitPlanes];
+  const UInt_t nlev = npts-1;     // Odometer levels, excluding first plane
+  const UInt_t n0 = fCoords.GetNpoints(0);
+  vector<Double_t> a1(n0), a2(n0), chi2(n0);
+  UInt_t l = 0;   // Level = index into the odometer
+  ipt[0] = 0;
+  while( true ) {
+    if( l < nlev ) {
+      // The plane for level l
+      UInt_t ip = npts-1-l;
+      if( ipt[l] == fCoords.GetNpoints(ip) ) {
+	// All points of this plane done
+	if( l == 0 )
+	  break;
+	++ipt[--l];
+	continue;
+      }
+      xs[ip] = fCoords.GetX(ip)[ipt[l]];
+      zs[ip] = fCoords.GetZ(ip);
+      ws[ip] = fCoords.GetW(ip)[ipt[l]];
+      sums[l+1] = sums[l];
+      sums[l+1].Add( xs[ip], zs[ip], ws[ip] );
+      if( l+1 >= 3 ) {
+	Double_t bound = fChi2;
+	if( chi2_test and chi2_interval.second < bound )
+	  bound = chi2_interval.second;
+	if( sums[l+1].MinChi2Above(bound) ) {
+	  ++ipt[l];
+	  continue;
 	}
       }
-#endif
+      ipt[++l] = 0;
+      continue;
     }
 
+    // Points selected in all planes but the first. Fit the combinations
+    // with each of the points of the first plane
+    FitLineCombos( xs+1, zs+1, ws+1, nlev, fCoords.GetZ(0),
+		   fCoords.GetX(0), fCoords.GetW(0), n0,
+		   &a1[0], &a2[0], &chi2[0] );
+
+    for( UInt_t k = 0; k < n0; ++k ) {
 #ifdef VERBOSE
-    if( fProjection->GetDebug() > 3 )
-      cout << "Fit:"
-	   << " a1 = " << a1 << " (" << TMath::Sqrt(V[0]) << ")"
-	   << " a2 = " << a2
-	   << " chi2 = " << chi2
-	   << " ndof = " << fDof
-	   << endl;
-#endif
-
-    // Save the fit results (good or bad)
-    if( chi2 < fChi2 ) {
-      fPos   = a1;
-      fSlope = a2;
-      fChi2  = chi2;
-      memcpy( fV, V, 3*sizeof(Double_t) );
-      // Save points used for this fit
-      fFitCoord.swap( selected );
-      fPlanePattern = pat;
+      if( fProjection->GetDebug() > 3 )
+	cout << "Fit:"
+	     << " a1 = " << a1[k]
+	     << " a2 = " << a2[k]
+	     << " chi2 = " << chi2[k]
+	     << " ndof = " << fDof
+	     << endl;
+#endif
+      // Save the fit results (good or bad)
+      if( chi2[k] < fChi2 ) {
+	fPos   = a1[k];
+	fSlope = a2[k];
+	fChi2  = chi2[k];
+	fSums.Clear();
+	fSums.Add( fCoords.GetX(0)[k], fCoords.GetZ(0), fCoords.GetW(0)[k] );
+	for( UInt_t j = 1; j < npts; ++j )
+	  fSums.Add( xs[j], zs[j], ws[j] );
+	// Covariance matrix of the fitted parameters
+	Double_t b1, b2;
+	fSums.Solve( b1, b2, fV );
+	// Save points used for this fit
+	fFitCoord.resize( npts );
+	fFitCoord[0] = fPoints[0][k];
+	for( UInt_t j = 1; j < npts; ++j )
+	  fFitCoord[j] = fPoints[j][ipt[npts-1-j]];
+	fPlanePattern = 0;
 #ifdef MCDATA
-      if( mcdata ) {
-	fNMCTrackHitsFit = nmcplanes;
-	fMCTrackPlanePatternFit = mcpat;
-      }
+	fNMCTrackHitsFit = fMCTrackPlanePatternFit = 0;
 #endif
-      if( fProjection->DoingChisqTest() ) {
-	// Throw out Chi2's outside of selected confidence interval
-	// NB: Obviously, this requires accurate hit resolutions
-	//TODO: keep statistics
-	if( chi2 < chi2_interval.first )
-	  continue;
-	if( chi2 > chi2_interval.second )
-	  continue;
-      }
-      fGood = true;
+	for( UInt_t j = 0; j < npts; ++j ) {
+	  Point* p = fFitCoord[j];
+	  // Must never use two points in the same plane
+	  assert( p->hit->GetPlaneNum() != kMaxUInt );
+	  assert( (fPlanePattern & (1U << p->hit->GetPlaneNum())) == 0 );
+	  fPlanePattern |= 1U << p->hit->GetPlaneNum();
+#ifdef MCDATA
+	  if( mcdata ) {
+	    MCHitInfo* mcinfo = dynamic_cast<Podd::MCHitInfo*>(p->hit);
+	    assert( mcinfo );
+	    // TODO: see CollectCoordinates
+	    if( mcinfo->fMCTrack != 0 ) {
+	      fMCTrackPlanePatternFit |= 1U << p->hit->GetPlaneNum();
+	      ++fNMCTrackHitsFit;
+	    }
+	  }
+#endif
+	}
+	if( chi2_test ) {
+	  // Throw out Chi2's outside of selected confidence interval
+	  // NB: Obviously, this requires accurate hit resolutions
+	  //TODO: keep statistics
+	  if( chi2[k] < chi2_interval.first )
+	    continue;
+	  if( chi2[k] > chi2_interval.second )
+	    continue;
+	}
+	fGood = true;
 #ifdef TESTCODE
-      ++fNfits;
+	++fNfits;
 #endif
 #ifdef VERBOSE
-      if( fProjection->GetDebug() > 3 ) cout << "ACCEPTED" << endl;
+	if( fProjection->GetDebug() > 3 ) cout << "ACCEPTED" << endl;
 #endif
+      }
     }
-
-  }// for n_combinations
+    if( l == 0 )
+      break;
+    ++ipt[--l];
+  }// for all combinations
 
   if( !fGood )
     fTrkStat = kNoGoodFit;
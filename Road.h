@@ -8,6 +8,7 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "Hit.h"
+#include "LineFit.h"
 #include "TVector2.h"
 #include <set>
 #include <utility>
@@ -44,7 +45,28 @@ namespace TreeSearch {
     };
 
     typedef std::vector<Road::Point*>  Pvec_t;
-    typedef std::list<const Node_t*>   NodeList_t;
+    typedef std::vector<const Node_t*> NodeList_t;
+
+    //_________________________________________________________________________
+    // The Points of one plane, a range of Point pointers owned by the Road
+    class PointRange {
+    public:
+      typedef Point* const*  const_iterator;
+      typedef const_iterator iterator;
+      typedef UInt_t         size_type;
+      PointRange() : fBegin(0), fEnd(0) {}
+      PointRange( const_iterator b, const_iterator e ) : fBegin(b), fEnd(e) {}
+      const_iterator begin() const { return fBegin; }
+      const_iterator end()   const { return fEnd; }
+      Bool_t         empty() const { return (fBegin == fEnd); }
+      size_type      size()  const { return (size_type)(fEnd-fBegin); }
+      Point*         front() const { assert(!empty()); return *fBegin; }
+      Point* operator[]( size_type i ) const
+      { assert(i<size()); return fBegin[i]; }
+    private:
+      const_iterator fBegin;
+      const_iterator fEnd;
+    };
 
     //_________________________________________________________________________
     // For global variable access/event display
@@ -77,12 +99,19 @@ namespace TreeSearch {
         fMCTrackPlanePatternFit(0),
 #endif
         fPos(0), fSlope(0), fChi2(0), fDof(0), fGood(false), fTrack(0),
-        fBuild(0), fGrown(false), fTrkStat(kTrackOK), fNfits(0) {} // For internal ROOT use
+        fBuild(0), fBuildStore(0), fGrown(false), fTrkStat(kTrackOK),
+        fNfits(0)
+#ifdef TESTCODE
+      , fNalloc(0)
+#endif
+      {} // For internal ROOT use and TClonesArray::ConstructedAt
     Road( const Road& );
     Road& operator=( const Road& );
     virtual ~Road();
 
+    void           Init( const Node_t& nd, const Projection* proj );
     Bool_t         Add( const Node_t& nd );
+    virtual void   Clear( Option_t* opt="" );
     void           ClearGrow() { fGrown = false; }
     virtual Int_t  Compare( const TObject* obj ) const;
     void           Finish();
@@ -91,6 +120,7 @@ namespace TreeSearch {
     UInt_t         GetNdof()    const { return fDof; }
     const Hset_t&  GetHits()    const { return fHits; }
     const Pvec_t&  GetPoints()  const { return fFitCoord; }
+    const FitSums_t& GetFitSums() const { return fSums; }
     Double_t       GetPos()     const { return fPos; }
     Double_t       GetPos( Double_t z ) const { return fPos + z*fSlope; }
     Double_t       GetPosErrsq( Double_t z ) const;
@@ -107,6 +137,9 @@ namespace TreeSearch {
     Bool_t         IsInRange( const Node_t& nd ) const;
     virtual Bool_t IsSortable() const { return kTRUE; }
     Bool_t         IsVoid()     const { return !fGood; }
+#ifdef TESTCODE
+    UInt_t         GetNalloc()  const { return fNalloc; }
+#endif
     virtual void   Print( Option_t* opt="" ) const;
     void           SetGrow() { fGrown = true; }
     void           SetTrack( THaTrack* track ) { fTrack = track; }
@@ -146,8 +179,14 @@ namespace TreeSearch {
 
     NodeList_t     fPatterns;   // Patterns in this road
     Hset_t         fHits;       // All hits linked to the patterns
-    vector<Pvec_t> fPoints;     // All hit coordinates within road [nplanes][]
+    // The Points are stored in fPointBuf, and fPointPtr holds pointers to
+    // them, grouped by plane. All three arrays keep their capacity when the
+    // Road is cleared, so that recycled Roads rarely allocate memory.
+    vector<PointRange> fPoints; //! All hit coordinates in road [nplanes][]
+    vector<Point>  fPointBuf;   //! Storage of the Points
+    Pvec_t         fPointPtr;   //! Pointers to fPointBuf, ordered by plane
     Pvec_t         fFitCoord;   // fPoints used in best fit [nplanes]
+    FitPoints      fCoords;     //! Coordinates of fPoints for fit kernel
     UInt_t         fPlanePattern; // Bitpattern of planes in best fit
 
     const Projection* fProjection; //! Projection that this Road belongs to
@@ -170,18 +209,23 @@ namespace TreeSearch {
     Double_t       fChi2;       // Chi2 of fit
     Double_t       fV[3];       // Covar matrix of param (V11, V12=V21, V22)
     UInt_t         fDof;        // Degrees of freedom of fit (nhits-2)
+    FitSums_t      fSums;       //! Fit sums of fFitCoord
 
     Bool_t         fGood;       // Road successfully fit
     THaTrack*      fTrack;      // The lowest-chi2 3D track using this road
 
     BuildInfo_t*   fBuild;      //! Working data for building
+    BuildInfo_t*   fBuildStore; //! Storage of fBuild, kept for reuse
     Bool_t         fGrown;      //! Add() added hits in front or back plane
     ETrackingStatus fTrkStat;   // Reconstruction status
 
     // Only needed for TESTCODE
     UInt_t         fNfits;      // Statistics: num fits with acceptable chi2
+#ifdef TESTCODE
+    UInt_t         fNalloc;     // Statistics: buffer (re)allocations
+#endif
 
-    Bool_t   CheckMatch( const Hset_t& hits ) const;
+    Bool_t   CheckMatch( const HitSet& set ) const;
     Bool_t   CollectCoordinates();
 
   private:
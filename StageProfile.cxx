@@ -0,0 +1,200 @@
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+// TreeSearch::StageProfile                                                  //
+//                                                                           //
+// Always-available timing of the reconstruction stages (decoding, tree      //
+// search, road building, fitting etc.) of Trackers and Projections.         //
+//                                                                           //
+// The clock is the time stamp counter on x86 and std::chrono::steady_clock  //
+// elsewhere. Reading it costs a few ns, so the profile can be left enabled  //
+// also for microsecond-scale stages. Each stage's latencies are collected   //
+// in a LatencyHist with logarithmic bins, from which Print() estimates      //
+// percentiles at the end of the run.                                        //
+//                                                                           //
+// This file requires C++11 (std::chrono). The header does not, so that it   //
+// can still be processed by rootcint.                                       //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+#include "StageProfile.h"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+
+using namespace std;
+
+namespace TreeSearch {
+
+//_____________________________________________________________________________
+void LatencyHist::Reset()
+{
+  // Clear all entries
+
+  memset( fCount, 0, sizeof(fCount) );
+  fN = fSum = fMax = 0;
+}
+
+//_____________________________________________________________________________
+void LatencyHist::Add( const LatencyHist& rhs )
+{
+  // Add the entries of "rhs" to this histogram
+
+  for( UInt_t i = 0; i < kNbins; ++i )
+    fCount[i] += rhs.fCount[i];
+  fN   += rhs.fN;
+  fSum += rhs.fSum;
+  if( rhs.fMax > fMax )
+    fMax = rhs.fMax;
+}
+
+//_____________________________________________________________________________
+ULong64_t LatencyHist::GetBinLow( UInt_t bin )
+{
+  // Lower edge of the given bin (ticks)
+
+  const UInt_t kNsub = 1 << kSubBits;
+  assert( bin < kNbins );
+  if( bin < kNsub )
+    return bin;
+  UInt_t msb = (bin >> kSubBits) + kSubBits - 1;
+  ULong64_t sub = bin & (kNsub-1);
+  return (kNsub + sub) << (msb-kSubBits);
+}
+
+//_____________________________________________________________________________
+ULong64_t LatencyHist::GetBinWidth( UInt_t bin )
+{
+  // Width of the given bin (ticks)
+
+  assert( bin < kNbins );
+  if( bin < (1U << kSubBits) )
+    return 1;
+  UInt_t msb = (bin >> kSubBits) + kSubBits - 1;
+  return ULong64_t(1) << (msb-kSubBits);
+}
+
+//_____________________________________________________________________________
+Double_t LatencyHist::GetQuantile( Double_t q ) const
+{
+  // Estimate the quantile "q" (0-1) of the entries, in ticks, by linear
+  // interpolation within the bin containing it
+
+  if( fN == 0 )
+    return 0;
+  Double_t target = q*fN, cum = 0;
+  for( UInt_t i = 0; i < kNbins; ++i ) {
+    if( fCount[i] == 0 )
+      continue;
+    if( cum + fCount[i] >= target ) {
+      Double_t x = GetBinLow(i) + GetBinWidth(i)*(target-cum)/fCount[i];
+      return ( x < fMax ) ? x : (Double_t)fMax;
+    }
+    cum += fCount[i];
+  }
+  return fMax;
+}
+
+//_____________________________________________________________________________
+void StageProfile::Init( const char* const* names )
+{
+  // Set up one histogram for each of the given stages
+
+  assert( names );
+  fNames = names;
+  UInt_t n = 0;
+  while( names[n] )
+    ++n;
+  fHist.assign( n, LatencyHist() );
+}
+
+//_____________________________________________________________________________
+void StageProfile::Reset()
+{
+  // Clear the histograms
+
+  for( vector<LatencyHist>::size_type i = 0; i < fHist.size(); ++i )
+    fHist[i].Reset();
+}
+
+//_____________________________________________________________________________
+void StageProfile::Add( const StageProfile& rhs )
+{
+  // Add the histograms of "rhs", which must have the same stages
+
+  assert( rhs.fHist.size() == fHist.size() );
+  for( vector<LatencyHist>::size_type i = 0; i < fHist.size(); ++i )
+    fHist[i].Add( rhs.fHist[i] );
+}
+
+//_____________________________________________________________________________
+void StageProfile::Print( const char* title ) const
+{
+  // Print number of entries, mean, percentiles and maximum of each stage
+  // in microseconds. Stages without entries are skipped.
+
+  bool header = false;
+  for( vector<LatencyHist>::size_type i = 0; i < fHist.size(); ++i ) {
+    const LatencyHist& h = fHist[i];
+    if( h.GetEntries() == 0 )
+      continue;
+    if( !header ) {
+      cout << "Stage latencies (us) of " << title << ":" << endl
+	   << "  " << left << setw(10) << "stage" << right
+	   << setw(10) << "events" << setw(10) << "mean"
+	   << setw(10) << "median" << setw(10) << "90%"
+	   << setw(10) << "99%" << setw(10) << "99.9%"
+	   << setw(10) << "max" << endl;
+      header = true;
+    }
+    cout << "  " << left << setw(10) << fNames[i] << right
+	 << setw(10) << h.GetEntries() << fixed << setprecision(1)
+	 << setw(10) << h.GetMean()/GetTicksPerUs()
+	 << setw(10) << h.GetQuantile(0.5)/GetTicksPerUs()
+	 << setw(10) << h.GetQuantile(0.9)/GetTicksPerUs()
+	 << setw(10) << h.GetQuantile(0.99)/GetTicksPerUs()
+	 << setw(10) << h.GetQuantile(0.999)/GetTicksPerUs()
+	 << setw(10) << ToUs(h.GetMax()) << endl;
+    cout.unsetf( ios::floatfield );
+  }
+}
+
+//_____________________________________________________________________________
+ULong64_t StageProfile::ReadSteadyClock()
+{
+  // Nanoseconds since an arbitrary fixed time
+
+  return chrono::duration_cast<chrono::nanoseconds>
+    ( chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+//_____________________________________________________________________________
+static Double_t CalibrateClock()
+{
+  // Measure the rate of ReadClock() against the steady clock
+
+#ifdef TREESEARCH_HAVE_RDTSC
+  typedef chrono::steady_clock clock;
+  clock::time_point t0 = clock::now();
+  ULong64_t c0 = StageProfile::ReadClock();
+  while( clock::now() - t0 < chrono::milliseconds(20) ) {}
+  ULong64_t c1 = StageProfile::ReadClock();
+  chrono::duration<Double_t,micro> dt = clock::now() - t0;
+  return (c1-c0)/dt.count();
+#else
+  return 1e3;
+#endif
+}
+
+//_____________________________________________________________________________
+Double_t StageProfile::GetTicksPerUs()
+{
+  // Clock ticks per microsecond. The first call takes about 20 ms.
+
+  static const Double_t ticks_per_us = CalibrateClock();
+  return ticks_per_us;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // end namespace TreeSearch
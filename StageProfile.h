@@ -0,0 +1,153 @@
+#ifndef ROOT_TreeSearch_StageProfile
+#define ROOT_TreeSearch_StageProfile
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+// TreeSearch::StageProfile                                                  //
+//                                                                           //
+// Latency histograms of the stages of event reconstruction.                 //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+#include "Rtypes.h"
+#include <vector>
+#include <cassert>
+
+// Use the processor's time stamp counter as the clock where available
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define TREESEARCH_HAVE_RDTSC
+#endif
+
+namespace TreeSearch {
+
+  //___________________________________________________________________________
+  // Histogram of time intervals, in clock ticks, with logarithmic bins.
+  // Each power of 2 is divided into 2^kSubBits bins, giving a resolution of
+  // better than 25% over the full 64-bit range of the clock.
+  class LatencyHist {
+  public:
+    enum { kSubBits = 2, kNbins = 64 << kSubBits };
+
+    LatencyHist() { Reset(); }
+
+    void      Fill( ULong64_t ticks );
+    void      Add( const LatencyHist& rhs );
+    void      Reset();
+
+    ULong64_t GetEntries() const { return fN; }
+    ULong64_t GetMax()     const { return fMax; }
+    Double_t  GetMean()    const { return fN > 0 ? (Double_t)fSum/fN : 0.0; }
+    Double_t  GetQuantile( Double_t q ) const;
+
+    static UInt_t    GetBin( ULong64_t ticks );
+    static ULong64_t GetBinLow( UInt_t bin );
+    static ULong64_t GetBinWidth( UInt_t bin );
+
+  private:
+    UInt_t    fCount[kNbins]; // Entries per bin
+    ULong64_t fN;             // Total entries
+    ULong64_t fSum;           // Sum of entries (ticks)
+    ULong64_t fMax;           // Largest entry (ticks)
+  };
+
+  //___________________________________________________________________________
+  // Latency histograms for a fixed set of named stages. Each instance
+  // must only be filled by one thread at a time, normally the one
+  // processing the object that owns it, so no locking is needed.
+  class StageProfile {
+  public:
+    StageProfile() : fNames(0) {}
+
+    // "names" is a 0-terminated list of stage names. It is not copied.
+    void     Init( const char* const* names );
+    void     Reset();
+    void     Add( const StageProfile& rhs );
+    void     Print( const char* title ) const;
+
+    UInt_t   GetNstages() const { return (UInt_t)fHist.size(); }
+    const LatencyHist& GetHist( UInt_t stage ) const;
+
+    // Record the time since "since" for "stage", set "since" to the
+    // current time and return the interval in microseconds
+    Double_t Lap( UInt_t stage, ULong64_t& since );
+
+    static ULong64_t ReadClock();     // Current time (ticks)
+    static Double_t  GetTicksPerUs(); // Clock calibration
+    static Double_t  ToUs( ULong64_t ticks )
+    { return (Double_t)ticks/GetTicksPerUs(); }
+
+  private:
+    std::vector<LatencyHist> fHist;   // Histograms, one per stage
+    const char* const*       fNames;  // Stage names
+
+    static ULong64_t ReadSteadyClock();
+  };
+
+  //___________________________________________________________________________
+  inline UInt_t LatencyHist::GetBin( ULong64_t ticks )
+  {
+    // Bin number for "ticks". Intervals below 2^kSubBits have a bin each.
+
+    const ULong64_t kNsub = 1 << kSubBits;
+    if( ticks < kNsub )
+      return (UInt_t)ticks;
+    UInt_t msb;
+#ifdef __GNUC__
+    msb = 63 - __builtin_clzll(ticks);
+#else
+    msb = 0;
+    for( ULong64_t t = ticks; t > 1; t >>= 1 )
+      ++msb;
+#endif
+    UInt_t sub = (UInt_t)(ticks >> (msb-kSubBits)) & (kNsub-1);
+    return ((msb-kSubBits+1) << kSubBits) + sub;
+  }
+
+  //___________________________________________________________________________
+  inline void LatencyHist::Fill( ULong64_t ticks )
+  {
+    // Add one entry for an interval of "ticks"
+
+    ++fCount[GetBin(ticks)];
+    ++fN;
+    fSum += ticks;
+    if( ticks > fMax )
+      fMax = ticks;
+  }
+
+  //___________________________________________________________________________
+  inline const LatencyHist& StageProfile::GetHist( UInt_t stage ) const
+  {
+    assert( stage < fHist.size() );
+    return fHist[stage];
+  }
+
+  //___________________________________________________________________________
+  inline ULong64_t StageProfile::ReadClock()
+  {
+    // Read the fastest available monotonic clock
+
+#if defined(TREESEARCH_HAVE_RDTSC) && !defined(__CINT__)
+    UInt_t lo, hi;
+    __asm__ __volatile__( "rdtsc" : "=a"(lo), "=d"(hi) );
+    return (static_cast<ULong64_t>(hi) << 32) | lo;
+#else
+    return ReadSteadyClock();
+#endif
+  }
+
+  //___________________________________________________________________________
+  inline Double_t StageProfile::Lap( UInt_t stage, ULong64_t& since )
+  {
+    assert( stage < fHist.size() );
+    ULong64_t now = ReadClock(), ticks = now - since;
+    fHist[stage].Fill( ticks );
+    since = now;
+    return ToUs( ticks );
+  }
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // end namespace TreeSearch
+
+#endif
@@ -0,0 +1,473 @@
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+// TreeSearch::TaskPool                                                      //
+//                                                                           //
+// Pool of persistent worker threads for running batches of independent      //
+// tasks, e.g. the tracking of each projection or the subtrees of a          //
+// projection's tree search.                                                 //
+//                                                                           //
+// Tasks submitted with Run() go into a bounded lock-free multi-producer/    //
+// multi-consumer queue [D. Vyukov, "Bounded MPMC queue", 1024cores.net].    //
+// Idle workers poll the queue for a short while before going to sleep, so   //
+// that back-to-back batches, as for consecutive low-multiplicity events,    //
+// are picked up without a thread wakeup. Run() blocks until all tasks of    //
+// its batch are finished. When called from a worker thread (i.e. from a     //
+// task), it helps executing queued tasks while waiting, so tasks may        //
+// submit nested batches without the risk of deadlock.                       //
+//                                                                           //
+// Workers can be confined to one NUMA node and pinned to single CPUs. The   //
+// topology is read from /sys/devices/system/node. Placement is only         //
+// supported on Linux. Elsewhere, or if the topology cannot be read or the   //
+// affinity cannot be set, a Warning is issued and the threads run unplaced. //
+//                                                                           //
+// This file requires C++11 (std::thread, std::atomic). The header does      //
+// not, so that it can still be processed by rootcint.                       //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+#include "TaskPool.h"
+#include "TError.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cassert>
+#include <cstdio>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+namespace TreeSearch {
+
+// Number of polls of the queue by an idle thread before it goes to sleep
+static const UInt_t kSpinCount = 2000;
+// Capacity of the task queue (must be a power of 2)
+static const size_t kQueueSize = 4096;
+
+TaskPool* TaskPool::fgPool = 0;
+static mutex gPoolLock;  // Protects fgPool and its fNusers
+
+//_____________________________________________________________________________
+static bool ReadNodeCPUs( UInt_t node, vector<UInt_t>& cpus )
+{
+  // Append the CPUs of the given NUMA node, from its sysfs cpulist, e.g.
+  // "0-7,16-23". Returns false if the node does not exist.
+
+  char path[64];
+  snprintf( path, sizeof(path), "/sys/devices/system/node/node%u/cpulist",
+	    node );
+  FILE* f = fopen( path, "r" );
+  if( !f )
+    return false;
+  UInt_t lo, hi;
+  int c = ',';
+  while( c == ',' and fscanf(f, "%u", &lo) == 1 ) {
+    hi = lo;
+    c = fgetc(f);
+    if( c == '-' ) {
+      if( fscanf(f, "%u", &hi) != 1 )
+	break;
+      c = fgetc(f);
+    }
+    for( UInt_t cpu = lo; cpu <= hi; ++cpu )
+      cpus.push_back(cpu);
+  }
+  fclose(f);
+  return true;
+}
+
+//_____________________________________________________________________________
+static vector<UInt_t> GetCPUs( Int_t node )
+{
+  // CPUs of the given NUMA node, or of all nodes, in node order, if
+  // node < 0. Empty if the topology is unknown.
+
+  vector<UInt_t> cpus;
+  if( node >= 0 )
+    ReadNodeCPUs( node, cpus );
+  else {
+    for( UInt_t i = 0; ReadNodeCPUs(i, cpus); ++i ) {}
+  }
+  return cpus;
+}
+
+//_____________________________________________________________________________
+static bool SetAffinity( thread::native_handle_type thr,
+			 const vector<UInt_t>& cpus )
+{
+  // Allow thread thr to run only on the given CPUs
+
+#ifdef __linux__
+  if( cpus.empty() )
+    return false;
+  cpu_set_t set;
+  CPU_ZERO( &set );
+  for( size_t i = 0; i < cpus.size(); ++i ) {
+    if( cpus[i] < CPU_SETSIZE )
+      CPU_SET( cpus[i], &set );
+  }
+  return ( pthread_setaffinity_np(thr, sizeof(set), &set) == 0 );
+#else
+  (void)thr; (void)cpus;
+  return false;
+#endif
+}
+
+//_____________________________________________________________________________
+// Completion tracking for the tasks of one TaskPool::Run call
+class TaskBatch {
+public:
+  explicit TaskBatch( UInt_t ntasks ) : fRemaining(ntasks), fDone(false) {}
+
+  void Done()
+  {
+    if( fRemaining.fetch_sub(1, memory_order_acq_rel) == 1 ) {
+      lock_guard<mutex> lock(fLock);
+      fDone = true;
+      fCond.notify_one();
+    }
+  }
+  bool IsDone() const { return fRemaining.load(memory_order_acquire) == 0; }
+  void Wait()
+  {
+    // Must always be called before destroying the batch, since Done() may
+    // still be signaling even though IsDone() is already true
+    unique_lock<mutex> lock(fLock);
+    while( !fDone )
+      fCond.wait(lock);
+  }
+
+private:
+  atomic<UInt_t>     fRemaining;  // Number of unfinished tasks
+  mutex              fLock;       // Protects fDone
+  condition_variable fCond;       // Signaled when the last task is done
+  bool               fDone;       // All tasks finished
+};
+
+//_____________________________________________________________________________
+// Queue entry: a task and the batch it belongs to
+struct TaskItem {
+  Task*      task;
+  TaskBatch* batch;
+};
+
+//_____________________________________________________________________________
+// Bounded lock-free MPMC queue of TaskItems
+class TaskQueue {
+public:
+  TaskQueue() : fCells(new Cell[kQueueSize]), fEnq(0), fDeq(0)
+  {
+    for( size_t i = 0; i < kQueueSize; ++i )
+      fCells[i].seq.store(i, memory_order_relaxed);
+  }
+  ~TaskQueue() { delete [] fCells; }
+
+  bool Push( const TaskItem& item )
+  {
+    // Append item. Returns false if the queue is full.
+    Cell* cell;
+    size_t pos = fEnq.load(memory_order_relaxed);
+    while( true ) {
+      cell = &fCells[pos & (kQueueSize-1)];
+      size_t seq = cell->seq.load(memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+      if( dif == 0 ) {
+	if( fEnq.compare_exchange_weak(pos, pos+1, memory_order_relaxed) )
+	  break;
+      } else if( dif < 0 )
+	return false;
+      else
+	pos = fEnq.load(memory_order_relaxed);
+    }
+    cell->item = item;
+    cell->seq.store(pos+1, memory_order_release);
+    return true;
+  }
+  bool Pop( TaskItem& item )
+  {
+    // Remove first item. Returns false if the queue is empty.
+    Cell* cell;
+    size_t pos = fDeq.load(memory_order_relaxed);
+    while( true ) {
+      cell = &fCells[pos & (kQueueSize-1)];
+      size_t seq = cell->seq.load(memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+      if( dif == 0 ) {
+	if( fDeq.compare_exchange_weak(pos, pos+1, memory_order_relaxed) )
+	  break;
+      } else if( dif < 0 )
+	return false;
+      else
+	pos = fDeq.load(memory_order_relaxed);
+    }
+    item = cell->item;
+    cell->seq.store(pos+kQueueSize, memory_order_release);
+    return true;
+  }
+
+private:
+  struct Cell {
+    atomic<size_t> seq;
+    TaskItem       item;
+  };
+  Cell*  fCells;
+  // Keep the producer and consumer positions on separate cache lines
+  alignas(64) atomic<size_t> fEnq;
+  alignas(64) atomic<size_t> fDeq;
+};
+
+//_____________________________________________________________________________
+// Index of the current thread in the pool, or -1 if not a worker
+static thread_local Int_t tWorker = -1;
+
+//_____________________________________________________________________________
+class TaskPool::Impl {
+public:
+  Impl( UInt_t nthreads, Int_t node, bool pin )
+    : fNqueued(0), fNsleeping(0), fTerminate(false)
+  {
+    static const char* const here = "TreeSearch::TaskPool";
+
+    vector<UInt_t> cpus;
+    if( node >= 0 or pin )
+      cpus = GetCPUs(node);
+    if( cpus.empty() and (node >= 0 or pin) )
+      ::Warning( here, "Unknown CPU topology. Thread placement disabled." );
+    fThreads.reserve(nthreads);
+    for( UInt_t i = 0; i < nthreads; ++i ) {
+      fThreads.push_back( thread(&Impl::Work, this, i) );
+      if( cpus.empty() )
+	continue;
+      // Pinned workers fill the CPUs in node order, wrapping around if
+      // there are more workers than CPUs
+      bool ok = pin
+	? SetAffinity( fThreads.back().native_handle(),
+		       vector<UInt_t>(1, cpus[i % cpus.size()]) )
+	: SetAffinity( fThreads.back().native_handle(), cpus );
+      if( !ok and i == 0 )
+	::Warning( here, "Cannot set CPU affinity of worker threads" );
+    }
+  }
+  ~Impl()
+  {
+    {
+      lock_guard<mutex> lock(fSleepLock);
+      fTerminate.store(true);
+      fWake.notify_all();
+    }
+    for( size_t i = 0; i < fThreads.size(); ++i )
+      fThreads[i].join();
+  }
+
+  void Submit( const TaskItem& item )
+  {
+    while( !fQueue.Push(item) ) {
+      // Queue full. Help out if we can, otherwise let the workers catch up
+      if( tWorker < 0 or !RunOne() )
+	this_thread::yield();
+    }
+    fNqueued.fetch_add(1);
+  }
+  void WakeWorkers()
+  {
+    // Wake up sleeping workers. The seq_cst ordering of fNqueued and
+    // fNsleeping guarantees that a worker going to sleep either sees the
+    // new tasks or is seen here.
+    if( fNsleeping.load() > 0 ) {
+      lock_guard<mutex> lock(fSleepLock);
+      fWake.notify_all();
+    }
+  }
+  bool RunOne()
+  {
+    // Execute one queued task in the current (worker) thread, if any
+    assert( tWorker >= 0 );
+    TaskItem item;
+    if( !fQueue.Pop(item) )
+      return false;
+    fNqueued.fetch_sub(1);
+    item.task->Run( tWorker );
+    item.batch->Done();
+    return true;
+  }
+  void Wait( TaskBatch& batch )
+  {
+    // Wait for the tasks of the given batch to finish. Worker threads
+    // execute queued tasks in the meantime; other threads poll for a while
+    // before blocking.
+    UInt_t nspin = 0;
+    while( !batch.IsDone() ) {
+      if( tWorker >= 0 ) {
+	if( !RunOne() )
+	  this_thread::yield();
+      } else if( ++nspin < kSpinCount )
+	this_thread::yield();
+      else
+	break;
+    }
+    batch.Wait();
+  }
+
+private:
+  void Work( UInt_t index )
+  {
+    // Main loop of worker thread number "index"
+    tWorker = index;
+    UInt_t nspin = 0;
+    while( true ) {
+      if( RunOne() ) {
+	nspin = 0;
+	continue;
+      }
+      if( ++nspin < kSpinCount ) {
+	this_thread::yield();
+	continue;
+      }
+      // Nothing to do for a while. Sleep until new tasks are submitted
+      unique_lock<mutex> lock(fSleepLock);
+      fNsleeping.fetch_add(1);
+      while( fNqueued.load() <= 0 and !fTerminate.load() )
+	fWake.wait(lock);
+      fNsleeping.fetch_sub(1);
+      if( fTerminate.load() and fNqueued.load() <= 0 )
+	break;
+      nspin = 0;
+    }
+  }
+
+  TaskQueue          fQueue;      // Queued tasks
+  atomic<Long_t>     fNqueued;    // Tasks in fQueue (may be < 0 briefly)
+  atomic<UInt_t>     fNsleeping;  // Workers waiting on fWake
+  atomic<bool>       fTerminate;  // Workers should exit
+  mutex              fSleepLock;  // Mutex for fWake
+  condition_variable fWake;       // Signals new tasks or termination
+  vector<thread>     fThreads;    // The worker threads
+};
+
+//_____________________________________________________________________________
+TaskPool::TaskPool( UInt_t nthreads, Int_t node, Bool_t pin )
+  : fImpl(0), fNthreads(nthreads > 0 ? nthreads : 1), fNode(node),
+    fPin(pin), fNusers(0)
+{
+  // Constructor. Starts the worker threads.
+
+  fImpl = new Impl(fNthreads, fNode, fPin);
+}
+
+//_____________________________________________________________________________
+TaskPool::~TaskPool()
+{
+  // Destructor. Waits for any queued tasks to finish, then terminates
+  // the worker threads.
+
+  delete fImpl;
+}
+
+//_____________________________________________________________________________
+TaskPool* TaskPool::Acquire( UInt_t nthreads, Int_t node, Bool_t pin )
+{
+  // Return the shared pool. If it does not exist yet, start it with
+  // "nthreads" worker threads, placed according to node and pin (see
+  // header). If it does, its size and placement are not changed since
+  // current users may hold per-worker resources.
+
+  static const char* const here = "TreeSearch::TaskPool::Acquire";
+
+  lock_guard<mutex> lock(gPoolLock);
+  if( !fgPool )
+    fgPool = new TaskPool(nthreads, node, pin);
+  else {
+    if( nthreads > fgPool->fNthreads )
+      ::Info( here, "Sharing existing pool of %u threads (%u requested)",
+	      fgPool->fNthreads, nthreads );
+    if( node != fgPool->fNode or pin != fgPool->fPin )
+      ::Info( here, "Sharing existing pool with placement node = %d, "
+	      "pin = %d", fgPool->fNode, fgPool->fPin );
+  }
+  ++fgPool->fNusers;
+  return fgPool;
+}
+
+//_____________________________________________________________________________
+void TaskPool::Release( TaskPool* pool )
+{
+  // Release the shared pool obtained from Acquire. Stops the threads when
+  // there are no more users.
+
+  if( !pool )
+    return;
+  lock_guard<mutex> lock(gPoolLock);
+  assert( pool == fgPool and pool->fNusers > 0 );
+  if( --pool->fNusers == 0 ) {
+    delete pool;
+    fgPool = 0;
+  }
+}
+
+//_____________________________________________________________________________
+UInt_t TaskPool::GetNnodes()
+{
+  // Number of NUMA nodes of this host. 1 if the topology is unknown.
+
+  vector<UInt_t> cpus;
+  UInt_t n = 0;
+  while( ReadNodeCPUs(n, cpus) )
+    ++n;
+  return ( n > 0 ) ? n : 1;
+}
+
+//_____________________________________________________________________________
+UInt_t TaskPool::GetNodeNcpus( Int_t node )
+{
+  // Number of CPUs of the given NUMA node, or of all nodes if node < 0.
+  // 0 if unknown.
+
+  return (UInt_t)GetCPUs(node).size();
+}
+
+//_____________________________________________________________________________
+Bool_t TaskPool::BindThread( Int_t node )
+{
+  // Restrict the calling thread to the CPUs of the given NUMA node.
+  // With the kernel's default first-touch policy, memory it allocates and
+  // initializes afterwards is then placed on that node.
+  // Returns false if not supported or the node does not exist.
+
+#ifdef __linux__
+  if( node < 0 )
+    return false;
+  return SetAffinity( pthread_self(), GetCPUs(node) );
+#else
+  (void)node;
+  return false;
+#endif
+}
+
+//_____________________________________________________________________________
+void TaskPool::Run( const vector<Task*>& tasks, UInt_t ntasks )
+{
+  // Execute the first "ntasks" (default: all) "tasks" in the worker threads
+  // and return when they are done. The order of execution is undefined.
+
+  if( ntasks > tasks.size() )
+    ntasks = (UInt_t)tasks.size();
+  if( ntasks == 0 )
+    return;
+
+  TaskBatch batch( ntasks );
+  for( UInt_t i = 0; i < ntasks; ++i ) {
+    assert( tasks[i] );
+    TaskItem item = { tasks[i], &batch };
+    fImpl->Submit( item );
+  }
+  fImpl->WakeWorkers();
+  fImpl->Wait( batch );
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // end namespace TreeSearch
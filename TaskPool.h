@@ -0,0 +1,81 @@
+#ifndef ROOT_TreeSearch_TaskPool
+#define ROOT_TreeSearch_TaskPool
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+// TreeSearch::TaskPool                                                      //
+//                                                                           //
+// Persistent set of worker threads executing batches of independent tasks.  //
+// One pool is shared by all Trackers in the process.                        //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+#include "Rtypes.h"
+#include <vector>
+
+namespace TreeSearch {
+
+  //___________________________________________________________________________
+  // Unit of work for a TaskPool. Run() is called exactly once per
+  // TaskPool::Run call, in one of the pool's worker threads.
+  // "worker" is the index (0..GetNthreads()-1) of the executing worker,
+  // which allows tasks to use per-worker resources without locking.
+  class Task {
+  public:
+    virtual void Run( UInt_t worker ) = 0;
+    virtual ~Task() {}
+  };
+
+  //___________________________________________________________________________
+  class TaskPool {
+  public:
+    // Get the shared pool, starting it with "nthreads" workers if it does
+    // not exist yet. Each Acquire must be matched by a Release. The pool
+    // terminates when the last user releases it.
+    // If node >= 0, the workers run only on the CPUs of that NUMA node.
+    // If pin is set, each worker is pinned to a single CPU, filling the
+    // CPUs node by node.
+    static TaskPool* Acquire( UInt_t nthreads, Int_t node = -1,
+			      Bool_t pin = false );
+    static void      Release( TaskPool* pool );
+
+    // NUMA topology of the host (one node if unknown)
+    static UInt_t    GetNnodes();
+    static UInt_t    GetNodeNcpus( Int_t node );
+    // Restrict the calling thread to the CPUs of the given node. Memory it
+    // allocates afterwards is placed on that node (first-touch policy).
+    static Bool_t    BindThread( Int_t node );
+
+    // Execute the first ntasks of the given tasks and wait until all of
+    // them are done. May be called from several threads at the same time,
+    // including from within tasks.
+    void   Run( const std::vector<Task*>& tasks, UInt_t ntasks = kMaxUInt );
+
+    UInt_t GetNthreads() const { return fNthreads; }
+    Int_t  GetNode()     const { return fNode; }
+    Bool_t IsPinned()    const { return fPin; }
+
+    class Impl;  // Defined in implementation
+
+  private:
+    TaskPool( UInt_t nthreads, Int_t node, Bool_t pin );
+    ~TaskPool();
+
+    Impl*    fImpl;      // Threads and task queue
+    UInt_t   fNthreads;  // Number of worker threads
+    Int_t    fNode;      // NUMA node of the workers (-1 = any)
+    Bool_t   fPin;       // Workers pinned to single CPUs
+    UInt_t   fNusers;    // Number of Acquire calls not yet released
+
+    static TaskPool* fgPool;  // The shared pool
+
+    // Prevent copying and assignment
+    TaskPool( const TaskPool& orig );
+    TaskPool& operator=( const TaskPool& rhs );
+  };
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // end namespace TreeSearch
+
+#endif
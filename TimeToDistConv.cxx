@@ -6,13 +6,31 @@
 
 #include "TimeToDistConv.h"
 #include "TMath.h"
+#include "Helper.h"
+#include <cassert>
+#ifdef TREESEARCH_HAVE_AVX2
+#include <immintrin.h>
+#endif
 
 ClassImp(TreeSearch::TimeToDistConv)
 ClassImp(TreeSearch::LinearTTD)
 ClassImp(TreeSearch::TanhFitTTD)
+ClassImp(TreeSearch::TabulatedTTD)
 
 namespace TreeSearch {
 
+//_____________________________________________________________________________
+void TimeToDistConv::ConvertTimesToDist( UInt_t n, const Double_t* time,
+					 Double_t slope, Double_t* dist ) const
+{
+  // Convert the n drift times (s) in "time" to distances (m) in "dist",
+  // all for the same track slope. The default calls ConvertTimeToDist
+  // for each time.
+
+  for( UInt_t i = 0; i < n; ++i )
+    dist[i] = ConvertTimeToDist( time[i], slope );
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //                                                                           //
 // LinearTTD                                                                 //
@@ -135,6 +153,198 @@ Double_t TanhFitTTD::ConvertTimeToDist( Double_t time, Double_t slope ) const
   return d * TMath::Sqrt( 1.0 + slope*slope );
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+// TabulatedTTD                                                              //
+//                                                                           //
+// Lookup table for another converter, for converters that are expensive     //
+// to evaluate. The table holds the converter's distances for time and       //
+// slope values on a regular grid and is interpolated bilinearly. Times      //
+// and slopes outside of the table range are passed to the converter.        //
+// The maximum and RMS interpolation errors, sampled between the grid        //
+// points, are available from GetMaxError() and GetRMSError().               //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+//_____________________________________________________________________________
+TabulatedTTD::TabulatedTTD()
+  : fConv(0), fTmin(0), fTmax(0), fMaxSlope(0), fNtime(0), fNslope(0),
+    fInvDt(0), fInvDs(0), fMaxError(0), fRMSError(0)
+{
+  // Default constructor, for ROOT RTTI. Creates an unusable object.
+}
+
+//_____________________________________________________________________________
+TabulatedTTD::TabulatedTTD( TimeToDistConv* conv, Double_t tmin,
+			    Double_t tmax, UInt_t ntime, Double_t maxslope,
+			    UInt_t nslope )
+  : TimeToDistConv(conv ? conv->GetNparam() : 0),
+    fConv(conv), fTmin(tmin), fTmax(tmax), fMaxSlope(TMath::Abs(maxslope)),
+    fNtime(ntime > 0 ? ntime : 1), fNslope(nslope > 0 ? nslope : 1),
+    fInvDt(0), fInvDs(0), fMaxError(0), fRMSError(0)
+{
+  // Constructor. Tabulate the given converter, which must already be set up,
+  // for times between tmin and tmax (s) in ntime bins, and slopes between
+  // -maxslope and maxslope in nslope bins. Takes ownership of "conv".
+
+  assert( fConv and fTmax > fTmin and fMaxSlope > 0 );
+  MakeTable();
+}
+
+//_____________________________________________________________________________
+TabulatedTTD::~TabulatedTTD()
+{
+  // Destructor
+
+  delete fConv;
+}
+
+//_____________________________________________________________________________
+void TabulatedTTD::MakeTable()
+{
+  // Fill the table from the converter and determine the interpolation error
+
+  fInvDt = fNtime/(fTmax-fTmin);
+  fInvDs = fNslope/(2.0*fMaxSlope);
+  Double_t dt = 1.0/fInvDt, ds = 1.0/fInvDs;
+  fTable.resize( (fNslope+1)*(fNtime+1) );
+  for( UInt_t is = 0; is <= fNslope; ++is ) {
+    Double_t slope = -fMaxSlope + is*ds;
+    for( UInt_t it = 0; it <= fNtime; ++it )
+      fTable[is*(fNtime+1)+it] =
+	fConv->ConvertTimeToDist( fTmin + it*dt, slope );
+  }
+  // Sample the interpolation error between the grid points. Linear
+  // interpolation is worst near the middle of the intervals, except where
+  // the converter has a kink (e.g. at t = t0), hence several points per
+  // time interval
+  const UInt_t kNsub = 4;
+  fMaxError = 0;
+  Double_t sum2 = 0;
+  for( UInt_t is = 0; is < fNslope; ++is ) {
+    Double_t slope = -fMaxSlope + (is+0.5)*ds;
+    for( UInt_t it = 1; it < kNsub*fNtime; ++it ) {
+      Double_t time = fTmin + it*dt/kNsub;
+      Double_t err = ConvertTimeToDist(time, slope) -
+	fConv->ConvertTimeToDist(time, slope);
+      fMaxError = TMath::Max( fMaxError, TMath::Abs(err) );
+      sum2 += err*err;
+    }
+  }
+  fRMSError = TMath::Sqrt( sum2/(fNslope*(kNsub*fNtime-1)) );
+}
+
+//_____________________________________________________________________________
+Double_t TabulatedTTD::GetParameter( UInt_t i ) const
+{
+  // Get i-th parameter of the tabulated converter
+
+  return fConv ? fConv->GetParameter(i) : kBig;
+}
+
+//_____________________________________________________________________________
+Int_t TabulatedTTD::SetParameters( const vector<double>& parameters )
+{
+  // Set parameters of the tabulated converter and recalculate the table
+
+  if( !fConv )
+    return -1;
+  Int_t ret = fConv->SetParameters( parameters );
+  if( ret == 0 )
+    MakeTable();
+  return ret;
+}
+
+//_____________________________________________________________________________
+Double_t TabulatedTTD::ConvertTimeToDist( Double_t time, Double_t slope ) const
+{
+  // Convert time (s) to distance (m) by interpolating in the table.
+  // Slope is the track slope.
+
+  Double_t u = (time-fTmin)*fInvDt, v = (slope+fMaxSlope)*fInvDs;
+  // The negated tests also catch NaNs
+  if( !(u >= 0 and u < fNtime and v >= 0 and v <= fNslope) )
+    return fConv->ConvertTimeToDist( time, slope );
+
+  // At v = fNslope, interpolate in the last slope interval
+  UInt_t it = static_cast<UInt_t>(u);
+  UInt_t is = TMath::Min( static_cast<UInt_t>(v), fNslope-1 );
+  Double_t fu = u-it, fv = v-is;
+  const Double_t* r0 = &fTable[is*(fNtime+1)+it];
+  const Double_t* r1 = r0 + fNtime+1;
+  Double_t d0 = r0[0] + fu*(r0[1]-r0[0]);
+  Double_t d1 = r1[0] + fu*(r1[1]-r1[0]);
+  return d0 + fv*(d1-d0);
+}
+
+#ifdef TREESEARCH_HAVE_AVX2
+//_____________________________________________________________________________
+TREESEARCH_AVX2
+UInt_t TabulatedTTD::ConvertTimesAVX2( UInt_t n, const Double_t* time,
+				       Double_t slope, Double_t v,
+				       Double_t* dist ) const
+{
+  // Convert the first 4*(n/4) of the n drift times four at a time, for the
+  // slope with table coordinate v, which must be within the table. Returns
+  // the number of times done.
+
+  UInt_t i = 0;
+  UInt_t is = TMath::Min( static_cast<UInt_t>(v), fNslope-1 );
+  const Double_t* r0 = &fTable[is*(fNtime+1)];
+  const Double_t* r1 = r0 + fNtime+1;
+  const __m256d vfv = _mm256_set1_pd( v-is );
+  const __m256d tmin = _mm256_set1_pd(fTmin), invdt = _mm256_set1_pd(fInvDt);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d umax = _mm256_set1_pd( static_cast<Double_t>(fNtime) );
+  for( ; i+4 <= n; i += 4 ) {
+    __m256d u = _mm256_mul_pd( _mm256_sub_pd(_mm256_loadu_pd(time+i),tmin),
+			       invdt );
+    __m256d ok = _mm256_and_pd( _mm256_cmp_pd(u,zero,_CMP_GE_OQ),
+				_mm256_cmp_pd(u,umax,_CMP_LT_OQ) );
+    if( _mm256_movemask_pd(ok) != 0xF ) {
+      // Some times outside of the table
+      for( UInt_t j = i; j < i+4; ++j )
+	dist[j] = ConvertTimeToDist( time[j], slope );
+      continue;
+    }
+    __m128i it = _mm256_cvttpd_epi32(u);
+    __m128i it1 = _mm_add_epi32( it, _mm_set1_epi32(1) );
+    __m256d fu = _mm256_sub_pd( u, _mm256_cvtepi32_pd(it) );
+    __m256d a0 = _mm256_i32gather_pd( r0, it, 8 );
+    __m256d b0 = _mm256_i32gather_pd( r0, it1, 8 );
+    __m256d a1 = _mm256_i32gather_pd( r1, it, 8 );
+    __m256d b1 = _mm256_i32gather_pd( r1, it1, 8 );
+    __m256d d0 = _mm256_add_pd( a0, _mm256_mul_pd(fu,_mm256_sub_pd(b0,a0)) );
+    __m256d d1 = _mm256_add_pd( a1, _mm256_mul_pd(fu,_mm256_sub_pd(b1,a1)) );
+    _mm256_storeu_pd( dist+i,
+		      _mm256_add_pd(d0,_mm256_mul_pd(vfv,_mm256_sub_pd(d1,d0))) );
+  }
+  return i;
+}
+#endif
+
+//_____________________________________________________________________________
+void TabulatedTTD::ConvertTimesToDist( UInt_t n, const Double_t* time,
+				       Double_t slope, Double_t* dist ) const
+{
+  // Convert the n drift times (s) in "time" to distances (m) in "dist",
+  // all for the same track slope, by interpolating in the table.
+  // On CPUs with AVX2, four times are converted at a time.
+
+  Double_t v = (slope+fMaxSlope)*fInvDs;
+  if( !(v >= 0 and v <= fNslope) ) {
+    TimeToDistConv::ConvertTimesToDist( n, time, slope, dist );
+    return;
+  }
+  UInt_t i = 0;
+#ifdef TREESEARCH_HAVE_AVX2
+  if( HaveAVX2() )
+    i = ConvertTimesAVX2( n, time, slope, v, dist );
+#endif
+  for( ; i < n; ++i )
+    dist[i] = ConvertTimeToDist( time[i], slope );
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -25,6 +25,9 @@ namespace TreeSearch {
 
     virtual Double_t ConvertTimeToDist( Double_t time,
 					Double_t slope ) const = 0;
+    // Convert n times at once, all with the same slope
+    virtual void     ConvertTimesToDist( UInt_t n, const Double_t* time,
+					 Double_t slope, Double_t* dist ) const;
             UInt_t   GetNparam() const { return fNparam; }
     virtual Double_t GetParameter( UInt_t ) const { return kBig; }
     virtual Int_t    SetParameters( const vector<double>& ) { return 0; }
@@ -97,6 +100,57 @@ protected:
     ClassDef(TanhFitTTD,0)  // TanhFit drift time-to-distance converter
   };
 
+  //___________________________________________________________________________
+  // TabulatedTTD
+  //
+  // Fast approximation of any other converter by bilinear interpolation
+  // in a table of its values on a grid of drift times and slopes
+
+  class TabulatedTTD : public TimeToDistConv {
+
+  public:
+    TabulatedTTD();
+    TabulatedTTD( TimeToDistConv* conv, Double_t tmin, Double_t tmax,
+		  UInt_t ntime, Double_t maxslope, UInt_t nslope );
+    virtual ~TabulatedTTD();
+
+    virtual Double_t ConvertTimeToDist( Double_t time, Double_t slope ) const;
+    virtual void     ConvertTimesToDist( UInt_t n, const Double_t* time,
+					 Double_t slope, Double_t* dist ) const;
+    virtual Double_t GetParameter( UInt_t i ) const;
+    virtual Int_t    SetParameters( const vector<double>& param );
+
+    TimeToDistConv*  GetConverter() const { return fConv; }
+    Double_t         GetMaxError()  const { return fMaxError; }
+    Double_t         GetRMSError()  const { return fRMSError; }
+
+protected:
+
+    TimeToDistConv*  fConv;      // Converter being tabulated (owned)
+    Double_t         fTmin;      // Lower edge of time range (s)
+    Double_t         fTmax;      // Upper edge of time range (s)
+    Double_t         fMaxSlope;  // Table covers slopes in +/- fMaxSlope
+    UInt_t           fNtime;     // Number of time bins
+    UInt_t           fNslope;    // Number of slope bins
+    Double_t         fInvDt;     // 1/time bin width (1/s)
+    Double_t         fInvDs;     // 1/slope bin width
+    vector<Double_t> fTable;     // [(fNslope+1)*(fNtime+1)] distances (m)
+    Double_t         fMaxError;  // Largest deviation from fConv found (m)
+    Double_t         fRMSError;  // RMS deviation from fConv (m)
+
+    void             MakeTable();
+    // Vector part of ConvertTimesToDist, for CPUs with AVX2
+    UInt_t           ConvertTimesAVX2( UInt_t n, const Double_t* time,
+				       Double_t slope, Double_t v,
+				       Double_t* dist ) const;
+
+  private:
+    TabulatedTTD( const TabulatedTTD& );
+    TabulatedTTD& operator=( const TabulatedTTD& );
+
+    ClassDef(TabulatedTTD,0)  // Tabulated drift time-to-distance converter
+  };
+
 ///////////////////////////////////////////////////////////////////////////////
 
 }  // end namespace TreeSearch
@@ -12,6 +12,13 @@
 // horizontal drift chambers and TreeSearch::GEMTracker for sets of GEM      //
 // tracker planes.                                                           //
 //                                                                           //
+// Batch mode (ProcessEvent/ProcessBatch) is for standalone processing       //
+// drivers only, such as tsbench -b. The analyzer's event loop does not use  //
+// it; it tracks one event at a time via CoarseTrack/FineTrack. With more    //
+// than one lane, the global variables of the other lanes are private to     //
+// them, so only the THaTrack results returned per event are available for   //
+// every event of a batch.                                                   //
+//                                                                           //
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "Tracker.h"
@@ -19,21 +26,25 @@
 #include "Projection.h"
 #include "Road.h"
 #include "Helper.h"
+#include "TaskPool.h"
+#include "HitStream.h"
+#include "NormalEquations.h"
 
 #include "THaDetMap.h"
 #include "THaTrack.h"
+#include "THaVarList.h"
+#include "THaRunBase.h"
+#include "THaApparatus.h"
 
 #include "TString.h"
 #include "TMath.h"
 #include "THashTable.h"
 #include "TVector2.h"
-#include "TDecompChol.h"
 #include "TSystem.h"
-#include "TThread.h"
-#include "TCondition.h"
-#include "TMutex.h"
 #include "TBits.h"
 #include "TClass.h"
+#include "TROOT.h"
+#include "TList.h"
 
 #include <iostream>
 #include <algorithm>
@@ -43,9 +54,6 @@
 #include <stdexcept>
 #include <cstring>   // for memset
 
-#ifdef TESTCODE
-#include "TStopwatch.h"
-#endif
 #ifdef MCDATA
 #include "Hit.h"
 #endif
@@ -55,6 +63,11 @@ using namespace Podd;
 
 typedef string::size_type ssiz_t;
 
+// Names of the profiled stages, in the order of Tracker::EStage
+static const char* const kStageNames[] = {
+  "decode", "track2d", "match3d", "fit3d", "coarse", 0
+};
+
 namespace {
 
 // Helper classes for describing a DAQ hardware module and using it with a
@@ -134,6 +147,8 @@ const Double_t kBig = 1e38;
 
 // Default value for minimum difference between all projection angles
 static const Double_t kMinProjAngleDiff = 5.0 * TMath::DegToRad();
+// Minimum number of road combinations for parallel 3D matching
+static const UInt_t   kMinParallelMatch = 2000;
 
 #ifdef MCDATA
 // Reconstruction status bit numbers, for evaluating tracking with MC data
@@ -167,203 +182,397 @@ struct ProjAngle_t {
 };
 
 //_____________________________________________________________________________
-// Support classes for data-processing threads
-
-struct TrackThread {
-  Projection*  proj;    // Projection to be processed
-  Int_t*       status;  // Return status (shared)
-  UInt_t*      running; // Bitfield indicating threads to wait for (shared)
-  TMutex*      start_m; // Mutex for start condition
-  TMutex*      done_m;  // Mutex for done condition
-  TCondition*  start;   // Start condition of tracking threads
-  TCondition*  done;    // Condition indicating all tracking threads done
-  TThread*     thread;  // The actual thread running with these arguments
-  TrackThread()
-    : proj(0), status(0), running(0), start_m(0), done_m(0),
-      start(0), done(0), thread(0) {}
-  ~TrackThread() {
-    if( thread ) {
-      TThread::Delete(thread);
-      delete thread;
-    }
-  }
+// Tracking of one projection, for execution by the TaskPool
+
+class TrackTask : public Task {
+public:
+  explicit TrackTask( Projection* proj ) : fProj(proj), fRet(0)
+  { assert(fProj); }
+  virtual void Run( UInt_t ) { fRet = fProj->Track(); }
+  Int_t GetResult() const { return fRet; }
+private:
+  Projection*  fProj;  // Projection to be processed
+  Int_t        fRet;   // Return value of Track()
 };
 
 //_____________________________________________________________________________
-class ThreadCtrl {
+// Finding the tracks of one Tracker of a concurrent group. Used by
+// Tracker::FindGroupTracks
+class FindTracksTask : public Task {
 public:
-  explicit ThreadCtrl( const vector<Projection*>& vp )
-    : fTrackStatus(0), fTrackToDo(0),
-      fTrackStartM(new TMutex), fTrackDoneM(new TMutex),
-      fTrackStart(new TCondition(fTrackStartM)),
-      fTrackDone(new TCondition(fTrackDoneM))
-  {
-    if( !vp.empty() ) {
-      fTrack.reserve( vp.size() );
-      fTrackStartM->Lock();
-      for( vpsiz_t k = 0; k < vp.size(); ++k ) {
-	TThread* t = AddTrackThread( vp[k] );
-	t->Run();
-      }
-      fTrackStartM->UnLock();
+  explicit FindTracksTask( Tracker* tracker ) : fTracker(tracker)
+  { assert(fTracker); }
+  virtual void Run( UInt_t ) { fTracker->FindTracks(); }
+private:
+  Tracker*  fTracker;  // Tracker to be processed
+};
+
+//_____________________________________________________________________________
+// Task decoding one plane. Used by Tracker::Decode
+class DecodeTask : public Task {
+public:
+  explicit DecodeTask( Plane* plane ) : fPlane(plane), fEvdata(0), fRet(0)
+  { assert(fPlane); }
+  virtual void Run( UInt_t ) { fRet = fPlane->Decode(*fEvdata); }
+  void  SetEvent( const THaEvData* evdata ) { fEvdata = evdata; }
+  Int_t GetResult() const { return fRet; }
+private:
+  Plane*            fPlane;   // Plane to be decoded
+  const THaEvData*  fEvdata;  // Current event data
+  Int_t             fRet;     // Return value of Decode()
+};
+
+//_____________________________________________________________________________
+// Task filling the hitpattern of one projection. Used by Tracker::Decode
+class FillHitpatternTask : public Task {
+public:
+  explicit FillHitpatternTask( Projection* proj ) : fProj(proj)
+  { assert(fProj); }
+  virtual void Run( UInt_t ) { fProj->FillHitpattern(); }
+private:
+  Projection*  fProj;  // Projection to be processed
+};
+
+//_____________________________________________________________________________
+// Search for combinations of roads, one from each projection, that match
+// in 3D according to the criterion of Tracker::MatchRoadsGeneric.
+//
+// The front and back intersections of all pairs of roads from different
+// projections are computed once in the constructor. The search is
+// depth-first over the projections, starting with the last one. Every
+// road added to a partial combination adds its intersections with the
+// roads already selected. The sum of the squared distances of these
+// intersections to their centers of gravity is a lower bound for the
+// matchval of any complete combination containing them, since adding
+// points never decreases it and since the center of gravity minimizes it.
+// Partial combinations whose bound already exceeds the cut are skipped.
+//
+// Optionally, the front intersections of the roads of each projection with
+// each road of the last projection are binned in a 2D grid with cells of
+// size 2*sqrt(cut). In a match, all intersections lie within sqrt(cut) of
+// their center of gravity, hence within 2*sqrt(cut) of each other. Once
+// roads in the last two projections are selected, only the roads of the
+// other projections whose intersection with the last projection's road
+// falls into one of the 3x3 grid cells around the selected pair's
+// intersection are tried. This makes the search close to linear in the
+// number of roads for realistic occupancies, while finding exactly the
+// same matches.
+class RoadMatchSearch {
+public:
+  typedef list< pair<Double_t,Rvec_t> > Mlist_t;
+
+  RoadMatchSearch( const vector<Rvec_t>& roads, const Plane* front,
+		   const Plane* back, Double_t cut, Bool_t use_grid,
+		   Int_t debug );
+
+  // Number of combinations of roads in the last two projections. Search
+  // ranges refer to these.
+  UInt_t GetNouter() const
+  { return fRoads[fNproj-1].size() * fRoads[fNproj-2].size(); }
+  // Find all matches whose roads in the last two projections are outer
+  // combination number "begin" to "end"-1. Results are appended to
+  // "found" in the order in which NthCombination would produce them.
+  UInt_t Search( UInt_t begin, UInt_t end, Mlist_t& found ) const;
+
+private:
+  // Partial sums of the intersections of a partial combination
+  struct Partial_t {
+    TVector2 f, b;    // Sum of front/back intersections
+    Double_t ff, bb;  // Sum of their squared moduli
+    UInt_t   n;       // Number of intersections per plane
+    Partial_t() : ff(0), bb(0), n(0) {}
+    void Add( const TVector2& fx, const TVector2& bx )
+    { f += fx; b += bx; ff += fx.Mod2(); bb += bx.Mod2(); ++n; }
+    Bool_t Exceeds( Double_t cut ) const
+    {
+      // Lower bound of the matchval, with some tolerance for roundoff
+      if( n < 2 ) return false;
+      Double_t bound = ff + bb - (f.Mod2() + b.Mod2())/n;
+      return ( bound - 1e-12*(ff+bb) >= cut );
     }
-  }
+  };
+
+  // Grid cell entry: cell indices and road index
+  struct Cell_t {
+    Int_t  ix, iy;
+    UInt_t ip;
+    bool operator<( const Cell_t& rhs ) const
+    {
+      if( ix != rhs.ix ) return ( ix < rhs.ix );
+      if( iy != rhs.iy ) return ( iy < rhs.iy );
+      return ( ip < rhs.ip );
+    }
+  };
+  typedef vector< vector<UInt_t> > Scratch_t;
 
-  //___________________________________________________________________________
-  ~ThreadCtrl()
+  Int_t  CellIndex( Double_t x ) const
   {
-    // Terminate all running tracking threads
-    if( !fTrack.empty() ) {
-      fTrackDoneM->Lock();
-      fTrackStartM->Lock();
-      fTrackToDo = 0;
-      for( vector<TrackThread>::iterator it = fTrack.begin(); it !=
-	     fTrack.end(); ++it ) {
-	TThread* th = it->thread;
-	if( th and th->GetState() == TThread::kRunningState )
-	  SETBIT(fTrackToDo, it->proj->GetType());
-      }
-      // MSB is termination flag
-      SETBIT(fTrackToDo, kThreadTerminateBit);
-      fTrackStart->Broadcast();
-      fTrackStartM->UnLock();
-      while( true ) {
-#ifndef NDEBUG
-	Int_t ret =
-#endif
-	  fTrackDone->Wait();
-	assert( ret == 0 );
-	if( fTrackToDo == BIT(kThreadTerminateBit) )
-	  break;
+    Double_t i = TMath::Floor( x*fInvCellSize );
+    if( i >  1e9 ) return  1000000000;
+    if( i < -1e9 ) return -1000000000;
+    return static_cast<Int_t>(i);
+  }
+  void   FindCandidates( UInt_t p, const UInt_t* sel,
+			 vector<UInt_t>& cand ) const;
+  const TVector2& FrontXpt( UInt_t p, UInt_t ip, UInt_t q, UInt_t iq ) const
+  { return fFxpts[fPairIdx[p*fNproj+q]][ip*fRoads[q].size()+iq]; }
+  const TVector2& BackXpt( UInt_t p, UInt_t ip, UInt_t q, UInt_t iq ) const
+  { return fBxpts[fPairIdx[p*fNproj+q]][ip*fRoads[q].size()+iq]; }
+  void   Descend( UInt_t p, const Partial_t& part, UInt_t* sel,
+		  Scratch_t& scratch, Mlist_t& found, UInt_t& nfound ) const;
+  void   Evaluate( const UInt_t* sel, Mlist_t& found, UInt_t& nfound ) const;
+
+  const vector<Rvec_t>& fRoads;  // Roads in each projection
+  const Plane*   fFront;         // Front reference plane
+  const Plane*   fBack;          // Back reference plane
+  Double_t       fCut;           // Maximum matchval
+  Int_t          fDebug;         // Debug level
+  UInt_t         fNproj;         // Number of projections
+  UInt_t         fNpairs;        // Number of projection pairs
+  vector<UInt_t> fPairIdx;       // Pair number for projections (p,q), p<q
+  vector< vector<TVector2> > fFxpts;  // Front intersections [pair][ip*nq+iq]
+  vector< vector<TVector2> > fBxpts;  // Back intersections [pair][ip*nq+iq]
+  Double_t       fInvCellSize;   // 1/(grid cell size)
+  vector< vector<Cell_t> > fGrid; // Sorted cells [p*nlast+ilast], or empty
+};
+
+//_____________________________________________________________________________
+RoadMatchSearch::RoadMatchSearch( const vector<Rvec_t>& roads,
+				  const Plane* front, const Plane* back,
+				  Double_t cut, Bool_t use_grid, Int_t debug )
+  : fRoads(roads), fFront(front), fBack(back), fCut(cut), fDebug(debug),
+    fNproj(roads.size()), fNpairs(fNproj*(fNproj-1)/2),
+    fPairIdx(fNproj*fNproj, kMaxUInt), fFxpts(fNpairs), fBxpts(fNpairs),
+    fInvCellSize(0)
+{
+  // Constructor. Computes the intersections of all pairs of roads.
+  // Pairs are numbered in the order (0,1), (0,2), ..., (1,2), ...
+  // If requested, also sets up the grid of front intersections with the
+  // roads of the last projection.
+
+  assert( fNproj >= 3 );
+  Double_t zback = fBack->GetZ();
+  UInt_t k = 0;
+  for( UInt_t p = 0; p < fNproj; ++p ) {
+    for( UInt_t q = p+1; q < fNproj; ++q, ++k ) {
+      fPairIdx[p*fNproj+q] = k;
+      const Rvec_t& rp = fRoads[p];
+      const Rvec_t& rq = fRoads[q];
+      fFxpts[k].reserve( rp.size()*rq.size() );
+      fBxpts[k].reserve( rp.size()*rq.size() );
+      for( Rvec_t::size_type ip = 0; ip < rp.size(); ++ip ) {
+	for( Rvec_t::size_type iq = 0; iq < rq.size(); ++iq ) {
+	  //TODO: weigh with uncertainties of coordinates?
+	  fFxpts[k].push_back( rp[ip]->Intersect(rq[iq], 0.0) );
+	  fBxpts[k].push_back( rp[ip]->Intersect(rq[iq], zback) );
+	}
       }
-      fTrackDoneM->UnLock();
     }
-    // At this point, all threads should have released their condition
-    // waits and mutexes, so clean up is safe
-    delete fTrackDone;
-    delete fTrackStart;
-    delete fTrackDoneM;
-    delete fTrackStartM;
   }
+  assert( k == fNpairs );
 
-  //___________________________________________________________________________
-  Int_t Run( UInt_t maxthreads )
-  {
-    // Run our threads, at most maxthreads at a time
-    if( maxthreads == 0 or fTrack.empty() )
-      return 0;
-    if( maxthreads > kThreadTerminateBit )
-      maxthreads = kThreadTerminateBit;
-    fTrackDoneM->Lock();
-    fTrackStatus = 0;
-    vector<TrackThread>::iterator it = fTrack.begin();
-    while( it != fTrack.end() ) {
-      fTrackStartM->Lock();
-      fTrackToDo = 0;
-      UInt_t n = 0;
-      while( n < maxthreads and it != fTrack.end() ) {
-	SETBIT(fTrackToDo, it->proj->GetType());
-	++n;
-	++it;
-      }
-      // Start tracking within the threads
-      fTrackStart->Broadcast();
-      fTrackStartM->UnLock();
-      while( true ) {
-	// Wait for end of processing
-#ifndef NDEBUG
-	Int_t ret =
-#endif
-	  fTrackDone->Wait();
-	assert( ret == 0 );
-	if( fTrackToDo == 0 )
-	  break;
+  if( !use_grid or fCut <= 0.0 )
+    return;
+  fInvCellSize = 0.5/TMath::Sqrt(fCut);
+  UInt_t q = fNproj-1, nq = fRoads[q].size();
+  fGrid.resize( (fNproj-2)*nq );
+  for( UInt_t p = 0; p+2 < fNproj; ++p ) {
+    for( UInt_t iq = 0; iq < nq; ++iq ) {
+      vector<Cell_t>& grid = fGrid[p*nq+iq];
+      grid.reserve( fRoads[p].size() );
+      for( UInt_t ip = 0; ip < fRoads[p].size(); ++ip ) {
+	const TVector2& x = FrontXpt(p,ip,q,iq);
+	Cell_t cell = { CellIndex(x.X()), CellIndex(x.Y()), ip };
+	grid.push_back( cell );
       }
+      sort( ALL(grid) );
     }
-    fTrackDoneM->UnLock();
-    return fTrackStatus;
   }
+}
 
-  //___________________________________________________________________________
-  static void DoTrack( void* ptr )
-  {
-    TrackThread* arg = reinterpret_cast<TrackThread*>(ptr);
+//_____________________________________________________________________________
+void RoadMatchSearch::FindCandidates( UInt_t p, const UInt_t* sel,
+				      vector<UInt_t>& cand ) const
+{
+  // Put into "cand" the indices of the roads of projection p that may
+  // match the roads already selected in the last two projections, in
+  // ascending order
+
+  UInt_t q = fNproj-1, nq = fRoads[q].size();
+  const vector<Cell_t>& grid = fGrid[p*nq+sel[q]];
+  const TVector2& ctr = FrontXpt(q-1,sel[q-1],q,sel[q]);
+  Int_t cx = CellIndex(ctr.X()), cy = CellIndex(ctr.Y());
+  cand.clear();
+  for( Int_t ix = cx-1; ix <= cx+1; ++ix ) {
+    // Cells (ix,cy-1..cy+1) are contiguous in the sorted grid
+    Cell_t lo = { ix, cy-1, 0 }, hi = { ix, cy+1, kMaxUInt };
+    vector<Cell_t>::const_iterator it = lower_bound( ALL(grid), lo );
+    vector<Cell_t>::const_iterator end = upper_bound( it, grid.end(), hi );
+    for( ; it != end; ++it )
+      cand.push_back( it->ip );
+  }
+  sort( ALL(cand) );
+}
 
-    //  TThread::SetCancelOn();
-    bool terminate = false;
-    arg->start_m->Lock();
-    while( !terminate ) {
+//_____________________________________________________________________________
+UInt_t RoadMatchSearch::Search( UInt_t begin, UInt_t end,
+				Mlist_t& found ) const
+{
+  // Search all combinations of roads whose roads in the last two
+  // projections are outer combination number begin..end-1, i.e.
+  // ( roads[nproj-1][t/n], roads[nproj-2][t%n] ) for t = begin..end-1,
+  // where n = roads[nproj-2].size(). Returns the number of matches found.
 
-      // Wait for start condition
-      while( true ) {
-#ifndef NDEBUG
-	Int_t ret =
-#endif
-	  arg->start->Wait(); // unlocks arg->start_m
-	assert( ret == 0 );
-	terminate = TESTBIT(*arg->running, kThreadTerminateBit);
-	if( TESTBIT(*arg->running, arg->proj->GetType()) or terminate )
-	  break;
-      }
-      arg->start_m->UnLock();
-
-      Int_t nrd = 0;
-      if( !terminate )
-	// Process this event
-	nrd = arg->proj->Track();
-
-      // Ensure we're the only one modifying/testing thread
-      // control data (arg->running)
-      arg->done_m->Lock();
-      // Set error flag, if necessary
-      if( nrd < 0 ) {
-	*arg->status = 1;
+  assert( end <= GetNouter() );
+  UInt_t nfound = 0;
+  UInt_t sel[32];  // Selected road index for each projection
+  assert( fNproj <= sizeof(sel)/sizeof(sel[0]) );
+  UInt_t p = fNproj-2, q = fNproj-1;
+  UInt_t n = fRoads[p].size();
+  Scratch_t scratch( fGrid.empty() ? 0 : fNproj );
+  for( UInt_t t = begin; t < end; ++t ) {
+    sel[q] = t / n;
+    sel[p] = t % n;
+    Partial_t part;
+    part.Add( FrontXpt(p,sel[p],q,sel[q]), BackXpt(p,sel[p],q,sel[q]) );
+    Descend( p-1, part, sel, scratch, found, nfound );
+  }
+  return nfound;
+}
+
+//_____________________________________________________________________________
+void RoadMatchSearch::Descend( UInt_t p, const Partial_t& part, UInt_t* sel,
+			       Scratch_t& scratch, Mlist_t& found,
+			       UInt_t& nfound ) const
+{
+  // Try each road of projection p with the roads selected in projections
+  // p+1...nproj-1, and recurse to the preceding projection unless the
+  // partial combination is hopeless. With the grid, only the candidate
+  // roads near the selected ones are tried.
+
+  const vector<UInt_t>* cand = 0;
+  UInt_t n = fRoads[p].size();
+  if( !fGrid.empty() ) {
+    FindCandidates( p, sel, scratch[p] );
+    cand = &scratch[p];
+    n = cand->size();
+  }
+  for( UInt_t k = 0; k < n; ++k ) {
+    UInt_t ip = cand ? (*cand)[k] : k;
+    sel[p] = ip;
+    Partial_t next(part);
+    for( UInt_t q = p+1; q < fNproj; ++q )
+      next.Add( FrontXpt(p,ip,q,sel[q]), BackXpt(p,ip,q,sel[q]) );
+    if( next.Exceeds(fCut) )
+      continue;
+    if( p == 0 )
+      Evaluate( sel, found, nfound );
+    else
+      Descend( p-1, next, sel, scratch, found, nfound );
+  }
+}
+
+//_____________________________________________________________________________
+void RoadMatchSearch::Evaluate( const UInt_t* sel, Mlist_t& found,
+				UInt_t& nfound ) const
+{
+  // Compute the matchval of the complete combination of roads given by
+  // "sel" and save the combination if it is below the cut
+
+  TVector2 fctr, bctr;
+  for( UInt_t p = 0; p < fNproj; ++p ) {
+    for( UInt_t q = p+1; q < fNproj; ++q ) {
+      fctr += FrontXpt(p,sel[p],q,sel[q]);
+      bctr += BackXpt(p,sel[p],q,sel[q]);
+#ifdef VERBOSE
+      if( fDebug > 3 ) {
+	Road *rd1 = fRoads[p][sel[p]], *rd2 = fRoads[q][sel[q]];
+	UInt_t k = fPairIdx[p*fNproj+q]+1;
+	cout << rd1->GetProjection()->GetName()
+	     << rd2->GetProjection()->GetName()
+	     << " front(" << k << ") = ";
+	FrontXpt(p,sel[p],q,sel[q]).Print();
+	cout << rd1->GetProjection()->GetName()
+	     << rd2->GetProjection()->GetName()
+	     << " back (" << k << ") = ";
+	BackXpt(p,sel[p],q,sel[q]).Print();
       }
-      // Clear the bit for this projection in the status bitfield
-      CLRBIT( *arg->running, arg->proj->GetType() );
-      // If all bits are zero, all threads have finished processing,
-      // in which case we wake up the main thread
-      if( (*arg->running & ~BIT(kThreadTerminateBit)) == 0 )
-	arg->done->Signal();
-
-      if( !terminate )
-	// Ensure that we enter Wait() before the main thread can send the
-	// next Broadcast(). This must come before unlocking arg->done_m,
-	// or else we have a race condition in the main thread.
-	arg->start_m->Lock();
-
-      arg->done_m->UnLock();
+#endif
+    }
+  }
+  fctr /= static_cast<Double_t>( fNpairs );
+  if( !fFront->Contains(fctr) )
+    return;
+  bctr /= static_cast<Double_t>( fNpairs );
+  if( !fBack->Contains(bctr) )
+    return;
+  Double_t matchval = 0.0;
+  for( UInt_t p = 0; p < fNproj; ++p ) {
+    for( UInt_t q = p+1; q < fNproj; ++q ) {
+      matchval += (FrontXpt(p,sel[p],q,sel[q])-fctr).Mod2()
+	+ (BackXpt(p,sel[p],q,sel[q])-bctr).Mod2();
     }
   }
+#ifdef VERBOSE
+  if( fDebug > 3 ) {
+    cout << "fctr = "; fctr.Print();
+    cout << "bctr = "; bctr.Print();
+    cout << "matchval = " << matchval << endl;
+  }
+#endif
+  // We could just connect fctr and bctr here to get an approximate
+  // 3D track. But the linear minimization in FitTrack is the right
+  // way to do this.
 
-  static UInt_t GetMaxThreads() { return kThreadTerminateBit; }
+  if( matchval < fCut ) {
+    Rvec_t selected( fNproj );
+    for( UInt_t p = 0; p < fNproj; ++p )
+      selected[p] = fRoads[p][sel[p]];
+    found.push_back( make_pair(matchval,selected) );
+    ++nfound;
+  }
+}
 
+//_____________________________________________________________________________
+// Task for searching part of the road combinations on the task pool
+class RoadMatchTask : public Task {
+public:
+  RoadMatchTask( const RoadMatchSearch* search, UInt_t begin, UInt_t end )
+    : fSearch(search), fBegin(begin), fEnd(end), fNfound(0) {}
+  virtual void Run( UInt_t ) { fNfound = fSearch->Search(fBegin,fEnd,fFound); }
+  UInt_t GetNfound() const { return fNfound; }
+  const RoadMatchSearch::Mlist_t& GetFound() const { return fFound; }
 private:
-  static const UInt_t kThreadTerminateBit = 8*sizeof(UInt_t)-1; // = 31
+  const RoadMatchSearch* fSearch;  // The search to do
+  UInt_t  fBegin;                  // First outer combination to search
+  UInt_t  fEnd;                    // Last+1 outer combination to search
+  UInt_t  fNfound;                 // Matches found
+  RoadMatchSearch::Mlist_t fFound; // The matches
+};
 
-  TThread* AddTrackThread( Projection* proj ) {
-    assert( proj );
-    fTrack.push_back( TrackThread() );
-    TrackThread* t = &fTrack.back();
-    t->proj    = proj;
-    t->status  = &fTrackStatus;
-    t->running = &fTrackToDo;
-    t->start_m = fTrackStartM;
-    t->done_m  = fTrackDoneM;
-    t->start   = fTrackStart;
-    t->done    = fTrackDone;
-    string tn;
-    tn = "trk_"; tn.append( proj->GetName() );
-    t->thread  = new TThread( tn.c_str(), DoTrack, (void*)t );
-    return t->thread;
-  }
-  vector<TrackThread>  fTrack;        // Tracking thread descriptors
-  Int_t                fTrackStatus;  // Common status variable
-  UInt_t               fTrackToDo;    // Bitfield of threads to wait for
-  TMutex*              fTrackStartM;  // Mutex for start condition
-  TMutex*              fTrackDoneM;   // Mutex for done condition
-  TCondition*          fTrackStart;   // Start condition
-  TCondition*          fTrackDone;    // Finish condition
+//_____________________________________________________________________________
+// Task processing every step-th event of a batch, starting with "first",
+// in one Tracker lane. Event is THaEvData or HitEvent.
+template< typename Event >
+class BatchTask : public Task {
+public:
+  BatchTask( Tracker* lane, const vector<const Event*>& events,
+	     const vector<TClonesArray*>& tracks, vector<Int_t>& status,
+	     UInt_t first, UInt_t step )
+    : fLane(lane), fEvents(&events), fTracks(&tracks), fStatus(&status),
+      fFirst(first), fStep(step) { assert(fLane and fStep > 0); }
+  virtual void Run( UInt_t )
+  {
+    for( UInt_t i = fFirst; i < fEvents->size(); i += fStep )
+      (*fStatus)[i] = fLane->ProcessEvent( *(*fEvents)[i], *(*fTracks)[i] );
+  }
+private:
+  Tracker*                           fLane;    // Tracker to use
+  const vector<const Event*>*        fEvents;  // Events of the batch
+  const vector<TClonesArray*>*       fTracks;  // Output track arrays
+  vector<Int_t>*                     fStatus;  // Tracking status per event
+  UInt_t                             fFirst;   // First event to process
+  UInt_t                             fStep;    // Event number increment
 };
 
 //====================== Tracker class ========================================
@@ -372,11 +581,16 @@ private:
 Tracker::Tracker( const char* name, const char* desc, THaApparatus* app )
   : THaTrackingDetector(name,desc,app), fCrateMap(0),
     fMinProjAngleDiff(kMinProjAngleDiff), fIsRotated(false),
-    fAllPartnered(false), fMaxThreads(1), fThreads(0),
+    fAllPartnered(false), fMaxThreads(1), fNumaNode(-1), fPinThreads(false),
+    fTaskPool(0), fNlanes(1),
+    fLaneVars(0), fIsReplica(false), fConcurrent(false), fGroupLeader(0),
+    fHitRecorder(0), fHitBuffer(0), fInBatch(false), fHitSource(0),
+    fNreplayMissed(0),
     fMinReqProj(3), f3dMatchvalScalefact(1), f3dMatchCut(0),
-    fMinNdof(1), fTrkStat(kTrackOK),
-    fNcombos(0), fN3dFits(0), fEvNum(0),
-    t_track(0), t_3dmatch(0), t_3dfit(0), t_coarse(0)
+    f3dGridMatch(true), f3dFastFit(true),
+    fMinNdof(1), fDoProfile(false), fTrkStat(kTrackOK),
+    fTracksFound(false), fFindRet(0), fNcombos(0), fN3dFits(0), fEvNum(0),
+    t_decode(0), t_track(0), t_3dmatch(0), t_3dfit(0), t_coarse(0)
 #ifdef MCDATA
   , fMCDecoder(0), fMCPointUpdater(0), fChecked(false)
 #endif
@@ -385,6 +599,7 @@ Tracker::Tracker( const char* name, const char* desc, THaApparatus* app )
   // Constructor
 
   SetBit(kProjTrackToZ0);
+  fProfile.Init( kStageNames );
 }
 
 //_____________________________________________________________________________
@@ -394,9 +609,10 @@ Tracker::~Tracker()
   if (fIsSetup)
     RemoveVariables();
 
-  delete fThreads;
-  if( fMaxThreads > 1 )
-    gSystem->Unload("libThread");
+  StopRecording();
+  StopReplay();
+  DeleteLanes();
+  DeleteTrackTasks();
 
   DeleteContainer( fPlanes );
   DeleteContainer( fProj );
@@ -406,9 +622,161 @@ Tracker::~Tracker()
 #endif
 }
 
+//_____________________________________________________________________________
+void Tracker::DeleteLanes()
+{
+  // Delete the batch mode replicas of this Tracker. Their global variables
+  // live in a private list, which must be current while they are removed.
+
+  if( !fLanes.empty() ) {
+    THaVarList* vars = gHaVars;
+    gHaVars = fLaneVars;
+    DeleteContainer( fLanes );
+    gHaVars = vars;
+  }
+  delete fLaneVars;
+  fLaneVars = 0;
+}
+
+//_____________________________________________________________________________
+Tracker* Tracker::MakeReplica() const
+{
+  // Create an uninitialized Tracker of the same type and configuration as
+  // this one, for processing events concurrently in batch mode. Trackers
+  // that support batch mode must override this. The default returns 0.
+
+  return 0;
+}
+
+//_____________________________________________________________________________
+void Tracker::DeleteTrackTasks()
+{
+  // Delete the decoding and tracking tasks and release the worker threads
+
+  DissolveGroup();
+  for( vpsiz_t k = 0; k < fProj.size(); ++k )
+    fProj[k]->SetTaskPool(0);
+  DeleteContainer( fTrackTasks );
+  DeleteContainer( fDecodeTasks );
+  DeleteContainer( fFillTasks );
+  TaskPool::Release( fTaskPool );
+  fTaskPool = 0;
+}
+
+//_____________________________________________________________________________
+void Tracker::MakeGroup()
+{
+  // Group the Trackers of our apparatus that request concurrent tracking
+  // (db "concurrent"). The first one in the apparatus' detector list
+  // leads the group: once per event, it finds the tracks of all members
+  // in parallel in its worker threads. A group of one is not formed.
+
+  static const char* const here = "MakeGroup";
+
+  if( !fConcurrent or !GetApparatus() )
+    return;
+  vector<Tracker*> group;
+  TIter next( GetApparatus()->GetDetectors() );
+  while( TObject* obj = next() ) {
+    Tracker* tracker = dynamic_cast<Tracker*>(obj);
+    if( tracker and tracker->fConcurrent and tracker->IsOK() and
+	tracker->fTaskPool and !tracker->fIsReplica )
+      group.push_back( tracker );
+  }
+  // Only the leader sets up the group. Its Begin() runs before ours.
+  if( group.size() < 2 or group[0] != this )
+    return;
+
+  for( vector<Tracker*>::size_type k = 0; k < group.size(); ++k )
+    group[k]->DissolveGroup();
+  fGroup.swap( group );
+  fGroupTasks.reserve( fGroup.size() );
+  for( vector<Tracker*>::size_type k = 0; k < fGroup.size(); ++k ) {
+    fGroup[k]->fGroupLeader = this;
+    fGroupTasks.push_back( new FindTracksTask(fGroup[k]) );
+  }
+  if( fDebug > 0 )
+    Info( Here(here), "Tracking concurrently with %u Trackers of "
+	  "apparatus %s", GetGroupSize(), GetApparatus()->GetName() );
+}
+
+//_____________________________________________________________________________
+void Tracker::DissolveGroup()
+{
+  // Leave the concurrent tracking group, if any. This dissolves the group
+  // for all its members, since it is only set up for the complete set of
+  // Trackers of the apparatus.
+
+  Tracker* leader = fGroupLeader;
+  if( !leader )
+    return;
+  for( vector<Tracker*>::size_type k = 0; k < leader->fGroup.size(); ++k )
+    leader->fGroup[k]->fGroupLeader = 0;
+  leader->fGroup.clear();
+  DeleteContainer( leader->fGroupTasks );
+}
+
+//_____________________________________________________________________________
+UInt_t Tracker::GetGroupSize() const
+{
+  // Number of Trackers found concurrently with this one, including itself
+
+  return fGroupLeader ? (UInt_t)fGroupLeader->fGroup.size() : 1;
+}
+
+//_____________________________________________________________________________
+void Tracker::FindGroupTracks()
+{
+  // Find the tracks of all members of our concurrent group that have not
+  // been done yet for the current event, one member per task. Must be
+  // called for the group leader.
+
+  assert( !fGroup.empty() and fGroup.size() == fGroupTasks.size() );
+  assert( fTaskPool );
+
+  vector<Task*> tasks;
+  tasks.reserve( fGroupTasks.size() );
+  for( vector<Tracker*>::size_type k = 0; k < fGroup.size(); ++k ) {
+    if( !fGroup[k]->fTracksFound )
+      tasks.push_back( fGroupTasks[k] );
+  }
+  fTaskPool->Run( tasks );
+}
+
+//_____________________________________________________________________________
+static TString RunFileName( const string& name, const THaRunBase* run )
+{
+  // Hit stream file name for "run": "%d" in "name" is replaced with the
+  // run number
+
+  TString filename( name.c_str() );
+  if( run )
+    filename.ReplaceAll( "%d", Form("%u",run->GetNumber()) );
+  return filename;
+}
+
 //_____________________________________________________________________________
 Int_t Tracker::Begin( THaRunBase* run )
 {
+  for( vrsiz_t iproj = 0; iproj < fProj.size(); ++iproj )
+    fProj[iproj]->Begin(run);
+  fProfile.Reset();
+  // The batch mode replicas are not seen by the analyzer
+  for( vector<Tracker*>::size_type k = 0; k < fLanes.size(); ++k ) {
+    Tracker* lane = fLanes[k];
+    lane->fProfile.Reset();
+    for( vpsiz_t iproj = 0; iproj < lane->fProj.size(); ++iproj )
+      lane->fProj[iproj]->GetProfile().Reset();
+  }
+  // Replay and/or record the decoded hits of this run, if requested
+  if( !fIsReplica and !fReplayFile.empty() )
+    StartReplay( RunFileName(fReplayFile, run) );
+  if( !fIsReplica and !fRecordFile.empty() )
+    StartRecording( RunFileName(fRecordFile, run) );
+  // All Trackers of the apparatus are initialized now. Set up concurrent
+  // tracking with them, if requested
+  if( !fIsReplica )
+    MakeGroup();
 #ifdef TESTCODE
   for( vrsiz_t iplane = 0; iplane < fPlanes.size(); ++iplane )
     fPlanes[iplane]->Begin(run);
@@ -433,10 +801,21 @@ void Tracker::Clear( Option_t* opt )
 #ifdef TESTCODE
   size_t nbytes = (char*)&t_coarse - (char*)&fNcombos + sizeof(t_coarse);
   memset( &fNcombos, 0, nbytes );
+#else
+  if( fDoProfile ) {
+    size_t nbytes = (char*)&t_coarse - (char*)&t_decode + sizeof(t_coarse);
+    memset( &t_decode, 0, nbytes );
+  }
 #endif
 
   // Clear tracking status
   fTrkStat = kTrackOK;
+  fCalibTracks.clear();
+  fCalibRoads.clear();
+  fTracksFound = false;
+  fFindRet = 0;
+  fRoadCombos.clear();
+  fNewTracks.clear();
 
 #ifdef MCDATA
   fMCHitBits.clear();
@@ -487,23 +866,72 @@ Int_t Tracker::Decode( const THaEvData& evdata )
   }
 #endif
 
-  // Decode the planes, then fill the hitpatterns in the projections
-  //TODO: multithread?
-  for( vpiter_t it = fProj.begin(); it != fProj.end(); ++it ) {
-    Projection* theProj = *it;
-    Int_t nhits = theProj->Decode( evdata );
+  ULong64_t t0 = DoTiming() ? StageProfile::ReadClock() : 0;
+
+  // Decode the planes, then fill the hitpatterns in the projections.
+  // In replay mode, take the hits from the hit stream instead, if it
+  // has this event.
+  if( fHitSource and ReplayEvent(evdata.GetEvNum()) ) {
 #ifdef MCDATA
-    if( mcdata )
-      mchitcount[theProj->GetType()].min = theProj->GetMinFitPlanes();
+    if( mcdata ) {
+      for( vpsiz_t k = 0; k < fProj.size(); ++k )
+	mchitcount[fProj[k]->GetType()].min = fProj[k]->GetMinFitPlanes();
+    }
 #endif
-    // Sanity cut on overfull planes. nhits < 0 indicates overflow
-    if( nhits < 0 ) {
-      fTrkStat = kTooManyRawHits;
-      continue;
+  } else {
+    // With a task pool, decode all planes in parallel. The planes are
+    // independent, but the hitpattern of a projection needs the hits of
+    // all of its planes. The tasks are ordered by projection, then by plane.
+    if( fTaskPool ) {
+      for( vector<Task*>::size_type k = 0; k < fDecodeTasks.size(); ++k )
+	static_cast<DecodeTask*>(fDecodeTasks[k])->SetEvent( &evdata );
+      fTaskPool->Run( fDecodeTasks );
+    }
+    vector<Task*> filltasks;
+    UInt_t itask = 0;
+    for( vpsiz_t k = 0; k < fProj.size(); ++k ) {
+      Projection* theProj = fProj[k];
+      Int_t nhits = 0;
+      if( fTaskPool ) {
+	for( UInt_t i = 0; i < theProj->GetNallPlanes(); ++i, ++itask ) {
+	  assert( itask < fDecodeTasks.size() );
+	  nhits = Projection::AddPlaneHits( nhits,
+	    static_cast<DecodeTask*>(fDecodeTasks[itask])->GetResult() );
+	}
+      } else
+	nhits = theProj->Decode( evdata );
+#ifdef MCDATA
+      if( mcdata )
+	mchitcount[theProj->GetType()].min = theProj->GetMinFitPlanes();
+#endif
+      // Sanity cut on overfull planes. nhits < 0 indicates overflow
+      if( nhits < 0 ) {
+	fTrkStat = kTooManyRawHits;
+	continue;
+      }
+      // Fill the hitpattern if doing tracking
+      if( TestBit(kDoCoarse) ) {
+	if( fTaskPool )
+	  filltasks.push_back( fFillTasks[k] );
+	else
+	  theProj->FillHitpattern();
+      }
+    }
+    if( fTaskPool ) {
+      assert( itask == fDecodeTasks.size() );
+      fTaskPool->Run( filltasks );
     }
-    // Fill the hitpattern if doing tracking
-    if( TestBit(kDoCoarse) )
-      theProj->FillHitpattern();
+  }
+
+  if( DoTiming() )
+    t_decode = fProfile.Lap( kDecodeStage, t0 );
+
+  // Record the decoded hits, if requested. Batch mode events are written
+  // in order at the end of ProcessBatch.
+  if( fHitBuffer ) {
+    RecordEvent( evdata.GetEvNum() );
+    if( !fIsReplica and !fInBatch and FlushRecordedEvents() != 0 )
+      StopRecording();
   }
 
 #ifdef MCDATA
@@ -556,6 +984,397 @@ Int_t Tracker::Decode( const THaEvData& evdata )
   return 0;
 }
 
+//_____________________________________________________________________________
+Int_t Tracker::MapHitStream( const HitStreamReader& stream )
+{
+  // Associate the planes of the given hit stream with our planes, by name,
+  // for use with LoadEvent. Must be called after Init.
+  // Returns 0 on success, -1 if the stream contains unknown planes.
+
+  vector<string> names;
+  for( UInt_t i = 0; i < stream.GetNplanes(); ++i )
+    names.push_back( stream.GetPlaneName(i) );
+  return MapHitStream( names );
+}
+
+//_____________________________________________________________________________
+Int_t Tracker::MapHitStream( const vector<string>& names )
+{
+  // Use the planes with the given names, in this order, for the plane
+  // indices of the hits passed to LoadEvent. The batch mode lanes are
+  // mapped the same way.
+  // Returns 0 on success, -1 if any of the names is unknown.
+
+  static const char* const here = "MapHitStream";
+
+  fStreamPlanes.clear();
+  for( vector<string>::size_type i = 0; i < names.size(); ++i ) {
+    const char* name = names[i].c_str();
+    Rpvec_t::iterator it = find_if( ALL(fPlanes), Plane::NameEquals(name) );
+    if( it == fPlanes.end() ) {
+      Error( Here(here), "Plane \"%s\" of hit stream not found", name );
+      fStreamPlanes.clear();
+      return -1;
+    }
+    fStreamPlanes.push_back( *it );
+  }
+  for( vector<Tracker*>::size_type k = 0; k < fLanes.size(); ++k ) {
+    Int_t ret = fLanes[k]->MapHitStream( names );
+    assert( ret == 0 );  // Lanes have the same planes as we do
+    (void)ret;
+  }
+  return 0;
+}
+
+//_____________________________________________________________________________
+Int_t Tracker::LoadEvent( const HitEvent& event )
+{
+  // Fill the planes with the recorded hits of "event", then fill the
+  // hitpatterns, like Decode does, but without decoding raw data.
+  // Call Clear() first, and MapHitStream() once for the stream.
+  // Returns 0 on success, -1 if the event refers to unknown planes.
+
+#ifdef TESTCODE
+  fEvNum = event.fEvNum;
+#endif
+  ULong64_t t0 = DoTiming() ? StageProfile::ReadClock() : 0;
+
+  Int_t ret = LoadStreamHits( event );
+
+  if( DoTiming() )
+    t_decode = fProfile.Lap( kDecodeStage, t0 );
+
+  return ret;
+}
+
+//_____________________________________________________________________________
+Int_t Tracker::LoadStreamHits( const HitEvent& event )
+{
+  // Load the hits of "event" into the planes and fill the hitpatterns.
+  // Common part of LoadEvent and replay mode Decode.
+
+  static const char* const here = "LoadEvent";
+
+  // Load the hits of each plane, which are stored contiguously
+  vector<Projection*> overflow;
+  for( UInt_t i = 0; i < event.fNhits; ) {
+    UInt_t ipl = event.fHits[i].fPlane, j = i+1;
+    while( j < event.fNhits and event.fHits[j].fPlane == ipl )
+      ++j;
+    if( ipl >= fStreamPlanes.size() ) {
+      Error( Here(here), "Event %u: invalid plane index %u. Hit stream "
+	     "not mapped?", event.fEvNum, ipl );
+      return -1;
+    }
+    Plane* pl = fStreamPlanes[ipl];
+    Int_t n = pl->LoadHits( event.fHits+i,
+			    event.fMCHits ? event.fMCHits+i : 0, j-i );
+    // Sanity cut on overfull planes, as in Decode
+    if( n < 0 )
+      overflow.push_back( pl->GetProjection() );
+    i = j;
+  }
+
+  // Fill the hitpatterns if doing tracking
+  vector<Task*> filltasks;
+  for( vpsiz_t k = 0; k < fProj.size(); ++k ) {
+    if( find(ALL(overflow), fProj[k]) != overflow.end() ) {
+      fTrkStat = kTooManyRawHits;
+      continue;
+    }
+    if( !TestBit(kDoCoarse) )
+      continue;
+    if( fTaskPool )
+      filltasks.push_back( fFillTasks[k] );
+    else
+      fProj[k]->FillHitpattern();
+  }
+  if( !filltasks.empty() )
+    fTaskPool->Run( filltasks );
+
+  return 0;
+}
+
+//_____________________________________________________________________________
+Int_t Tracker::SetSearchWindow( EProjType type,
+				Double_t front_lo, Double_t front_hi,
+				Double_t back_lo, Double_t back_hi )
+{
+  // Restrict the search in the projection of the given type to tracks
+  // crossing its front and back planes within the given ranges (m, along
+  // the projection axis), e.g. around a calorimeter cluster. Applies to
+  // the current event only. Call between Decode and CoarseTrack.
+  // Returns -1 if there is no projection of this type.
+  //
+  // In batch mode (ProcessBatch), windows would have to be set on each
+  // lane for each event, which is not supported.
+
+  for( vpsiz_t k = 0; k < fProj.size(); ++k ) {
+    if( fProj[k]->GetType() == type ) {
+      fProj[k]->SetSearchWindow( front_lo, front_hi, back_lo, back_hi );
+      return 0;
+    }
+  }
+  return -1;
+}
+
+//_____________________________________________________________________________
+void Tracker::ClearSearchWindows()
+{
+  // Remove the search windows of all projections
+
+  for( vpsiz_t k = 0; k < fProj.size(); ++k )
+    fProj[k]->ClearSearchWindow();
+}
+
+//_____________________________________________________________________________
+void Tracker::EnableProfiling( Bool_t enable )
+{
+  // Enable/disable recording of the stage latencies of this Tracker, its
+  // projections and its batch mode replicas, overriding the database key
+  // "profile". The stage times are only available as global variables if
+  // "profile" was set when Init was called.
+
+  fDoProfile = enable;
+  for( vpsiz_t k = 0; k < fProj.size(); ++k )
+    fProj[k]->SetProfiling( enable );
+  for( vector<Tracker*>::size_type k = 0; k < fLanes.size(); ++k )
+    fLanes[k]->EnableProfiling( enable );
+  if( enable )
+    StageProfile::GetTicksPerUs();
+}
+
+//_____________________________________________________________________________
+Int_t Tracker::StartRecording( const char* filename )
+{
+  // Start writing the decoded hits of all active planes of each event to
+  // the hit stream file "filename", including MC truth data if kMCdata is
+  // set. Also records the events processed by the batch mode lanes.
+  // Returns 0 on success, -1 on error.
+
+  static const char* const here = "StartRecording";
+
+  StopRecording();
+  assert( !fIsReplica );
+  if( !filename or !*filename ) {
+    Error( Here(here), "No hit stream file name given" );
+    return -1;
+  }
+  vector<string> names;
+  for( vrsiz_t i = 0; i < fPlanes.size(); ++i ) {
+    if( !fPlanes[i]->IsDummy() ) {
+      fRecordPlanes.push_back( fPlanes[i] );
+      names.push_back( fPlanes[i]->GetName() );
+    }
+  }
+  Bool_t mc = false;
+#ifdef MCDATA
+  mc = TestBit(kMCdata);
+#endif
+  fHitRecorder = new HitStreamWriter;
+  if( fHitRecorder->Open(filename, names, mc) != 0 ) {
+    delete fHitRecorder;
+    fHitRecorder = 0;
+    fRecordPlanes.clear();
+    return -1;
+  }
+  fHitBuffer = new HitEventBuffer;
+  // The lanes are configured from the same database, so their planes
+  // are in the same order
+  for( vector<Tracker*>::size_type k = 0; k < fLanes.size(); ++k ) {
+    Tracker* lane = fLanes[k];
+    for( vrsiz_t i = 0; i < lane->fPlanes.size(); ++i )
+      if( !lane->fPlanes[i]->IsDummy() )
+	lane->fRecordPlanes.push_back( lane->fPlanes[i] );
+    assert( lane->fRecordPlanes.size() == fRecordPlanes.size() );
+    lane->fHitBuffer = new HitEventBuffer;
+  }
+  if( fDebug > 0 )
+    Info( Here(here), "Recording decoded hits to %s", filename );
+  return 0;
+}
+
+//_____________________________________________________________________________
+Int_t Tracker::StopRecording()
+{
+  // Write any pending events and the index of the hit stream and close it.
+  // Returns 0 on success or if not recording, -1 on error.
+
+  static const char* const here = "StopRecording";
+
+  Int_t ret = 0;
+  if( fHitRecorder ) {
+    ret = FlushRecordedEvents();
+    UInt_t nev = fHitRecorder->GetNevents();
+    if( fHitRecorder->Close() != 0 )
+      ret = -1;
+    if( fDebug > 0 )
+      Info( Here(here), "Recorded %u events", nev );
+    delete fHitRecorder;
+    fHitRecorder = 0;
+  }
+  delete fHitBuffer;
+  fHitBuffer = 0;
+  fRecordPlanes.clear();
+  for( vector<Tracker*>::size_type k = 0; k < fLanes.size(); ++k ) {
+    delete fLanes[k]->fHitBuffer;
+    fLanes[k]->fHitBuffer = 0;
+    fLanes[k]->fRecordPlanes.clear();
+  }
+  return ret;
+}
+
+//_____________________________________________________________________________
+Int_t Tracker::StartReplay( const char* filename )
+{
+  // Take the hits of each event from the hit stream file "filename"
+  // instead of decoding the raw data. The file is memory-mapped, and the
+  // hits are loaded directly from the mapping into the planes, looking up
+  // events by event number. The plane Decode methods are skipped, so any
+  // strip or wire level data of the planes are not available. Events not
+  // found in the stream are decoded normally. The batch mode lanes share
+  // the stream. Returns 0 on success, -1 on error.
+
+  static const char* const here = "StartReplay";
+
+  StopReplay();
+  assert( !fIsReplica );
+  if( !filename or !*filename ) {
+    Error( Here(here), "No hit stream file name given" );
+    return -1;
+  }
+  fHitSource = new HitStreamReader;
+  if( fHitSource->Open(filename) != 0 or MapHitStream(*fHitSource) != 0 ) {
+    delete fHitSource;
+    fHitSource = 0;
+    return -1;
+  }
+#ifdef MCDATA
+  if( TestBit(kMCdata) and !fHitSource->HasMC() )
+    Warning( Here(here), "Hit stream %s has no MC data. Replayed hits will "
+	     "not have MC truth information.", filename );
+#endif
+  fNreplayMissed = 0;
+  for( vector<Tracker*>::size_type k = 0; k < fLanes.size(); ++k ) {
+    Tracker* lane = fLanes[k];
+    lane->fHitSource = fHitSource;
+    lane->fNreplayMissed = 0;
+  }
+  if( fDebug > 0 )
+    Info( Here(here), "Replaying hits of %u events from %s",
+	  fHitSource->GetNevents(), filename );
+  return 0;
+}
+
+//_____________________________________________________________________________
+void Tracker::StopReplay()
+{
+  // Close the replayed hit stream and return to decoding raw data
+
+  static const char* const here = "StopReplay";
+
+  if( fIsReplica ) {
+    // The stream belongs to the main Tracker
+    fHitSource = 0;
+    fStreamPlanes.clear();
+    return;
+  }
+  if( !fHitSource )
+    return;
+  UInt_t nmissed = fNreplayMissed;
+  for( vector<Tracker*>::size_type k = 0; k < fLanes.size(); ++k ) {
+    Tracker* lane = fLanes[k];
+    nmissed += lane->fNreplayMissed;
+    lane->fHitSource = 0;
+    lane->fStreamPlanes.clear();
+  }
+  if( nmissed > 0 )
+    Warning( Here(here), "%u events not found in hit stream were decoded "
+	     "from raw data", nmissed );
+  delete fHitSource;
+  fHitSource = 0;
+  fStreamPlanes.clear();
+}
+
+//_____________________________________________________________________________
+Bool_t Tracker::ReplayEvent( UInt_t evnum )
+{
+  // Load the hits of event number "evnum" from the replayed hit stream.
+  // Returns false if the stream does not have this event or it cannot be
+  // loaded, in which case the event is to be decoded from raw data.
+
+  assert( fHitSource );
+  HitEvent event;
+  if( !fHitSource->FindEvent(evnum, event) ) {
+    if( fNreplayMissed++ == 0 )
+      Warning( Here("Decode"), "Event %u not found in hit stream. Decoding "
+	       "raw data instead.", evnum );
+    return false;
+  }
+  if( LoadStreamHits(event) != 0 ) {
+    // Start over with the raw data
+    for( vrsiz_t i = 0; i < fPlanes.size(); ++i )
+      fPlanes[i]->Clear();
+    for( vpsiz_t k = 0; k < fProj.size(); ++k )
+      fProj[k]->Clear();
+    fTrkStat = kTrackOK;
+    ++fNreplayMissed;
+    return false;
+  }
+  return true;
+}
+
+//_____________________________________________________________________________
+void Tracker::RecordEvent( UInt_t evnum )
+{
+  // Append the current hits of the recorded planes to fHitBuffer
+
+  assert( fHitBuffer );
+  vector<HitRecord>& hits = fHitBuffer->GetHits();
+  vector<MCHitRecord>* mchits = 0;
+#ifdef MCDATA
+  if( TestBit(kMCdata) )
+    mchits = &fHitBuffer->GetMCHits();
+#endif
+  for( vrsiz_t i = 0; i < fRecordPlanes.size(); ++i )
+    fRecordPlanes[i]->SaveHits( hits, mchits, i );
+  fHitBuffer->EndEvent( evnum );
+}
+
+//_____________________________________________________________________________
+Int_t Tracker::FlushRecordedEvents()
+{
+  // Write the buffered events of this Tracker and its batch mode lanes to
+  // the hit stream, in the original event order. ProcessBatch has lane k
+  // process events k, k+nlanes, k+2*nlanes etc., with this Tracker being
+  // lane 0. Returns 0 on success, -1 on error.
+
+  assert( fHitRecorder and fHitBuffer );
+  vector<HitEventBuffer*> buffers( 1, fHitBuffer );
+  for( vector<Tracker*>::size_type k = 0; k < fLanes.size(); ++k )
+    buffers.push_back( fLanes[k]->fHitBuffer );
+  vector<UInt_t> next( buffers.size(), 0 );
+  Int_t ret = 0;
+  HitEvent event;
+  for( bool more = true; more and ret == 0; ) {
+    more = false;
+    for( vector<HitEventBuffer*>::size_type k = 0; k < buffers.size(); ++k ) {
+      assert( buffers[k] );
+      if( next[k] < buffers[k]->GetNevents() ) {
+	buffers[k]->GetEvent( next[k]++, event );
+	if( fHitRecorder->WriteEvent(event) != 0 ) {
+	  ret = -1;
+	  break;
+	}
+	more = true;
+      }
+    }
+  }
+  for( vector<HitEventBuffer*>::size_type k = 0; k < buffers.size(); ++k )
+    buffers[k]->Clear();
+  return ret;
+}
+
 #ifdef MCDATA
 //_____________________________________________________________________________
 void Tracker::MCPointUpdater::UpdateHit( MCTrackPoint* pt, Hit* hit,
@@ -704,8 +1523,7 @@ Int_t Tracker::FitMCPoints( MCTrack* mctrk ) const
   }
 
   // Mimic the fit procedure used in FitTrack, except for the weighting
-  TMatrixDSym AtA(4);
-  TVectorD Aty(4);
+  NormalEquations<4> eqs;
 
   // Fill fit matrixes
   Int_t npoints = 0;
@@ -723,29 +1541,16 @@ Int_t Tracker::FitMCPoints( MCTrack* mctrk ) const
     Double_t x = hitpos.X()*cosa + hitpos.Y()*sina;
     Double_t z = hitpos.Z();
     Double_t Ai[4] = { cosa, cosa*z, sina, sina*z };
-    for( int j = 0; j<4; ++j ) {
-      for( int k = j; k<4; ++k ) {
-	AtA(j,k) += Ai[j] * Ai[k];
-      }
-      Aty(j) += Ai[j] * x;
-    }
+    eqs.Add( Ai, x );
     ++npoints;
   }
   assert( npoints > 4 );  // assured by caller
 
-  for( int j = 0; j<4; ++j )
-    for( int k = j+1; k<4; ++k )
-      AtA(k,j) = AtA(j,k);
-
-  // Solve the normal equations
-  TDecompChol chol(AtA);
-  Bool_t ok = chol.Solve(Aty);
+  // Solve the normal equations. Results are in order x, x', y, y'
+  Double_t coef[4];
+  Bool_t ok = eqs.Solve( coef );
   if( !ok ) return -1;
 
-  // Results are here, in order x, x', y, y'
-  assert( Aty.GetNrows() == 4 );
-  Double_t* coef = Aty.GetMatrixArray();
-
   // Calculate chi2
   //FIXME: too much code duplication here somehow
   Double_t chi2 = 0;
@@ -799,6 +1604,27 @@ Int_t Tracker::FitMCPoints( MCTrack* mctrk ) const
 //_____________________________________________________________________________
 Int_t Tracker::End( THaRunBase* run )
 {
+  // Include the stage latencies and tree profiles of the batch mode
+  // replicas in ours
+  for( vector<Tracker*>::size_type k = 0; k < fLanes.size(); ++k ) {
+    Tracker* lane = fLanes[k];
+    assert( lane->fProj.size() == fProj.size() );
+    fProfile.Add( lane->fProfile );
+    for( vpsiz_t iproj = 0; iproj < fProj.size(); ++iproj ) {
+      fProj[iproj]->GetProfile().Add( lane->fProj[iproj]->GetProfile() );
+      fProj[iproj]->AddNodeCounts( *lane->fProj[iproj] );
+    }
+  }
+  if( fDoProfile ) {
+    fProfile.Print( GetPrefix() );
+    for( vpsiz_t iproj = 0; iproj < fProj.size(); ++iproj )
+      fProj[iproj]->GetProfile().Print( fProj[iproj]->GetPrefix() );
+  }
+  StopRecording();
+  StopReplay();
+
+  for( vrsiz_t iproj = 0; iproj < fProj.size(); ++iproj )
+    fProj[iproj]->End(run);
 #ifdef TESTCODE
   for( vrsiz_t iplane = 0; iplane < fPlanes.size(); ++iplane )
     fPlanes[iplane]->End(run);
@@ -839,38 +1665,6 @@ public:
 };
 #endif
 
-//_____________________________________________________________________________
-class FillFitMatrix
-{
-public:
-  FillFitMatrix( TMatrixDSym& AtA, TVectorD& Aty )
-    : fAtA(AtA), fAty(Aty), fNpoints(0)
-  {
-    assert( fAtA.GetNrows() == 4 && fAty.GetNrows() == 4 );
-  }
-
-  void operator() ( Road* rd, Road::Point* p, const vector<Double_t>& )
-  {
-    const Projection* proj = rd->GetProjection();
-    Double_t cosa = proj->GetCosAngle();
-    Double_t sina = proj->GetSinAngle();
-    Double_t Ai[4] = { cosa, cosa * p->z, sina, sina * p->z };
-    Double_t s2 = 1.0/(p->res()*p->res());
-    for( int j = 0; j<4; ++j ) {
-      for( int k = j; k<4; ++k ) {
-	fAtA(j,k) += Ai[j] * s2 * Ai[k];
-      }
-      fAty(j) += Ai[j] * s2 * p->x;
-    }
-    ++fNpoints;
-  }
-  Int_t GetNpoints() const { return fNpoints; }
-private:
-  TMatrixDSym& fAtA;
-  TVectorD&    fAty;
-  Int_t        fNpoints;
-};
-
 //_____________________________________________________________________________
 class CalcChisquare
 {
@@ -964,6 +1758,41 @@ void Tracker::FitErrPrint( Int_t err ) const
 #endif
 }
 
+//_____________________________________________________________________________
+static Int_t FillNormalEquations( const Rvec_t& roads, NormalEquations<4>& eqs,
+				  Double_t& sxx )
+{
+  // Fill the (At W A) matrix and (At W y) vector of the 3D track fit (see
+  // Tracker::FitTrack) with the points of the given roads. Also sums up
+  // yt W y in sxx. Returns the number of points.
+  //
+  // All points of a road have the same axis angle, so their contributions
+  // follow from the weighted sums of the road's 2D fit, Road::GetFitSums.
+  // With c = cos(a), s = sin(a), A_i = ( c, c*z_i, s, s*z_i ), hence
+  //   sum w_i A_i,j A_i,k = (c or s)*(c or s) * (S11, S12 or S22)
+  //   sum w_i A_i,j y_i   = (c or s) * (G1 or G2)
+
+  Int_t npoints = 0;
+  sxx = 0;
+  for( Rvec_t::const_iterator it = roads.begin(); it != roads.end(); ++it ) {
+    const Road* rd = *it;
+    const FitSums_t& sums = rd->GetFitSums();
+    const Projection* proj = rd->GetProjection();
+    Double_t cs[2] = { proj->GetCosAngle(), proj->GetSinAngle() };
+    Double_t S[3] = { sums.S11, sums.S12, sums.S22 };
+    Double_t G[2] = { sums.G1, sums.G2 };
+    for( int j = 0; j<4; ++j ) {
+      for( int k = j; k<4; ++k ) {
+	eqs.AtA(j,k) += cs[j/2] * cs[k/2] * S[j%2 + k%2];
+      }
+      eqs.Aty(j) += cs[j/2] * G[j%2];
+    }
+    sxx += sums.Sxx;
+    npoints += rd->GetPoints().size();
+  }
+  return npoints;
+}
+
 //_____________________________________________________________________________
 Int_t Tracker::FitTrack( const Rvec_t& roads, vector<Double_t>& coef,
 			 Double_t& chi2, TMatrixDSym* coef_covar ) const
@@ -973,7 +1802,9 @@ Int_t Tracker::FitTrack( const Rvec_t& roads, vector<Double_t>& coef,
   //
   // This is a much streamlined version of ROOT's TLinearFitter that solves
   // the normal equations with weights, (At W A) b = (At W) y, where AWb = Wy,
-  // using Cholesky decomposition, TDecompChol. The model used is
+  // using Cholesky decomposition (NormalEquations, which does the same
+  // arithmetic as TDecompChol, but without heap allocations). The model
+  // used is
   //   y_i = P_i * T_i
   //       = ( x + z_i * mx, y + z_i * my) * ( cos(a_i), sin(a_i) )
   // where
@@ -1002,33 +1833,23 @@ Int_t Tracker::FitTrack( const Rvec_t& roads, vector<Double_t>& coef,
   // The return value is the number of degrees of freedom of the fit, i.e.
   // npoints-4 > 0, or negative if too few points or matrix inversion error
 
-  // Fill the (At W A) matrix and (At W y) vector with the measured points
-  TMatrixDSym AtA(4);
-  TVectorD Aty(4);
-  FillFitMatrix f = ForAllTrackPoints(roads, coef, FillFitMatrix(AtA, Aty));
-
-  Int_t npoints = f.GetNpoints();
+  NormalEquations<4> eqs;
+  Double_t sxx;
+  Int_t npoints = FillNormalEquations( roads, eqs, sxx );
   assert( npoints > 4 );
   if( npoints <=4 ) return -1; // Meaningful fit not possible
 
-  // FillFitMatrix only fills the upper triangle for efficiency
-  //TODO: make a function of FillFitMatrix?
-  for( int j = 0; j<4; ++j )
-    for( int k = j+1; k<4; ++k )
-      AtA(k,j) = AtA(j,k);
-
   // Invert the characteristic matrix and solve the normal equations.
   // As in ROOT's TLinearFitter, we use a Cholesky decomposition
   // to do this (since AtA is symmetric and positive-definite).
   // For more speed but less accuracy, one could use TMatrixDSymCramerInv.
-  TDecompChol chol(AtA);
-  Bool_t ok = chol.Solve(Aty);
+  Double_t b[4];
+  Bool_t ok = eqs.Solve( b );
   assert(ok);
   if( !ok ) return -2; //Urgh, decomposition failed. Should never happen
 
   // Copy results to output vector in order x, x', y, y'
-  assert( Aty.GetNrows() == 4 );
-  coef.assign( Aty.GetMatrixArray(), Aty.GetMatrixArray()+Aty.GetNrows() );
+  coef.assign( b, b+4 );
 
 #ifdef VERBOSE
   if( fDebug > 2 ) {
@@ -1044,9 +1865,11 @@ Int_t Tracker::FitTrack( const Rvec_t& roads, vector<Double_t>& coef,
   if( coef_covar ) {
     if( coef_covar->GetNrows() != 4 )
       coef_covar->ResizeTo(4,4);
-    Bool_t ok = chol.Invert(*coef_covar);
+    Double_t covar[16];
+    Bool_t ok = eqs.Invert( covar );
     assert(ok);
     if( !ok ) return -3; // Urgh, inversion failed. Should never happen
+    coef_covar->SetMatrixArray( covar );
   }
 
 #ifdef VERBOSE
@@ -1060,6 +1883,41 @@ Int_t Tracker::FitTrack( const Rvec_t& roads, vector<Double_t>& coef,
   return npoints-4;
 }
 
+//_____________________________________________________________________________
+Int_t Tracker::FitTrackChi2( const Rvec_t& roads, Double_t& chi2 ) const
+{
+  // Fast version of FitTrack that only computes the chi2 of the fit, for
+  // ranking candidate road combinations. The chi2 is obtained from the fit
+  // sums as yt W y - bt (At W y) instead of from the residuals of the
+  // individual points. It agrees with that of FitTrack to rounding
+  // precision.
+  //
+  // Returns the number of degrees of freedom, as FitTrack.
+
+  NormalEquations<4> eqs;
+  Double_t sxx;
+  Int_t npoints = FillNormalEquations( roads, eqs, sxx );
+  assert( npoints > 4 );
+  if( npoints <=4 ) return -1;
+
+  Double_t aty[4];
+  for( int j = 0; j<4; ++j )
+    aty[j] = eqs.Aty(j);
+  Double_t b[4];
+  Bool_t ok = eqs.Solve( b );
+  assert(ok);
+  if( !ok ) return -2;
+
+  chi2 = sxx;
+  for( int j = 0; j<4; ++j )
+    chi2 -= b[j] * aty[j];
+  // Guard against cancellation for fits with (nearly) zero residuals
+  if( chi2 < 0 )
+    chi2 = 0;
+
+  return npoints-4;
+}
+
 //_____________________________________________________________________________
 Int_t Tracker::NewTrackCalc( Int_t , THaTrack*, const TVector3&,
 			     const TVector3&, const FitRes_t& )
@@ -1159,14 +2017,16 @@ THaTrack* Tracker::NewTrack( TClonesArray& tracks, const FitRes_t& fit_par )
   }
 #endif
 
+  // Save the fit coordinates of the hits used by this track
+  ForAllTrackPoints( *fit_par.roads, fit_par.coef, AddFitCoord() );
+
   // For any planes in calibration mode, save the hits closest to this track.
   // Minimizing the hit residuals is the standard procedure for alignment
-  // calibration.
-  ForAllTrackPoints( *fit_par.roads, fit_par.coef, AddFitCoord() );
-  for( Rpvec_t::const_iterator it = fCalibPlanes.begin(); it !=
-	 fCalibPlanes.end(); ++it ) {
-    Plane* pl = *it;
-    pl->RecordNearestHits( newTrack, *fit_par.roads );
+  // calibration. The hits are looked up for all tracks of the event at
+  // once, see RecordCalibHits.
+  if( !fCalibPlanes.empty() ) {
+    fCalibTracks.push_back( newTrack );
+    fCalibRoads.push_back( *fit_par.roads );
   }
 
   // Do additional calculations for the new track (used by derived classes)
@@ -1175,6 +2035,24 @@ THaTrack* Tracker::NewTrack( TClonesArray& tracks, const FitRes_t& fit_par )
   return newTrack;
 }
 
+//_____________________________________________________________________________
+void Tracker::RecordCalibHits()
+{
+  // For any planes in calibration mode, save the hits closest to each of
+  // the tracks found by NewTrack. Each plane looks up all the tracks in a
+  // single pass over its sorted hits.
+
+  if( !fCalibTracks.empty() ) {
+    for( Rpvec_t::const_iterator it = fCalibPlanes.begin(); it !=
+	   fCalibPlanes.end(); ++it ) {
+      Plane* pl = *it;
+      pl->RecordNearestHits( fCalibTracks, fCalibRoads );
+    }
+  }
+  fCalibTracks.clear();
+  fCalibRoads.clear();
+}
+
 //_____________________________________________________________________________
 class CheckTypes : public unary_function<Road*,void>
 {
@@ -1343,6 +2221,13 @@ UInt_t Tracker::MatchRoadsGeneric( vector<Rvec_t>& roads, const UInt_t ncombos,
   //  - compute weighted center of gravity of intersection points
   //  - sum dist^2 of points to center of gravity -> matchval
   // Requires at least 3 projections
+  //
+  // The intersections of each pair of roads are computed only once, and
+  // partial combinations that cannot pass the cut are not completed
+  // (see RoadMatchSearch). With f3dGridMatch, only roads that are close
+  // to each other in a grid of the front intersections are combined at
+  // all. For large numbers of combinations, the search is split among the
+  // threads of the task pool, if enabled.
 
   vector<Rvec_t>::size_type nproj = roads.size();
   assert( nproj >= 3 );
@@ -1352,76 +2237,43 @@ UInt_t Tracker::MatchRoadsGeneric( vector<Rvec_t>& roads, const UInt_t ncombos,
     cout << "generic algo):";
 #endif
 
-  // Vector holding a combination of roads to test. One road from each
-  // projection
-  Rvec_t selected;
-
+  RoadMatchSearch search( roads, fPlanes.front(), fPlanes.back(),
+			  f3dMatchCut, f3dGridMatch, fDebug );
+  UInt_t nouter = search.GetNouter();
   UInt_t nfound = 0;
-  Double_t zback = fPlanes.back()->GetZ();
 
-  vector<TVector2> fxpts, bxpts;
-  fxpts.reserve( nproj*(nproj-1)/2 );
-  bxpts.reserve( nproj*(nproj-1)/2 );
-
-  for( UInt_t i = 0; i < ncombos; ++i ) {
-    Double_t matchval = 0.0;
-
-    NthCombination( i, roads, selected );
-    assert( selected.size() == nproj );
-
-    fxpts.clear();
-    bxpts.clear();
-    TVector2 fctr, bctr;
-    for( Rvec_t::iterator it1 = selected.begin(); it1 != selected.end();
-	 ++it1 ) {
-      for( Rvec_t::iterator it2 = it1+1; it2 != selected.end(); ++it2 ) {
-	//TODO: weigh with uncertainties of coordinates?
-	fxpts.push_back( (*it1)->Intersect(*it2, 0.0) );
-	bxpts.push_back( (*it1)->Intersect(*it2, zback) );
-	fctr += fxpts.back();
-	bctr += bxpts.back();
+  if( fTaskPool and ncombos >= kMinParallelMatch and nouter > 1
 #ifdef VERBOSE
-	Road *rd1 = *it1, *rd2 = *it2;
-	if( fDebug > 3 ) {
-	  cout << rd1->GetProjection()->GetName()
-	       << rd2->GetProjection()->GetName()
-	       << " front(" << fxpts.size() << ") = ";
-	  fxpts.back().Print();
-	  cout << rd1->GetProjection()->GetName()
-	       << rd2->GetProjection()->GetName()
-	       << " back (" << bxpts.size() << ") = ";
-	  bxpts.back().Print();
-	}
+      and fDebug <= 3  // Keep debug printout in order
 #endif
-      }
+      ) {
+    // Split the outer combinations into a few chunks per thread, then
+    // collect the results in the same order as the serial search would
+    UInt_t ntasks = min( nouter, 4*fTaskPool->GetNthreads() );
+    vector<RoadMatchTask> tasks;
+    vector<Task*> taskp;
+    tasks.reserve( ntasks );
+    taskp.reserve( ntasks );
+    for( UInt_t k = 0; k < ntasks; ++k ) {
+      tasks.push_back( RoadMatchTask(&search, (k*nouter)/ntasks,
+				     ((k+1)*nouter)/ntasks) );
+      taskp.push_back( &tasks.back() );
     }
-    assert( fxpts.size() <= nproj*(nproj-1)/2 );
-    assert( bxpts.size() == fxpts.size() );
-    fctr /= static_cast<Double_t>( fxpts.size() );
-    if( !fPlanes.front()->Contains(fctr) )
-      continue;
-    bctr /= static_cast<Double_t>( fxpts.size() );
-    if( !fPlanes.back()->Contains(bctr) )
-      continue;
-    for( vector<TVector2>::size_type k = 0; k < fxpts.size(); ++k ) {
-      matchval += (fxpts[k]-fctr).Mod2() + (bxpts[k]-bctr).Mod2();
-    }
-#ifdef VERBOSE
-    if( fDebug > 3 ) {
-      cout << "fctr = "; fctr.Print();
-      cout << "bctr = "; bctr.Print();
-      cout << "matchval = " << matchval << endl;
+    fTaskPool->Run( taskp );
+    for( UInt_t k = 0; k < ntasks; ++k ) {
+      const RoadMatchSearch::Mlist_t& found = tasks[k].GetFound();
+      for( RoadMatchSearch::Mlist_t::const_iterator it = found.begin();
+	   it != found.end(); ++it )
+	Add3dMatch( it->second, it->first, combos_found, unique_found );
+      nfound += tasks[k].GetNfound();
     }
-#endif
-    // We could just connect fctr and bctr here to get an approximate
-    // 3D track. But the linear minimization in FitTrack is the right
-    // way to do this.
-
-    if( matchval < f3dMatchCut ) {
-      ++nfound;
-      Add3dMatch( selected, matchval, combos_found, unique_found );
-    }
-  } //for(ncombos)
+  } else {
+    RoadMatchSearch::Mlist_t found;
+    nfound = search.Search( 0, nouter, found );
+    for( RoadMatchSearch::Mlist_t::const_iterator it = found.begin();
+	 it != found.end(); ++it )
+      Add3dMatch( it->second, it->first, combos_found, unique_found );
+  }
 
   return nfound;
 }
@@ -1690,24 +2542,56 @@ Int_t Tracker::CoarseTrack( TClonesArray& tracks )
 {
   // Find tracks from the hitpatterns, using the coarse hit drift times
   // uncorrected for track slope, timing offset, fringe field effects etc.
+  //
+  // If this Tracker is tracked concurrently with others of its apparatus
+  // (db "concurrent"), the first one of the group called for an event finds
+  // the tracks of all of them at once. The others then only add their
+  // tracks to "tracks", in the same order as if run one after the other.
+
+  if( !fTracksFound ) {
+    if( fGroupLeader )
+      fGroupLeader->FindGroupTracks();
+    else
+      FindTracks();
+  }
+  assert( fTracksFound );
+  return MakeTracks( tracks );
+}
+
+//_____________________________________________________________________________
+Int_t Tracker::FindTracks()
+{
+  // Find the tracks of the current event: track the projections, match
+  // their roads in 3D and fit and select the track candidates. The results
+  // are kept in fNewTracks until MakeTracks adds them to a track array.
+  // Thread-safe with respect to other Trackers; does not create any
+  // ROOT objects other than the roads of the projections.
 
-  //  static const char* const here = "CoarseTrack";
+  assert( !fTracksFound );
+  fTracksFound = true;
+  fFindRet = -1;
 
   if( fTrkStat != 0 )
-    return -1;
+    return fFindRet;
 
   if( !TestBit(kDoCoarse) ) {
     fTrkStat = kNoTrackingRequested;
-    return 0;
+    return fFindRet = 0;
   }
 
-#ifdef TESTCODE
-  TStopwatch timer, timer_tot;
-#endif
+  Bool_t timing = DoTiming();
+  ULong64_t t0 = 0, tstart = 0;
+  if( timing )
+    t0 = tstart = StageProfile::ReadClock();
 
   Int_t err = 0;
-  if( fMaxThreads > 1 ) {
-    err = fThreads->Run( fMaxThreads );
+  if( fTaskPool ) {
+    // Track all projections in parallel
+    fTaskPool->Run( fTrackTasks );
+    for( vector<Task*>::size_type k = 0; k < fTrackTasks.size(); ++k ) {
+      if( static_cast<TrackTask*>(fTrackTasks[k])->GetResult() < 0 )
+	err = 1;
+    }
   } else {
     // Single-threaded execution: Track() each projection in turn
     for( vpiter_t it = fProj.begin(); it != fProj.end(); ++it ) {
@@ -1719,7 +2603,7 @@ Int_t Tracker::CoarseTrack( TClonesArray& tracks )
   // Abort on error (e.g. too many patterns)
   if( err != 0 ) {
     fTrkStat = kProjTrackError;
-    return -1;
+    return fFindRet;
   }
   // Copy pointers to roads from each projection into local 2D vector
   // (projections, roads).
@@ -1736,53 +2620,54 @@ Int_t Tracker::CoarseTrack( TClonesArray& tracks )
 
     Int_t nrd = proj->GetNgoodRoads();
     if( nrd > 0 ) {
-      // Count number of projections with at least one road
-      ++nproj;
-      SETBIT( found_types, type );
-      // Add pointers to the good roads to the appropriate vector
+      // Add pointers to the good roads to the appropriate vector.
+      // If a search window is set, skip roads outside of it.
       roads.push_back( Rvec_t() );
       roads.back().reserve(nrd);
       for( UInt_t i = 0; i < proj->GetNroads(); ++i ) {
 	Road* rd = proj->GetRoad(i);
 	assert(rd);
-	if( rd->IsGood() )
+	if( rd->IsGood() and proj->IsInSearchWindow(rd) )
 	  roads.back().push_back(rd);
       }
+      if( roads.back().empty() ) {
+	roads.pop_back();
+	continue;
+      }
+      // Count number of projections with at least one road
+      ++nproj;
+      SETBIT( found_types, type );
     }
   }
   assert( roads.size() == nproj );
-#ifdef TESTCODE
-  t_track = 1e6*timer.RealTime();
-  timer.Start();
-#endif
+  if( timing )
+    t_track = fProfile.Lap( kTrackStage, t0 );
 
   // Combine track projections to 3D tracks
   if( nproj >= fMinReqProj ) {
-    // Vector holding the results (vectors of roads with good matchval)
-    list< pair<Double_t,Rvec_t> > road_combos;
-    // Set of the unique roads occurring in the road_combos elements
+    // The results are kept in fRoadCombos (vectors of roads with good
+    // matchval), which the selected fits refer to.
+    // Set of the unique roads occurring in the fRoadCombos elements
     Rset_t unique_found;
 
     // Find matching combinations of roads
-    UInt_t nfits = MatchRoads( roads, road_combos, unique_found );
+    UInt_t nfits = MatchRoads( roads, fRoadCombos, unique_found );
 
-#ifdef TESTCODE
-    t_3dmatch = 1e6*timer.RealTime();
-    timer.Start();
-#endif
+    if( timing )
+      t_3dmatch = fProfile.Lap( k3dMatchStage, t0 );
     // Fit each set of matched roads using linear least squares, yielding
     // the 3D track parameters, x, x'(=mx), y, y'(=my)
     FitRes_t fit_par;
     fit_par.coef.reserve(4);
     if( nfits == 1 ) {
       // If there is only one combo (typical case), life is simple:
-      fit_par.matchval    = road_combos.front().first;
-      Rvec_t& these_roads = road_combos.front().second;
+      fit_par.matchval    = fRoadCombos.front().first;
+      Rvec_t& these_roads = fRoadCombos.front().second;
       fit_par.roads       = &these_roads;
       fit_par.ndof = FitTrack( these_roads, fit_par.coef, fit_par.chi2 );
       if( fit_par.ndof > 0 ) {
 	if( PassTrackCuts(fit_par) )
-	  NewTrack( tracks, fit_par );
+	  fNewTracks.push_back( fit_par );
 	else
 	  fTrkStat = kFailedTrackCuts;
       }
@@ -1796,12 +2681,17 @@ Int_t Tracker::CoarseTrack( TClonesArray& tracks )
       FitResMap_t fit_results;
       multimap< TrackFitWeight, Rset_t > fit_chi2;
       // Fit all combinations and sort the results by ascending chi2
-      for( list< pair<Double_t,Rvec_t> >::iterator it = road_combos.begin();
-	   it != road_combos.end(); ++it ) {
+      for( list< pair<Double_t,Rvec_t> >::iterator it = fRoadCombos.begin();
+	   it != fRoadCombos.end(); ++it ) {
 	fit_par.matchval    = it->first;
 	Rvec_t& these_roads = it->second;
 	fit_par.roads       = &these_roads;
-	fit_par.ndof = FitTrack( these_roads, fit_par.coef, fit_par.chi2 );
+	if( f3dFastFit )
+	  // Only rank the fits here. The tracks that are kept are refit
+	  // in full below
+	  fit_par.ndof = FitTrackChi2( these_roads, fit_par.chi2 );
+	else
+	  fit_par.ndof = FitTrack( these_roads, fit_par.coef, fit_par.chi2 );
 	if( fit_par.ndof > 0 ) {
 	  if( PassTrackCuts(fit_par) ) {
 	    Rset_t road_tuple( ALL(these_roads) );
@@ -1824,10 +2714,11 @@ Int_t Tracker::CoarseTrack( TClonesArray& tracks )
 	  FitResMap_t::iterator found = fit_results.find((*it).second);
 	  FitRes_t& r = (*found).second;
 	  cout	 << "ndof = " << r.ndof
-		 << " rchi2 = " << r.chi2/(double)r.ndof
-		 << " x/y = " << r.coef[0] << "/" << r.coef[2]
-		 << " mx/my = " << r.coef[1] << "/" << r.coef[3]
-		 << endl;
+		 << " rchi2 = " << r.chi2/(double)r.ndof;
+	  if( !r.coef.empty() )  // Not yet fitted with f3dFastFit
+	    cout << " x/y = " << r.coef[0] << "/" << r.coef[2]
+		 << " mx/my = " << r.coef[1] << "/" << r.coef[3];
+	  cout << endl;
 	}
       }
 #endif
@@ -1846,7 +2737,15 @@ Int_t Tracker::CoarseTrack( TClonesArray& tracks )
 	  // Retrieve the fit results for this tuple
 	  FitResMap_t::iterator found = fit_results.find(*it);
 	  assert( found != fit_results.end() );
-	  NewTrack( tracks, (*found).second );
+	  FitRes_t& res = (*found).second;
+	  if( f3dFastFit ) {
+	    res.ndof = FitTrack( *res.roads, res.coef, res.chi2 );
+	    if( res.ndof <= 0 ) {
+	      FitErrPrint( res.ndof );
+	      continue;
+	    }
+	  }
+	  fNewTracks.push_back( res );
 	}
       }
       else {
@@ -1857,29 +2756,10 @@ Int_t Tracker::CoarseTrack( TClonesArray& tracks )
       fTrkStat = kFailed3DMatch;
     } //if(nfits)
 
+    if( timing )
+      t_3dfit = fProfile.Lap( k3dFitStage, t0 );
 #ifdef TESTCODE
     fN3dFits = nfits;
-    t_3dfit = 1e6*timer.RealTime();
-#endif
-#ifdef VERBOSE
-    if( fDebug > 0 ) {
-      Int_t ntr = tracks.GetLast()+1;
-      cout << ntr << " track";
-      if( ntr != 1 ) cout << "s";
-      if( nfits > 1 ) cout << " after chi2 optimization";
-      if( fDebug > 1 and ntr > 0 ) {
-	cout << ":" << endl;
-	for( Int_t i = 0; i < ntr; ++i ) {
-	  THaTrack* tr = (THaTrack*)tracks.UncheckedAt(i);
-	  cout << "3D track:  x/y = " << tr->GetX() << "/" << tr->GetY()
-	       << " mx/my = " << tr->GetTheta() << "/" << tr->GetPhi()
-	       << " ndof = "  << tr->GetNDoF()
-	       << " rchi2 = " << tr->GetChi2()/static_cast<double>(tr->GetNDoF())
-	       << endl;
-	}
-      } else
-	cout << endl;
-    }
 #endif
   }
   else {
@@ -1905,9 +2785,46 @@ Int_t Tracker::CoarseTrack( TClonesArray& tracks )
 #endif
   } //if(nproj>=fMinReqProj)
 
-#ifdef TESTCODE
-    t_coarse = 1e6*timer_tot.RealTime();
+  if( timing )
+    t_coarse = fProfile.Lap( kCoarseStage, tstart );
+  return fFindRet = 0;
+}
+
+//_____________________________________________________________________________
+Int_t Tracker::MakeTracks( TClonesArray& tracks )
+{
+  // Add the tracks selected by FindTracks to "tracks" and record the
+  // nearest hits of the calibration planes
+
+  if( fFindRet != 0 )
+    return fFindRet;
+
+  for( vector<FitRes_t>::size_type i = 0; i < fNewTracks.size(); ++i )
+    NewTrack( tracks, fNewTracks[i] );
+  RecordCalibHits();
+
+#ifdef VERBOSE
+  if( fDebug > 0 and fTrkStat != kTooFewProj and
+      fTrkStat != kNoTrackingRequested ) {
+    Int_t ntr = tracks.GetLast()+1;
+    cout << ntr << " track";
+    if( ntr != 1 ) cout << "s";
+    if( fRoadCombos.size() > 1 ) cout << " after chi2 optimization";
+    if( fDebug > 1 and ntr > 0 ) {
+      cout << ":" << endl;
+      for( Int_t i = 0; i < ntr; ++i ) {
+	THaTrack* tr = (THaTrack*)tracks.UncheckedAt(i);
+	cout << "3D track:  x/y = " << tr->GetX() << "/" << tr->GetY()
+	     << " mx/my = " << tr->GetTheta() << "/" << tr->GetPhi()
+	     << " ndof = "  << tr->GetNDoF()
+	     << " rchi2 = " << tr->GetChi2()/static_cast<double>(tr->GetNDoF())
+	     << endl;
+      }
+    } else
+      cout << endl;
+  }
 #endif
+
   // Quit here to let detectors CoarseProcess() the approximate tracks,
   // so that they can determine the corrections that we need when we
   // continue in FineTrack
@@ -1935,6 +2852,129 @@ Int_t Tracker::FineTrack( TClonesArray& /* tracks */ )
   return 0;;
 }
 
+//_____________________________________________________________________________
+Int_t Tracker::ProcessEvent( const THaEvData& evdata, TClonesArray& tracks )
+{
+  // Do all processing of one event: clear, decode, coarse and fine tracking.
+  // The found tracks are put into "tracks", which is cleared first.
+  // Returns the tracking status (ETrackingStatus).
+
+  tracks.Clear("C");
+  Clear();
+  Decode( evdata );
+  // Batch mode processes this Tracker's events independently of the
+  // other Trackers, so find the tracks here even if grouped
+  FindTracks();
+  MakeTracks( tracks );
+  FineTrack( tracks );
+
+  return fTrkStat;
+}
+
+//_____________________________________________________________________________
+Int_t Tracker::ProcessEvent( const HitEvent& event, TClonesArray& tracks )
+{
+  // Same as ProcessEvent for raw data, but take the hits of the event from
+  // a record of a hit stream, as LoadEvent does. The hit stream must be
+  // mapped with MapHitStream.
+
+  tracks.Clear("C");
+  Clear();
+  LoadEvent( event );
+  FindTracks();
+  MakeTracks( tracks );
+  FineTrack( tracks );
+
+  return fTrkStat;
+}
+
+//_____________________________________________________________________________
+Int_t Tracker::ProcessBatch( const vector<const THaEvData*>& events,
+			     const vector<TClonesArray*>& tracks,
+			     vector<Int_t>* status )
+{
+  // Batch mode: track the given decoded events. The tracks found in
+  // events[i] are returned in tracks[i], and, if requested, the tracking
+  // status in (*status)[i], so results are in the original event order.
+  //
+  // If batch_lanes > 1 is set in the database, up to that many events are
+  // processed at the same time, each by its own replica of this Tracker
+  // (a "lane"), on the shared task pool. Within each event, projections
+  // are still tracked in parallel, so the decoding, tree search, road
+  // fitting and 3D matching of different events overlap. Each replica
+  // processes every GetNlanes()-th event of the batch.
+  //
+  // This is meant for standalone processing drivers that can hand over
+  // several events at once, such as tsbench (option -b, with events from
+  // a hit stream). The analyzer never calls it, so batch_lanes has no
+  // effect in a normal replay. Only the tracks and status are returned per
+  // event: after a batch, the event-by-event data of this Tracker and its
+  // global variables are those of the last event it processed itself, and
+  // the global variables of the other lanes cannot be reached. The events
+  // must remain valid until this function returns.
+  // Returns 0 on success, or -1 if the input is inconsistent.
+
+  return RunBatch( events, tracks, status );
+}
+
+//_____________________________________________________________________________
+Int_t Tracker::ProcessBatch( const vector<const HitEvent*>& events,
+			     const vector<TClonesArray*>& tracks,
+			     vector<Int_t>* status )
+{
+  // Batch mode for recorded hits: same as ProcessBatch for raw data, with
+  // the events loaded as by LoadEvent. MapHitStream also maps the stream
+  // for the lanes.
+
+  return RunBatch( events, tracks, status );
+}
+
+//_____________________________________________________________________________
+template< typename Event >
+Int_t Tracker::RunBatch( const vector<const Event*>& events,
+			 const vector<TClonesArray*>& tracks,
+			 vector<Int_t>* status )
+{
+  // Common implementation of the ProcessBatch variants
+
+  static const char* const here = "ProcessBatch";
+
+  if( tracks.size() != events.size() ) {
+    Error( Here(here), "Number of track arrays (%u) differs from number "
+	   "of events (%u)", static_cast<UInt_t>(tracks.size()),
+	   static_cast<UInt_t>(events.size()) );
+    return -1;
+  }
+  vector<Int_t> stat_local;
+  vector<Int_t>& stat = status ? *status : stat_local;
+  stat.assign( events.size(), kTrackOK );
+  if( events.empty() )
+    return 0;
+
+  UInt_t nlanes = GetNlanes();
+  if( nlanes == 1 or events.size() == 1 ) {
+    BatchTask<Event>( this, events, tracks, stat, 0, 1 ).Run(0);
+    return 0;
+  }
+  assert( fTaskPool );
+  vector< BatchTask<Event> > tasks;
+  vector<Task*> taskp;
+  tasks.reserve( nlanes );
+  taskp.reserve( nlanes );
+  for( UInt_t k = 0; k < nlanes and k < events.size(); ++k ) {
+    Tracker* lane = ( k == 0 ) ? this : fLanes[k-1];
+    tasks.push_back( BatchTask<Event>(lane, events, tracks, stat, k, nlanes) );
+    taskp.push_back( &tasks.back() );
+  }
+  fInBatch = ( fHitBuffer != 0 );
+  fTaskPool->Run( taskp );
+  fInBatch = false;
+  if( fHitBuffer and FlushRecordedEvents() != 0 )
+    StopRecording();
+
+  return 0;
+}
+
 //_____________________________________________________________________________
 Int_t Tracker::DefineVariables( EMode mode )
 {
@@ -1957,14 +2997,23 @@ Int_t Tracker::DefineVariables( EMode mode )
 #ifdef TESTCODE
       { "ncombos",    "Number of road combinations",        "fNcombos" },
       { "nfits",      "Number of 3D track fits done",       "fN3dFits" },
+#endif
+      { 0 }
+    };
+    DefineVarsFromList( vars_tracking, mode );
+  }
+
+  // Stage times, if measured
+  if( DoTiming() ) {
+    RVarDef vars_timing[] = {
+      { "t_decode",   "Time decoding/filling hitpatterns (us)", "t_decode" },
       { "t_track",    "Time in 1st stage tracking (us)",    "t_track" },
       { "t_3dmatch",  "Time in MatchRoads (us)",            "t_3dmatch" },
       { "t_3dfit",    "Time fitting/selecting 3D tracks (us)", "t_3dfit" },
       { "t_coarse",   "Total time in CoarseTrack (us)",     "t_coarse" },
-#endif
       { 0 }
     };
-    DefineVarsFromList( vars_tracking, mode );
+    DefineVarsFromList( vars_timing, mode );
   }
   return 0;
 }
@@ -2227,22 +3276,89 @@ THaAnalysisObject::EStatus Tracker::Init( const TDatime& date )
     }
   }
 
-  // If threading requested, load thread library and start up threads
+  // If threading requested, start up the worker threads, or share them
+  // with other Trackers
+  DeleteTrackTasks();
   if( fMaxThreads > 1 ) {
-    delete fThreads; fThreads = 0;
-    if( gSystem->Load("libThread") >= 0 ) {
-      fThreads = new ThreadCtrl( fProj );
+    fTaskPool = TaskPool::Acquire( fMaxThreads, fNumaNode, fPinThreads );
+    fTrackTasks.reserve( fProj.size() );
+    for( vpsiz_t k = 0; k < fProj.size(); ++k ) {
+      fTrackTasks.push_back( new TrackTask(fProj[k]) );
+      fFillTasks.push_back( new FillHitpatternTask(fProj[k]) );
+      for( UInt_t i = 0; i < fProj[k]->GetNallPlanes(); ++i )
+	fDecodeTasks.push_back( new DecodeTask(fProj[k]->GetAllPlane(i)) );
+      // The workers also run the subtree searches of projections that
+      // split their tree search (split_depth > 0)
+      fProj[k]->SetTaskPool( fTaskPool );
+    }
+    if( fDebug > 0 )
+      Info( Here(here), "Using %u worker threads", fTaskPool->GetNthreads() );
+  }
+
+  // Concurrent tracking with other Trackers runs their FindTracks in our
+  // worker threads. The group itself is set up in Begin().
+  if( fConcurrent and !fIsReplica ) {
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+    if( !fTaskPool ) {
+      Warning( Here(here), "concurrent = 1 requires more than one thread. "
+	       "Concurrent tracking disabled." );
+      fConcurrent = false;
+    } else
+      ROOT::EnableThreadSafety();
+#else
+    Warning( Here(here), "Concurrent tracking requires ROOT 6.06 or later. "
+	     "Disabled." );
+    fConcurrent = false;
+#endif
+  }
+
+  // For batch mode, set up replicas of ourselves that process events
+  // concurrently. They are initialized from the same database, but their
+  // global variables are kept out of gHaVars.
+  DeleteLanes();
+  if( fNlanes > 1 and !fIsReplica ) {
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+    if( !fTaskPool ) {
+      Warning( Here(here), "batch_lanes = %u requires more than one thread. "
+	       "Batch mode disabled.", fNlanes );
     } else {
-      // Error loading library
-      Warning( Here(here), "Error loading thread library. Falling back to "
-	       "single-threaded processing." );
-      fMaxThreads = 1;
+      ROOT::EnableThreadSafety();
+      fLaneVars = new THaVarList;
+      THaVarList* vars = gHaVars;
+      gHaVars = fLaneVars;
+      for( UInt_t k = 1; k < fNlanes; ++k ) {
+	Tracker* lane = MakeReplica();
+	if( !lane ) {
+	  Warning( Here(here), "Batch mode not supported by class %s. "
+		   "Disabled.", ClassName() );
+	  break;
+	}
+	lane->fIsReplica = true;
+	fLanes.push_back( lane );
+	if( lane->Init(date) != kOK ) {
+	  gHaVars = vars;
+	  Error( Here(here), "Error initializing batch mode lane %u", k );
+	  DeleteLanes();
+	  return fStatus = kInitError;
+	}
+      }
+      gHaVars = vars;
+      if( fDebug > 0 and !fLanes.empty() )
+	Info( Here(here), "Batch mode with %u events in flight", GetNlanes() );
     }
+#else
+    Warning( Here(here), "Batch mode requires ROOT 6.06 or later. "
+	     "Disabled." );
+#endif
   }
 
   // Keep a simple flag for the rotation status for efficiency.
   fIsRotated = !fRotation.IsIdentity();
 
+  // Calibrate the profiling clock now rather than in the first event
+  if( DoTiming() )
+    StageProfile::GetTicksPerUs();
+
 #ifdef MCDATA
   // Set up handler for MC data
   if( TestBit(kMCdata) ) {
@@ -2263,9 +3379,13 @@ Int_t Tracker::ReadDatabase( const TDatime& date )
 
   fIsInit = kFALSE;
   // Delete existing configuration (in case we are re-initializing)
+  DeleteTrackTasks();
+  StopRecording();
+  StopReplay();
   DeleteContainer( fProj );
   DeleteContainer( fPlanes );
   fCalibPlanes.clear();
+  fStreamPlanes.clear();
 
   FILE* file = OpenFile( date );
   if( !file ) return kFileError;
@@ -2287,14 +3407,16 @@ Int_t Tracker::ReadDatabase( const TDatime& date )
   // Putting this container on the stack may cause strange stack overflows!
   vector<vector<Int_t> > *cmap = new vector<vector<Int_t> >;
 
-  string planeconfig, calibconfig;
+  string planeconfig, calibconfig, record_hits, replay_hits;
   f3dMatchCut = 1e-4;
   Int_t event_display = 0, disable_tracking = 0,
-    disable_finetrack = 0, disable_chi2 = 0, proj_to_z0 = 1;
+    disable_finetrack = 0, disable_chi2 = 0, proj_to_z0 = 1, grid_match = 1,
+    fast_fit = 1;
 #ifdef MCDATA
   Int_t mc_data = 0;
 #endif
-  Int_t maxthreads = -1;
+  Int_t maxthreads = -1, batch_lanes = 1, profile = 0, numa_node = -1,
+    pin_threads = 0, concurrent = 0;
   fDBmaxmiss = -1;
   fDBconf_level = 1e-9;
   ResetBit( k3dFastMatch ); // Set in Init()
@@ -2314,7 +3436,16 @@ Int_t Tracker::ReadDatabase( const TDatime& date )
     { "3d_maxmiss",        &fDBmaxmiss,        kInt,    0, 1 },
     { "3d_chi2_conflevel", &fDBconf_level,     kDouble, 0, 1 },
     { "3d_disable_chi2",   &disable_chi2,      kInt,    0, 1 },
+    { "3d_gridmatch",      &grid_match,        kInt,    0, 1 },
+    { "3d_fastfit",        &fast_fit,          kInt,    0, 1 },
     { "maxthreads",        &maxthreads,        kInt,    0, 1 },
+    { "numa_node",         &numa_node,         kInt,    0, 1 },
+    { "pin_threads",       &pin_threads,       kInt,    0, 1 },
+    { "batch_lanes",       &batch_lanes,       kInt,    0, 1 },
+    { "concurrent",        &concurrent,        kInt,    0, 1 },
+    { "profile",           &profile,           kInt,    0, 1 },
+    { "record_hits",       &record_hits,       kString, 0, 1 },
+    { "replay_hits",       &replay_hits,       kString, 0, 1 },
     { 0 }
   };
 
@@ -2361,6 +3492,11 @@ Int_t Tracker::ReadDatabase( const TDatime& date )
   SetBit( kDoFine,        !(disable_tracking or disable_finetrack) );
   SetBit( kDoChi2,        !disable_chi2 );
   SetBit( kProjTrackToZ0, proj_to_z0 );
+  f3dGridMatch = (grid_match != 0);
+  f3dFastFit = (fast_fit != 0);
+  fDoProfile = (profile != 0);
+  fRecordFile = record_hits;
+  fReplayFile = replay_hits;
 
   cout << endl;
   if( fDebug > 0 ) {
@@ -2438,12 +3574,29 @@ Int_t Tracker::ReadDatabase( const TDatime& date )
   // has priority. maxthreads = 0 or negative indicates that the number of
   // CPUs/cores of the current host should be used. If not available, use 1.
   // To ensure single-threaded processing, set maxthreads = 1 in the database.
-  // The number of threads is capped by the maximum that the ThreadCtrl class
-  // supports - currently 31 due to the size of UInt_t, which is more than
-  // enough since we never run more threads than the number of projections.
+  // The worker threads are shared by all Trackers in the process (see
+  // TaskPool). The first Tracker to start them determines their number.
+  //
+  // With numa_node >= 0, the calling thread and the workers are restricted
+  // to the CPUs of that NUMA node, e.g. to run one analysis process per
+  // socket. Since this happens before the projections are initialized,
+  // their pattern trees and hitpatterns are then allocated on that node.
+  // pin_threads pins each worker to its own CPU.
+  fNumaNode = -1;
+  if( numa_node >= 0 ) {
+    if( TaskPool::BindThread(numa_node) )
+      fNumaNode = numa_node;
+    else
+      Warning( Here(here), "Cannot bind to NUMA node %d (host has %u). "
+	       "Ignoring numa_node.", numa_node, TaskPool::GetNnodes() );
+  }
+  fPinThreads = (pin_threads != 0);
+  UInt_t nodecpus = ( fNumaNode >= 0 ) ? TaskPool::GetNodeNcpus(fNumaNode) : 0;
   bool warn = false;
   if( maxthreads > 0 )
     fMaxThreads = maxthreads;
+  else if( nodecpus > 0 )
+    fMaxThreads = nodecpus;
   else {
     SysInfo_t sysifo;
     gSystem->GetSysInfo( &sysifo );
@@ -2454,14 +3607,17 @@ Int_t Tracker::ReadDatabase( const TDatime& date )
       fMaxThreads = 1;
     }
   }
-  // Limit number of threads to what ThreadCtrl can support (currently = 31)
-  fMaxThreads = min(fMaxThreads, ThreadCtrl::GetMaxThreads());
   if( warn )
     Warning( Here(here), "Cannot determine number of CPU cores. "
 	     "Falling back to single-threaded processing." );
   else if( fDebug > 0 )
     Info( Here(here), "Enabled up to %u threads", fMaxThreads );
 
+  // Number of events to process concurrently in ProcessBatch
+  fNlanes = ( batch_lanes > 1 ) ? batch_lanes : 1;
+  // Track concurrently with the other Trackers of the apparatus
+  fConcurrent = (concurrent != 0);
+
   fIsInit = kTRUE;
   return kOK;
 }
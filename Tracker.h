@@ -12,7 +12,9 @@
 #include "THaTrackingDetector.h"
 #include "THaDetMap.h"
 #include "Types.h"
+#include "StageProfile.h"
 #include <vector>
+#include <string>
 #include <utility>
 #include <set>
 #include <list>
@@ -32,6 +34,7 @@ class TClonesArray;
 class THashTable;
 class TClass;
 class TSeqCollection;
+class THaVarList;
 
 using std::vector;
 
@@ -40,7 +43,13 @@ namespace TreeSearch {
   class Projection;
   class Road;
   class Hit;
-  class ThreadCtrl;  // Defined in implementation
+  class TaskPool;
+  class Task;
+  class HitStreamReader;
+  class HitStreamWriter;
+  class HitEventBuffer;
+  struct HitEvent;
+  class FindTracksTask;
 
   typedef std::vector<Road*> Rvec_t;
   typedef std::set<Road*>    Rset_t;
@@ -67,6 +76,57 @@ namespace TreeSearch {
     virtual Int_t   End( THaRunBase* r=0 );
 
     void            EnableEventDisplay( Bool_t enable = true );
+
+    // Batch mode: process several events concurrently. For standalone
+    // drivers only; not called by the analyzer's event loop (see .cxx).
+    // The events are either raw data or recorded hits (see LoadEvent).
+    Int_t           ProcessEvent( const THaEvData& evdata,
+				  TClonesArray& tracks );
+    Int_t           ProcessEvent( const HitEvent& event,
+				  TClonesArray& tracks );
+    Int_t           ProcessBatch( const std::vector<const THaEvData*>& events,
+				  const std::vector<TClonesArray*>& tracks,
+				  std::vector<Int_t>* status = 0 );
+    Int_t           ProcessBatch( const std::vector<const HitEvent*>& events,
+				  const std::vector<TClonesArray*>& tracks,
+				  std::vector<Int_t>* status = 0 );
+    UInt_t          GetNlanes() const { return (UInt_t)fLanes.size()+1; }
+    UInt_t          GetMaxThreads() const { return fMaxThreads; }
+
+    // Concurrent tracking with the other Trackers of the apparatus
+    // (db "concurrent")
+    Bool_t          IsConcurrent() const { return fGroupLeader != 0; }
+    UInt_t          GetGroupSize() const;
+
+    UInt_t          GetNplanes() const { return (UInt_t)fPlanes.size(); }
+    Plane*          GetPlane( UInt_t i ) const;
+
+    // Input of recorded hits instead of raw data (see HitStream)
+    Int_t           MapHitStream( const HitStreamReader& stream );
+    Int_t           MapHitStream( const std::vector<std::string>& names );
+    Int_t           LoadEvent( const HitEvent& event );
+
+    // Recording of the decoded hits (db "record_hits")
+    Int_t           StartRecording( const char* filename );
+    Int_t           StopRecording();
+    Bool_t          IsRecording() const { return fHitRecorder != 0; }
+
+    // Replay of recorded hits instead of decoding (db "replay_hits")
+    Int_t           StartReplay( const char* filename );
+    void            StopReplay();
+    Bool_t          IsReplaying() const { return fHitSource != 0; }
+
+    // Region of interest of the current event (see Projection)
+    Int_t           SetSearchWindow( EProjType type,
+				     Double_t front_lo, Double_t front_hi,
+				     Double_t back_lo, Double_t back_hi );
+    void            ClearSearchWindows();
+
+    // Stage latencies, filled if DoTiming()
+    const StageProfile& GetProfile() const { return fProfile; }
+    Bool_t          DoTiming() const;
+    void            EnableProfiling( Bool_t enable = true );
+
     const pdbl_t&   GetChisqLimits( UInt_t i ) const;
     const TRotation& GetRotation()     const { return fRotation; }
     const TRotation& GetInvRotation()  const { return fInvRot; }
@@ -119,6 +179,7 @@ namespace TreeSearch {
 
   protected:
     friend class Plane;
+    friend class FindTracksTask;
     class TrackFitWeight;
     struct FitRes_t {
       vector<Double_t> coef;
@@ -147,38 +208,98 @@ namespace TreeSearch {
 
     // Multithread support
     UInt_t         fMaxThreads;       // Maximum simultaneously active threads
-    ThreadCtrl*    fThreads;          //! Thread controller
+    Int_t          fNumaNode;         // NUMA node to run on (-1 = any)
+    Bool_t         fPinThreads;       // Pin worker threads to single CPUs
+    TaskPool*      fTaskPool;         //! Worker threads (shared)
+    std::vector<Task*> fTrackTasks;   //! Tracking tasks, one per projection
+    std::vector<Task*> fDecodeTasks;  //! Decoding tasks, one per plane
+    std::vector<Task*> fFillTasks;    //! Hitpattern tasks, one per projection
+    UInt_t         fNlanes;           // Events processed at once in batch mode
+    std::vector<Tracker*> fLanes;     //! Batch mode replicas of this Tracker
+    THaVarList*    fLaneVars;         //! Private global variables of fLanes
+    Bool_t         fIsReplica;        //! This is a batch mode replica
+    Bool_t         fConcurrent;       // Track concurrently with other
+                                      // Trackers of apparatus (db)
+    Tracker*       fGroupLeader;      //! First Tracker of our group, or 0
+    std::vector<Tracker*> fGroup;     //! Group members, if we lead it
+    std::vector<Task*> fGroupTasks;   //! FindTracks tasks, one per member
+
+    // Recorded hit input and output
+    Rpvec_t        fStreamPlanes;     //! Planes in order of mapped hit stream
+    std::string    fRecordFile;       // Hit stream output file name
+    Rpvec_t        fRecordPlanes;     //! Recorded planes
+    HitStreamWriter* fHitRecorder;    //! Hit stream output, or 0
+    HitEventBuffer*  fHitBuffer;      //! Recorded events not yet written
+    Bool_t         fInBatch;          //! ProcessBatch with lanes running
+    std::string    fReplayFile;       // Hit stream input file name
+    HitStreamReader* fHitSource;      //! Replayed hit stream, or 0
+    UInt_t         fNreplayMissed;    //! Events not in replayed stream
 
     // Parameters for 3D projection matching
     UInt_t         fMinReqProj;  // Minimum # proj required for 3D match
     Double_t       f3dMatchvalScalefact; // Correction for fast 3D matchval
     Double_t       f3dMatchCut;  // Maximum allowed 3D match error
+    Bool_t         f3dGridMatch; // Use spatial grid in generic 3D matching
+    Bool_t         f3dFastFit;   // Rank 3D fits by chi2 from the fit sums
     vec_uint_t     f3dIdx;       // Lookup table proj index -> fast 3d index
 
     // Track fit cut parameters
     Int_t          fMinNdof;     // Minimum number of points in fit-4
     vec_pdbl_t     fChisqLimits; // lo/hi confidence interval limits on Chi2
 
+    // Profiling
+    Bool_t         fDoProfile;   // Record stage latencies (db "profile")
+    StageProfile   fProfile;     //! Latencies of Decode/CoarseTrack stages
+    enum EStage { kDecodeStage = 0, kTrackStage, k3dMatchStage, k3dFitStage,
+		  kCoarseStage };
+
     // Event-by-event data
     ETrackingStatus fTrkStat;    // Reconstruction status
+    // New tracks and their roads, for recording the nearest hits in
+    // fCalibPlanes once all tracks of the event are found
+    std::vector<THaTrack*> fCalibTracks;  //!
+    std::vector<Rvec_t>    fCalibRoads;   //!
+    // Results of FindTracks, turned into THaTracks by MakeTracks
+    Bool_t         fTracksFound; //! FindTracks done for the current event
+    Int_t          fFindRet;     //! Return value of FindTracks
+    std::list<std::pair<Double_t,Rvec_t> > fRoadCombos; //! Matched roads
+    std::vector<FitRes_t>  fNewTracks;    //! Fits selected as tracks
 
     // Only needed for TESTCODE, but kept for binary compatibility
     UInt_t         fNcombos;     // # of road combinations tried
     UInt_t         fN3dFits;     // # of track fits done (=good road combos)
     Int_t          fEvNum;       // Current event number
-    Double_t       t_track, t_3dmatch, t_3dfit, t_coarse; // times in us
+    // Stage times in us, filled if DoTiming()
+    Double_t       t_decode, t_track, t_3dmatch, t_3dfit, t_coarse;
 
     void      Add3dMatch( const Rvec_t& selected, Double_t matchval,
 			  std::list<std::pair<Double_t,Rvec_t> >& combos_found,
 			  Rset_t& unique_found ) const;
+    void      DeleteLanes();
+    void      DeleteTrackTasks();
+    void      DissolveGroup();
+    Int_t     FindTracks();
+    void      FindGroupTracks();
+    void      MakeGroup();
+    Int_t     MakeTracks( TClonesArray& tracks );
+    Int_t     FlushRecordedEvents();
+    Int_t     LoadStreamHits( const HitEvent& event );
     void      FitErrPrint( Int_t err ) const;
     Int_t     FitTrack( const Rvec_t& roads, vector<Double_t>& coef,
 			Double_t& chi2, TMatrixDSym* coef_covar = 0 ) const;
+    Int_t     FitTrackChi2( const Rvec_t& roads, Double_t& chi2 ) const;
     template< typename Action > static
     Action    ForAllTrackPoints( const Rvec_t& roads,
 				 const vector<Double_t>& coef, Action action );
     THaTrack* NewTrack( TClonesArray& tracks, const FitRes_t& fit_par );
     Bool_t    PassTrackCuts( const FitRes_t& fit_par ) const;
+    template< typename Event >
+    Int_t     RunBatch( const std::vector<const Event*>& events,
+			const std::vector<TClonesArray*>& tracks,
+			std::vector<Int_t>* status );
+    void      RecordCalibHits();
+    void      RecordEvent( UInt_t evnum );
+    Bool_t    ReplayEvent( UInt_t evnum );
 
     UInt_t    MatchRoadsGeneric( vector<Rvec_t>& roads, UInt_t ncombos,
 		   std::list<std::pair<Double_t,Rvec_t> >& combos_found,
@@ -196,6 +317,7 @@ namespace TreeSearch {
 					Double_t angle,
 					THaDetectorBase* parent ) const;
     virtual UInt_t GetCrateMapDBcols() const = 0;
+    virtual Tracker* MakeReplica() const;
 
     virtual UInt_t MatchRoads( vector<Rvec_t>& roads,
 	         std::list<std::pair<Double_t,Rvec_t> >& combos_found,
@@ -253,6 +375,25 @@ namespace TreeSearch {
     ClassDef(Tracker,0)   // Tracking system analyzed using TreeSearch reconstruction
   };
 
+  //___________________________________________________________________________
+  inline Plane* Tracker::GetPlane( UInt_t i ) const
+  {
+    // Return i-th readout plane, in order of increasing z
+    assert( i < fPlanes.size() );
+    return fPlanes[i];
+  }
+
+  //___________________________________________________________________________
+  inline Bool_t Tracker::DoTiming() const
+  {
+    // True if the stage times are measured. TESTCODE always needs them.
+#ifdef TESTCODE
+    return kTRUE;
+#else
+    return fDoProfile;
+#endif
+  }
+
   //___________________________________________________________________________
   inline const pdbl_t& Tracker::GetChisqLimits( UInt_t i ) const
   {
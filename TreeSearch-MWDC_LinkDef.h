@@ -20,5 +20,6 @@
 #pragma link C++ class TreeSearch::TimeToDistConv+;
 #pragma link C++ class TreeSearch::LinearTTD+;
 #pragma link C++ class TreeSearch::TanhFitTTD+;
+#pragma link C++ class TreeSearch::TabulatedTTD+;
 
 #endif
@@ -11,9 +11,7 @@
 #pragma link C++ class TreeSearch::Tracker+;
 #pragma link C++ class TreeSearch::Plane+;
 #pragma link C++ class TreeSearch::Hit+;
-#pragma link C++ class TreeSearch::HitPairIter+;
 #pragma link C++ class TreeSearch::HitSet+;
-#pragma link C++ class TreeSearch::Bits+;
 #pragma link C++ class TreeSearch::Hitpattern+;
 #pragma link C++ class TreeSearch::Projection+;
 #pragma link C++ class TreeSearch::PatternTree+;
@@ -5,6 +5,7 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "TreeWalk.h"
+#include "PatternTree.h"
 #include "TError.h"
 #include <iomanip>
 #include <sstream>
@@ -26,6 +27,7 @@ TreeWalk::operator()( Link* link, NodeVisitor& action, Pattern* parent,
   //  kRecurseUncond: process child nodes (regardless of depth)
   //  fSkipChildNodes: ignore child nodes
   //  kError: error, return immediately
+  //  kAbort: stop, return immediately
 
   if( !link ) return NodeVisitor::kError;
   NodeVisitor::ETreeOp ret =
@@ -44,7 +46,8 @@ TreeWalk::operator()( Link* link, NodeVisitor& action, Pattern* parent,
       Bool_t new_mir = mirrored xor ln->Mirrored();
       ret = (*this)( ln, action, pat, depth+1,
 		     (shift << 1) + (new_mir xor ln->Shift()), new_mir );
-      if( ret == NodeVisitor::kError ) return ret;
+      if( ret == NodeVisitor::kError or ret == NodeVisitor::kAbort )
+	return ret;
       // Continue along the linked list of child nodes
       ln = ln->Next();
     }
@@ -53,6 +56,211 @@ TreeWalk::operator()( Link* link, NodeVisitor& action, Pattern* parent,
 }
 
 
+//_____________________________________________________________________________
+NodeVisitor::ETreeOp
+TreeWalk::operator()( const PatternTree& tree, NodeVisitor& action ) const
+{
+  // Traverse the pointer-free representation of "tree" and call function
+  // object "action" for each node. Same semantics as the Link-based version
+  // above, except that the NodeDescriptors passed to "action" carry no
+  // Link and parent Pattern pointers, only the pattern bits.
+  //
+  // This version is not recursive. It keeps one cursor into the contiguous
+  // child node records per tree level on a small, fixed-size stack.
+
+  struct Cursor_t {
+    UInt_t   cur;      // Index of next child record to visit
+    UInt_t   end;      // Index of last child record + 1
+    UInt_t   shift;    // Shift of the parent node
+    Bool_t   mirrored; // Mirroring state of the parent node
+  };
+  // Tree depth is limited to 15 (cf. TreeParam_t::Normalize)
+  static const UInt_t kMaxStack = 16;
+  Cursor_t stack[kMaxStack];
+
+  if( tree.GetNnodes() == 0 )
+    return NodeVisitor::kError;
+
+  UInt_t nplanes = tree.GetNplanes();
+  const PatternTree::FlatPattern* pat = &tree.GetNodePattern(0);
+  NodeVisitor::ETreeOp ret =
+    action(NodeDescriptor(pat->bits, nplanes, 0, false, 0));
+  if( ret == NodeVisitor::kError or ret == NodeVisitor::kAbort )
+    return ret;
+  if( pat->nchild == 0 or not ( ret == NodeVisitor::kRecurseUncond or
+				( ret == NodeVisitor::kRecurse and
+				  1 < fNlevels ) ) )
+    return ret;
+
+  UInt_t sp = 0;
+  Cursor_t* top = stack;
+  top->cur = pat->child;
+  top->end = pat->child + pat->nchild;
+  top->shift = 0;
+  top->mirrored = false;
+  ++sp;
+
+  while( sp > 0 ) {
+    if( top->cur == top->end ) {
+      // All children at this level done. Don't move the cursor below the
+      // bottom of the stack.
+      if( --sp > 0 )
+	--top;
+      continue;
+    }
+    // The current depth equals the stack size
+    UInt_t node = tree.GetNode(top->cur++);
+    UInt_t type = PatternTree::NodeType(node);
+    pat = &tree.GetPattern( node & PatternTree::kNodePatternMask );
+    // See comments in the Link-based version above
+    Bool_t mirrored = top->mirrored xor ((type & 2) != 0);
+    UInt_t shift = (top->shift << 1) + (mirrored xor (type & 1));
+    ret = action(NodeDescriptor(pat->bits, nplanes, shift, mirrored, sp));
+    if( ret == NodeVisitor::kError or ret == NodeVisitor::kAbort )
+      return ret;
+    if( pat->nchild > 0 and
+	( ret == NodeVisitor::kRecurseUncond or
+	  ( ret == NodeVisitor::kRecurse and sp+1 < fNlevels ) ) ) {
+      if( sp+1 >= kMaxStack ) {
+	::Error( "TreeWalk", "Tree too deep. Call expert." );
+	return NodeVisitor::kError;
+      }
+      ++top;
+      ++sp;
+      top->cur = pat->child;
+      top->end = pat->child + pat->nchild;
+      top->shift = shift;
+      top->mirrored = mirrored;
+    }
+  }
+  return ret;
+}
+
+//_____________________________________________________________________________
+NodeVisitor::ETreeOp
+TreeWalk::operator()( const PatternTree& tree, SiblingVisitor& action,
+		      UInt_t first, UInt_t n, UInt_t depth, UInt_t shift,
+		      Bool_t mirrored ) const
+{
+  // Traverse the pointer-free representation of "tree" and call function
+  // object "action" once for each group of sibling nodes, i.e. for all
+  // children of a node at once. The tree operations returned by "action"
+  // for the individual children determine which of them are descended into.
+  // The traversal stops if "action" itself returns kError or kAbort.
+  //
+  // Unlike with the NodeVisitor version above, all children of a node are
+  // visited before any of their own children, so the order of visits
+  // differs from a depth-first traversal.
+  //
+  // If a start group other than the root is given, only the subtrees of
+  // that group are traversed, starting with a visit of the group itself.
+
+  struct Group_t {
+    UInt_t   first;    // Index of first child record of this group
+    UInt_t   n;        // Number of child records
+    UInt_t   next;     // Next child whose own children are to be visited
+    UInt_t   shift;    // Shift of the parent node
+    Bool_t   mirrored; // Mirroring state of the parent node
+  };
+  // Tree depth is limited to 15 (cf. TreeParam_t::Normalize)
+  static const UInt_t kMaxStack = 16;
+  Group_t stack[kMaxStack];
+  // Buffers for the tree operations requested for each child, per level.
+  // They keep their size between calls.
+  if( fOps.size() < kMaxStack )
+    fOps.resize( kMaxStack );
+  vector<NodeVisitor::ETreeOp>* ops = &fOps[0];
+
+  if( tree.GetNnodes() == 0 or n == 0 or first+n > tree.GetNnodes() )
+    return NodeVisitor::kError;
+  if( depth >= kMaxStack ) {
+    ::Error( "TreeWalk", "Tree too deep. Call expert." );
+    return NodeVisitor::kError;
+  }
+
+  // The start group (by default the root node by itself). The stack is
+  // indexed by depth, so start at the group's depth
+  Group_t* top = stack+depth;
+  top->first = first;
+  top->n = n;
+  top->next = 0;
+  top->shift = shift;
+  top->mirrored = mirrored;
+  if( ops[depth].size() < n )
+    ops[depth].resize(n);
+  NodeVisitor::ETreeOp ret =
+    action( tree, first, n, depth, shift, mirrored, &ops[depth][0] );
+  if( ret == NodeVisitor::kError or ret == NodeVisitor::kAbort )
+    return ret;
+  UInt_t sp = depth+1;
+
+  while( sp > depth ) {
+    if( top->next == top->n ) {
+      // All children of this group done. Don't move the cursor below the
+      // start group.
+      if( --sp > depth )
+	--top;
+      continue;
+    }
+    // The depth of the nodes in the current group is sp-1
+    UInt_t k = top->next++;
+    NodeVisitor::ETreeOp op = ops[sp-1][k];
+    UInt_t node = tree.GetNode(top->first+k);
+    const PatternTree::FlatPattern& pat =
+      tree.GetPattern( node & PatternTree::kNodePatternMask );
+    if( pat.nchild == 0 or not ( op == NodeVisitor::kRecurseUncond or
+				 ( op == NodeVisitor::kRecurse and
+				   sp < fNlevels ) ) )
+      continue;
+    if( sp >= kMaxStack ) {
+      ::Error( "TreeWalk", "Tree too deep. Call expert." );
+      return NodeVisitor::kError;
+    }
+    // See comments in the Link-based version above
+    UInt_t type = PatternTree::NodeType(node);
+    Bool_t mirrored = top->mirrored xor ((type & 2) != 0);
+    UInt_t shift = (top->shift << 1) + (mirrored xor (type & 1));
+    ++top;
+    top->first = pat.child;
+    top->n = pat.nchild;
+    top->next = 0;
+    top->shift = shift;
+    top->mirrored = mirrored;
+    vector<NodeVisitor::ETreeOp>& childops = ops[sp];
+    if( childops.size() < pat.nchild )
+      childops.resize( pat.nchild );
+    ret = action( tree, pat.child, pat.nchild, sp, shift, mirrored,
+		  &childops[0] );
+    if( ret == NodeVisitor::kError or ret == NodeVisitor::kAbort )
+      return ret;
+    ++sp;
+  }
+  return ret;
+}
+
+//_____________________________________________________________________________
+NodeVisitor::ETreeOp
+NodeMatchCounter::operator() ( const PatternTree& tree, UInt_t first,
+			       UInt_t n, UInt_t depth, UInt_t shift,
+			       Bool_t mirrored, NodeVisitor::ETreeOp* ops )
+{
+  // Compare the sibling nodes with the wrapped visitor and count the ones
+  // whose subtrees are to be searched. Nothing is counted if the search
+  // stops here.
+
+  NodeVisitor::ETreeOp ret = fOp( tree, first, n, depth, shift, mirrored,
+				  ops );
+  if( ret == NodeVisitor::kError or ret == NodeVisitor::kAbort )
+    return ret;
+  assert( first+n <= fCounts.size() );
+  for( UInt_t k = 0; k < n; ++k ) {
+    if( ops[k] == NodeVisitor::kRecurse or
+	ops[k] == NodeVisitor::kRecurseUncond )
+      ++fCounts[first+k];
+  }
+  return ret;
+}
+
 //_____________________________________________________________________________
 void NodeVisitor::SetLinkPattern( Link* link, Pattern* pattern ) {
   link->fPattern = pattern;
@@ -74,7 +282,7 @@ void NodeVisitor::SetPatternChild( Pattern* pat, Link* link ) {
 
 //_____________________________________________________________________________
 WritePattern::WritePattern( const char* filename, size_t index_size )
-  : os(0), fIdxSiz(index_size)
+  : os(0), fOwnStream(true), fIdxSiz(index_size)
 {
   static const char* here = "PatternGenerator::WritePattern";
 
@@ -98,24 +306,25 @@ WritePattern::WritePattern( const char* filename, size_t index_size )
 }
 
 //_____________________________________________________________________________
-template< typename T>
-static inline
-void swapped_binary_write( ostream& os, const T& data, size_t n = 1,
-			   size_t start = 0 )
+WritePattern::WritePattern( ostream& ostr, size_t index_size )
+  : os(&ostr), fOwnStream(false), fIdxSiz(index_size)
 {
-  // Write "n" elements of "data" to "os" in binary big-endian (MSB) format.
-  // "start" indicates an optional _byte_ skip count from the beginning of
-  // the big-endian format data - designed to write only the non-trivial
-  // part of scalar data for which the upper bytes are known to be always zero.
-  size_t size = sizeof(T);
-  const char* bytes = reinterpret_cast<const char*>( &data );
-#ifdef R__BYTESWAP
-  size_t k = size-1;
-  for( size_t i = start; i < n * size; ++i )
-    os.put( bytes[(i&~k)+((k-i)&k)] );
-#else
-  os.write( bytes+start, n*size-start );
-#endif
+  // Construct a writer that appends the pattern data to an already open
+  // stream, e.g. following a file header. The stream must be binary and is
+  // not closed or deleted by this object.
+
+  static const char* here = "PatternGenerator::WritePattern";
+
+  if( !(*os) ) {
+    ::Error( here, "Output stream not ready" );
+    os = 0;
+  }
+  if( (fIdxSiz & (fIdxSiz-1)) != 0 ) {
+    stringstream s;
+    s << "Invalid index_size = " << fIdxSiz << ". Must be a power of 2";
+    ::Warning( here, "%s", s.str().c_str());
+    fIdxSiz = sizeof(Int_t);
+  }
 }
 
 //_____________________________________________________________________________
@@ -164,7 +373,7 @@ NodeVisitor::ETreeOp PrintPattern::operator() ( const NodeDescriptor& nd )
   if( fDump )
     os << setw(2) << nd.depth;
 
-  UInt_t nplanes = nd.link->GetPattern()->GetNbits();
+  UInt_t nplanes = nd.GetNbits();
   for( UInt_t i = 0; i < nplanes; i++ ) {
     UInt_t v = nd[i];
 
@@ -174,7 +383,8 @@ NodeVisitor::ETreeOp PrintPattern::operator() ( const NodeDescriptor& nd )
 
     // Otherwise draw a pretty ASCII picture of the pattern
     else {
-      UInt_t op = (nd.mirrored ? 2 : 0) + nd.link->Shift();
+      // Recover the link type from the shift (cf. TreeWalk::operator())
+      UInt_t op = (nd.mirrored ? 2 : 0) + ((nd.shift & 1) xor nd.mirrored);
       os << static_cast<UInt_t>(nd.depth) << "-" << op;
       for( UInt_t k = 0; k < nd.depth; ++k )
 	os << " ";
@@ -19,14 +19,19 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <vector>
+#include <cstring>
 
 namespace TreeSearch {
 
+  class PatternTree;
+
   //___________________________________________________________________________
   // Base class for "Visitors" to the pattern tree nodes
   class NodeVisitor {
   public:
-    enum ETreeOp { kRecurse, kRecurseUncond, kSkipChildNodes, kError };
+    // kAbort: stop the traversal immediately, but without error
+    enum ETreeOp { kRecurse, kRecurseUncond, kSkipChildNodes, kError, kAbort };
 
     virtual ETreeOp operator() ( const NodeDescriptor& nd ) = 0;
     virtual ~NodeVisitor() {}
@@ -39,12 +44,54 @@ namespace TreeSearch {
     static void SetPatternChild( Pattern* pat, Link* link );
   };
 
+  //___________________________________________________________________________
+  // Base class for "visitor" objects that process all children of a node
+  // at once (e.g. to compare them to the hitpattern in a vectorized loop).
+  // Used with the pointer-free PatternTree representation only.
+  // The visitor is called with the index "first" of the first of "n" child
+  // node records at the given depth and with the shift and mirroring state
+  // of their parent node. It must put the requested tree operation for each
+  // child into ops[0..n-1]. The return value is only checked for kError
+  // and kAbort.
+  class SiblingVisitor {
+  public:
+    virtual NodeVisitor::ETreeOp
+    operator() ( const PatternTree& tree, UInt_t first, UInt_t n,
+		 UInt_t depth, UInt_t shift, Bool_t mirrored,
+		 NodeVisitor::ETreeOp* ops ) = 0;
+    virtual ~SiblingVisitor() {}
+  };
+
+  //___________________________________________________________________________
+  // Count how often the search descends into the subtree of each node
+  // record, for recording a tree layout profile (see
+  // PatternTree::Reorder). Wraps the SiblingVisitor doing the actual
+  // comparison and passes its results through unchanged.
+  class NodeMatchCounter : public SiblingVisitor {
+  public:
+    NodeMatchCounter( SiblingVisitor& op, std::vector<UInt_t>& counts )
+      : fOp(op), fCounts(counts) {}
+    virtual NodeVisitor::ETreeOp
+    operator() ( const PatternTree& tree, UInt_t first, UInt_t n,
+		 UInt_t depth, UInt_t shift, Bool_t mirrored,
+		 NodeVisitor::ETreeOp* ops );
+
+  private:
+    SiblingVisitor&      fOp;      // Visitor doing the comparison
+    std::vector<UInt_t>& fCounts;  // [nnodes] Match counts per node record
+  };
+
 
   //___________________________________________________________________________
   // The actual tree iterator class
   class TreeWalk {
   private:
     UInt_t   fNlevels;  // Number of levels in tree
+    // Buffers for the tree operations of each level, used by the
+    // SiblingVisitor traversal. Kept between calls to avoid allocations in
+    // the search loop, so one object must not be used by several threads
+    // at once.
+    mutable std::vector< std::vector<NodeVisitor::ETreeOp> > fOps; //!
   public:
     explicit TreeWalk( UInt_t nlevels = 0 ) : fNlevels(nlevels) {}
     virtual ~TreeWalk() {}
@@ -54,6 +101,19 @@ namespace TreeSearch {
     operator() ( Link* link, NodeVisitor& op, Pattern* parent = 0,
 		 UInt_t depth = 0, UInt_t shift = 0,
 		 Bool_t mirrored = false ) const;
+    // Traverse the pointer-free representation of a PatternTree
+    // (non-recursive)
+    NodeVisitor::ETreeOp
+    operator() ( const PatternTree& tree, NodeVisitor& op ) const;
+    // Same, visiting groups of sibling nodes. By default, starts at the root.
+    // Otherwise, traverses the subtrees of the n sibling nodes starting at
+    // record "first" at the given depth, with shift and mirroring state of
+    // their parent node (as passed to SiblingVisitor).
+    NodeVisitor::ETreeOp
+    operator() ( const PatternTree& tree, SiblingVisitor& op,
+		 UInt_t first = 0, UInt_t n = 1, UInt_t depth = 0,
+		 UInt_t shift = 0, Bool_t mirrored = false ) const;
+
     ClassDef(TreeWalk, 0)  // Generic traversal function for a PatternTree
   };
 
@@ -72,11 +132,13 @@ namespace TreeSearch {
   class WritePattern : public NodeVisitor {
   public:
     WritePattern( const char* filename, size_t index_size = sizeof(Int_t) );
-    virtual ~WritePattern() { delete os; }
+    WritePattern( std::ostream& ostr, size_t index_size = sizeof(Int_t) );
+    virtual ~WritePattern() { if( fOwnStream ) delete os; }
     virtual ETreeOp operator() ( const NodeDescriptor& nd );
 
   private:
-    std::ofstream* os;        // Output file stream
+    std::ostream* os;         // Output stream
+    Bool_t    fOwnStream;     // os was opened by us (delete in d'tor)
     size_t    fIdxSiz;        // Byte size of the pattern count (1, 2, or 4)
     std::map<Pattern*,Int_t> fMap; // Index map for serializing
 
@@ -113,6 +175,50 @@ namespace TreeSearch {
     Bool_t         fDump;     // Dump mode (one line per pattern)
   };
 
+  //___________________________________________________________________________
+  // Binary I/O helpers for the tree file format. All data are stored in
+  // big-endian (MSB first) byte order, regardless of the host architecture.
+  template< typename T> inline
+  void swapped_binary_write( std::ostream& os, const T& data, size_t n = 1,
+			     size_t start = 0 )
+  {
+    // Write "n" elements of "data" to "os" in binary big-endian (MSB) format.
+    // "start" indicates an optional _byte_ skip count from the beginning of
+    // the big-endian format data - designed to write only the non-trivial
+    // part of scalar data for which the upper bytes are known to be always
+    // zero.
+    size_t size = sizeof(T);
+    const char* bytes = reinterpret_cast<const char*>( &data );
+#ifdef R__BYTESWAP
+    size_t k = size-1;
+    for( size_t i = start; i < n * size; ++i )
+      os.put( bytes[(i&~k)+((k-i)&k)] );
+#else
+    os.write( bytes+start, n*size-start );
+#endif
+  }
+
+  template< typename T> inline
+  void swapped_binary_read( std::istream& is, T& data, size_t n = 1,
+			    size_t start = 0 )
+  {
+    // Read "n" elements of big-endian binary data from "is" into "data".
+    // Counterpart of swapped_binary_write. If start > 0, the first "start"
+    // bytes of the big-endian data are not present in the stream and are
+    // taken to be zero (only sensible for n = 1).
+    size_t size = sizeof(T);
+    char* bytes = reinterpret_cast<char*>( &data );
+    if( start > 0 )
+      memset( bytes, 0, size );
+#ifdef R__BYTESWAP
+    size_t k = size-1;
+    for( size_t i = start; i < n * size; ++i )
+      is.get( bytes[(i&~k)+((k-i)&k)] );
+#else
+    is.read( bytes+start, n*size-start );
+#endif
+  }
+
   /////////////////////////////////////////////////////////////////////////////
 
 } // end namespace TreeSearch
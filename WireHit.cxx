@@ -67,8 +67,7 @@ Double_t WireHit::ConvertTimeToDist( Double_t slope )
   assert( dynamic_cast<WirePlane*>(fPlane) );
   WirePlane* wp = static_cast<WirePlane*>(fPlane);
   Double_t dist = wp->GetTTDConv()->ConvertTimeToDist(fTime, slope);
-  fPosL = fPos-dist;
-  fPosR = fPos+dist;
+  SetDriftDist( dist );
   return dist;
 }
 
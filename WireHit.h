@@ -37,6 +37,8 @@ namespace TreeSearch {
     virtual Double_t GetPosI( UInt_t i ) const;
 
     Double_t ConvertTimeToDist( Double_t slope );
+    void     SetDriftDist( Double_t dist )
+    { fPosL = fPos-dist; fPosR = fPos+dist; }
 
     Int_t    GetWireNum()    const { return fWireNum; }
     Double_t GetWirePos()    const { return GetPos(); }
@@ -13,6 +13,7 @@
 #include "MWDC.h"
 #include "TimeToDistConv.h"
 #include "Projection.h"
+#include "HitStream.h"
 
 #include "THaDetMap.h"
 #include "TClonesArray.h"
@@ -27,6 +28,7 @@
 
 #include <iostream>
 #include <stdexcept>
+#include <cstring>
 
 using namespace std;
 using namespace Podd;
@@ -86,6 +88,9 @@ void WirePlane::Clear( Option_t* opt )
 
   Plane::Clear(opt);
 
+  for( vector<Vint_t>::size_type i = 0; i < fModChans.size(); ++i )
+    fModChans[i].clear();
+
 #ifdef TESTCODE
   fWasSorted = 0;
   fNmiss = fNrej = fNhitwires = fNmultihit = fNmaxmul = 0;
@@ -157,10 +162,15 @@ Int_t WirePlane::WireDecode( const THaEvData& evData )
 
   // Decode data. This is done fairly efficiently by looping over only the
   // channels with hits on each module.
-  // FIXME: If a module is shared with another plane (common here), we waste
-  // time skipping hits that don't belong to us.
+  // Normally, the MWDC has already sorted the channels with hits by plane
+  // and module using its channel lookup table, so each module's list
+  // contains only our channels. Otherwise, if a module is shared with
+  // another plane, we waste time skipping hits that don't belong to us.
   // NB: certain indices below are guaranteed to be in range by construction
   // in ReadDatabase, so we can avoid unneeded checks.
+  bool dispatched = mwdc->HasChanLookup();
+  assert( !dispatched or
+	  fModChans.size() == static_cast<UInt_t>(fDetMap->GetSize()) );
   bool sorted = true;
   WireHit* prevHit = 0;
   for( Int_t imod = 0; imod < fDetMap->GetSize(); ++imod ) {
@@ -170,9 +180,9 @@ Int_t WirePlane::WireDecode( const THaEvData& evData )
 
     // Get number of channels with hits and loop over them, skipping channels
     // that are not part of this module
-    // FIXME: this becomes very inefficient if several modules with the
-    // same crate/slot are defined - e.g. one "module" per channel...ouch
-    Int_t nchan = evData.GetNumChan( d->crate, d->slot );
+    const Vint_t* chans = dispatched ? &fModChans[imod] : 0;
+    Int_t nchan = chans ? static_cast<Int_t>(chans->size())
+      : evData.GetNumChan( d->crate, d->slot );
     // For "reversed" detector map modules, loop backwards over the channels
     // to preserve the ordering of the hits by wire number
     Int_t ichan, incr;
@@ -184,7 +194,8 @@ Int_t WirePlane::WireDecode( const THaEvData& evData )
       incr = 1;
     }
     for( ; ichan < nchan && ichan >= 0; ichan += incr ) {
-      Int_t chan = evData.GetNextChan( d->crate, d->slot, ichan );
+      Int_t chan = chans ? (*chans)[ichan]
+	: evData.GetNextChan( d->crate, d->slot, ichan );
       if( chan < d->lo || chan > d->hi ) {
 #ifdef TESTCODE
 	++fNmiss;
@@ -239,10 +250,6 @@ Int_t WirePlane::WireDecode( const THaEvData& evData )
 		       fResolution,
 		       this
 		       );
-	  // Preliminary calculation of drift distance. Once tracks are known,
-	  // the distance can be recomputed using the track slope.
-	  theHit->ConvertTimeToDist( 0.0 );
-
 	  // We can test the ordering of the hits on the fly - they should
 	  // come in sorted if the lowest logical channel corresponds to
 	  // the smallest wire positiion. If they do, we can skip
@@ -263,6 +270,9 @@ Int_t WirePlane::WireDecode( const THaEvData& evData )
   if( !sorted )
     fHits->Sort();
 
+  // Preliminary calculation of drift distances
+  ConvertDriftTimes();
+
 #ifdef TESTCODE
   fWasSorted = sorted;
   CheckCrosstalk();
@@ -275,6 +285,125 @@ Int_t WirePlane::WireDecode( const THaEvData& evData )
   return nHits;
 }
 
+//_____________________________________________________________________________
+void WirePlane::ConvertDriftTimes()
+{
+  // Preliminary calculation of drift distances, for all hits at once.
+  // Once tracks are known, the distances can be recomputed using the track
+  // slope.
+
+  UInt_t nHits = GetNhits();
+  if( nHits > 0 ) {
+    fDriftBuf.resize( 2*nHits );
+    Double_t* times = &fDriftBuf[0];
+    Double_t* dists = times + nHits;
+    for( UInt_t i = 0; i < nHits; ++i )
+      times[i] = static_cast<WireHit*>(fHits->UncheckedAt(i))->GetDriftTime();
+    fTTDConv->ConvertTimesToDist( nHits, times, 0.0, dists );
+    for( UInt_t i = 0; i < nHits; ++i )
+      static_cast<WireHit*>(fHits->UncheckedAt(i))->SetDriftDist( dists[i] );
+  }
+}
+
+//_____________________________________________________________________________
+Int_t WirePlane::LoadHits( const HitRecord* hits, const MCHitRecord* mchits,
+			   UInt_t n )
+{
+  // Fill the hit array from "n" recorded hits, instead of decoding raw
+  // data. As in Decode, the wire positions, drift times and resolution
+  // are computed with the current geometry and calibration: the recorded
+  // drift times do not include the TDC offsets of the wires. The current
+  // drift time cut is applied, too (on top of the one used for recording).
+  // Drift distances are computed from the drift times.
+
+  assert( hits or n == 0 );
+
+  bool no_time_cut = !fTracker->TestBit(MWDC::kDoTimeCut);
+#ifdef MCDATA
+  bool mc_data = ( mchits != 0 and fTracker->TestBit(Tracker::kMCdata) );
+#endif
+  bool sorted = true;
+  WireHit* prevHit = 0;
+  UInt_t nHits = GetNhits();
+  for( UInt_t i = 0; i < n; ++i ) {
+    const HitRecord& h = hits[i];
+    Int_t iw = h.fElem;
+    if( iw < 0 or iw >= fNelem )
+      continue;
+    Double_t time = fTDCOffset[iw] + h.fAmpl;
+    if( !no_time_cut and !(fMinTime < time && time < fMaxTime) )
+      continue;
+    WireHit* theHit;
+#ifdef MCDATA
+    if( mc_data ) {
+      const MCHitRecord& m = mchits[i];
+      theHit = new( (*fHits)[nHits++] )
+	MCWireHit( iw, GetStart() + iw * GetPitch(), h.fRaw, time,
+		   fResolution, this, m.fMCTrack, m.fMCPos, m.fMCTime );
+    } else
+#endif
+      theHit = new( (*fHits)[nHits++] )
+	WireHit( iw, GetStart() + iw * GetPitch(), h.fRaw, time,
+		 fResolution, this );
+    if( sorted && prevHit && theHit->Compare(prevHit) < 0 )
+      sorted = false;
+    prevHit = theHit;
+  }
+  if( !sorted )
+    fHits->Sort();
+
+  ConvertDriftTimes();
+
+  // Negative return value indicates potential problem
+  if( nHits > fMaxHits )
+    return -nHits;
+
+  return nHits;
+}
+
+//_____________________________________________________________________________
+void WirePlane::SaveHits( vector<HitRecord>& hits, vector<MCHitRecord>* mchits,
+			  UInt_t index ) const
+{
+  // Append the current hits to "hits" for recording in a hit stream, with
+  // "index" as plane number, and their MC truth data to "mchits", if given
+
+  assert( index <= kMaxUShort );
+#ifdef MCDATA
+  bool mc_data = fTracker->TestBit(Tracker::kMCdata);
+#endif
+  for( Int_t i = 0; i < GetNhits(); ++i ) {
+    const WireHit* hit = static_cast<const WireHit*>( fHits->UncheckedAt(i) );
+    HitRecord h;
+    memset( &h, 0, sizeof(h) );
+    // Wire number and drift time without TDC offset, see LoadHits
+    Int_t iw = hit->GetWireNum();
+    assert( iw >= 0 and iw < fNelem );
+    h.fPos   = iw;
+    h.fRes   = hit->GetResolution();
+    h.fAmpl  = hit->GetDriftTime() - fTDCOffset[iw];
+    h.fElem  = iw;
+    h.fRaw   = TMath::Nint( hit->GetRawTDC() );
+    h.fPlane = index;
+    h.fSize  = 1;
+    hits.push_back( h );
+    if( mchits ) {
+      MCHitRecord m;
+      memset( &m, 0, sizeof(m) );
+#ifdef MCDATA
+      if( mc_data ) {
+	const MCWireHit* mchit = static_cast<const MCWireHit*>(hit);
+	m.fMCTrack = mchit->fMCTrack;
+	m.fContam  = mchit->fContam;
+	m.fMCPos   = mchit->fMCPos;
+	m.fMCTime  = mchit->fMCTime;
+      }
+#endif
+      mchits->push_back( m );
+    }
+  }
+}
+
 //_____________________________________________________________________________
 Hit* WirePlane::AddHitImpl( Double_t pos )
 {
@@ -431,6 +560,9 @@ Int_t WirePlane::ReadDatabase( const TDatime& date )
   // Default values for optional parameters
   fMinTime = -kBig;
   fMaxTime =  kBig;
+  Int_t ttd_tabulate = 0;
+  UInt_t ttd_ntime = 1000, ttd_nslope = 60;
+  Double_t ttd_maxslope = 3.0;
   try {
     // Putting this container on the stack may cause a stack overflow
     ttd_param = new vector<double>;
@@ -445,6 +577,10 @@ Int_t WirePlane::ReadDatabase( const TDatime& date )
       { "tdc.offsets",   &fTDCOffset,   kFloatV,  0, 0 },
       { "drift.min",     &fMinTime,     kDouble,  0, 1, gbl },
       { "drift.max",     &fMaxTime,     kDouble,  0, 1, gbl },
+      { "ttd.tabulate",  &ttd_tabulate, kInt,     0, 1, gbl },
+      { "ttd.table.ntime",    &ttd_ntime,    kUInt,   0, 1, gbl },
+      { "ttd.table.nslope",   &ttd_nslope,   kUInt,   0, 1, gbl },
+      { "ttd.table.maxslope", &ttd_maxslope, kDouble, 0, 1, gbl },
       { 0 }
     };
     status = LoadDB( file, date, request, fPrefix );
@@ -496,6 +632,32 @@ Int_t WirePlane::ReadDatabase( const TDatime& date )
       Error( Here(here), "Error initializing drift time-to-distance converter "
 	     "\"%s\". Check ttd.param in database.", s );
       status = kInitError;
+      goto ttderr;
+    }
+    // Optionally, replace the converter by a lookup table covering the
+    // drift time window (drift.min/max, in ns)
+    if( ttd_tabulate ) {
+      Double_t tmin = (fMinTime > -kBig) ? kTDCscale*fMinTime : 0.0;
+      Double_t tmax = (fMaxTime <  kBig) ? kTDCscale*fMaxTime : tmin;
+      if( tmax <= tmin or ttd_maxslope <= 0.0 ) {
+	Error( Here(here), "Tabulating the drift time-to-distance converter "
+	       "requires drift.max > drift.min and ttd.table.maxslope > 0. "
+	       "Fix database." );
+	status = kInitError;
+	goto ttderr;
+      }
+      TabulatedTTD* table = new TabulatedTTD( fTTDConv, tmin, tmax,
+					      ttd_ntime, ttd_maxslope,
+					      ttd_nslope );
+      fTTDConv = table;
+      Double_t err = table->GetMaxError();
+      Info( Here(here), "Drift distance lookup table with %u x %u bins, "
+	    "deviation max %.3g m, RMS %.3g m", ttd_ntime, ttd_nslope,
+	    err, table->GetRMSError() );
+      if( err > 0.1*fResolution )
+	Warning( Here(here), "Drift distance lookup table error up to %.3g m "
+		 "exceeds 10%% of resolution %.3g m. Consider increasing "
+		 "ttd.table.ntime/nslope.", err, fResolution );
     }
   }
 ttderr:
@@ -528,6 +690,8 @@ ttderr:
   if( fMinTime > -kBig )  fMinTime *= kTDCscale;
   if( fMaxTime <  kBig )  fMaxTime *= kTDCscale;
 
+  fModChans.assign( fDetMap->GetSize(), Vint_t() );
+
   fIsInit = true;
   return kOK;
 }
@@ -541,16 +705,13 @@ void WirePlane::Print( Option_t* opt ) const
 }
 
 //_____________________________________________________________________________
-Hit* WirePlane::FindNearestHitAndPos( Double_t x, Double_t& pmin ) const
+Hit* WirePlane::NearestHitAndPos( Double_t x, Int_t pos,
+				  Double_t& pmin ) const
 {
-  // Version of FindNearestHitandPos for horizontal drift chambers. Carries out
+  // Version of NearestHitAndPos for horizontal drift chambers. Carries out
   // additional checks to account for left/right ambiguity.
 
-  pmin = kBig;
-  if( GetNhits() == 0 )
-    return 0;
-
-  const Int_t pos = FindHitWithLowerBound( x );
+  assert( GetNhits() > 0 and pos >= 0 and pos <= GetNhits() );
 
   // Decide whether the wire >= x or the first one < x are closest.
   // If the track crosses between two adjacent wires, keep both.
@@ -29,14 +29,21 @@ namespace TreeSearch {
 
     virtual void     Clear( Option_t* opt="" );
     virtual Int_t    Decode( const THaEvData& );
+    virtual Int_t    LoadHits( const HitRecord* hits,
+			       const MCHitRecord* mchits, UInt_t n );
+    virtual void     SaveHits( std::vector<HitRecord>& hits,
+			       std::vector<MCHitRecord>* mchits,
+			       UInt_t index ) const;
     virtual void     Print( Option_t* opt="" ) const;
 
     virtual Double_t GetMaxLRdist() const { return GetPitch(); }
-    virtual Hit*     FindNearestHitAndPos( Double_t x, Double_t& pos ) const;
-
 
     TimeToDistConv*  GetTTDConv()   const { return fTTDConv; }
 
+    // Record a channel with hits in module imod of the detector map
+    void             AddChannel( Int_t imod, Int_t chan )
+    { fModChans[imod].push_back(chan); }
+
 #ifdef TESTCODE
     void             CheckCrosstalk();
 #endif
@@ -51,6 +58,11 @@ namespace TreeSearch {
     TimeToDistConv* fTTDConv;   // Drift time->distance converter
     Vflt_t          fTDCOffset; // [fNelem] TDC offsets for each wire
 
+    // Event data
+    std::vector<Vint_t> fModChans; //! Channels with hits per module,
+                                   //  filled via AddChannel by MWDC::Decode
+    std::vector<Double_t> fDriftBuf; //! Work space for drift conversions
+
     // Only needed for TESTCODE, but kept for binary compatibility
     UInt_t          fNmiss;     // Statistics: Decoder channel misses
     UInt_t          fNrej;      // Statistics: Rejected hits
@@ -65,6 +77,9 @@ namespace TreeSearch {
     // Support functions for dummy planes
     virtual Hit*  AddHitImpl( Double_t x );
     virtual Int_t WireDecode( const THaEvData& );
+    void          ConvertDriftTimes();
+    virtual Hit*  NearestHitAndPos( Double_t x, Int_t pos,
+				    Double_t& pmin ) const;
 
     // Podd interface
     virtual Int_t ReadDatabase( const TDatime& date );
@@ -0,0 +1,438 @@
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+// tsbench                                                                   //
+//                                                                           //
+// Standalone benchmark of the TreeSearch tracking code. Initializes a       //
+// Tracker from its database (which loads or builds the pattern trees),      //
+// then repeatedly tracks a fixed set of events given as decoded hits,       //
+// without analyzer, decoder or raw data. The events are read from a hit     //
+// stream file (see HitStream.h) or generated: straight tracks through all   //
+// planes, smeared by the plane resolution, plus random noise hits.          //
+// All events are loaded into memory before the timing starts.               //
+//                                                                           //
+// Reports the throughput and the latency percentiles of each stage of the   //
+// Tracker and its projections (see StageProfile).                           //
+//                                                                           //
+// With -b, the events are then tracked again in batches of nbatch events    //
+// with Tracker::ProcessBatch, using the batch_lanes set in the database,    //
+// and the tracks of each event are checked against those of the first       //
+// serial pass. Events with different results are listed, and the exit       //
+// status is nonzero if there are any.                                       //
+//                                                                           //
+// Usage: tsbench [options] [hitfile]                                        //
+//   -t gem|mwdc  Tracker class (default gem)                                //
+//   -n name      Tracker name = database prefix (default gem)               //
+//   -d date      Database date, "yyyy-mm-dd hh:mm:ss" (default now)        //
+//   -g nev       Generate nev events instead of reading hitfile             //
+//   -k ntracks   Tracks per generated event (default 1)                     //
+//   -o noise     Mean number of noise hits per plane and generated event    //
+//   -s seed      Random number seed for generated events (default 4357)     //
+//   -w file      Write the generated events to the given hit stream file    //
+//   -r npass     Number of passes over the events (default 1)               //
+//   -e evnum     Only replay event number evnum of hitfile                  //
+//   -b nbatch    Also track in batches of nbatch events and compare         //
+//                                                                           //
+// The database is found as usual via $DB_DIR.                               //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+#include "GEMTracker.h"
+#include "MWDC.h"
+#include "Plane.h"
+#include "Projection.h"
+#include "HitStream.h"
+#include "StageProfile.h"
+
+#include "THaGlobals.h"
+#include "THaVarList.h"
+#include "THaTrack.h"
+#include "TClonesArray.h"
+#include "TDatime.h"
+#include "TRandom3.h"
+#include "TMath.h"
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>   // for getopt
+
+using namespace std;
+using namespace TreeSearch;
+
+// Events held in memory: hit records and, optionally, MC records
+struct BenchEvent {
+  UInt_t                fEvNum;
+  vector<HitRecord>     fHits;
+  vector<MCHitRecord>   fMCHits;
+};
+
+// Parameters for generated events
+struct GenParam {
+  UInt_t   nev;      // Number of events
+  UInt_t   ntracks;  // Tracks per event
+  Double_t noise;    // Mean noise hits per plane and event
+  UInt_t   seed;     // Random number seed
+};
+
+// Tracking results of one event, for comparing serial and batch mode
+struct TrackResult {
+  Int_t              fStatus;   // Tracking status
+  vector<Double_t>   fPar;      // x, y, theta, phi, chi2 of each track
+};
+
+static const UInt_t kNpar = 5;  // Parameters per track in TrackResult
+
+//_____________________________________________________________________________
+static void Usage( const char* prog )
+{
+  cerr << "Usage: " << prog << " [-t gem|mwdc] [-n name] [-d date] "
+       << "[-g nev [-k ntracks] [-o noise] [-s seed] [-w file]] [-r npass] "
+       << "[-e evnum] [-b nbatch] [hitfile]" << endl;
+  exit(2);
+}
+
+//_____________________________________________________________________________
+static bool SortByPos( const HitRecord& a, const HitRecord& b )
+{
+  return ( a.fPlane != b.fPlane ) ? (a.fPlane < b.fPlane) : (a.fPos < b.fPos);
+}
+
+//_____________________________________________________________________________
+static void GetResult( const TClonesArray& tracks, Int_t status,
+		       TrackResult& res )
+{
+  // Copy the parameters of the given tracks to "res"
+
+  res.fStatus = status;
+  res.fPar.clear();
+  for( Int_t i = 0; i <= tracks.GetLast(); ++i ) {
+    const THaTrack* trk = static_cast<const THaTrack*>( tracks.At(i) );
+    res.fPar.push_back( trk->GetX() );
+    res.fPar.push_back( trk->GetY() );
+    res.fPar.push_back( trk->GetTheta() );
+    res.fPar.push_back( trk->GetPhi() );
+    res.fPar.push_back( trk->GetChi2() );
+  }
+}
+
+//_____________________________________________________________________________
+static Int_t ReadEvents( const char* filename, Tracker* tracker,
+			 vector<BenchEvent>& events, Int_t evnum )
+{
+  // Read all events from the given hit stream file into "events", or,
+  // if evnum >= 0, only the event with that number
+
+  HitStreamReader stream;
+  if( stream.Open(filename) != 0 or tracker->MapHitStream(stream) != 0 )
+    return -1;
+  HitEvent ev;
+  if( evnum >= 0 and !stream.FindEvent(evnum, ev) ) {
+    cerr << "Event " << evnum << " not found in " << filename << endl;
+    return -1;
+  }
+  while( evnum >= 0 or stream.NextEvent(ev) ) {
+    events.push_back( BenchEvent() );
+    BenchEvent& b = events.back();
+    b.fEvNum = ev.fEvNum;
+    b.fHits.assign( ev.fHits, ev.fHits+ev.fNhits );
+    if( ev.fMCHits )
+      b.fMCHits.assign( ev.fMCHits, ev.fMCHits+ev.fNhits );
+    if( evnum >= 0 )
+      break;
+  }
+  return 0;
+}
+
+//_____________________________________________________________________________
+static Int_t GenerateEvents( const GenParam& par, Tracker* tracker,
+			     vector<BenchEvent>& events,
+			     vector<string>& plane_names )
+{
+  // Generate straight tracks through the active planes of the tracker,
+  // plus uniformly distributed noise hits. Hits in wire planes are put on
+  // the nearest wire with zero drift time.
+
+  static const UInt_t kMaxTries = 10000;
+
+  TRandom3 rnd( par.seed );
+
+  // Active planes and their geometry
+  vector<Plane*> planes;
+  Double_t maxslope = 1e10, range = 0, zmid = 0;
+  for( UInt_t i = 0; i < tracker->GetNplanes(); ++i ) {
+    Plane* pl = tracker->GetPlane(i);
+    if( pl->IsDummy() )
+      continue;
+    planes.push_back( pl );
+    plane_names.push_back( pl->GetName() );
+    maxslope = TMath::Min( maxslope, pl->GetMaxSlope() );
+    Double_t lo = pl->GetStart(), hi = lo + (pl->GetNelem()-1)*pl->GetPitch();
+    range = TMath::Max( range, TMath::Max(TMath::Abs(lo), TMath::Abs(hi)) );
+    zmid += pl->GetZ();
+  }
+  if( planes.empty() ) {
+    cerr << "No active planes" << endl;
+    return -1;
+  }
+  zmid /= planes.size();
+  maxslope *= 0.5;
+
+  MCHitRecord nomc;
+  memset( &nomc, 0, sizeof(nomc) );
+  for( UInt_t iev = 0; iev < par.nev; ++iev ) {
+    events.push_back( BenchEvent() );
+    BenchEvent& b = events.back();
+    b.fEvNum = iev+1;
+    for( UInt_t itrk = 0; itrk < par.ntracks; ++itrk ) {
+      // Accept tracks crossing all planes
+      vector<Double_t> u( planes.size() );
+      UInt_t itry = 0;
+      for( ; itry < kMaxTries; ++itry ) {
+	Double_t x = rnd.Uniform(-range,range), y = rnd.Uniform(-range,range);
+	Double_t mx = rnd.Uniform(-maxslope,maxslope);
+	Double_t my = rnd.Uniform(-maxslope,maxslope);
+	bool inside = true;
+	for( vector<Plane*>::size_type ip = 0; inside and ip<planes.size();
+	     ++ip ) {
+	  Plane* pl = planes[ip];
+	  Double_t dz = pl->GetZ() - zmid;
+	  const Projection* proj = pl->GetProjection();
+	  u[ip] = (x + mx*dz)*proj->GetCosAngle() +
+	    (y + my*dz)*proj->GetSinAngle();
+	  Double_t lo = pl->GetStart();
+	  Double_t hi = lo + (pl->GetNelem()-1)*pl->GetPitch();
+	  inside = ( lo < u[ip] and u[ip] < hi );
+	}
+	if( inside )
+	  break;
+      }
+      if( itry == kMaxTries ) {
+	cerr << "Cannot generate tracks crossing all planes" << endl;
+	return -1;
+      }
+      Double_t ampl = rnd.Uniform( 200, 2000 );
+      for( vector<Plane*>::size_type ip = 0; ip < planes.size(); ++ip ) {
+	Plane* pl = planes[ip];
+	HitRecord h;
+	memset( &h, 0, sizeof(h) );
+	h.fPlane = ip;
+	h.fRes   = pl->GetResolution();
+	h.fSize  = 1;
+	// Positions are in units of the sensor pitch (see HitRecord)
+	if( pl->GetMaxLRdist() > 0 ) {
+	  h.fElem = TMath::Nint( (u[ip]-pl->GetStart())/pl->GetPitch() );
+	  h.fPos  = h.fElem;
+	} else {
+	  h.fPos  = (u[ip] + rnd.Gaus( 0, h.fRes ) - pl->GetStart())
+	    / pl->GetPitch();
+	  h.fAmpl = ampl * rnd.Gaus( 1.0, 0.1 );
+	  h.fSize = 3;
+	}
+	b.fHits.push_back( h );
+      }
+    }
+    // Noise hits
+    for( vector<Plane*>::size_type ip = 0; ip < planes.size(); ++ip ) {
+      Plane* pl = planes[ip];
+      UInt_t nnoise = par.noise > 0 ? rnd.Poisson( par.noise ) : 0;
+      for( UInt_t k = 0; k < nnoise; ++k ) {
+	HitRecord h;
+	memset( &h, 0, sizeof(h) );
+	h.fPlane = ip;
+	h.fRes   = pl->GetResolution();
+	h.fElem  = rnd.Integer( pl->GetNelem() );
+	h.fPos   = h.fElem;
+	h.fSize  = 1;
+	if( pl->GetMaxLRdist() == 0 ) {
+	  h.fPos += rnd.Uniform( -0.5, 0.5 );
+	  h.fAmpl = rnd.Uniform( 50, 500 );
+	}
+	b.fHits.push_back( h );
+      }
+    }
+    sort( b.fHits.begin(), b.fHits.end(), SortByPos );
+  }
+  return 0;
+}
+
+//_____________________________________________________________________________
+int main( int argc, char* argv[] )
+{
+  string type = "gem", name = "gem", date_str, outfile;
+  GenParam gen;
+  gen.nev = 0; gen.ntracks = 1; gen.noise = 0; gen.seed = 4357;
+  UInt_t npass = 1, nbatch = 0;
+  Int_t evnum = -1;
+
+  int opt;
+  while( (opt = getopt(argc, argv, "t:n:d:g:k:o:s:w:r:e:b:h")) != -1 ) {
+    switch( opt ) {
+    case 't': type = optarg; break;
+    case 'n': name = optarg; break;
+    case 'd': date_str = optarg; break;
+    case 'g': gen.nev = atoi(optarg); break;
+    case 'k': gen.ntracks = atoi(optarg); break;
+    case 'o': gen.noise = atof(optarg); break;
+    case 's': gen.seed = atoi(optarg); break;
+    case 'w': outfile = optarg; break;
+    case 'r': npass = atoi(optarg); break;
+    case 'e': evnum = atoi(optarg); break;
+    case 'b': nbatch = atoi(optarg); break;
+    default:  Usage(argv[0]);
+    }
+  }
+  if( (gen.nev == 0) == (optind == argc) or npass == 0 )
+    Usage(argv[0]);
+
+  // Set up the Tracker
+  gHaVars = new THaVarList;
+  Tracker* tracker = 0;
+  if( type == "gem" )
+    tracker = new GEMTracker( name.c_str(), "Benchmark tracker" );
+  else if( type == "mwdc" )
+    tracker = new MWDC( name.c_str(), "Benchmark tracker" );
+  else
+    Usage(argv[0]);
+  TDatime date;
+  if( !date_str.empty() )
+    date.Set( date_str.c_str() );
+  if( tracker->Init(date) != THaAnalysisObject::kOK ) {
+    cerr << "Error initializing tracker " << name << endl;
+    return 1;
+  }
+  tracker->EnableProfiling();
+
+  // Load or generate the events
+  vector<BenchEvent> events;
+  if( gen.nev > 0 ) {
+    vector<string> plane_names;
+    if( GenerateEvents(gen, tracker, events, plane_names) != 0 )
+      return 1;
+    if( !outfile.empty() ) {
+      HitStreamWriter writer;
+      if( writer.Open(outfile.c_str(), plane_names) != 0 )
+	return 1;
+      for( vector<BenchEvent>::size_type i = 0; i < events.size(); ++i )
+	writer.WriteEvent( events[i].fEvNum, events[i].fHits );
+    }
+    if( tracker->MapHitStream(plane_names) != 0 )
+      return 1;
+  } else if( ReadEvents(argv[optind], tracker, events, evnum) != 0 )
+    return 1;
+  if( events.empty() ) {
+    cerr << "No events" << endl;
+    return 1;
+  }
+
+  vector<HitEvent> hitev( events.size() );
+  for( vector<BenchEvent>::size_type i = 0; i < events.size(); ++i ) {
+    const BenchEvent& b = events[i];
+    HitEvent& ev = hitev[i];
+    ev.fEvNum  = b.fEvNum;
+    ev.fNhits  = b.fHits.size();
+    ev.fHits   = b.fHits.empty() ? 0 : &b.fHits[0];
+    ev.fMCHits = b.fMCHits.empty() ? 0 : &b.fMCHits[0];
+  }
+
+  // Track the events
+  TClonesArray tracks( "THaTrack", 10 );
+  map<Int_t,UInt_t> trkstat;
+  ULong64_t ntracks = 0, nhits = 0;
+  vector<TrackResult> serial( nbatch > 0 ? events.size() : 0 );
+  tracker->Begin();
+  ULong64_t start = StageProfile::ReadClock();
+  for( UInt_t ipass = 0; ipass < npass; ++ipass ) {
+    for( vector<HitEvent>::size_type i = 0; i < hitev.size(); ++i ) {
+      const HitEvent& ev = hitev[i];
+
+      tracks.Clear("C");
+      tracker->Clear();
+      tracker->LoadEvent( ev );
+      tracker->CoarseTrack( tracks );
+      tracker->FineTrack( tracks );
+
+      ntracks += tracks.GetLast()+1;
+      nhits += ev.fNhits;
+      ++trkstat[tracker->GetTrackingStatus()];
+      if( ipass == 0 and nbatch > 0 )
+	GetResult( tracks, tracker->GetTrackingStatus(), serial[i] );
+    }
+  }
+  Double_t elapsed = StageProfile::ToUs( StageProfile::ReadClock()-start );
+  tracker->End();
+
+  ULong64_t nev = (ULong64_t)npass * events.size();
+  cout << endl << "Tracked " << nev << " events (" << events.size()
+       << " x " << npass << ") in " << 1e-6*elapsed << " s: "
+       << 1e6*nev/elapsed << " events/s, " << elapsed/nev << " us/event"
+       << endl
+       << "Mean hits/event " << (Double_t)nhits/nev
+       << ", tracks/event " << (Double_t)ntracks/nev << endl
+       << "Tracking status: ";
+  for( map<Int_t,UInt_t>::iterator it = trkstat.begin(); it != trkstat.end();
+       ++it )
+    cout << " " << it->first << ":" << it->second;
+  cout << endl;
+
+  // Track the events again in batches and compare with the serial results
+  Int_t ret = 0;
+  if( nbatch > 0 ) {
+    static const UInt_t kMaxReport = 10;
+    vector<TClonesArray*> batch_tracks;
+    for( UInt_t k = 0; k < nbatch; ++k )
+      batch_tracks.push_back( new TClonesArray("THaTrack", 10) );
+    vector<const HitEvent*> batch;
+    vector<TClonesArray*> out;
+    vector<Int_t> status;
+    TrackResult res;
+    UInt_t ndiff = 0;
+    tracker->Begin();
+    elapsed = 0;
+    for( UInt_t ipass = 0; ipass < npass; ++ipass ) {
+      for( vector<HitEvent>::size_type i = 0; i < hitev.size();
+	   i += nbatch ) {
+	vector<HitEvent>::size_type n =
+	  TMath::Min<vector<HitEvent>::size_type>( nbatch, hitev.size()-i );
+	batch.clear();
+	for( vector<HitEvent>::size_type k = 0; k < n; ++k )
+	  batch.push_back( &hitev[i+k] );
+	out.assign( batch_tracks.begin(), batch_tracks.begin()+n );
+	start = StageProfile::ReadClock();
+	if( tracker->ProcessBatch(batch, out, &status) != 0 )
+	  return 1;
+	elapsed += StageProfile::ToUs( StageProfile::ReadClock()-start );
+	for( vector<HitEvent>::size_type k = 0; k < n; ++k ) {
+	  GetResult( *out[k], status[k], res );
+	  const TrackResult& ref = serial[i+k];
+	  if( res.fStatus == ref.fStatus and res.fPar == ref.fPar )
+	    continue;
+	  if( ndiff < kMaxReport )
+	    cout << "Pass " << ipass << ", event " << hitev[i+k].fEvNum
+		 << ": batch status " << res.fStatus << ", "
+		 << res.fPar.size()/kNpar << " tracks; serial status "
+		 << ref.fStatus << ", " << ref.fPar.size()/kNpar << " tracks"
+		 << endl;
+	  ++ndiff;
+	}
+      }
+    }
+    tracker->End();
+
+    cout << endl << "Batch mode with " << tracker->GetNlanes()
+	 << " lane(s), " << nbatch << " events/batch: " << 1e6*nev/elapsed
+	 << " events/s, " << elapsed/nev << " us/event" << endl
+	 << "Events differing from serial tracking: " << ndiff << " of "
+	 << nev << endl;
+    if( ndiff > 0 )
+      ret = 1;
+    for( UInt_t k = 0; k < nbatch; ++k )
+      delete batch_tracks[k];
+  }
+
+  delete tracker;
+  return ret;
+}